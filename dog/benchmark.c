@@ -170,6 +170,141 @@ static int benchmark_io(int argc, char **argv)
 	return 0;
 }
 
+static void benchmark_inode_report(const char *name, int total,
+				   uint64_t start)
+{
+	double sec = (double)(clock_get_time() - start) / 1000000000;
+
+	printf("%s: %d ops, %.3f s, %.0f ops/s\n", name, total, sec,
+	       total / sec);
+}
+
+/* Take the lock of the vdi, which keeps the clients off while we update it */
+static int benchmark_lock_vdi(const char *vdiname, uint32_t *vid)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char buf[SD_MAX_VDI_LEN] = {};
+	int ret;
+
+	pstrcpy(buf, sizeof(buf), vdiname);
+	sd_init_req(&hdr, SD_OP_LOCK_VDI);
+	hdr.data_length = SD_MAX_VDI_LEN;
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.vdi.type = LOCK_TYPE_NORMAL;
+
+	ret = dog_exec_req(&sd_nid, &hdr, buf);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to lock %s, %s", vdiname,
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	*vid = rsp->vdi.vdi_id;
+	return EXIT_SUCCESS;
+}
+
+static void benchmark_unlock_vdi(uint32_t vid)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_RELEASE_VDI);
+	hdr.vdi.base_vdi_id = vid;
+	hdr.vdi.type = LOCK_TYPE_NORMAL;
+	if (send_light_req(&sd_nid, &hdr))
+		sd_err("failed to unlock %" PRIx32, vid);
+}
+
+/*
+ * Benchmark looking up and updating the data object index of a hypervolume at
+ * random. The update phase sets the mapped indexes which were looked up to the
+ * value they already have, under the lock of the vdi, so the data of the vdi
+ * is not changed.
+ */
+static int benchmark_inode(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	struct sd_inode *inode;
+	uint64_t nr_objects, start;
+	uint32_t vid, *idxs, *vids;
+	int ret, total = DEFAULT_TOTAL, nr_mapped = 0;
+
+	if (benchmark_cmd_data.total != 0)
+		total = benchmark_cmd_data.total;
+
+	if (!benchmark_cmd_data.force)
+		confirm("Caution! benchmark inode command will rewrite the"
+			" index of target VDI.\n Are you sure you want to"
+			" continue? [yes/no]");
+
+	ret = benchmark_lock_vdi(vdiname, &vid);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	sd_inode_cache_hold(vid);
+
+	inode = xzalloc(sizeof(*inode));
+	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, sizeof(*inode));
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	if (inode->store_policy == 0) {
+		sd_err("VDI %s is not a hypervolume", vdiname);
+		ret = EXIT_USAGE;
+		goto out;
+	}
+
+	nr_objects = DIV_ROUND_UP(inode->vdi_size,
+				  1ULL << inode->block_size_shift);
+	nr_objects = min(nr_objects, (uint64_t)MAX_DATA_OBJS);
+	idxs = xmalloc(sizeof(*idxs) * total);
+	vids = xmalloc(sizeof(*vids) * total);
+	srandom(time(NULL));
+	for (int i = 0; i < total; i++)
+		idxs[i] = random() % nr_objects;
+
+	start = clock_get_time();
+	for (int i = 0; i < total; i++)
+		vids[i] = sd_inode_get_vid(inode, idxs[i]);
+	benchmark_inode_report("get_vid", total, start);
+
+	/* Setting unmapped indexes would add entries of vid 0 to the index */
+	for (int i = 0; i < total; i++) {
+		if (!vids[i])
+			continue;
+		idxs[nr_mapped] = idxs[i];
+		vids[nr_mapped] = vids[i];
+		nr_mapped++;
+	}
+	if (!nr_mapped) {
+		printf("set_vid: no mapped index found\n");
+		ret = EXIT_SUCCESS;
+		goto out_free;
+	}
+
+	start = clock_get_time();
+	for (int i = 0; i < nr_mapped; i++)
+		sd_inode_set_vid(inode, idxs[i], vids[i]);
+	ret = sd_inode_write(inode, 0, false, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to write inode of %s, %s", vdiname,
+		       sd_strerror(ret));
+		ret = EXIT_FAILURE;
+		goto out_free;
+	}
+	benchmark_inode_report("set_vid", nr_mapped, start);
+	ret = EXIT_SUCCESS;
+out_free:
+	free(vids);
+	free(idxs);
+out:
+	free(inode);
+	sd_inode_cache_release(vid);
+	benchmark_unlock_vdi(vid);
+	return ret;
+}
+
 static int benchmark_parser(int ch, const char *opt)
 {
 	switch (ch) {
@@ -197,6 +332,10 @@ static int benchmark_parser(int ch, const char *opt)
 static struct subcommand benchmark_cmd[] = {
 	{"io", "<vdiname>", "aprhTfwtn", "benchmark I/O performance",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG, benchmark_io, benchmark_options},
+	{"inode", "<vdiname>", "aprhTft",
+	 "benchmark index lookup and update of a hypervolume",
+	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG, benchmark_inode,
+	 benchmark_options},
 	{NULL,},
 };
 
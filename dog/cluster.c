@@ -27,7 +27,13 @@ static struct sd_option cluster_options[] = {
 	{'l', "lock", false, "Lock vdi to exclude multiple users"},
 	{'m', "multithread", false,
 	 "use multi-thread for 'cluster snapshot save'"},
+	{'n', "nr-threads", true, "number of worker threads for "
+	 "'cluster snapshot save/load'"},
+	{'C', "cdc", false,
+	 "use content-defined slices for 'cluster snapshot save'"},
 	{'R', "recyclevid", false, "enable recycling of VID"},
+	{'S', "sparse", false, "don't allocate the unwritten parts of data "
+	 "objects"},
 	{'t', "strict", false,
 	 "do not serve write request if number of nodes is not sufficient"},
 	{'z', "block_size_shift", true, "specify the shift num of default"
@@ -36,6 +42,8 @@ static struct sd_option cluster_options[] = {
 	{'d', "diff", false,
 	 "just output the changes between the two adjacent epoches"
 		"for cluster info"},
+	{'H', "hash", true, "specify the digest to compare replicas with,\n"
+	 "                          sha1 (default) or crc32c (faster)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -43,15 +51,19 @@ static struct cluster_cmd_data {
 	uint8_t copies;
 	uint8_t copy_policy;
 	uint8_t multithread;
+	int nr_threads;
+	bool cdc;
 	uint8_t block_size_shift;
 	bool force;
 	bool strict;
 	bool diff;
+	bool crc32c;
 	char name[STORE_LEN];
 	bool fixed_vnodes;
 	bool use_lock;
 	bool recycle_vid;
 	bool avoid_diskfull;
+	bool sparse;
 } cluster_cmd_data;
 
 #define DEFAULT_STORE	"plain"
@@ -193,6 +205,9 @@ static int cluster_format(int argc, char **argv)
 	if (cluster_cmd_data.avoid_diskfull)
 		hdr.cluster.flags |= SD_CLUSTER_FLAG_AVOID_DISKFULL;
 
+	if (cluster_cmd_data.sparse)
+		hdr.cluster.flags |= SD_CLUSTER_FLAG_SPARSE;
+
 	printf("using backend %s store\n", store_name);
 	ret = dog_exec_req(&sd_nid, &hdr, store_name);
 	if (ret < 0)
@@ -541,7 +556,7 @@ static int save_snapshot(int argc, char **argv)
 {
 	const char *tag = argv[optind++];
 	char *path, *p;
-	int ret = EXIT_SYSFAIL, uninitialized_var(unused);
+	int ret = EXIT_SYSFAIL, uninitialized_var(unused), nr_threads;
 	struct vdi_option opt;
 
 	unused = strtol(tag, &p, 10);
@@ -585,7 +600,10 @@ static int save_snapshot(int argc, char **argv)
 		goto out;
 	}
 
-	if (farm_save_snapshot(tag, cluster_cmd_data.multithread)
+	nr_threads = cluster_cmd_data.nr_threads;
+	if (!nr_threads && !cluster_cmd_data.multithread)
+		nr_threads = 1;
+	if (farm_save_snapshot(tag, nr_threads, cluster_cmd_data.cdc)
 	    != SD_RES_SUCCESS)
 		goto out;
 
@@ -632,8 +650,8 @@ static int load_snapshot(int argc, char **argv)
 	if (cluster_format(0, NULL) != SD_RES_SUCCESS)
 		goto out;
 
-	if (farm_load_snapshot(idx, tag, argc - optind, argv + optind)
-			!= SD_RES_SUCCESS)
+	if (farm_load_snapshot(idx, tag, argc - optind, argv + optind,
+			       cluster_cmd_data.nr_threads) != SD_RES_SUCCESS)
 		goto out;
 
 	ret = EXIT_SUCCESS;
@@ -803,7 +821,7 @@ static void cluster_check_cb(uint32_t vid, const char *name, const char *tag,
 	else
 		printf("fix vdi %s\n", name);
 
-	do_vdi_check(inode);
+	do_vdi_check(inode, cluster_cmd_data.crc32c);
 }
 
 static int cluster_check(int argc, char **argv)
@@ -899,12 +917,12 @@ failure:
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprhvTd", "show cluster information",
 	 NULL, CMD_NEED_NODELIST, cluster_info, cluster_options},
-	{"format", NULL, "bcltaphzTVRfF", "create a Sheepdog store",
+	{"format", NULL, "bcltaphzTVRfFS", "create a Sheepdog store",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST, cluster_format, cluster_options},
 	{"shutdown", NULL, "aphT", "stop Sheepdog",
 	 NULL, CMD_NEED_ROOT, cluster_shutdown, cluster_options},
 	{"snapshot", "<tag|idx> <path> [vdi1] [vdi2] ...",
-	 "aphTm", "snapshot/restore the cluster",
+	 "aphTmnC", "snapshot/restore the cluster",
 	 cluster_snapshot_cmd, CMD_NEED_ROOT|CMD_NEED_ARG,
 	 cluster_snapshot, cluster_options},
 	{"recover", NULL, "afphT",
@@ -913,7 +931,7 @@ static struct subcommand cluster_cmd[] = {
 	 cluster_recover, cluster_options},
 	{"reweight", NULL, "aphT", "reweight the cluster", NULL, CMD_NEED_ROOT,
 	 cluster_reweight, cluster_options},
-	{"check", NULL, "aphT", "check and repair cluster", NULL,
+	{"check", NULL, "aphTH", "check and repair cluster", NULL,
 	 CMD_NEED_ROOT|CMD_NEED_NODELIST, cluster_check, cluster_options},
 	{"alter-copy", NULL, "aphTcf", "set the cluster's redundancy level",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST, cluster_alter_copy, cluster_options},
@@ -950,6 +968,17 @@ static int cluster_parser(int ch, const char *opt)
 		break;
 	case 'm':
 		cluster_cmd_data.multithread = true;
+		break;
+	case 'n':
+		cluster_cmd_data.nr_threads = atoi(opt);
+		if (cluster_cmd_data.nr_threads < 1) {
+			sd_err("Invalid number of threads: %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 'C':
+		cluster_cmd_data.cdc = true;
+		break;
 	case 't':
 		cluster_cmd_data.strict = true;
 		break;
@@ -978,6 +1007,12 @@ static int cluster_parser(int ch, const char *opt)
 	case 'F':
 		cluster_cmd_data.avoid_diskfull = true;
 		break;
+	case 'S':
+		cluster_cmd_data.sparse = true;
+		break;
+	case 'H':
+		cluster_cmd_data.crc32c = parse_hash_name(opt);
+		break;
 	}
 
 	return 0;
@@ -541,6 +541,18 @@ uint8_t parse_copy(const char *str, uint8_t *copy_policy)
 	return copy;
 }
 
+/* Return true for "crc32c" and false for "sha1", the digests of GET_HASH */
+bool parse_hash_name(const char *str)
+{
+	if (!strcmp(str, "crc32c"))
+		return true;
+	if (strcmp(str, "sha1")) {
+		sd_err("Invalid hash %s, it must be sha1 or crc32c", str);
+		exit(EXIT_USAGE);
+	}
+	return false;
+}
+
 bool is_root(void)
 {
 	if (geteuid() != 0)
@@ -96,12 +96,13 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
 		  uint8_t nr_copies, uint8_t copy_policy,
 		  uint8_t store_policy, uint8_t block_size_shift);
-int do_vdi_check(const struct sd_inode *inode);
+int do_vdi_check(const struct sd_inode *inode, bool crc32c);
 void show_progress(uint64_t done, uint64_t total, bool raw);
 size_t get_store_objsize(uint8_t copy_policy, uint8_t block_size_shift,
 			 uint64_t oid);
 bool is_erasure_oid(uint64_t oid, uint8_t policy);
 uint8_t parse_copy(const char *str, uint8_t *copy_policy);
+bool parse_hash_name(const char *str);
 
 int dog_bnode_writer(uint64_t oid, void *mem, unsigned int len, uint64_t offset,
 		     uint32_t flags, int copies, int copy_policy, bool create,
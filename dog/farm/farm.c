@@ -19,6 +19,7 @@
 #include "rbtree.h"
 
 static char farm_object_dir[PATH_MAX];
+static char farm_index_dir[PATH_MAX];
 static char farm_dir[PATH_MAX];
 
 static struct sd_rw_lock active_vdi_lock = SD_RW_LOCK_INITIALIZER;
@@ -61,6 +62,7 @@ struct snapshot_work {
 };
 static struct work_queue *wq;
 static uatomic_bool work_error;
+static bool slice_cdc;
 
 static int vdi_cmp(const struct active_vdi_entry *e1,
 		   const struct active_vdi_entry *e2)
@@ -145,6 +147,34 @@ char *get_object_directory(void)
 	return farm_object_dir;
 }
 
+char *get_index_directory(void)
+{
+	return farm_index_dir;
+}
+
+/* Create 'name' under 'buf' with 256 subdirectories for the sha1 files */
+static int create_sha1_directory(struct strbuf *buf, const char *name,
+				 char *out, size_t size)
+{
+	strbuf_addf(buf, "/%s", name);
+	if (xmkdir(buf->buf, 0755) < 0)
+		return -1;
+
+	for (int i = 0; i < 256; i++) {
+		strbuf_addf(buf, "/%02x", i);
+		if (xmkdir(buf->buf, 0755) < 0)
+			return -1;
+
+		strbuf_remove(buf, buf->len - 3, 3);
+	}
+
+	if (!strlen(out))
+		strbuf_copyout(buf, out, size);
+
+	strbuf_remove(buf, buf->len - strlen(name) - 1, strlen(name) + 1);
+	return 0;
+}
+
 static int create_directory(const char *p)
 {
 	int ret = -1;
@@ -160,20 +190,13 @@ static int create_directory(const char *p)
 	if (!strlen(farm_dir))
 		strbuf_copyout(&buf, farm_dir, sizeof(farm_dir));
 
-	strbuf_addstr(&buf, "/objects");
-	if (xmkdir(buf.buf, 0755) < 0)
+	if (create_sha1_directory(&buf, "objects", farm_object_dir,
+				  sizeof(farm_object_dir)) < 0)
 		goto out;
 
-	for (int i = 0; i < 256; i++) {
-		strbuf_addf(&buf, "/%02x", i);
-		if (xmkdir(buf.buf, 0755) < 0)
-			goto out;
-
-		strbuf_remove(&buf, buf.len - 3, 3);
-	}
-
-	if (!strlen(farm_object_dir))
-		strbuf_copyout(&buf, farm_object_dir, sizeof(farm_object_dir));
+	if (create_sha1_directory(&buf, "index", farm_index_dir,
+				  sizeof(farm_index_dir)) < 0)
+		goto out;
 
 	ret = 0;
 out:
@@ -254,17 +277,57 @@ bool farm_contain_snapshot(uint32_t idx, const char *tag)
 	return (get_trunk_sha1(idx, tag, trunk_sha1) == 0);
 }
 
+/*
+ * Ask a node which holds the object for its sha1.  Snapshot objects are
+ * read-only and sheep caches their digests, so this is much cheaper than
+ * reading them.
+ */
+static int get_object_hash(const struct trunk_entry *entry,
+			   unsigned char *hash)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int nr_copies = min((int)entry->nr_copies, sd_nodes_nr);
+
+	/* sheep only hashes its own strip of erasure coded objects */
+	if (is_erasure_oid(entry->oid, entry->copy_policy))
+		return -1;
+
+	oid_to_vnodes(entry->oid, &sd_vroot, nr_copies, vnodes);
+	for (int i = 0; i < nr_copies; i++) {
+		sd_init_req(&hdr, SD_OP_GET_HASH);
+		hdr.obj.oid = entry->oid;
+		hdr.obj.tgt_epoch = sd_epoch;
+
+		if (dog_exec_req(&vnodes[i]->node->nid, &hdr, NULL) < 0)
+			continue;
+		if (rsp->result == SD_RES_SUCCESS) {
+			memcpy(hash, rsp->hash.digest, SHA1_DIGEST_SIZE);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 static void do_save_object(struct work *work)
 {
-	void *buf;
+	void *buf = NULL;
 	size_t size;
 	struct snapshot_work *sw;
+	unsigned char hash[SHA1_DIGEST_SIZE];
 
 	if (uatomic_is_true(&work_error))
 		return;
 
 	sw = container_of(work, struct snapshot_work, work);
 
+	/* the object is already in the farm if we have seen its digest */
+	if (get_object_hash(&sw->entry, hash) == 0 &&
+	    sha1_index_read(hash, sw->entry.sha1) == 0)
+		return;
+
 	size = get_objsize(sw->entry.oid,
 			  (UINT32_C(1) <<  sw->entry.block_size_shift));
 	buf = xmalloc(size);
@@ -272,7 +335,15 @@ static void do_save_object(struct work *work)
 	if (dog_read_object(sw->entry.oid, buf, size, 0, true) < 0)
 		goto error;
 
-	if (slice_write(buf, size, sw->entry.sha1) < 0)
+	if (slice_write(buf, size, sw->entry.sha1, slice_cdc) < 0)
+		goto error;
+
+	/*
+	 * Index what we have read rather than the digest from sheep, which
+	 * might be of another version if the object is still writable.
+	 */
+	get_buffer_sha1(buf, size, hash);
+	if (sha1_index_write(hash, sw->entry.sha1) < 0)
 		goto error;
 
 	free(buf);
@@ -322,7 +393,22 @@ static int queue_save_snapshot_work(uint64_t oid, uint32_t nr_copies,
 	return 0;
 }
 
-int farm_save_snapshot(const char *tag, bool multithread)
+/*
+ * Objects are saved and loaded by 'nr_threads' workers which handle one
+ * object at a time, so the network I/O of some objects overlaps the hashing
+ * and the disk I/O of the others.  Zero means one worker per node.
+ */
+static struct work_queue *create_farm_work_queue(const char *name,
+						 int nr_threads)
+{
+	if (nr_threads == 0)
+		return create_work_queue(name, WQ_DYNAMIC);
+	if (nr_threads == 1)
+		return create_work_queue(name, WQ_ORDERED);
+	return create_fixed_work_queue(name, nr_threads);
+}
+
+int farm_save_snapshot(const char *tag, int nr_threads, bool cdc)
 {
 	unsigned char trunk_sha1[SHA1_DIGEST_SIZE];
 	struct strbuf trunk_buf;
@@ -365,8 +451,8 @@ int farm_save_snapshot(const char *tag, bool multithread)
 
 	strbuf_init(&trunk_buf, sizeof(struct trunk_entry) * nr_objects);
 
-	wq = create_work_queue("save snapshot",
-			       multithread ? WQ_DYNAMIC : WQ_ORDERED);
+	slice_cdc = cdc;
+	wq = create_farm_work_queue("save snapshot", nr_threads);
 	if (for_each_object_in_tree(queue_save_snapshot_work,
 				    &trunk_buf) < 0) {
 		ret = -1;
@@ -540,7 +626,8 @@ static void register_obj(struct sd_inode *inode)
 	}
 }
 
-int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name)
+int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name,
+		       int nr_threads)
 {
 	int ret = -1;
 	unsigned char trunk_sha1[SHA1_DIGEST_SIZE];
@@ -564,7 +651,7 @@ int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name)
 		goto out;
 	}
 
-	wq = create_work_queue("load snapshot", WQ_DYNAMIC);
+	wq = create_farm_work_queue("load snapshot", nr_threads);
 	if (for_each_entry_in_trunk(trunk_sha1, queue_load_snapshot_work,
 				    NULL) < 0)
 		goto out;
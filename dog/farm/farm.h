@@ -63,10 +63,12 @@ struct vdi_option {
 /* farm.c */
 int farm_init(const char *path);
 bool farm_contain_snapshot(uint32_t idx, const char *tag);
-int farm_save_snapshot(const char *tag, bool);
-int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name);
+int farm_save_snapshot(const char *tag, int nr_threads, bool cdc);
+int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name,
+		       int nr_threads);
 int farm_show_snapshot(uint32_t idx, const char *tag, int count, char **name);
 char *get_object_directory(void);
+char *get_index_directory(void);
 
 /* trunk.c */
 int trunk_init(void);
@@ -86,7 +88,11 @@ int snap_log_write_hdr(struct snap_log_hdr *);
 
 /* sha1_file.c */
 int sha1_file_write(void *buf, size_t len, unsigned char *sha1);
+int sha1_files_write(unsigned char **bufs, const unsigned *lens, int nr,
+		     unsigned char *sha1s);
 void *sha1_file_read(const unsigned char *sha1, size_t *size);
+int sha1_index_write(const unsigned char *key, const unsigned char *sha1);
+int sha1_index_read(const unsigned char *key, unsigned char *sha1);
 
 /* object_tree.c */
 int object_tree_size(void);
@@ -98,7 +104,7 @@ int for_each_object_in_tree(int (*func)(uint64_t oid, uint32_t nr_copies,
 					uint8_t, uint8_t block_size_shift,
 					void *data), void *data);
 /* slice.c */
-int slice_write(void *buf, size_t len, unsigned char *outsha1);
+int slice_write(void *buf, size_t len, unsigned char *outsha1, bool cdc);
 void *slice_read(const unsigned char *sha1, size_t *outsize);
 
 #endif
@@ -39,13 +39,11 @@ static void fill_sha1_path(char *pathbuf, const unsigned char *sha1)
 	}
 }
 
-static char *sha1_to_path(const unsigned char *sha1)
+static char *sha1_to_path_in(const char *objdir, const unsigned char *sha1)
 {
 	static __thread char buf[PATH_MAX];
-	const char *objdir;
 	int len;
 
-	objdir = get_object_directory();
 	len = strlen(objdir);
 
 	/* '/' + sha1(2) + '/' + sha1(38) + '\0' */
@@ -57,6 +55,11 @@ static char *sha1_to_path(const unsigned char *sha1)
 	return buf;
 }
 
+static char *sha1_to_path(const unsigned char *sha1)
+{
+	return sha1_to_path_in(get_object_directory(), sha1);
+}
+
 static int sha1_buffer_write(const unsigned char *sha1,
 			     void *buf, unsigned int size)
 {
@@ -96,6 +99,21 @@ int sha1_file_write(void *buf, size_t len, unsigned char *outsha1)
 	return 0;
 }
 
+/*
+ * Write 'nr' buffers as sha1 files.  Their sha1s, which are computed together
+ * with get_buffers_sha1(), are stored in 'sha1s'.
+ */
+int sha1_files_write(unsigned char **bufs, const unsigned *lens, int nr,
+		     unsigned char *sha1s)
+{
+	get_buffers_sha1(bufs, lens, nr, sha1s);
+	for (int i = 0; i < nr; i++)
+		if (sha1_buffer_write(sha1s + i * SHA1_DIGEST_SIZE, bufs[i],
+				      lens[i]) < 0)
+			return -1;
+	return 0;
+}
+
 static int verify_sha1_file(const unsigned char *sha1,
 			    void *buf, unsigned long len)
 {
@@ -146,3 +164,53 @@ out:
 	close(fd);
 	return buf;
 }
+
+/*
+ * The index maps the sha1 of a whole object, which sheep can compute for us,
+ * to the sha1 of its slice list.  An object whose digest is in the index
+ * doesn't have to be read again to be saved.
+ */
+int sha1_index_write(const unsigned char *key, const unsigned char *sha1)
+{
+	char *filename = sha1_to_path_in(get_index_directory(), key);
+	int fd, ret = 0;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0) {
+		if (errno != EEXIST) {
+			sd_err("failed to open file %s with error: %m",
+			       filename);
+			ret = -1;
+		}
+		return ret;
+	}
+	if (xwrite(fd, sha1, SHA1_DIGEST_SIZE) != SHA1_DIGEST_SIZE) {
+		sd_err("%m");
+		unlink(filename);
+		ret = -1;
+	}
+
+	close(fd);
+	return ret;
+}
+
+int sha1_index_read(const unsigned char *key, unsigned char *sha1)
+{
+	char *filename = sha1_to_path_in(get_index_directory(), key);
+	int fd = open(filename, O_RDONLY), ret = -1;
+
+	if (fd < 0)
+		return -1;
+
+	if (xread(fd, sha1, SHA1_DIGEST_SIZE) != SHA1_DIGEST_SIZE)
+		goto out;
+
+	/* the slices must still be there */
+	if (access(sha1_to_path(sha1), F_OK) < 0)
+		goto out;
+
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
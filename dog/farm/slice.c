@@ -12,8 +12,13 @@
  */
 
 /*
- * Slice is a fixed chunk of one object to be stored in farm. We slice
- * the object into smaller chunks to get better deduplication.
+ * Slice is a chunk of one object to be stored in farm. We slice the object
+ * into smaller chunks to get better deduplication.
+ *
+ * Slices are fixed-size by default.  With content-defined slicing, an object
+ * is cut where a rolling hash of the last 64 bytes matches a pattern, so data
+ * shifted by an insertion still yields the same slices.  slice_read() doesn't
+ * care how the slices were cut.
  */
 
 #include <pthread.h>
@@ -37,30 +42,91 @@ struct slice_file {
 /* 128k, best empirical value from some tests, but no rationale */
 #define SLICE_SIZE (1024*128)
 
-int slice_write(void *buf, size_t len, unsigned char *outsha1)
+/* bounds and average size of content-defined slices */
+#define CDC_MIN_SIZE (1024*32)
+#define CDC_MAX_SIZE (1024*512)
+/* the top 17 bits of the gear hash are zero once every 128k on average */
+#define CDC_MASK (~UINT64_C(0) << (64 - 17))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* The table must be the same for every run, or nothing is deduplicated */
+static void gear_init(void)
 {
-	int count = DIV_ROUND_UP(len, SLICE_SIZE);
-	size_t slen = count * SHA1_DIGEST_SIZE;
-	char *sbuf = xmalloc(slen);
-	char *p = buf;
+	uint64_t x = 0;
 
-	for (int i = 0; i < count; i++, p += SLICE_SIZE) {
-		unsigned char sha1[SHA1_DIGEST_SIZE];
-		size_t wlen = (ssize_t)len - SLICE_SIZE > 0 ? SLICE_SIZE : len;
-		len -= SLICE_SIZE;
+	for (int i = 0; i < ARRAY_SIZE(gear); i++) {
+		uint64_t z;
 
-		if (sha1_file_write(p, wlen, sha1) < 0)
-			goto err;
-		memcpy(sbuf + i * SHA1_DIGEST_SIZE, sha1, SHA1_DIGEST_SIZE);
+		/* splitmix64 */
+		x += UINT64_C(0x9e3779b97f4a7c15);
+		z = x;
+		z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+		z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+		gear[i] = z ^ (z >> 31);
 	}
+}
 
-	if (sha1_file_write(sbuf, slen, outsha1) < 0)
-		goto err;
-	free(sbuf);
-	return 0;
-err:
-	free(sbuf);
-	return -1;
+static size_t cdc_slice_len(const unsigned char *p, size_t len)
+{
+	uint64_t h = 0;
+
+	if (len <= CDC_MIN_SIZE)
+		return len;
+
+	len = min(len, (size_t)CDC_MAX_SIZE);
+	for (size_t i = CDC_MIN_SIZE; i < len; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & CDC_MASK))
+			return i + 1;
+	}
+
+	return len;
+}
+
+int slice_write(void *buf, size_t len, unsigned char *outsha1, bool cdc)
+{
+	unsigned char *p = buf, **bufs, *sha1s = NULL;
+	unsigned *lens;
+	int nr = 0, ret = -1;
+
+	if (cdc)
+		pthread_once(&gear_once, gear_init);
+
+	/* at most one slice is shorter than CDC_MIN_SIZE */
+	bufs = xmalloc(sizeof(*bufs) * (len / CDC_MIN_SIZE + 1));
+	lens = xmalloc(sizeof(*lens) * (len / CDC_MIN_SIZE + 1));
+
+	while (len > 0) {
+		size_t wlen;
+
+		if (cdc)
+			wlen = cdc_slice_len(p, len);
+		else
+			wlen = min(len, (size_t)SLICE_SIZE);
+
+		bufs[nr] = p;
+		lens[nr] = wlen;
+		nr++;
+		p += wlen;
+		len -= wlen;
+	}
+
+	/* the slices are hashed together, see get_buffers_sha1() */
+	sha1s = xmalloc(SHA1_DIGEST_SIZE * nr);
+	if (sha1_files_write(bufs, lens, nr, sha1s) < 0)
+		goto out;
+
+	if (sha1_file_write(sha1s, SHA1_DIGEST_SIZE * nr, outsha1) < 0)
+		goto out;
+
+	ret = 0;
+out:
+	free(sha1s);
+	free(lens);
+	free(bufs);
+	return ret;
 }
 
 static struct slice_file *slice_file_read(const unsigned char *sha1)
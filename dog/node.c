@@ -17,6 +17,7 @@ static struct node_cmd_data {
 	bool watch;
 	bool local;
 	bool force;
+	bool clear;
 } node_cmd_data;
 
 static void cal_total_vdi_size(uint32_t vid, const char *name, const char *tag,
@@ -410,6 +411,30 @@ static int node_kill(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+/* The average wait is of the requests scheduled since 'last' */
+static void print_qos_stat(const struct sd_stat *stat,
+			   const struct sd_stat *last)
+{
+	uint64_t nr = stat->q.total_nr - last->q.total_nr;
+	uint64_t wait = stat->q.wait_time - last->q.wait_time;
+
+	printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%.3fms\n",
+	       raw_output ? "" :
+	       "QoS\tQueued\tTotal\tThrottled\tAvg Wait\nGateway\t",
+	       stat->q.queued_nr, stat->q.total_nr, stat->q.throttled_nr,
+	       nr ? (double)wait / nr / 1000000 : 0.0);
+}
+
+static void print_scrub_stat(const struct sd_stat *stat)
+{
+	printf("%s%"PRIu64"\t%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+	       raw_output ? "" :
+	       "Scrub\tObjects\tBytes\tCorrupt\tRepaired\tUnrepaired\n\t",
+	       stat->s.scanned_nr, strnumber(stat->s.scanned_bytes),
+	       stat->s.corrupt_nr, stat->s.repaired_nr,
+	       stat->s.unrepaired_nr);
+}
+
 static int node_stat(int argc, char **argv)
 {
 	struct sd_req hdr;
@@ -462,6 +487,8 @@ again:
 		       strnumber(stat.r.peer_total_tx - last.r.peer_total_tx),
 		       strnumber_raw(stat.r.peer_total_nr -
 				     last.r.peer_total_nr, true));
+		print_qos_stat(&stat, &last);
+		print_scrub_stat(&stat);
 		last = stat;
 		sleep(1);
 		goto again;
@@ -484,6 +511,8 @@ again:
 		       stat.r.peer_total_remove_nr, 0UL,
 		       strnumber(stat.r.peer_total_rx),
 		       strnumber(stat.r.peer_total_tx));
+		print_qos_stat(&stat, &last);
+		print_scrub_stat(&stat);
 	}
 
 	return EXIT_SUCCESS;
@@ -527,6 +556,14 @@ static int node_md_info(struct node_id *nid)
 				strnumber(info.disk[i].free),
 				ratio, info.disk[i].path);
 	}
+
+	if (!raw_output && info.rebalancing)
+		fprintf(stdout, "Rebalancing: disk %"PRIu32"/%"PRIu32", "
+			"%"PRIu64" objects scanned, %"PRIu64" objects (%s) "
+			"moved\n", info.rebalance_disk + 1,
+			info.rebalance_nr_disks, info.rebalance_scanned,
+			info.rebalance_moved,
+			strnumber(info.rebalance_bytes));
 	return EXIT_SUCCESS;
 }
 
@@ -622,6 +659,137 @@ static int node_md(int argc, char **argv)
 	return do_generic_subcommand(node_md_cmd, argc, argv);
 }
 
+static const char *slow_req_op_name(uint8_t opcode)
+{
+	switch (opcode) {
+	case SD_OP_READ_OBJ:
+	case SD_OP_READ_PEER:
+		return "read";
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_WRITE_PEER:
+		return "write";
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+	case SD_OP_CREATE_AND_WRITE_PEER:
+		return "create";
+	case SD_OP_REMOVE_OBJ:
+	case SD_OP_REMOVE_PEER:
+		return "remove";
+	case SD_OP_DECREF_OBJ:
+	case SD_OP_DECREF_PEER:
+		return "decref";
+	default:
+		return "other";
+	}
+}
+
+static void print_slow_req(const struct sd_slow_req *e)
+{
+	time_t t = e->time / 1000000000;
+	char date[32], from[HOST_NAME_MAX + 8] = "-";
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	if (e->type == SD_SLOW_REQ_PEER &&
+	    memcmp(e->addr, (uint8_t [16]){ 0 }, sizeof(e->addr)))
+		pstrcpy(from, sizeof(from), addr_to_str(e->addr, 0));
+
+	printf(raw_output ?
+	       "%s %"PRIu32" %s %016"PRIx64" %s %s %"PRIu32" %"PRIu32
+	       " %"PRIu32" %"PRIu32"\n" :
+	       "%s %10"PRIu32" %-6s %016"PRIx64" %-15s %-16s %8"PRIu32
+	       " %8"PRIu32" %8"PRIu32" %8"PRIu32"\n",
+	       date, e->req_id, slow_req_op_name(e->opcode), e->oid, from,
+	       e->result == SD_RES_SUCCESS ? "success" :
+	       sd_strerror(e->result), e->queue, e->exec, e->reply, e->total);
+
+	for (int i = 0; i < e->nr_peers; i++)
+		printf(raw_output ? "peer %s %"PRIu32"\n" :
+		       "    -> %-24s %8"PRIu32"\n",
+		       addr_to_str(e->peers[i].addr, e->peers[i].port),
+		       e->peers[i].latency);
+}
+
+static int slow_req_cmp(const struct sd_slow_req *a,
+			const struct sd_slow_req *b)
+{
+	int ret = intcmp(a->type, b->type);
+
+	if (ret)
+		return ret;
+	/* slowest first */
+	return -intcmp(a->total, b->total);
+}
+
+#define SLOWLOG_MAX_ENTRIES 128
+
+static int node_slowlog_one(const struct node_id *nid)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_slow_req *ents;
+	size_t len = sizeof(*ents) * SLOWLOG_MAX_ENTRIES;
+	int ret, nr;
+	uint8_t type = 0;
+
+	ents = xmalloc(len);
+	sd_init_req(&hdr, SD_OP_GET_SLOW_REQS);
+	hdr.data_length = len;
+	if (node_cmd_data.clear)
+		hdr.flags = SD_FLAG_CMD_DEL;
+
+	ret = dog_exec_req(nid, &hdr, ents);
+	if (ret < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get the slow request log: %s",
+		       sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	nr = rsp->data_length / sizeof(*ents);
+	xqsort(ents, nr, slow_req_cmp);
+	for (int i = 0; i < nr; i++) {
+		if (!raw_output && ents[i].type != type) {
+			type = ents[i].type;
+			printf("%s requests:\n"
+			       "Date                    ReqId Op     Object           "
+			       "From            Result          Queue(us) "
+			       "Exec(us) Reply(us) Total(us)\n",
+			       type == SD_SLOW_REQ_GATEWAY ? "Gateway" : "Peer");
+		}
+		print_slow_req(ents + i);
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(ents);
+	return ret;
+}
+
+static int node_slowlog(int argc, char **argv)
+{
+	struct sd_node *n;
+	int ret;
+
+	if (!node_cmd_data.all_nodes)
+		return node_slowlog_one(&sd_nid);
+
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		if (!raw_output)
+			printf("Node %s:\n", addr_to_str(n->nid.addr,
+							n->nid.port));
+		ret = node_slowlog_one(&n->nid);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static int node_parser(int ch, const char *opt)
 {
 	switch (ch) {
@@ -640,6 +808,9 @@ static int node_parser(int ch, const char *opt)
 	case 'f':
 		node_cmd_data.force = true;
 		break;
+	case 'c':
+		node_cmd_data.clear = true;
+		break;
 	}
 
 	return 0;
@@ -651,6 +822,7 @@ static struct sd_option node_options[] = {
 	{'w', "watch", false, "watch the stat every second"},
 	{'l', "local", false, "issue request to local node"},
 	{'f', "force", false, "ignore the confirmation"},
+	{'c', "clear", false, "clear the slow request log after showing it"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -904,6 +1076,9 @@ static struct subcommand node_cmd[] = {
 	 node_md_cmd, CMD_NEED_ROOT|CMD_NEED_ARG, node_md, node_options},
 	{"stat", NULL, "aprwhT", "show stat information about the node", NULL,
 	 0, node_stat, node_options},
+	{"slowlog", NULL, "aprAchT",
+	 "show the slowest requests of the node with their stage latencies",
+	 NULL, CMD_NEED_NODELIST, node_slowlog, node_options},
 	{"log", NULL, "aphT", "show or set log level of the node", node_log_cmd,
 	 CMD_NEED_ROOT|CMD_NEED_ARG, node_log},
 	{"vnodes", "<num of vnodes>", "aph", "set new vnodes", node_vnodes_cmd,
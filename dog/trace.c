@@ -96,9 +96,10 @@ read_buffer:
 	hdr.data_length = TRACE_BUF_LEN;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
-	if (ret < 0)
+	if (ret < 0) {
 		rval = EXIT_SYSFAIL;
 		goto out;
+	}
 
 	if (rsp->result == SD_RES_AGAIN)
 		goto read_buffer;
@@ -118,18 +119,60 @@ out:
 	return rval;
 }
 
+static struct trace_cmd_data {
+	const char *function;
+	const char *sample;
+	const char *request;
+} trace_cmd_data;
+
+/* Append 'name=val' to the comma separated options, false if too long */
+static bool add_trace_option(char *opts, size_t size, const char *name,
+			     const char *val)
+{
+	size_t len = strlen(opts);
+
+	if (!val)
+		return true;
+
+	return snprintf(opts + len, size - len, "%s%s=%s", len ? "," : "",
+			name, val) < size - len;
+}
+
 static int trace_enable(int argc, char **argv)
 {
 	const char *tracer = argv[optind];
 	int ret;
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char buf[512], *opts;
+	size_t len = strlen(tracer) + 1;
+
+	if (len >= sizeof(buf)) {
+		sd_err("too long tracer name");
+		return EXIT_USAGE;
+	}
+	pstrcpy(buf, sizeof(buf), tracer);
+
+	/* the options of the tracer follow its name */
+	opts = buf + len;
+	*opts = '\0';
+	if (!add_trace_option(opts, sizeof(buf) - len, "func",
+			      trace_cmd_data.function) ||
+	    !add_trace_option(opts, sizeof(buf) - len, "sample",
+			      trace_cmd_data.sample) ||
+	    !add_trace_option(opts, sizeof(buf) - len, "req",
+			      trace_cmd_data.request)) {
+		sd_err("too long tracer options");
+		return EXIT_USAGE;
+	}
+	if (*opts)
+		len += strlen(opts) + 1;
 
 	sd_init_req(&hdr, SD_OP_TRACE_ENABLE);
 	hdr.flags = SD_FLAG_CMD_WRITE;
-	hdr.data_length = strlen(tracer) + 1;
+	hdr.data_length = len;
 
-	ret = dog_exec_req(&sd_nid, &hdr, (void *)tracer);
+	ret = dog_exec_req(&sd_nid, &hdr, buf);
 	if (ret < 0)
 		return EXIT_SYSFAIL;
 
@@ -140,7 +183,8 @@ static int trace_enable(int argc, char **argv)
 		sd_err("no such tracer %s", tracer);
 		return EXIT_FAILURE;
 	case SD_RES_INVALID_PARMS:
-		sd_err("tracer %s is already enabled", tracer);
+		sd_err("tracer %s is already enabled or the options are invalid"
+		       " (see the log of sheep)", tracer);
 		return EXIT_FAILURE;
 	default:
 		sd_err("unknown error (%s)", sd_strerror(rsp->result));
@@ -348,9 +392,31 @@ static int graph_stat(int argc, char **argv)
 
 static int trace_parser(int ch, const char *opt)
 {
+	switch (ch) {
+	case 'F':
+		trace_cmd_data.function = opt;
+		break;
+	case 'S':
+		trace_cmd_data.sample = opt;
+		break;
+	case 'R':
+		trace_cmd_data.request = opt;
+		break;
+	}
+
 	return 0;
 }
 
+static struct sd_option trace_options[] = {
+	{'F', "function", true, "trace only the specified function and its "
+	 "callees\n                          (graph tracer)"},
+	{'S', "sample", true, "trace one of every N calls of the function "
+	 "specified\n                          by -F (graph tracer)"},
+	{'R', "request", true, "trace only the requests with the id shown by "
+	 "'dog node\n                          slowlog' (graph tracer)"},
+	{ 0, NULL, false, NULL },
+};
+
 static struct subcommand graph_cmd[] = {
 	{"cat", NULL, NULL, "cat the output of graph tracer",
 	 NULL, 0, graph_cat},
@@ -366,8 +432,8 @@ static int trace_graph(int argc, char **argv)
 
 /* Subcommand list of trace */
 static struct subcommand trace_cmd[] = {
-	{"enable", "<tracer>", "aph", "enable tracer", NULL,
-	 CMD_NEED_ARG, trace_enable},
+	{"enable", "<tracer>", "aphFSR", "enable tracer", NULL,
+	 CMD_NEED_ARG, trace_enable, trace_options},
 	{"disable", "<tracer>", "aph", "disable tracer", NULL,
 	 CMD_NEED_ARG, trace_disable},
 	{"status", NULL, "aph", "show tracer statuses", NULL,
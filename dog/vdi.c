@@ -50,6 +50,8 @@ static struct sd_option vdi_options[] = {
 	 "reclamation during VDI deletion"},
 	{'I', "reclamation-interval", true, "specify how long (unit: second)"
 	 "in reclamation loop during VDI deletion"},
+	{'H', "hash", true, "specify the digest to compare replicas with,\n"
+	 "                          sha1 (default) or crc32c (faster)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -71,6 +73,7 @@ static struct vdi_cmd_data {
 	uint64_t oid;
 	bool no_share;
 	bool exist;
+	bool crc32c;
 	bool reduce_identical_snapshots;
 	int nr_batched_reclamation;
 	int reclamation_interval;
@@ -1653,6 +1656,226 @@ static int vdi_getattr(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+/* limits given to 'dog vdi qos', UINT64_MAX if not specified */
+static struct sd_vdi_qos qos_arg = {
+	.iops = UINT64_MAX, .iops_burst = UINT64_MAX,
+	.bps = UINT64_MAX, .bps_burst = UINT64_MAX, .weight = UINT32_MAX,
+};
+
+static int qos_parse_count(const char *s, uint64_t *ret)
+{
+	char *p;
+
+	*ret = strtoull(s, &p, 10);
+	if (s == p || *p != '\0' || *ret == UINT64_MAX) {
+		sd_err("Invalid number '%s'", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int qos_parse_bandwidth(const char *s, uint64_t *ret)
+{
+	if (option_parse_size(s, ret) < 0 || *ret == UINT64_MAX)
+		return -1;
+
+	return 0;
+}
+
+static int qos_iops_parser(const char *s)
+{
+	return qos_parse_count(s, &qos_arg.iops);
+}
+
+static int qos_iops_burst_parser(const char *s)
+{
+	return qos_parse_count(s, &qos_arg.iops_burst);
+}
+
+static int qos_bps_parser(const char *s)
+{
+	return qos_parse_bandwidth(s, &qos_arg.bps);
+}
+
+static int qos_bps_burst_parser(const char *s)
+{
+	return qos_parse_bandwidth(s, &qos_arg.bps_burst);
+}
+
+static int qos_weight_parser(const char *s)
+{
+	uint64_t weight;
+
+	if (qos_parse_count(s, &weight) < 0)
+		return -1;
+	if (weight > UINT16_MAX) {
+		sd_err("Weight must be %d or less", UINT16_MAX);
+		return -1;
+	}
+	qos_arg.weight = weight;
+
+	return 0;
+}
+
+static void merge_vdi_qos(struct sd_vdi_qos *qos)
+{
+	if (qos_arg.iops != UINT64_MAX)
+		qos->iops = qos_arg.iops;
+	if (qos_arg.iops_burst != UINT64_MAX)
+		qos->iops_burst = qos_arg.iops_burst;
+	if (qos_arg.bps != UINT64_MAX)
+		qos->bps = qos_arg.bps;
+	if (qos_arg.bps_burst != UINT64_MAX)
+		qos->bps_burst = qos_arg.bps_burst;
+	if (qos_arg.weight != UINT32_MAX)
+		qos->weight = qos_arg.weight;
+}
+
+static const char *qos_limit_str(uint64_t limit, bool size)
+{
+	if (!limit)
+		return "unlimited";
+
+	return size ? strnumber(limit) : strnumber_raw(limit, true);
+}
+
+static void print_vdi_qos(const struct sd_vdi_qos *qos)
+{
+	if (raw_output) {
+		printf("%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu32"\n",
+		       qos->iops, qos->iops_burst, qos->bps, qos->bps_burst,
+		       qos->weight);
+		return;
+	}
+
+	printf("IOPS: %s (burst: %s)\n", qos_limit_str(qos->iops, false),
+	       qos_limit_str(qos->iops_burst ? : qos->iops, false));
+	printf("Bandwidth: %s%s (burst: %s)\n", qos_limit_str(qos->bps, true),
+	       qos->bps ? "/s" : "",
+	       qos_limit_str(qos->bps_burst ? : qos->bps, true));
+	printf("Weight: %"PRIu32"\n", qos->weight ? : 1);
+}
+
+static int print_vdi_qos_stat(uint32_t vid)
+{
+	struct sd_node *n;
+	int i = 0;
+
+	if (!raw_output)
+		printf("\nId\tRequests\tBytes\tThrottled\tAvg Wait\tQueued\n");
+
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		struct sd_req hdr;
+		struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+		struct sd_vdi_qos_stat stat;
+		int ret;
+
+		sd_init_req(&hdr, SD_OP_GET_VDI_QOS);
+		hdr.data_length = sizeof(stat);
+		hdr.vdi.base_vdi_id = vid;
+
+		ret = dog_exec_req(&n->nid, &hdr, &stat);
+		if (ret < 0)
+			return EXIT_SYSFAIL;
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_err("Failed to get QoS statistics of %s: %s",
+			       addr_to_str(n->nid.addr, n->nid.port),
+			       sd_strerror(rsp->result));
+			return EXIT_FAILURE;
+		}
+
+		printf(raw_output ? "%d %"PRIu64" %s %"PRIu64" %.3f %"PRIu32"\n"
+		       : "%2d\t%8"PRIu64"\t%s\t%9"PRIu64"\t%6.3fms\t%6"PRIu32"\n",
+		       i++, stat.nr_reqs, strnumber(stat.bytes),
+		       stat.nr_throttled, stat.nr_reqs ?
+		       (double)stat.wait_time / stat.nr_reqs / 1000000 : 0.0,
+		       stat.nr_queued);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int vdi_qos(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	char *limits = argv[optind];
+	struct option_parser qos_parsers[] = {
+		{ "iops=", qos_iops_parser },
+		{ "iops-burst=", qos_iops_burst_parser },
+		{ "bps=", qos_bps_parser },
+		{ "bps-burst=", qos_bps_burst_parser },
+		{ "weight=", qos_weight_parser },
+		{ NULL, NULL },
+	};
+	struct sheepdog_vdi_attr vattr;
+	struct sd_vdi_qos qos = {};
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint32_t vid, nr_copies;
+	uint64_t attr_oid;
+	int ret;
+
+	if (limits && option_parse(limits, ",", qos_parsers) < 0)
+		return EXIT_USAGE;
+
+	ret = find_vdi_attr_oid(vdiname, vdi_cmd_data.snapshot_tag,
+				vdi_cmd_data.snapshot_id, SD_VDI_QOS_ATTR_KEY,
+				NULL, 0, &vid, &attr_oid, &nr_copies, false,
+				false, false);
+	if (ret == SD_RES_SUCCESS) {
+		ret = dog_read_object(attr_oid, &vattr, SD_ATTR_OBJ_SIZE, 0,
+				      true);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("Failed to read QoS of %s: %s", vdiname,
+			       sd_strerror(ret));
+			return EXIT_SYSFAIL;
+		}
+		memcpy(&qos, vattr.value, min((size_t)vattr.value_len,
+					      sizeof(qos)));
+	} else if (ret == SD_RES_NO_VDI) {
+		sd_err("VDI not found");
+		return EXIT_MISSING;
+	} else if (ret != SD_RES_NO_OBJ) {
+		sd_err("Failed to find QoS of %s: %s", vdiname,
+		       sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	if (!limits) {
+		print_vdi_qos(&qos);
+		/* the gateways group the vdis like the attributes */
+		return print_vdi_qos_stat(sd_hash_vdi(vdiname));
+	}
+
+	merge_vdi_qos(&qos);
+	ret = find_vdi_attr_oid(vdiname, vdi_cmd_data.snapshot_tag,
+				vdi_cmd_data.snapshot_id, SD_VDI_QOS_ATTR_KEY,
+				&qos, sizeof(qos), &vid, &attr_oid,
+				&nr_copies, true, false, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to save QoS of %s: %s", vdiname,
+		       sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	sd_init_req(&hdr, SD_OP_SET_VDI_QOS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(qos);
+	hdr.vdi.base_vdi_id = vid;
+
+	ret = dog_exec_req(&sd_nid, &hdr, &qos);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to apply QoS of %s: %s", vdiname,
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static int vdi_read(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
@@ -1881,6 +2104,7 @@ enum vdi_check_result {
 
 struct vdi_check_info {
 	uint64_t oid;
+	bool crc32c;
 	uint8_t nr_copies;
 	uint8_t copy_policy;
 	uint8_t block_size_shift;
@@ -1964,8 +2188,11 @@ static void vdi_check_object_work(struct work *work)
 		hdr.obj.ec_index = vcw->ec_index;
 		hdr.epoch = sd_epoch;
 		vcw->buf = xmalloc(hdr.data_length);
-	} else
+	} else {
 		sd_init_req(&hdr, SD_OP_GET_HASH);
+		if (info->crc32c)
+			hdr.flags = SD_FLAG_CMD_CRC32C;
+	}
 	hdr.obj.oid = info->oid;
 	hdr.obj.tgt_epoch = sd_epoch;
 
@@ -2174,13 +2401,14 @@ static void vdi_check_object_main(struct work *work)
 
 static void queue_vdi_check_work(const struct sd_inode *inode, uint64_t oid,
 				 uint64_t *done, struct work_queue *wq,
-				 int nr_copies)
+				 int nr_copies, bool crc32c)
 {
 	struct vdi_check_info *info;
 	const struct sd_vnode *tgt_vnodes[SD_MAX_COPIES];
 
 	info = xzalloc(sizeof(*info) + sizeof(info->vcw[0]) * nr_copies);
 	info->oid = oid;
+	info->crc32c = crc32c;
 	info->nr_copies = nr_copies;
 	info->total = inode->vdi_size;
 	info->done = done;
@@ -2205,6 +2433,7 @@ struct check_arg {
 	uint64_t *done;
 	struct work_queue *wq;
 	int nr_copies;
+	bool crc32c;
 };
 
 static void check_cb(struct sd_index *idx, void *arg, int ignore)
@@ -2218,11 +2447,11 @@ static void check_cb(struct sd_index *idx, void *arg, int ignore)
 		*(carg->done) = (uint64_t)idx->idx * object_size;
 		vdi_show_progress(*(carg->done), carg->inode->vdi_size);
 		queue_vdi_check_work(carg->inode, oid, NULL, carg->wq,
-				     carg->nr_copies);
+				     carg->nr_copies, carg->crc32c);
 	}
 }
 
-int do_vdi_check(const struct sd_inode *inode)
+int do_vdi_check(const struct sd_inode *inode, bool crc32c)
 {
 	uint32_t max_idx;
 	uint64_t done = 0, oid;
@@ -2242,7 +2471,7 @@ int do_vdi_check(const struct sd_inode *inode)
 	init_fec();
 
 	queue_vdi_check_work(inode, vid_to_vdi_oid(inode->vdi_id), NULL, wq,
-			     nr_copies);
+			     nr_copies, crc32c);
 
 	if (inode->store_policy == 0) {
 		max_idx = count_data_objs(inode);
@@ -2252,14 +2481,14 @@ int do_vdi_check(const struct sd_inode *inode)
 			if (vid) {
 				oid = vid_to_data_oid(vid, idx);
 				queue_vdi_check_work(inode, oid, &done, wq,
-						     nr_copies);
+						     nr_copies, crc32c);
 			} else {
 				done += object_size;
 				vdi_show_progress(done, inode->vdi_size);
 			}
 		}
 	} else {
-		struct check_arg arg = {inode, &done, wq, nr_copies};
+		struct check_arg arg = {inode, &done, wq, nr_copies, crc32c};
 		sd_inode_index_walk(inode, check_cb, &arg);
 		vdi_show_progress(inode->vdi_size, inode->vdi_size);
 	}
@@ -2288,7 +2517,7 @@ static int vdi_check(int argc, char **argv)
 	if (vdi_cmd_data.exist)
 		ret = do_vdi_check_exist(inode);
 	else
-		ret = do_vdi_check(inode);
+		ret = do_vdi_check(inode, vdi_cmd_data.crc32c);
 out:
 	free(inode);
 	return ret;
@@ -2967,7 +3196,8 @@ static int vdi_lock(int argc, char **argv)
 }
 
 static struct subcommand vdi_cmd[] = {
-	{"check", "<vdiname>", "seaphT", "check and repair image's consistency",
+	{"check", "<vdiname>", "seaphTH",
+	 "check and repair image's consistency",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_check, vdi_options},
 	{"create", "<vdiname> <size>", "PycaphrvzT", "create an image",
@@ -3005,6 +3235,10 @@ static struct subcommand vdi_cmd[] = {
 	{"getattr", "<vdiname> <key>", "aphT", "get a VDI attribute",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_getattr, vdi_options},
+	{"qos", "<vdiname> [iops=N,iops-burst=N,bps=SIZE,bps-burst=SIZE,"
+	 "weight=N]", "aprhT", "set or show the QoS limits of an image",
+	 NULL, CMD_NEED_NODELIST|CMD_NEED_ROOT|CMD_NEED_ARG,
+	 vdi_qos, vdi_options},
 	{"resize", "<vdiname> <new size>", "aphT", "resize an image",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_resize, vdi_options},
@@ -3117,6 +3351,9 @@ static int vdi_parser(int ch, const char *opt)
 	case 'e':
 		vdi_cmd_data.exist = true;
 		break;
+	case 'H':
+		vdi_cmd_data.crc32c = parse_hash_name(opt);
+		break;
 	case 'z':
 		block_size_shift = (uint8_t)atoi(opt);
 		if (block_size_shift > 31) {
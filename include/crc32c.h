@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * CRC-32C (Castagnoli) of 'buf', continuing 'crc'.  Start with 0, and feed
+ * the result back in to checksum a buffer in pieces.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -24,7 +24,7 @@
 #include "rbtree.h"
 #include "fec.h"
 
-#define SD_SHEEP_PROTO_VER 0x0a
+#define SD_SHEEP_PROTO_VER 0x0b
 
 #define SD_DEFAULT_COPIES 3
 /*
@@ -115,10 +115,25 @@
 #define SD_OP_SET_RECOVERY      0xCB
 #define SD_OP_SET_VNODES 0xCC
 #define SD_OP_GET_VNODES 0xCD
+#define SD_OP_REMOVE_PEERS 0xCE
+#define SD_OP_GET_OBJ_LIST_FILTERED 0xCF
+#define SD_OP_GET_SLOW_REQS 0xD0
+#define SD_OP_SET_VDI_QOS   0xD1
+#define SD_OP_GET_VDI_QOS   0xD2
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
 #define SD_FLAG_CMD_WILDCARD 0x0100
+/*
+ * read: zero chunks may be left out of the response, see sparse_pack().
+ * Sheep which don't know this flag speak an older SD_SHEEP_PROTO_VER, so
+ * they can't join the cluster nor send peer requests to it.
+ */
+#define SD_FLAG_CMD_SPARSE   0x0200
+/* get hash: CRC-32C based digest, see csum_digest() */
+#define SD_FLAG_CMD_CRC32C   0x0400
+/* recovery read: a request is waiting for the object, see peer_io_class() */
+#define SD_FLAG_CMD_URGENT   0x0800
 
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
@@ -152,6 +167,7 @@
 #define SD_RES_INVALID_VNODES_STRATEGY 0x98 /* Invalid vnodes strategy */
 /* Node doesn't have a required entry of checkpoint */
 #define SD_RES_NO_CHECKPOINT_ENTRY 0x99
+#define SD_RES_CSUM_MISMATCH 0x9A /* Object doesn't match its checksums */
 
 #define SD_CLUSTER_FLAG_STRICT		0x0001 /* Strict mode for write */
 #define SD_CLUSTER_FLAG_DISKMODE	0x0002 /* Disk mode for cluster */
@@ -159,6 +175,10 @@
 #define SD_CLUSTER_FLAG_USE_LOCK	0x0008 /* Lock/Unlock vdi */
 #define SD_CLUSTER_FLAG_RECYCLE_VID	0x0010 /* Enable recycling of VID */
 #define SD_CLUSTER_FLAG_AVOID_DISKFULL	0x0020 /* Avoid disk full by recovery */
+#define SD_CLUSTER_FLAG_SPARSE		0x0040 /* Thin provisioned data objects */
+
+/* data object chunks which are all zero are kept as holes in sparse mode */
+#define SD_SPARSE_CHUNK_SIZE	(64 * 1024)
 
 enum sd_status {
 	SD_STATUS_OK = 1,
@@ -314,6 +334,15 @@ struct md_info {
 struct sd_md_info {
 	struct md_info disk[MD_MAX_DISK];
 	int nr;
+
+	/* progress of the rebalancing after the disks were changed */
+	uint8_t rebalancing;
+	uint8_t __pad[3];
+	uint32_t rebalance_disk;	/* the disk being scanned */
+	uint32_t rebalance_nr_disks;
+	uint64_t rebalance_scanned;	/* objects */
+	uint64_t rebalance_moved;	/* objects */
+	uint64_t rebalance_bytes;	/* bytes moved */
 };
 
 static inline __attribute__((used)) void __sd_epoch_format_build_bug_ons(void)
@@ -368,6 +397,79 @@ struct sd_stat {
 		uint64_t peer_total_read_nr;
 		uint64_t peer_total_write_nr;
 	} r;
+	struct s_qos {
+		uint64_t queued_nr; /* Requests waiting in the gateway now */
+		uint64_t total_nr; /* Total nr of requests scheduled by QoS */
+		uint64_t throttled_nr; /* Total nr of requests delayed by limits */
+		uint64_t wait_time; /* Total time requests waited, in ns */
+	} q;
+	struct s_scrub {
+		uint64_t scanned_nr; /* Objects verified by the scrubber */
+		uint64_t scanned_bytes;
+		uint64_t corrupt_nr; /* Objects which didn't match checksums */
+		uint64_t repaired_nr;
+		uint64_t unrepaired_nr;
+	} s;
+};
+
+/*
+ * QoS limits of a vdi, which are stored as the vdi attribute
+ * SD_VDI_QOS_ATTR_KEY and enforced by the gateway of each node.  Zero means
+ * no limit, and the bursts default to a second of the rates.  The weight is
+ * the share of the gateway the vdi gets when requests of several vdis are
+ * waiting, 1 if zero.
+ */
+#define SD_VDI_QOS_ATTR_KEY "sheepdog.qos"
+
+struct sd_vdi_qos {
+	uint64_t iops;		/* requests per second */
+	uint64_t iops_burst;	/* requests */
+	uint64_t bps;		/* bytes per second */
+	uint64_t bps_burst;	/* bytes */
+	uint32_t weight;
+	uint32_t __pad;
+};
+
+/* QoS counters of a vdi at the gateway of a node */
+struct sd_vdi_qos_stat {
+	struct sd_vdi_qos qos;	/* limits known by the node */
+	uint64_t nr_reqs;	/* requests sent to the gateway workers */
+	uint64_t bytes;
+	uint64_t nr_throttled;	/* requests delayed by the limits */
+	uint64_t wait_time;	/* total time requests waited, in ns */
+	uint32_t nr_queued;	/* requests waiting now */
+	uint32_t __pad;
+};
+
+/*
+ * An entry of the slow request log of a node.  Latencies are in microseconds;
+ * queue is the time until a worker picks up the request, exec the time in the
+ * worker and reply the time until the response is queued.
+ */
+#define SD_SLOW_REQ_GATEWAY 1
+#define SD_SLOW_REQ_PEER    2
+
+struct sd_slow_req {
+	uint64_t oid;
+	uint64_t time;		/* when the request was received, in ns */
+	uint32_t req_id;	/* assigned by the gateway, 0 if unknown */
+	uint32_t result;
+	uint8_t  opcode;
+	uint8_t  type;
+	uint8_t  nr_peers;
+	uint8_t  __pad;
+	uint32_t queue;
+	uint32_t exec;
+	uint32_t reply;
+	uint32_t total;
+	uint32_t __pad2;
+	uint8_t  addr[16];	/* sender of a peer request */
+	struct {
+		uint8_t  addr[16];
+		uint16_t port;
+		uint16_t __pad;
+		uint32_t latency;	/* from forwarding to the response */
+	} peers[SD_MAX_COPIES];	/* peers a gateway request was sent to */
 };
 
 void sd_inode_stat(const struct sd_inode *inode, uint64_t *, uint64_t *);
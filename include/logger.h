@@ -22,6 +22,7 @@
 #define LOG_SPACE_SIZE (1 * 1024 * 1024)
 #define LOG_SPACE_DEBUG_SIZE (32 * 1024 * 1024)
 #define MAX_MSG_SIZE 1024
+#define LOG_NR_RINGS 32
 #define MAX_THREAD_NAME_LEN	20
 
 struct logger_user_info {
@@ -29,6 +30,7 @@ struct logger_user_info {
 };
 
 extern int sd_log_level;
+extern int sd_log_nr_rings;
 
 enum log_dst_type {
 	LOG_DST_DEFAULT,
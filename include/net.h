@@ -74,6 +74,7 @@ const char *addr_to_str(const uint8_t *addr, uint16_t port);
 uint8_t *str_to_addr(const char *ipstr, uint8_t *addr);
 char *sockaddr_in_to_str(struct sockaddr_in *sockaddr);
 int set_nodelay(int fd);
+int set_nonblocking(int fd);
 int set_keepalive(int fd);
 int set_snd_timeout(int fd);
 int set_rcv_timeout(int fd);
@@ -33,5 +33,7 @@ sha1_final_func_t sha1_final;
 
 const char *sha1_to_hex(const unsigned char *sha1);
 void get_buffer_sha1(unsigned char *buf, unsigned len, unsigned char *sha1);
+void get_buffers_sha1(unsigned char **bufs, const unsigned *lens, int nr,
+		      unsigned char *sha1s);
 
 #endif
@@ -172,6 +172,7 @@ static inline const char *sd_strerror(int err)
 		[SD_RES_AGAIN] = "Ask to try again",
 		[SD_RES_STALE_OBJ] = "Object may be stale",
 		[SD_RES_CLUSTER_ERROR] = "Cluster driver error",
+		[SD_RES_CSUM_MISMATCH] = "Object doesn't match its checksums",
 	};
 
 	if (!(0 <= err && err < ARRAY_SIZE(descs)) || descs[err] == NULL) {
@@ -152,7 +152,7 @@ struct sd_req {
 			uint8_t		reserved;
 			uint32_t	tgt_epoch;
 			uint32_t	offset;
-			uint32_t	__pad;
+			uint32_t	req_id; /* set by the gateway */
 		} obj;
 		struct {
 			uint64_t	vdi_size;
@@ -207,6 +207,13 @@ struct sd_req {
 			uint32_t        vid;
 			uint32_t        validate;
 		} inode_coherence;
+		struct {
+			uint64_t	cursor;
+			uint8_t		addr[16];
+			uint16_t	port;
+			uint16_t	__pad;
+			uint32_t	tgt_epoch;
+		} obj_list;
 
 
 		uint32_t		__pad[8];
@@ -407,6 +414,8 @@ extern int sd_inode_write_vid(struct sd_inode *inode,
 			      uint32_t idx, uint32_t vid, uint32_t value,
 			      int flags, bool create, bool direct);
 extern uint32_t sd_inode_get_meta_size(struct sd_inode *inode, size_t size);
+extern void sd_inode_cache_hold(uint32_t vid);
+extern int sd_inode_cache_release(uint32_t vid);
 extern void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 			       uint32_t *data_vdi_id, uint8_t store_policy,
 			       uint8_t nr_copies, uint8_t copy_policy,
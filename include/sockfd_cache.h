@@ -8,6 +8,7 @@ struct sockfd *sockfd_cache_get(const struct node_id *nid);
 void sockfd_cache_put(const struct node_id *nid, struct sockfd *sfd);
 void sockfd_cache_del_node(const struct node_id *nid);
 void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd);
+void sockfd_cache_discard(const struct node_id *nid, struct sockfd *sfd);
 void sockfd_cache_add(const struct node_id *nid);
 void sockfd_cache_add_group(const struct rb_root *nroot);
 
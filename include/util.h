@@ -421,6 +421,21 @@ static inline int sd_cond_wait_timeout(struct sd_cond *cond,
 	return pthread_cond_timedwait(&cond->cond, &mutex->mutex, &wait_time);
 }
 
+static inline int sd_cond_wait_timeout_ms(struct sd_cond *cond,
+					  struct sd_mutex *mutex, int msec)
+{
+	struct timespec wait_time;
+
+	clock_gettime(CLOCK_REALTIME, &wait_time);
+	wait_time.tv_sec += msec / 1000;
+	wait_time.tv_nsec += (msec % 1000) * 1000000;
+	if (wait_time.tv_nsec >= 1000000000) {
+		wait_time.tv_sec++;
+		wait_time.tv_nsec -= 1000000000;
+	}
+	return pthread_cond_timedwait(&cond->cond, &mutex->mutex, &wait_time);
+}
+
 static inline int sd_cond_broadcast(struct sd_cond *cond)
 {
 	return pthread_cond_broadcast(&cond->cond);
@@ -574,6 +589,15 @@ static inline uint64_t clock_get_time(void)
 	return (uint64_t)ts.tv_sec * 1000000000LL + (uint64_t)ts.tv_nsec;
 }
 
+/* Same as clock_get_time(), but for measuring intervals */
+static inline uint64_t clock_get_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000LL + (uint64_t)ts.tv_nsec;
+}
+
 char *xstrdup(const char *s);
 uint32_t str_to_u32(const char *nptr);
 uint16_t str_to_u16(const char *nptr);
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CRC-32C, with the crc32 instruction of SSE4.2 if the CPU has it and the
+ * slicing-by-8 tables otherwise.
+ */
+
+#include <endian.h>
+
+#include "crc32c.h"
+#include "util.h"
+
+#define CRC32C_POLY	0x82f63b78 /* reversed */
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		v = le64toh(v) ^ crc;
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+	}
+
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef __x86_64__
+
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc, v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		asm("crc32b %1, %k0" : "+r" (crc64) : "rm" (*p));
+		p++;
+		len--;
+	}
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		asm("crc32q %1, %0" : "+r" (crc64) : "rm" (v));
+	}
+
+	while (len--) {
+		asm("crc32b %1, %k0" : "+r" (crc64) : "rm" (*p));
+		p++;
+	}
+
+	return crc64;
+}
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc32c_fn(~crc, buf, len);
+}
+
+static void __attribute__((constructor)) __crc32c_init(void)
+{
+	uint32_t crc;
+
+	for (int i = 0; i < 256; i++) {
+		crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (int j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+
+	crc32c_fn = crc32c_sw;
+#ifdef __x86_64__
+	if (cpu_has_xmm4_2)
+		crc32c_fn = crc32c_sse42;
+#endif
+}
@@ -23,8 +23,12 @@
 #define TRACEPOINT_DEFINE
 #include "event_tp.h"
 
-static int efd;
-static struct rb_root events_tree = RB_ROOT;
+/*
+ * Every thread which calls init_event() has its own event loop, and the
+ * functions below work on the loop of the calling thread.
+ */
+static __thread int efd;
+static __thread struct rb_root events_tree = RB_ROOT;
 
 static void timer_handler(int fd, int events, void *data)
 {
@@ -72,8 +76,8 @@ struct event_info {
 	int prio;
 };
 
-static struct epoll_event *events;
-static int nr_events;
+static __thread struct epoll_event *events;
+static __thread int nr_events;
 
 static int event_cmp(const struct event_info *e1, const struct event_info *e2)
 {
@@ -177,7 +181,7 @@ int modify_event(int fd, unsigned int new_events)
 	return 0;
 }
 
-static bool event_loop_refresh;
+static __thread bool event_loop_refresh;
 
 void event_force_refresh(void)
 {
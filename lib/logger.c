@@ -21,6 +21,7 @@
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <time.h>
 #include <sys/shm.h>
 #include <sys/ipc.h>
@@ -74,6 +75,20 @@ union semun {
 	struct seminfo *__buf;
 };
 
+/*
+ * Per-thread message ring.  A ring has a single producer (the thread which
+ * claimed it) and a single consumer (the logger process), so messages can be
+ * staged without taking the semaphore.  head and tail are byte offsets which
+ * only grow; the producer advances head and the logger advances tail.
+ */
+struct log_ring {
+	unsigned long owner;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	char *start;
+};
+
 struct logarea {
 	bool active;
 	char *tail;
@@ -82,6 +97,11 @@ struct logarea {
 	int semid;
 	union semun semarg;
 	int fd;
+	uint64_t dropped;
+
+	struct log_ring *rings;
+	int nr_rings;
+	size_t ring_size;
 };
 
 #define FUNC_NAME_SIZE 32 /* according to C89, including '\0' */
@@ -97,6 +117,21 @@ struct logmsg {
 	char str[0];
 };
 
+/* a ring holds at least this many messages of the maximum size */
+#define LOG_RING_MIN_SIZE (16 * (sizeof(struct logmsg) + MAX_MSG_SIZE))
+
+/* number of messages a thread without a ring logs before it retries */
+#define LOG_RING_RETRY 64
+
+/* prio of the record which pads the end of a ring when a message wraps */
+#define LOG_REC_PAD (-1)
+#define LOG_REC_ALIGN 8
+
+static inline size_t log_rec_len(const struct logmsg *msg)
+{
+	return round_up(sizeof(*msg) + msg->str_len + 1, LOG_REC_ALIGN);
+}
+
 typedef int (*formatter_fn)(char *, size_t, const struct logmsg *, bool);
 
 struct log_format {
@@ -115,10 +150,18 @@ static struct logarea *la;
 static const char *log_name;
 static char *log_nowname;
 int sd_log_level = SDOG_INFO;
+int sd_log_nr_rings = LOG_NR_RINGS;
 static pid_t sheep_pid;
 pid_t logger_pid = -1;
 static key_t semkey;
 static char *log_buff;
+static const struct logmsg **log_msgs;
+static int nr_log_msgs;
+static uint64_t *log_dropped;
+
+static pthread_key_t ring_key;
+static __thread struct log_ring *thread_ring;
+static __thread unsigned int ring_retry;
 
 static int64_t max_logsize = 500 * 1024 * 1024;  /*500MB*/
 
@@ -288,6 +331,78 @@ init_log_formatter(void)
 	exit(1);
 }
 
+static void put_log_ring(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	/* make our last head update visible before the next owner reads it */
+	cmm_smp_mb();
+	uatomic_set(&ring->owner, 0);
+}
+
+static bool ring_key_created;
+
+static void create_ring_key(void)
+{
+	ring_key_created = pthread_key_create(&ring_key, put_log_ring) == 0;
+}
+
+/*
+ * The rings share the size of the log area, which depends on the log level,
+ * so with the default number of rings a thread can stage 32 KB of messages
+ * (1 MB with debug level) between two flushes of the logger.
+ */
+static int log_rings_init(int size)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	size_t ring_size;
+	char *p;
+	int shmid;
+
+	la->rings = NULL;
+	la->nr_rings = 0;
+	if (sd_log_nr_rings <= 0)
+		return 0;
+
+	ring_size = round_down((size_t)size / sd_log_nr_rings, LOG_REC_ALIGN);
+	ring_size = max(ring_size, LOG_RING_MIN_SIZE);
+
+	pthread_once(&once, create_ring_key);
+	if (!ring_key_created) {
+		syslog(LOG_ERR, "failed to create a key for log rings");
+		return 1;
+	}
+
+	shmid = shmget(IPC_PRIVATE,
+		       sd_log_nr_rings * (sizeof(struct log_ring) + ring_size),
+		       0644 | IPC_CREAT | IPC_EXCL);
+	if (shmid == -1) {
+		syslog(LOG_ERR, "shmget log rings failed: %m");
+		return 1;
+	}
+
+	la->rings = shmat(shmid, NULL, 0);
+	if (la->rings == (void *)-1) {
+		syslog(LOG_ERR, "shmat log rings failed: %m");
+		shmctl(shmid, IPC_RMID, NULL);
+		return 1;
+	}
+	shmctl(shmid, IPC_RMID, NULL);
+
+	p = (char *)(la->rings + sd_log_nr_rings);
+	for (int i = 0; i < sd_log_nr_rings; i++) {
+		struct log_ring *ring = la->rings + i;
+
+		memset(ring, 0, sizeof(*ring));
+		ring->start = p;
+		p += ring_size;
+	}
+	la->nr_rings = sd_log_nr_rings;
+	la->ring_size = ring_size;
+
+	return 0;
+}
+
 static int logarea_init(int size)
 {
 	int shmid;
@@ -346,6 +461,13 @@ static int logarea_init(int size)
 		return 1;
 	}
 
+	if (log_rings_init(size)) {
+		semctl(la->semid, 0, IPC_RMID, la->semarg);
+		shmdt(la->start);
+		shmdt(la);
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -354,6 +476,8 @@ static void free_logarea(void)
 	if (log_fd >= 0)
 		close(log_fd);
 	semctl(la->semid, 0, IPC_RMID, la->semarg);
+	if (la->rings)
+		shmdt(la->rings);
 	shmdt(la->start);
 	shmdt(la);
 }
@@ -394,6 +518,119 @@ static void init_logmsg(struct logmsg *msg, struct timeval *tv,
 	msg->worker_idx = worker_idx;
 }
 
+static bool log_ring_drained(struct log_ring *ring)
+{
+	return uatomic_read(&ring->head) == uatomic_read(&ring->tail);
+}
+
+static struct log_ring *claim_log_ring(bool drained)
+{
+	for (int i = 0; i < la->nr_rings; i++) {
+		struct log_ring *ring = la->rings + i;
+
+		if (uatomic_read(&ring->owner))
+			continue;
+		if (drained && !log_ring_drained(ring))
+			continue;
+		if (uatomic_cmpxchg(&ring->owner, 0, 1) == 0)
+			return ring;
+	}
+
+	return NULL;
+}
+
+/*
+ * Claim a free ring on the first message of the thread.  The ring is released
+ * when the thread exits.  Rings which the logger has already drained are
+ * preferred so that short-lived threads don't fill up the same ring between
+ * two flushes.  If all the rings are taken, the thread falls back to the
+ * shared area protected by the semaphore, and tries again after
+ * LOG_RING_RETRY messages in case another thread has released its ring.
+ */
+static struct log_ring *get_log_ring(void)
+{
+	struct log_ring *ring;
+
+	if (likely(thread_ring))
+		return thread_ring;
+
+	if (ring_retry) {
+		ring_retry--;
+		return NULL;
+	}
+
+	ring = claim_log_ring(true);
+	if (!ring)
+		ring = claim_log_ring(false);
+	if (!ring) {
+		ring_retry = LOG_RING_RETRY;
+		return NULL;
+	}
+
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+static void log_ring_enqueue(struct log_ring *ring, const struct logmsg *msg)
+{
+	size_t len = log_rec_len(msg), size = la->ring_size;
+	uint64_t head = ring->head, tail = uatomic_read(&ring->tail);
+	size_t off = head % size, pad = 0;
+
+	/* records are contiguous, so skip the rest of the ring if needed */
+	if (size - off < len)
+		pad = size - off;
+
+	if (head + pad + len - tail > size) {
+		uatomic_set(&ring->dropped, ring->dropped + 1);
+		return;
+	}
+
+	/* don't overwrite the records before the logger has copied them */
+	cmm_smp_mb();
+
+	if (pad) {
+		if (pad >= sizeof(*msg))
+			((struct logmsg *)(ring->start + off))->prio =
+				LOG_REC_PAD;
+		head += pad;
+		off = 0;
+	}
+	memcpy(ring->start + off, msg, sizeof(*msg) + msg->str_len + 1);
+
+	cmm_smp_wmb();
+	uatomic_set(&ring->head, head + len);
+}
+
+static void log_area_enqueue(const struct logmsg *msg)
+{
+	size_t len = sizeof(*msg) + msg->str_len + 1;
+	struct sembuf ops;
+
+	ops.sem_num = 0;
+	ops.sem_flg = SEM_UNDO;
+	ops.sem_op = -1;
+	if (semop(la->semid, &ops, 1) < 0) {
+		syslog(LOG_ERR, "semop up failed: %m");
+		return;
+	}
+
+	/* not enough space: drop msg, the logger reports it later */
+	if (len > la->end - la->tail)
+		la->dropped++;
+	else {
+		memcpy(la->tail, msg, len);
+		la->tail += len;
+	}
+
+	ops.sem_op = 1;
+	if (semop(la->semid, &ops, 1) < 0) {
+		syslog(LOG_ERR, "semop down failed: %m");
+		return;
+	}
+}
+
 static void dolog(int prio, const char *func, int line,
 		const char *fmt, va_list ap)
 {
@@ -410,40 +647,18 @@ static void dolog(int prio, const char *func, int line,
 		return;
 	}
 	msg->str_len = min(len, MAX_MSG_SIZE - 1);
+	init_logmsg(msg, &tv, prio, func, line);
 
 	if (la) {
-		struct sembuf ops;
-
-		ops.sem_num = 0;
-		ops.sem_flg = SEM_UNDO;
-		ops.sem_op = -1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop up failed: %m");
-			return;
-		}
-
-		/* not enough space: drop msg */
-		if (len + sizeof(struct logmsg) + 1 > la->end - la->tail)
-			syslog(LOG_ERR, "enqueue: log area overrun, "
-			       "dropping message\n");
-		else {
-			/* ok, we can stage the msg in the area */
-			msg = (struct logmsg *)la->tail;
-			init_logmsg(msg, &tv, prio, func, line);
-			memcpy(msg->str, str, len + 1);
-			msg->str_len = len;
-			la->tail += sizeof(struct logmsg) + len + 1;
-		}
+		struct log_ring *ring = get_log_ring();
 
-		ops.sem_op = 1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop down failed: %m");
-			return;
-		}
+		if (ring)
+			log_ring_enqueue(ring, msg);
+		else
+			log_area_enqueue(msg);
 	} else {
 		char str_final[MAX_MSG_SIZE];
 
-		init_logmsg(msg, &tv, prio, func, line);
 		len = format->formatter(str_final, sizeof(str_final) - 1, msg,
 					true);
 		str_final[len++] = '\n';
@@ -493,39 +708,131 @@ void log_write(int prio, const char *func, int line, const char *fmt, ...)
 	va_end(ap);
 }
 
+static size_t log_ring_drain(struct log_ring *ring, char *buf)
+{
+	uint64_t head = uatomic_read(&ring->head), tail = ring->tail;
+	size_t size = la->ring_size, done = 0;
+
+	cmm_smp_rmb();
+
+	while (tail < head) {
+		size_t off = tail % size, len;
+		const struct logmsg *msg;
+
+		msg = (const struct logmsg *)(ring->start + off);
+		if (size - off < sizeof(*msg) || msg->prio == LOG_REC_PAD) {
+			tail += size - off;
+			continue;
+		}
+
+		len = log_rec_len(msg);
+		memcpy(buf + done, msg, len);
+		log_msgs[nr_log_msgs++] = (const struct logmsg *)(buf + done);
+		done += len;
+		tail += len;
+	}
+
+	/* the producer may reuse the space once it sees the new tail */
+	cmm_smp_mb();
+	uatomic_set(&ring->tail, tail);
+
+	return done;
+}
+
+static int logmsg_cmp(const struct logmsg **a, const struct logmsg **b)
+{
+	const struct logmsg *m1 = *a, *m2 = *b;
+	int ret;
+
+	ret = intcmp(m1->tv.tv_sec, m2->tv.tv_sec);
+	if (ret)
+		return ret;
+	ret = intcmp(m1->tv.tv_usec, m2->tv.tv_usec);
+	if (ret)
+		return ret;
+
+	/* messages of the same source are copied to log_buff in order */
+	return intcmp((uintptr_t)m1, (uintptr_t)m2);
+}
+
+static void log_report_dropped(uint64_t nr)
+{
+	char buf[sizeof(struct logmsg) + MAX_MSG_SIZE];
+	struct logmsg *msg = (struct logmsg *)buf;
+	struct timeval tv;
+	int len;
+
+	gettimeofday(&tv, NULL);
+	init_logmsg(msg, &tv, SDOG_WARNING, __func__, __LINE__);
+	pstrcpy(msg->worker_name, MAX_THREAD_NAME_LEN, "logger");
+	msg->worker_idx = 0;
+	len = snprintf(msg->str, MAX_MSG_SIZE,
+		       "log space overrun, %" PRIu64 " messages were dropped",
+		       nr);
+	msg->str_len = min(len, MAX_MSG_SIZE - 1);
+
+	log_syslog(msg);
+}
+
 static void log_flush(void)
 {
 	struct sembuf ops;
-	size_t size, done = 0;
+	size_t size = 0, done = 0;
+	uint64_t dropped = 0, nr;
 	const struct logmsg *msg;
 
-	if (la->tail == la->start)
-		return;
+	nr_log_msgs = 0;
 
-	ops.sem_num = 0;
-	ops.sem_flg = SEM_UNDO;
-	ops.sem_op = -1;
-	if (semop(la->semid, &ops, 1) < 0) {
-		syslog(LOG_ERR, "semop up failed: %m");
-		exit(1);
-	}
+	if (la->tail != la->start || la->dropped != log_dropped[0]) {
+		ops.sem_num = 0;
+		ops.sem_flg = SEM_UNDO;
+		ops.sem_op = -1;
+		if (semop(la->semid, &ops, 1) < 0) {
+			syslog(LOG_ERR, "semop up failed: %m");
+			exit(1);
+		}
 
-	size = la->tail - la->start;
-	memcpy(log_buff, la->start, size);
-	memset(la->start, 0, size);
-	la->tail = la->start;
+		size = la->tail - la->start;
+		memcpy(log_buff, la->start, size);
+		memset(la->start, 0, size);
+		la->tail = la->start;
+		nr = la->dropped;
 
-	ops.sem_op = 1;
-	if (semop(la->semid, &ops, 1) < 0) {
-		syslog(LOG_ERR, "semop down failed: %m");
-		exit(1);
+		ops.sem_op = 1;
+		if (semop(la->semid, &ops, 1) < 0) {
+			syslog(LOG_ERR, "semop down failed: %m");
+			exit(1);
+		}
+
+		dropped += nr - log_dropped[0];
+		log_dropped[0] = nr;
+
+		while (done < size) {
+			msg = (const struct logmsg *)(log_buff + done);
+			log_msgs[nr_log_msgs++] = msg;
+			done += sizeof(*msg) + msg->str_len + 1;
+		}
 	}
 
-	while (done < size) {
-		msg = (const struct logmsg *)(log_buff + done);
-		log_syslog(msg);
-		done += sizeof(*msg) + msg->str_len + 1;
+	size = round_up(size, LOG_REC_ALIGN);
+	for (int i = 0; i < la->nr_rings; i++) {
+		struct log_ring *ring = la->rings + i;
+
+		size += log_ring_drain(ring, log_buff + size);
+
+		nr = uatomic_read(&ring->dropped);
+		dropped += nr - log_dropped[i + 1];
+		log_dropped[i + 1] = nr;
 	}
+
+	if (nr_log_msgs > 1)
+		xqsort(log_msgs, nr_log_msgs, logmsg_cmp);
+
+	for (int i = 0; i < nr_log_msgs; i++)
+		log_syslog(log_msgs[i]);
+
+	if (dropped)
+		log_report_dropped(dropped);
 }
 
 static bool is_sheep_dead(int signo)
@@ -562,8 +869,14 @@ static void sighup_handler(int signo, siginfo_t *info, void *context)
 static void logger(char *log_dir, char *outfile)
 {
 	int fd;
+	size_t buff_size;
 
-	log_buff = xzalloc(la->end - la->start);
+	buff_size = round_up(la->end - la->start, LOG_REC_ALIGN) +
+		la->nr_rings * la->ring_size;
+	log_buff = xzalloc(buff_size);
+	log_msgs = xcalloc(buff_size / sizeof(struct logmsg),
+			   sizeof(*log_msgs));
+	log_dropped = xcalloc(la->nr_rings + 1, sizeof(*log_dropped));
 
 	if (dst_type == LOG_DST_DEFAULT) {
 		log_fd = open(outfile, O_CREAT | O_RDWR | O_APPEND, 0644);
@@ -629,6 +942,8 @@ static void logger(char *log_dir, char *outfile)
 
 	log_flush();
 	free(log_buff);
+	free(log_msgs);
+	free(log_dropped);
 	free_logarea();
 	exit(0);
 }
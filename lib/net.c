@@ -491,6 +491,23 @@ int set_nodelay(int fd)
 	return ret;
 }
 
+int set_nonblocking(int fd)
+{
+	int ret;
+
+	ret = fcntl(fd, F_GETFL);
+	if (ret < 0) {
+		sd_err("fcntl F_GETFL failed: %m");
+		return -1;
+	}
+
+	ret = fcntl(fd, F_SETFL, ret | O_NONBLOCK);
+	if (ret < 0)
+		sd_err("fcntl O_NONBLOCK failed: %m");
+
+	return ret;
+}
+
 /*
  * Timeout after request is issued after 5s.
  *
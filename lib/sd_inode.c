@@ -81,6 +81,8 @@
 #include <string.h>
 
 #include "util.h"
+#include "list.h"
+#include "rbtree.h"
 #include "internal_proto.h"
 #include "sheep.h"
 
@@ -129,6 +131,8 @@ static int indirect_idx_compare(struct sd_indirect_idx *a,
 
 typedef void (*btree_cb_fn)(void *data, void *arg, int type);
 
+static int icache_writeback(uint32_t vid);
+
 /*
  * Traverse the whole btree that include all header, indirect_idx and index.
  * @interest specify which objects user wants to run @fn against.
@@ -163,6 +167,9 @@ static void traverse_btree(const struct sd_inode *inode, btree_cb_fn fn,
 		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
 		tmp = (void *)leaf_node;
 
+		/* Walking all the nodes through the cache would thrash it */
+		icache_writeback(inode->vdi_id);
+
 		while (iter_idx != last_idx) {
 			ret = inode_actor.reader(iter_idx->oid, &tmp,
 						 SD_INODE_DATA_INDEX_SIZE, 0);
@@ -234,141 +241,471 @@ static void dump_btree(struct sd_inode *inode)
 #endif
 }
 
+void sd_inode_init(void *data, int depth)
+{
+	struct sd_index_header *header = INDEX_HEADER(data);
+	header->magic = INODE_BTREE_MAGIC;
+	header->depth = depth;
+	header->entries = 0;
+}
+
+static bool index_in_range(struct sd_index_header *header, struct sd_index *ext)
+{
+	struct sd_index *last = LAST_INDEX(header);
+	if (last - ext > 0)
+		return true;
+	return false;
+}
+
+static bool indirect_in_range(struct sd_index_header *header,
+			      struct sd_indirect_idx *idx)
+{
+	struct sd_indirect_idx *last = LAST_INDRECT_IDX(header);
+	if (last - idx > 0)
+		return true;
+	return false;
+}
+
+static struct sd_index *search_index_entry(struct sd_index_header *header,
+					   uint32_t idx)
+{
+	struct sd_index tmp;
+	tmp.idx = idx;
+	return nbsearch(&tmp, FIRST_INDEX(header), header->entries,
+			index_compare);
+}
+
+static struct
+sd_indirect_idx *search_indirect_entry(struct sd_index_header *header,
+				       uint32_t idx)
+{
+	struct sd_indirect_idx tmp;
+	tmp.idx = idx;
+	return nbsearch(&tmp, FIRST_INDIRECT_IDX(header), header->entries,
+			indirect_idx_compare);
+}
+
 /*
- * This is the cache for inode and ext-node (B-tree), so we name it 'icache'.
- * Cache of the same inode and ext-node dose not support concurrent operations
- * so it could only be used in sd_inode_set_vid() which will be protected by
- * distributed lock and should be released in the end of sd_inode_set_vid().
+ * This is the cache for ext-nodes (B-tree leaf nodes), so we name it 'icache'.
+ *
+ * Nodes are cached in LRU order up to ICACHE_MAX_BYTES. Only the used part of
+ * a node, the header and its sd_indexs, is kept. Updates of the nodes are
+ * written back in a batch by sd_inode_write() of the inode which the nodes
+ * belong to. Dirty nodes aren't evicted until then.
+ *
+ * Another node of the cluster might update the B-tree too, so a clean node is
+ * only served from the cache while its vdi is held, that is, between
+ * sd_inode_cache_hold() and sd_inode_cache_release() called under the cluster
+ * lock of the vdi.  Lookups of other vdis read the node again each time, so
+ * a read-modify-write without the lock never starts from an old copy.
+ *
+ * icache_lock protects the cache and is never held across I/O, so lookups
+ * don't wait for the reads and writes of other vdis. icache_write_lock, which
+ * is taken before icache_lock, keeps the writes of the nodes in order.
  */
+#define ICACHE_MAX_BYTES (64 * 1024 * 1024)
 
-/* no rationale */
-#define NUMBER_OF_CACHE	4
-
-struct inode_cache {
+struct icache_node {
+	struct rb_node rb;
+	struct list_node lru;
 	uint64_t oid;
-	unsigned char mem[SD_INODE_DATA_INDEX_SIZE];
-} cache_array[NUMBER_OF_CACHE];
-static int cache_idx;
+	bool stale;		/* might be older than the stored node */
+	bool dirty;
+	int copies;
+	int copy_policy;
+	unsigned int len;	/* bytes used in mem */
+	unsigned char *mem;
+};
+
+struct icache_hold {
+	struct list_node list;
+	uint32_t vid;
+	int count;
+};
+
+static struct rb_root icache_root = RB_ROOT;
+static LIST_HEAD(icache_lru);
+static LIST_HEAD(icache_holds);
+static uint64_t icache_bytes;
+/* bumped when a node is written through or dropped, see icache_get() */
+static uint64_t icache_gen;
+static struct sd_mutex icache_lock = SD_MUTEX_INITIALIZER;
+static struct sd_mutex icache_write_lock = SD_MUTEX_INITIALIZER;
+
+static int icache_cmp(const struct icache_node *a, const struct icache_node *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+/* Size of the used part of an ext-node */
+static unsigned int node_size(const void *mem)
+{
+	const struct sd_index_header *header = mem;
+
+	if (header->magic != INODE_BTREE_MAGIC || header->depth != 1 ||
+	    header->entries > MAX_INDEX)
+		return 0;
+	return sizeof(*header) + header->entries * sizeof(struct sd_index);
+}
 
-static void icache_writeout(int copies, int policy)
+static struct icache_node *icache_search(uint64_t oid)
 {
-	int i;
-	for (i = 0; i < cache_idx; i++) {
-		inode_actor.writer(cache_array[i].oid, cache_array[i].mem,
-				   SD_INODE_DATA_INDEX_SIZE, 0, 0, copies,
-				   policy, false, false);
+	struct icache_node key = { .oid = oid };
+
+	return rb_search(&icache_root, &key, rb, icache_cmp);
+}
+
+static struct icache_hold *icache_find_hold(uint32_t vid)
+{
+	struct icache_hold *hold;
+
+	list_for_each_entry(hold, &icache_holds, list) {
+		if (hold->vid == vid)
+			return hold;
 	}
+	return NULL;
 }
 
-static void icache_release(int copies, int policy)
+static bool icache_fresh(const struct icache_node *node)
 {
-	icache_writeout(copies, policy);
-	cache_idx = 0; /* reset icache */
+	if (node->dirty)
+		return true;
+	return !node->stale && icache_find_hold(oid_to_vid(node->oid));
 }
 
-static void icache_insert(int copies, int policy,
-			  uint64_t oid, void *mem)
+/*
+ * Write out the node.  Called with icache_write_lock and icache_lock held.
+ * icache_lock is dropped during the write, so the node might be gone when
+ * this returns.
+ */
+static int icache_writeout(struct icache_node *node)
 {
-	int i;
-	for (i = 0; i < cache_idx; i++) {
-		if (oid == cache_array[i].oid) {
-			memcpy(cache_array[i].mem, mem,
-			       SD_INODE_DATA_INDEX_SIZE);
-			return;
-		}
+	uint64_t oid = node->oid;
+	unsigned int len = node->len;
+	int copies = node->copies, copy_policy = node->copy_policy;
+	void *mem = xmalloc(len);
+	int ret;
+
+	memcpy(mem, node->mem, len);
+	node->dirty = false;
+	sd_mutex_unlock(&icache_lock);
+
+	ret = inode_actor.writer(oid, mem, len, 0, 0, copies, copy_policy,
+				 false, false);
+
+	sd_mutex_lock(&icache_lock);
+	free(mem);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to write %016"PRIx64, oid);
+		node = icache_search(oid);
+		if (node)
+			node->dirty = true;
+	}
+	return ret;
+}
+
+static void icache_remove(struct icache_node *node)
+{
+	rb_erase(&node->rb, &icache_root);
+	list_del(&node->lru);
+	icache_bytes -= node->len;
+	free(node->mem);
+	free(node);
+	icache_gen++;
+}
+
+static void icache_evict(void)
+{
+	struct icache_node *node;
+
+	list_for_each_entry(node, &icache_lru, lru) {
+		if (icache_bytes <= ICACHE_MAX_BYTES)
+			break;
+		if (!node->dirty)
+			icache_remove(node);
 	}
+}
 
-	if (cache_idx == (NUMBER_OF_CACHE - 1)) {
-		sd_debug("cache for B-tree is full, so write all out");
-		icache_release(copies, policy);
+/* Replace the cached copy of the node with 'mem' */
+static struct icache_node *icache_insert(uint64_t oid, const void *mem,
+					 int copies, int copy_policy)
+{
+	unsigned int len = node_size(mem);
+	struct icache_node *node = icache_search(oid);
+
+	if (!len) {
+		sd_err("B-tree node %016"PRIx64" is corrupt", oid);
+		if (node)
+			icache_remove(node);
+		return NULL;
 	}
 
-	/* insert new cache */
-	cache_array[cache_idx].oid = oid;
-	memcpy(cache_array[cache_idx].mem, mem, SD_INODE_DATA_INDEX_SIZE);
-	cache_idx++;
+	if (!node) {
+		node = xzalloc(sizeof(*node));
+		node->oid = oid;
+		rb_insert(&icache_root, node, rb, icache_cmp);
+		list_add_tail(&node->lru, &icache_lru);
+	} else
+		list_move_tail(&node->lru, &icache_lru);
+
+	icache_bytes += len;
+	icache_bytes -= node->len;
+	node->mem = xrealloc(node->mem, len);
+	memcpy(node->mem, mem, len);
+	node->len = len;
+	node->copies = copies;
+	node->copy_policy = copy_policy;
+	node->stale = false;
+
+	icache_evict();
+	return icache_search(oid);
 }
 
-static void *icache_find(uint64_t oid)
+/*
+ * Return the cached node, reading it if it's not cached or can't be trusted.
+ * Called with icache_lock held, which is dropped while the node is read.
+ */
+static struct icache_node *icache_get(uint64_t oid)
 {
-	int i;
-	for (i = 0; i < cache_idx; i++) {
-		if (cache_array[i].oid == oid)
-			return cache_array[i].mem;
+	struct icache_node *node = icache_search(oid);
+	uint64_t gen = icache_gen;
+	int copies = 0, copy_policy = 0;
+	void *buf;
+	int ret;
+
+	if (node && icache_fresh(node)) {
+		list_move_tail(&node->lru, &icache_lru);
+		return node;
 	}
-	return NULL;
+	if (node) {
+		copies = node->copies;
+		copy_policy = node->copy_policy;
+	}
+
+	buf = xvalloc(SD_INODE_DATA_INDEX_SIZE);
+	sd_mutex_unlock(&icache_lock);
+	ret = inode_actor.reader(oid, &buf, SD_INODE_DATA_INDEX_SIZE, 0);
+	sd_mutex_lock(&icache_lock);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read %016"PRIx64, oid);
+		node = NULL;
+		goto out;
+	}
+
+	/* Someone might have read or updated the node in the meantime */
+	node = icache_search(oid);
+	if (node && icache_fresh(node)) {
+		list_move_tail(&node->lru, &icache_lru);
+		goto out;
+	}
+
+	node = icache_insert(oid, buf, copies, copy_policy);
+	/*
+	 * A write through during the read might have made what we read old.
+	 * Serve this lookup with it but read it again next time.
+	 */
+	if (node && gen != icache_gen)
+		node->stale = true;
+out:
+	free(buf);
+	return node;
+}
+
+/*
+ * Write out the dirty nodes of the vdi, or of all the vdis if vid is zero.
+ * Called with icache_write_lock and icache_lock held.
+ */
+static int __icache_writeback(uint32_t vid)
+{
+	struct icache_node *node;
+	uint64_t *oids = NULL;
+	int nr = 0, ret = SD_RES_SUCCESS;
+
+	/* The tree can change whenever icache_writeout() drops the lock */
+	rb_for_each_entry(node, &icache_root, rb) {
+		if (!node->dirty || (vid && oid_to_vid(node->oid) != vid))
+			continue;
+		oids = xrealloc(oids, sizeof(*oids) * (nr + 1));
+		oids[nr++] = node->oid;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		node = icache_search(oids[i]);
+		if (!node || !node->dirty)
+			continue;
+		if (icache_writeout(node) != SD_RES_SUCCESS)
+			ret = SD_RES_EIO;
+	}
+
+	free(oids);
+	return ret;
+}
+
+/* Write back the dirty nodes of the vdi */
+static int icache_writeback(uint32_t vid)
+{
+	int ret;
+
+	sd_mutex_lock(&icache_write_lock);
+	sd_mutex_lock(&icache_lock);
+	ret = __icache_writeback(vid);
+	sd_mutex_unlock(&icache_lock);
+	sd_mutex_unlock(&icache_write_lock);
+	return ret;
 }
 
 static int icache_writer(uint64_t id, void *mem, unsigned int len,
 			 uint64_t offset, uint32_t flags, int copies,
 			 int copy_policy, bool create, bool direct)
 {
-	/* Only try to cache entire ext-node */
-	if (!offset && !create && !direct && len == SD_INODE_DATA_INDEX_SIZE) {
-		icache_insert(copies, copy_policy, id, mem);
-		return SD_RES_SUCCESS;
+	struct icache_node *node;
+	int ret = SD_RES_SUCCESS;
+
+	/* Delay writing entire ext-nodes and updates to the cached ones */
+	if (!create && !direct) {
+		sd_mutex_lock(&icache_lock);
+		node = icache_search(id);
+		if (!offset && len == SD_INODE_DATA_INDEX_SIZE)
+			node = icache_insert(id, mem, copies, copy_policy);
+		else if (node && offset + len <= node->len)
+			memcpy(node->mem + offset, mem, len);
+		else
+			node = NULL;
+
+		if (node) {
+			node->dirty = true;
+			node->copies = copies;
+			node->copy_policy = copy_policy;
+		}
+		sd_mutex_unlock(&icache_lock);
+		if (node)
+			return SD_RES_SUCCESS;
+	}
+
+	sd_mutex_lock(&icache_write_lock);
+	sd_mutex_lock(&icache_lock);
+	node = icache_search(id);
+	if (node && node->dirty) {
+		ret = icache_writeout(node);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
 	}
-	return inode_actor.writer(id, mem, len, offset, flags, copies,
-				  copy_policy, create, direct);
+	sd_mutex_unlock(&icache_lock);
+
+	ret = inode_actor.writer(id, mem, len, offset, flags, copies,
+				 copy_policy, create, direct);
+
+	sd_mutex_lock(&icache_lock);
+	icache_gen++;
+	if (ret != SD_RES_SUCCESS) {
+		node = icache_search(id);
+		if (node)
+			icache_remove(node);
+	} else if (!offset && len == SD_INODE_DATA_INDEX_SIZE)
+		icache_insert(id, mem, copies, copy_policy);
+	else if ((node = icache_search(id)) && offset + len <= node->len)
+		memcpy(node->mem + offset, mem, len);
+	else if (node)
+		icache_remove(node);
+out:
+	sd_mutex_unlock(&icache_lock);
+	sd_mutex_unlock(&icache_write_lock);
+	return ret;
 }
 
 static int icache_reader(uint64_t id, void **mem, unsigned int len,
 			 uint64_t offset)
 {
-	void *data;
+	struct icache_node *node;
+	int ret = SD_RES_SUCCESS;
 
-	if (!offset && len == SD_INODE_DATA_INDEX_SIZE) {
-		data = icache_find(id);
-		if (data) {
-			memcpy(*mem, data, len);
-			return SD_RES_SUCCESS;
-		}
-	}
-	return inode_actor.reader(id, mem, len, offset);
-}
+	if (offset || len != SD_INODE_DATA_INDEX_SIZE)
+		return inode_actor.reader(id, mem, len, offset);
 
-void sd_inode_init(void *data, int depth)
-{
-	struct sd_index_header *header = INDEX_HEADER(data);
-	header->magic = INODE_BTREE_MAGIC;
-	header->depth = depth;
-	header->entries = 0;
+	sd_mutex_lock(&icache_lock);
+	node = icache_get(id);
+	if (node)
+		memcpy(*mem, node->mem, node->len);
+	else
+		ret = SD_RES_EIO;
+	sd_mutex_unlock(&icache_lock);
+	return ret;
 }
 
-static bool index_in_range(struct sd_index_header *header, struct sd_index *ext)
+/* Look up 'idx' in the cached ext-node without copying it */
+static uint32_t icache_get_vid(uint64_t oid, uint32_t idx)
 {
-	struct sd_index *last = LAST_INDEX(header);
-	if (last - ext > 0)
-		return true;
-	return false;
+	struct icache_node *node;
+	struct sd_index *ext;
+	uint32_t vid = 0;
+
+	sd_mutex_lock(&icache_lock);
+	node = icache_get(oid);
+	if (node) {
+		ext = search_index_entry(INDEX_HEADER(node->mem), idx);
+		if (index_in_range(INDEX_HEADER(node->mem), ext) &&
+		    ext->idx == idx)
+			vid = ext->vdi_id;
+	}
+	sd_mutex_unlock(&icache_lock);
+	return vid;
 }
 
-static bool indirect_in_range(struct sd_index_header *header,
-			      struct sd_indirect_idx *idx)
+/* Forget the clean nodes of the vdi.  Called with icache_lock held. */
+static void icache_drop_clean(uint32_t vid)
 {
-	struct sd_indirect_idx *last = LAST_INDRECT_IDX(header);
-	if (last - idx > 0)
-		return true;
-	return false;
+	struct icache_node *node;
+
+	list_for_each_entry(node, &icache_lru, lru) {
+		if (oid_to_vid(node->oid) == vid && !node->dirty)
+			icache_remove(node);
+	}
 }
 
-static struct sd_index *search_index_entry(struct sd_index_header *header,
-					   uint32_t idx)
+/*
+ * Let the B-tree nodes of the vdi be served from the cache.  Call this after
+ * taking the cluster lock of the vdi, which keeps the other nodes of the
+ * cluster from updating them.
+ */
+void sd_inode_cache_hold(uint32_t vid)
 {
-	struct sd_index tmp;
-	tmp.idx = idx;
-	return nbsearch(&tmp, FIRST_INDEX(header), header->entries,
-			index_compare);
+	struct icache_hold *hold;
+
+	sd_mutex_lock(&icache_lock);
+	hold = icache_find_hold(vid);
+	if (!hold) {
+		/* read before the lock was taken, might be old */
+		icache_drop_clean(vid);
+		hold = xzalloc(sizeof(*hold));
+		hold->vid = vid;
+		list_add(&hold->list, &icache_holds);
+	}
+	hold->count++;
+	sd_mutex_unlock(&icache_lock);
 }
 
-static struct
-sd_indirect_idx *search_indirect_entry(struct sd_index_header *header,
-				       uint32_t idx)
+/*
+ * Write back the updated B-tree nodes of the vdi and stop serving them from
+ * the cache.  Call this before releasing the cluster lock of the vdi.
+ */
+int sd_inode_cache_release(uint32_t vid)
 {
-	struct sd_indirect_idx tmp;
-	tmp.idx = idx;
-	return nbsearch(&tmp, FIRST_INDIRECT_IDX(header), header->entries,
-			indirect_idx_compare);
+	struct icache_hold *hold;
+	int ret;
+
+	sd_mutex_lock(&icache_write_lock);
+	sd_mutex_lock(&icache_lock);
+	ret = __icache_writeback(vid);
+	hold = icache_find_hold(vid);
+	if (hold && --hold->count == 0) {
+		list_del(&hold->list);
+		free(hold);
+		/* a failed write back keeps the only copy of the update */
+		icache_drop_clean(vid);
+	}
+	sd_mutex_unlock(&icache_lock);
+	sd_mutex_unlock(&icache_write_lock);
+	return ret;
 }
 
 static void insert_index_nosearch(struct sd_index_header *header,
@@ -538,6 +875,8 @@ out:
 
 uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx)
 {
+	struct sd_index_header *header;
+	struct sd_indirect_idx *ext_idx;
 	struct find_path path;
 	int ret;
 
@@ -548,8 +887,16 @@ uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx)
 		if (inode->data_vdi_id[0] == 0)
 			return 0;
 
+		header = INDEX_HEADER(inode->data_vdi_id);
+		if (header->depth == 2) {
+			ext_idx = search_indirect_entry(header, idx);
+			if (!indirect_in_range(header, ext_idx))
+				return 0;
+			return icache_get_vid(ext_idx->oid, idx);
+		}
+
 		memset(&path, 0, sizeof(path));
-		ret = search_whole_btree(inode_actor.reader, inode, idx, &path);
+		ret = search_whole_btree(icache_reader, inode, idx, &path);
 		if (ret == SD_RES_SUCCESS)
 			return path.p_index->vdi_id;
 		if (path.p_index_header)
@@ -721,8 +1068,8 @@ int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
 				      __func__);
 			/*
 			 * use icache(write buffer) to accelerate batch set
-			 * operation. icache will be released after this
-			 * transaction to assure consistency.
+			 * operation. Updated nodes are written back by
+			 * sd_inode_write().
 			 */
 			set_vid_for_btree(icache_writer, icache_reader, inode,
 					  idx, vdi_id);
@@ -731,7 +1078,6 @@ int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
 	if (inode->store_policy != 0)
 		dump_btree(inode);
 
-	icache_release(inode->nr_copies, inode->copy_policy);
 	/* XXX: return error code */
 	return 0;
 }
@@ -782,6 +1128,11 @@ int sd_inode_write(struct sd_inode *inode, int flags, bool create, bool direct)
 					 inode->copy_policy,
 					 create, direct);
 	else {
+		/* The nodes must be written before the root points to them */
+		ret = icache_writeback(inode->vdi_id);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+
 		len = SD_INODE_HEADER_SIZE + sd_inode_get_meta_size(inode, 0);
 		ret = inode_actor.writer(vid_to_vdi_oid(inode->vdi_id), inode,
 					 len, 0, flags, inode->nr_copies,
@@ -843,6 +1194,11 @@ void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 		last_idx = LAST_INDRECT_IDX(data_vdi_id);
 		old_iter_idx = FIRST_INDIRECT_IDX(data_vdi_id);
 		new_iter_idx = FIRST_INDIRECT_IDX(newi->data_vdi_id);
+
+		/* 'reader' doesn't know the nodes not written back yet */
+		if (old_iter_idx != last_idx)
+			icache_writeback(oid_to_vid(old_iter_idx->oid));
+
 		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
 		tmp = (void *)leaf_node;
 		while (old_iter_idx != last_idx) {
@@ -20,6 +20,10 @@
  *
  */
 #include <arpa/inet.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include "sha1.h"
 #include "util.h"
 
@@ -214,6 +218,61 @@ static asmlinkage void
 asmlinkage void sha1_transform_ssse3(uint32_t *, const uint8_t *, unsigned int);
 asmlinkage void sha1_transform_avx(uint32_t *, const uint8_t *, unsigned int);
 
+/*
+ * sha1rnds4 does four rounds and takes 'e' from sha1nexte, which derives it
+ * from 'a' four rounds earlier.  W[i] for i >= 16 is computed four words at
+ * a time by sha1msg1, xor and sha1msg2.
+ */
+#define SHANI_ROUNDS(i, f)						\
+do {									\
+	if (i >= 4)							\
+		msg[i % 4] = _mm_sha1msg2_epu32(			\
+			_mm_xor_si128(_mm_sha1msg1_epu32(msg[i % 4],	\
+							 msg[(i + 1) % 4]), \
+				      msg[(i + 2) % 4]),		\
+			msg[(i + 3) % 4]);				\
+	e = i == 0 ? _mm_add_epi32(e, msg[0]) :				\
+		_mm_sha1nexte_epu32(prev, msg[i % 4]);			\
+	prev = abcd;							\
+	abcd = _mm_sha1rnds4_epu32(abcd, e, f);				\
+} while (0)
+
+static void __attribute__((target("sha,sse4.1")))
+sha1_transform_shani(uint32_t *state, const uint8_t *data, unsigned int rounds)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+					     0x08090a0b0c0d0e0fULL);
+	__m128i abcd, e, abcd_save, e_save, prev, msg[4];
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+				 0x1b);
+	e = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; rounds > 0; rounds--, data += SHA1_BLOCK_SIZE) {
+		abcd_save = abcd;
+		e_save = e;
+
+		for (int i = 0; i < 4; i++)
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)data + i), bswap);
+
+		SHANI_ROUNDS(0, 0); SHANI_ROUNDS(1, 0); SHANI_ROUNDS(2, 0);
+		SHANI_ROUNDS(3, 0); SHANI_ROUNDS(4, 0);
+		SHANI_ROUNDS(5, 1); SHANI_ROUNDS(6, 1); SHANI_ROUNDS(7, 1);
+		SHANI_ROUNDS(8, 1); SHANI_ROUNDS(9, 1);
+		SHANI_ROUNDS(10, 2); SHANI_ROUNDS(11, 2); SHANI_ROUNDS(12, 2);
+		SHANI_ROUNDS(13, 2); SHANI_ROUNDS(14, 2);
+		SHANI_ROUNDS(15, 3); SHANI_ROUNDS(16, 3); SHANI_ROUNDS(17, 3);
+		SHANI_ROUNDS(18, 3); SHANI_ROUNDS(19, 3);
+
+		e = _mm_sha1nexte_epu32(prev, e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e, 3);
+}
+
 static void do_ssse3_sha1_update(struct sha1_ctx *ctx, const uint8_t *data,
 				unsigned int len, unsigned int partial)
 {
@@ -357,6 +416,8 @@ static void __attribute__((constructor)) __sha1_init(void)
 
 	if (avx_usable())
 		sha1_transform_asm = sha1_transform_avx;
+	if (cpu_has_sha_ni && cpu_has_xmm4_2)
+		sha1_transform_asm = sha1_transform_shani;
 
 	sha1_update = ssse3_sha1_update;
 	sha1_final = ssse3_sha1_final;
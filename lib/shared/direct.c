@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Direct I/O to the replicas
+ *
+ * The library keeps the node list of the cluster and computes the placement
+ * of the data objects like sheep does.  A write is sent as a peer request to
+ * every replica and a read to one of them, so the data doesn't go through
+ * the gateway.  The peers check the epoch of the requests, so a request is
+ * never done with a stale placement: it fails with SD_RES_OLD_NODE_VER and
+ * is sent again to the gateway, and the request thread reloads the node list
+ * before the next request.  Any other failure falls back to the gateway as
+ * well, which also handles the inode updates and the other objects.
+ *
+ * Each node we send requests to has its own connection with a reply thread.
+ */
+
+#include "sheepdog.h"
+#include "internal.h"
+#include "sheep.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct sd_direct {
+	/* placement at 'epoch', protected by 'lock' */
+	struct sd_rw_lock lock;
+	uint32_t epoch;
+	int nr_zones;
+	struct rb_root nroot;
+	struct rb_root vroot;
+
+	uatomic_bool stale;
+	uatomic_bool disabled;
+
+	/* connections to the nodes, which are never freed until disconnect */
+	struct sd_rw_lock peer_lock;
+	struct rb_root peer_root;
+};
+
+struct peer_conn {
+	struct rb_node rb;
+	struct node_id nid;
+	struct sd_conn conn;
+};
+
+static int peer_conn_cmp(const struct peer_conn *a, const struct peer_conn *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
+}
+
+/* Run the request on a connected socket, for which no reply thread runs */
+static int exec_req_fd(int fd, struct sd_req *hdr, void *data)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	uint32_t rlen = hdr->data_length, wlen = 0;
+
+	if (hdr->flags & SD_FLAG_CMD_WRITE) {
+		wlen = hdr->data_length;
+		rlen = 0;
+	}
+
+	if (xwrite(fd, hdr, sizeof(*hdr)) < 0 ||
+	    (wlen && xwrite(fd, data, wlen) < 0))
+		return SD_RES_EIO;
+
+	if (xread(fd, rsp, sizeof(*rsp)) != sizeof(*rsp))
+		return SD_RES_EIO;
+
+	if (rsp->data_length > rlen)
+		return SD_RES_EIO;
+	if (rsp->data_length &&
+	    xread(fd, data, rsp->data_length) != rsp->data_length)
+		return SD_RES_EIO;
+
+	return rsp->result;
+}
+
+static int count_zones(struct rb_root *nroot)
+{
+	uint32_t zones[SD_MAX_NODES];
+	struct sd_node *n;
+	int nr = 0, i;
+
+	rb_for_each_entry(n, nroot, rb) {
+		if (!n->nr_vnodes)
+			continue;
+		for (i = 0; i < nr; i++)
+			if (zones[i] == n->zone)
+				break;
+		if (i == nr)
+			zones[nr++] = n->zone;
+	}
+
+	return nr;
+}
+
+/*
+ * Load the node list and the flags of the cluster from the gateway, and
+ * replace the placement with it.
+ */
+static int load_placement(struct sd_cluster *c, struct sd_direct *d)
+{
+	struct sockaddr_in addr = {};
+	struct rb_root nroot = RB_ROOT, vroot = RB_ROOT, old_nroot, old_vroot;
+	struct sd_node *buf = NULL;
+	struct epoch_log elog;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint32_t epoch;
+	int fd, nr_nodes, ret;
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(c->port);
+	memcpy(&addr.sin_addr, c->addr, sizeof(addr.sin_addr));
+	fd = connect_to_sheep((struct sockaddr *)&addr, sizeof(addr));
+	if (fd < 0)
+		return -fd;
+
+	buf = xcalloc(SD_MAX_NODES, sizeof(*buf));
+	sd_init_req(&hdr, SD_OP_GET_NODE_LIST);
+	hdr.data_length = SD_MAX_NODES * sizeof(*buf);
+	ret = exec_req_fd(fd, &hdr, buf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	nr_nodes = rsp->data_length / sizeof(*buf);
+	epoch = rsp->epoch;
+
+	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
+	hdr.data_length = sizeof(elog);
+	ret = exec_req_fd(fd, &hdr, &elog);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	for (int i = 0; i < nr_nodes; i++) {
+		struct sd_node *n = xmalloc(sizeof(*n));
+
+		*n = buf[i];
+		if (unlikely(rb_insert(&nroot, n, rb, node_cmp)))
+			free(n);
+	}
+	if (elog.flags & SD_CLUSTER_FLAG_DISKMODE)
+		disks_to_vnodes(&nroot, &vroot);
+	else
+		nodes_to_vnodes(&nroot, &vroot);
+
+	sd_write_lock(&d->lock);
+	old_nroot = d->nroot;
+	old_vroot = d->vroot;
+	d->nroot = nroot;
+	d->vroot = vroot;
+	d->epoch = epoch;
+	d->nr_zones = count_zones(&d->nroot);
+	sd_rw_unlock(&d->lock);
+
+	rb_destroy(&old_vroot, struct sd_vnode, rb);
+	rb_destroy(&old_nroot, struct sd_node, rb);
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/* Called by the request thread before it submits requests */
+void refresh_placement(struct sd_cluster *c)
+{
+	struct sd_direct *d = c->direct;
+
+	if (!d || !uatomic_is_true(&d->stale))
+		return;
+
+	/* keep the old placement if this fails, the peers tell us again */
+	uatomic_set_false(&d->stale);
+	load_placement(c, d);
+}
+
+static int connect_to_node(const struct node_id *nid)
+{
+	bool use_io = nid->io_port ? true : false;
+	const uint8_t *a = use_io ? nid->io_addr : nid->addr;
+	uint16_t port = use_io ? nid->io_port : nid->port;
+	struct sockaddr_in sin = {};
+	struct sockaddr_in6 sin6 = {};
+	int i;
+
+	/* an IPv4 address is stored in the last 4 bytes */
+	for (i = 0; i < 12; i++)
+		if (a[i])
+			break;
+	if (i == 12) {
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		memcpy(&sin.sin_addr, a + 12, sizeof(sin.sin_addr));
+		return connect_to_sheep((struct sockaddr *)&sin, sizeof(sin));
+	}
+
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_port = htons(port);
+	memcpy(&sin6.sin6_addr, a, sizeof(sin6.sin6_addr));
+	return connect_to_sheep((struct sockaddr *)&sin6, sizeof(sin6));
+}
+
+/*
+ * Return the connection to the node, or NULL if we can't connect to it.  We
+ * don't try to connect again to a node which failed once, its requests go
+ * through the gateway.
+ */
+static struct sd_conn *get_peer_conn(struct sd_cluster *c,
+				     const struct node_id *nid)
+{
+	struct sd_direct *d = c->direct;
+	struct peer_conn key = { .nid = *nid }, *peer, *old;
+
+	sd_read_lock(&d->peer_lock);
+	peer = rb_search(&d->peer_root, &key, rb, peer_conn_cmp);
+	sd_rw_unlock(&d->peer_lock);
+	if (peer)
+		goto out;
+
+	peer = xzalloc(sizeof(*peer));
+	peer->nid = *nid;
+	init_sheep_conn(&peer->conn, c, connect_to_node(nid));
+
+	sd_write_lock(&d->peer_lock);
+	old = rb_insert(&d->peer_root, peer, rb, peer_conn_cmp);
+	sd_rw_unlock(&d->peer_lock);
+	if (old) {
+		close_sheep_conn(&peer->conn);
+		free(peer);
+		peer = old;
+	}
+out:
+	return uatomic_is_true(&peer->conn.dead) ? NULL : &peer->conn;
+}
+
+static uint8_t direct_opcode(uint8_t opcode)
+{
+	switch (opcode) {
+	case VDI_READ:
+		return SD_OP_READ_PEER;
+	case VDI_WRITE:
+		return SD_OP_WRITE_PEER;
+	case VDI_CREATE:
+		return SD_OP_CREATE_AND_WRITE_PEER;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Send the request directly to the replicas of the object.  Return 0 if it
+ * is sent, or -1 if it has to be sent to the gateway.
+ */
+int submit_direct_request(struct sheep_request *req)
+{
+	struct sd_cluster *c = req->aiocb->request->cluster;
+	struct sd_direct *d = c->direct;
+	struct sd_vdi *vdi = req->aiocb->request->vdi;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	struct sd_conn *conns[SD_MAX_COPIES];
+	struct sheep_request *child;
+	struct sd_req hdr = {}, fwd;
+	int nr_copies = vdi->inode->nr_copies, nr, ret = -1;
+	uint32_t wlen = 0;
+
+	hdr.opcode = direct_opcode(req->opcode);
+	if (!hdr.opcode || req->gateway || uatomic_is_true(&d->disabled) ||
+	    !is_data_obj(req->oid) || oid_to_vid(req->oid) != vdi->vid ||
+	    vdi->inode->copy_policy || !nr_copies)
+		return -1;
+
+	sd_read_lock(&d->lock);
+	if (nr_copies > d->nr_zones)
+		goto out;
+
+	oid_to_nodes(req->oid, &d->vroot, nr_copies, nodes);
+	if (req->opcode == VDI_READ) {
+		nodes[0] = nodes[(req->seq_num >> SD_INFLIGHT_HASH_BITS) %
+				 nr_copies];
+		nr = 1;
+	} else {
+		nr = nr_copies;
+	}
+	for (int i = 0; i < nr; i++) {
+		conns[i] = get_peer_conn(c, &nodes[i]->nid);
+		if (!conns[i])
+			goto out;
+	}
+
+	hdr.proto_ver = SD_SHEEP_PROTO_VER;
+	hdr.epoch = d->epoch;
+	hdr.data_length = req->length;
+	hdr.obj.oid = req->oid;
+	hdr.obj.cow_oid = req->cow_oid;
+	hdr.obj.offset = req->offset;
+	hdr.obj.copies = nr_copies;
+	if (req->opcode != VDI_READ) {
+		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
+		if (req->cow_oid)
+			hdr.flags |= SD_FLAG_CMD_COW;
+		wlen = req->length;
+	}
+	ret = 0;
+out:
+	sd_rw_unlock(&d->lock);
+	if (ret < 0)
+		return ret;
+
+	/* the children may complete before we send all of them */
+	req->peer_ret = SD_RES_SUCCESS;
+	uatomic_set(&req->nr_pending, nr);
+	for (int i = 0; i < nr; i++) {
+		child = xzalloc(sizeof(*child));
+		INIT_LIST_NODE(&child->list);
+		child->aiocb = req->aiocb;
+		child->parent = req;
+		child->oid = req->oid;
+		child->offset = req->offset;
+		child->length = req->length;
+		child->buf = req->buf;
+		child->opcode = req->opcode;
+		child->seq_num = sheep_new_seq_num(c, req->oid);
+
+		fwd = hdr;
+		send_sheep_request_on(child, conns[i], &fwd, req->buf, wlen);
+	}
+
+	return 0;
+}
+
+/*
+ * Called when a request to a replica completes.  When all the requests of
+ * the parent are done, the parent completes, or is sent to the gateway if
+ * any of them failed.
+ */
+void peer_request_done(struct sheep_request *req, int result)
+{
+	struct sheep_request *parent = req->parent;
+	struct sd_cluster *c = req->aiocb->request->cluster;
+	struct sd_direct *d = c->direct;
+	struct sd_rsp rsp = {};
+	int ret;
+
+	if (result != SD_RES_SUCCESS)
+		uatomic_cmpxchg(&parent->peer_ret, SD_RES_SUCCESS, result);
+
+	if (uatomic_sub_return(&parent->nr_pending, 1) == 0) {
+		ret = uatomic_read(&parent->peer_ret);
+		switch (ret) {
+		case SD_RES_SUCCESS:
+			rsp.result = ret;
+			complete_sheep_request(parent, &rsp);
+			break;
+		case SD_RES_OLD_NODE_VER:
+			uatomic_set_true(&d->stale);
+			eventfd_xwrite(c->request_fd, 1);
+			goto fallback;
+		case SD_RES_VER_MISMATCH:
+			/* the internal protocol of sheep has changed */
+			uatomic_set_true(&d->disabled);
+			/* fall through */
+		default:
+fallback:
+			parent->gateway = true;
+			submit_sheep_request(parent);
+			break;
+		}
+	}
+
+	/* drop the child after the parent is sent again, see end_sheep_request */
+	put_sheep_request(c, req);
+}
+
+int sd_enable_direct_io(struct sd_cluster *c)
+{
+	struct sd_direct *d;
+	int ret;
+
+	if (c->direct)
+		return SD_RES_SUCCESS;
+
+	d = xzalloc(sizeof(*d));
+	sd_init_rw_lock(&d->lock);
+	sd_init_rw_lock(&d->peer_lock);
+	INIT_RB_ROOT(&d->nroot);
+	INIT_RB_ROOT(&d->vroot);
+	INIT_RB_ROOT(&d->peer_root);
+
+	ret = load_placement(c, d);
+	if (ret != SD_RES_SUCCESS) {
+		destroy_direct(d);
+		return ret;
+	}
+
+	/* the request thread may look at it from now on */
+	uatomic_set(&c->direct, d);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Called by sd_disconnect() after all the requests are done */
+void destroy_direct(struct sd_direct *d)
+{
+	struct peer_conn *peer;
+
+	if (!d)
+		return;
+
+	rb_for_each_entry(peer, &d->peer_root, rb)
+		close_sheep_conn(&peer->conn);
+	rb_destroy(&d->peer_root, struct peer_conn, rb);
+	rb_destroy(&d->vroot, struct sd_vnode, rb);
+	rb_destroy(&d->nroot, struct sd_node, rb);
+	sd_destroy_rw_lock(&d->lock);
+	sd_destroy_rw_lock(&d->peer_lock);
+	free(d);
+}
@@ -32,7 +32,9 @@ struct sd_request {
 	size_t length;
 	off_t offset;
 	uint8_t opcode;
-	int efd;
+	int efd;		/* -1 if asynchronous */
+	sd_aio_done_t done;
+	void *opaque;
 	int ret;
 };
 
@@ -50,6 +52,8 @@ struct sheep_aiocb {
 
 struct sheep_request {
 	struct list_node list;
+	struct hlist_node hash;
+	struct sd_conn *conn;
 	struct sheep_aiocb *aiocb;
 	uint64_t oid;
 	uint64_t cow_oid;
@@ -58,6 +62,11 @@ struct sheep_request {
 	uint32_t offset;
 	uint32_t length;
 	char *buf;
+	/* for the requests sent directly to the replicas, see direct.c */
+	struct sheep_request *parent;
+	uint32_t nr_pending;	/* requests to the replicas in flight */
+	int peer_ret;		/* first error of them */
+	bool gateway;		/* send it to the gateway */
 };
 
 struct sd_op_template {
@@ -66,16 +75,38 @@ struct sd_op_template {
 	int (*response_process)(struct sheep_request *req, struct sd_rsp *rsp);
 };
 
+static inline uint32_t inflight_hash(uint64_t oid)
+{
+	return (oid * UINT64_C(0x9e3779b97f4a7c15)) >>
+		(64 - SD_INFLIGHT_HASH_BITS);
+}
+
 struct sheep_request *find_inflight_request_oid(struct sd_cluster *c,
 						       uint64_t oid);
+uint32_t sheep_new_seq_num(struct sd_cluster *c, uint64_t oid);
 struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
 						 uint64_t oid, uint64_t cow_oid,
 						 int len, int offset);
 int end_sheep_request(struct sheep_request *req);
-int sheep_submit_sdreq(struct sd_cluster *c, struct sd_req *hdr,
+void put_sheep_request(struct sd_cluster *c, struct sheep_request *req);
+void complete_sheep_request(struct sheep_request *req, struct sd_rsp *rsp);
+int sheep_submit_sdreq(struct sd_conn *conn, struct sd_req *hdr,
 			      void *data, uint32_t wlen);
+int send_sheep_request_on(struct sheep_request *req, struct sd_conn *conn,
+			  struct sd_req *hdr, void *data, uint32_t wlen);
+int send_sheep_request(struct sheep_request *req, struct sd_req *hdr,
+		       void *data, uint32_t wlen);
 int submit_sheep_request(struct sheep_request *req);
 
+int connect_to_sheep(const struct sockaddr *addr, socklen_t addrlen);
+int init_sheep_conn(struct sd_conn *conn, struct sd_cluster *c, int fd);
+void close_sheep_conn(struct sd_conn *conn);
+
+int submit_direct_request(struct sheep_request *req);
+void peer_request_done(struct sheep_request *req, int result);
+void refresh_placement(struct sd_cluster *c);
+void destroy_direct(struct sd_direct *d);
+
 const struct sd_op_template *get_sd_op(uint8_t opcode);
 void submit_blocking_sheep_request(struct sd_cluster *c, uint64_t oid);
 
@@ -83,6 +114,8 @@ uint32_t sheep_inode_get_vid(struct sd_request *req, uint32_t idx);
 
 struct sd_request *alloc_request(struct sd_cluster *c, void *data,
 	size_t count, uint8_t op);
+struct sd_request *alloc_aio_request(struct sd_cluster *c, void *data,
+	size_t count, uint8_t op, sd_aio_done_t done, void *opaque);
 void queue_request(struct sd_request *req);
 void free_request(struct sd_request *req);
 
@@ -111,7 +111,7 @@ static int vdi_create_response(struct sheep_request *req, struct sd_rsp *rsp)
 	vdi = req->aiocb->request->vdi;
 
 	/* We need to update inode for create */
-	new = xmalloc(sizeof(*new));
+	new = xzalloc(sizeof(*new));
 	vid = vdi->vid;
 	oid = vid_to_vdi_oid(vid);
 	idx = data_oid_to_idx(req->oid);
@@ -121,7 +121,7 @@ static int vdi_create_response(struct sheep_request *req, struct sd_rsp *rsp)
 	new->cow_oid = 0;
 	new->aiocb = req->aiocb;
 	new->buf = (char *)&vid;
-	new->seq_num = uatomic_add_return(&c->seq_num, 1);
+	new->seq_num = sheep_new_seq_num(c, oid);
 	new->opcode = VDI_WRITE;
 	uatomic_inc(&req->aiocb->nr_requests);
 	INIT_LIST_NODE(&new->list);
@@ -142,6 +142,7 @@ static int sheep_ctl_request(struct sheep_aiocb *aiocb)
 	struct sd_req *hdr = aiocb->request->hdr;
 	struct sd_cluster *c = aiocb->request->cluster;
 	struct sheep_request *request = xzalloc(sizeof(struct sheep_request));
+	uint32_t wlen = 0;
 
 	INIT_LIST_NODE(&request->list);
 	request->offset = hdr->obj.offset;
@@ -150,24 +151,14 @@ static int sheep_ctl_request(struct sheep_aiocb *aiocb)
 	request->cow_oid = hdr->obj.cow_oid;
 	request->aiocb = aiocb;
 	request->buf = aiocb->buf;
-	request->seq_num = uatomic_add_return(&c->seq_num, 1);
+	request->seq_num = sheep_new_seq_num(c, request->oid);
 	request->opcode = SHEEP_CTL;
-	hdr->id = request->seq_num;
-
-	sd_write_lock(&c->inflight_lock);
-	list_add_tail(&request->list, &c->inflight_list);
-	sd_rw_unlock(&c->inflight_lock);
-
-	uint32_t wlen = 0;
 
 	if (hdr->flags & SD_FLAG_CMD_WRITE)
 		wlen = hdr->data_length;
 
 	uatomic_inc(&aiocb->nr_requests);
-	int ret = sheep_submit_sdreq(c, hdr, aiocb->buf, wlen);
-	eventfd_xwrite(c->reply_fd, 1);
-
-	return ret;
+	return send_sheep_request(request, hdr, aiocb->buf, wlen);
 }
 
 static int sheep_ctl_response(struct sheep_request *req, struct sd_rsp *rsp)
@@ -20,22 +20,27 @@
 #include <netinet/tcp.h>
 #include <pthread.h>
 
-int sheep_submit_sdreq(struct sd_cluster *c, struct sd_req *hdr,
+int sheep_submit_sdreq(struct sd_conn *conn, struct sd_req *hdr,
 			      void *data, uint32_t wlen)
 {
 	int ret;
 
-	sd_mutex_lock(&c->submit_mutex);
-	ret = xwrite(c->sockfd, hdr, sizeof(*hdr));
+	if (uatomic_is_true(&conn->dead))
+		return -SD_RES_EIO;
+
+	sd_mutex_lock(&conn->submit_mutex);
+	ret = xwrite(conn->sockfd, hdr, sizeof(*hdr));
 	if (ret < 0)
 		goto out;
 
 	if (wlen)
-		ret = xwrite(c->sockfd, data, wlen);
+		ret = xwrite(conn->sockfd, data, wlen);
 out:
-	sd_mutex_unlock(&c->submit_mutex);
-	if (unlikely(ret < 0))
+	sd_mutex_unlock(&conn->submit_mutex);
+	if (unlikely(ret < 0)) {
+		uatomic_set_true(&conn->dead);
 		return -SD_RES_EIO;
+	}
 
 	return ret;
 }
@@ -62,8 +67,54 @@ int sd_run_sdreq(struct sd_cluster *c, struct sd_req *hdr, void *data)
 
 static void aio_end_request(struct sd_request *req, int ret)
 {
+	struct sd_cluster *c = req->cluster;
+
 	req->ret = ret;
-	eventfd_xwrite(req->efd, 1);
+	if (req->efd >= 0) {
+		eventfd_xwrite(req->efd, 1);
+		return;
+	}
+
+	if (req->done) {
+		req->done(req->opaque, ret);
+		free_request(req);
+		return;
+	}
+
+	sd_mutex_lock(&c->aio_lock);
+	list_add_tail(&req->list, &c->aio_completions);
+	sd_mutex_unlock(&c->aio_lock);
+	eventfd_xwrite(c->aio_fd, 1);
+}
+
+int sd_aio_fd(struct sd_cluster *c)
+{
+	return c->aio_fd;
+}
+
+int sd_aio_reap(struct sd_cluster *c, struct sd_aio_event *events, int nr)
+{
+	struct sd_request *req;
+	int n = 0;
+
+	/* reset the counter of aio_fd before we look at the completions */
+	eventfd_xread(c->aio_fd);
+
+	sd_mutex_lock(&c->aio_lock);
+	list_for_each_entry(req, &c->aio_completions, list) {
+		if (n == nr)
+			break;
+		list_del(&req->list);
+		events[n].opaque = req->opaque;
+		events[n].ret = req->ret;
+		free_request(req);
+		n++;
+	}
+	if (!list_empty(&c->aio_completions))
+		eventfd_xwrite(c->aio_fd, 1);
+	sd_mutex_unlock(&c->aio_lock);
+
+	return n;
 }
 
 static void aio_rw_done(struct sheep_aiocb *aiocb)
@@ -88,6 +139,12 @@ static struct sheep_aiocb *sheep_aiocb_setup(struct sd_request *req)
 	return aiocb;
 }
 
+uint32_t sheep_new_seq_num(struct sd_cluster *c, uint64_t oid)
+{
+	return (uatomic_add_return(&c->seq_num, 1) << SD_INFLIGHT_HASH_BITS) |
+		inflight_hash(oid);
+}
+
 struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
 						 uint64_t oid, uint64_t cow_oid,
 						 int len, int offset)
@@ -101,7 +158,7 @@ struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
 	req->cow_oid = cow_oid;
 	req->aiocb = aiocb;
 	req->buf = aiocb->buf + aiocb->buf_iter;
-	req->seq_num = uatomic_add_return(&c->seq_num, 1);
+	req->seq_num = sheep_new_seq_num(c, oid);
 	req->opcode = aiocb->request->opcode;
 	aiocb->buf_iter += len;
 
@@ -122,22 +179,128 @@ uint32_t sheep_inode_get_vid(struct sd_request *req, uint32_t idx)
 	return vid;
 }
 
+static inline struct sd_inflight_bucket *
+inflight_bucket(struct sd_cluster *c, uint32_t seq_num)
+{
+	return c->inflight + (seq_num & (SD_INFLIGHT_HASH_SIZE - 1));
+}
+
+static void add_inflight_request(struct sd_cluster *c,
+				 struct sheep_request *req)
+{
+	struct sd_inflight_bucket *bucket = inflight_bucket(c, req->seq_num);
+
+	sd_mutex_lock(&bucket->lock);
+	hlist_add_head(&req->hash, &bucket->head);
+	sd_mutex_unlock(&bucket->lock);
+}
+
+static struct sheep_request *fetch_inflight_request(struct sd_cluster *c,
+						    uint32_t seq_num)
+{
+	struct sd_inflight_bucket *bucket = inflight_bucket(c, seq_num);
+	struct sheep_request *req;
+	struct hlist_node *n;
+
+	sd_mutex_lock(&bucket->lock);
+	hlist_for_each_entry(req, n, &bucket->head, hash) {
+		if (req->seq_num == seq_num) {
+			hlist_del(&req->hash);
+			goto out;
+		}
+	}
+	req = NULL;
+out:
+	sd_mutex_unlock(&bucket->lock);
+	return req;
+}
+
+struct sheep_request *find_inflight_request_oid(struct sd_cluster *c,
+						       uint64_t oid)
+{
+	struct sd_inflight_bucket *bucket = c->inflight + inflight_hash(oid);
+	struct sheep_request *req;
+	struct hlist_node *n;
+
+	sd_mutex_lock(&bucket->lock);
+	hlist_for_each_entry(req, n, &bucket->head, hash) {
+		if (req->oid == oid)
+			goto out;
+	}
+	req = NULL;
+out:
+	sd_mutex_unlock(&bucket->lock);
+	return req;
+}
+
+static void fail_sheep_request(struct sheep_request *req, int ret)
+{
+	if (req->parent) {
+		peer_request_done(req, ret);
+		return;
+	}
+
+	req->aiocb->ret = ret;
+	end_sheep_request(req);
+}
+
+/*
+ * Send the request on the connection.  The reply is handled by the reply
+ * thread of the connection.
+ */
+int send_sheep_request_on(struct sheep_request *req, struct sd_conn *conn,
+			  struct sd_req *hdr, void *data, uint32_t wlen)
+{
+	struct sd_cluster *c = req->aiocb->request->cluster;
+	uint32_t seq_num = req->seq_num;
+	int ret;
+
+	req->conn = conn;
+	hdr->id = seq_num;
+	uatomic_inc(&c->nr_inflight);
+	add_inflight_request(c, req);
+
+	/* the request may be completed by the reply thread once it is sent */
+	ret = sheep_submit_sdreq(conn, hdr, data, wlen);
+	if (ret < 0) {
+		req = fetch_inflight_request(c, seq_num);
+		if (req)
+			fail_sheep_request(req, SD_RES_EIO);
+	}
+
+	return ret;
+}
+
+/*
+ * Send the request to the gateway.  The requests go round-robin over the
+ * connections.
+ */
+int send_sheep_request(struct sheep_request *req, struct sd_req *hdr,
+		       void *data, uint32_t wlen)
+{
+	struct sd_cluster *c = req->aiocb->request->cluster;
+	struct sd_conn *conn;
+
+	conn = c->conns +
+		(req->seq_num >> SD_INFLIGHT_HASH_BITS) % c->nr_conns;
+
+	return send_sheep_request_on(req, conn, hdr, data, wlen);
+}
+
 int submit_sheep_request(struct sheep_request *req)
 {
 	struct sd_req hdr = {};
-	struct sd_cluster *c = req->aiocb->request->cluster;
 	int ret = 0;
 
-	hdr.id = req->seq_num;
+	if (uatomic_read(&req->aiocb->request->cluster->direct) &&
+	    submit_direct_request(req) == 0)
+		return 0;
+
 	hdr.data_length = req->length;
 	hdr.obj.oid = req->oid;
 	hdr.obj.cow_oid = req->cow_oid;
 	hdr.obj.offset = req->offset;
 
-	sd_write_lock(&c->inflight_lock);
-	list_add_tail(&req->list, &c->inflight_list);
-	sd_rw_unlock(&c->inflight_lock);
-
 	switch (req->opcode) {
 	case VDI_CREATE:
 	case VDI_WRITE:
@@ -148,19 +311,14 @@ int submit_sheep_request(struct sheep_request *req)
 		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
 		if (req->cow_oid)
 			hdr.flags |= SD_FLAG_CMD_COW;
-		ret = sheep_submit_sdreq(c, &hdr, req->buf, req->length);
-		if (ret < 0)
-			goto err;
+		ret = send_sheep_request(req, &hdr, req->buf, req->length);
 		break;
 	case VDI_READ:
 		hdr.opcode = SD_OP_READ_OBJ;
-		ret = sheep_submit_sdreq(c, &hdr, NULL, 0);
-		if (ret < 0)
-			goto err;
+		ret = send_sheep_request(req, &hdr, NULL, 0);
 		break;
 	}
-err:
-	eventfd_xwrite(c->reply_fd, 1);
+
 	return ret;
 }
 
@@ -178,22 +336,6 @@ void submit_blocking_sheep_request(struct sd_cluster *c, uint64_t oid)
 	sd_rw_unlock(&c->blocking_lock);
 }
 
-struct sheep_request *find_inflight_request_oid(struct sd_cluster *c,
-						       uint64_t oid)
-{
-	struct sheep_request *req;
-
-	sd_read_lock(&c->inflight_lock);
-	list_for_each_entry(req, &c->inflight_list, list) {
-		if (req->oid == oid) {
-			sd_rw_unlock(&c->inflight_lock);
-			return req;
-		}
-	}
-	sd_rw_unlock(&c->inflight_lock);
-	return NULL;
-}
-
 static int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 {
 	struct sd_request *request = aiocb->request;
@@ -233,6 +375,7 @@ static void *request_handler(void *data)
 		if (empty)
 			continue;
 
+		refresh_placement(c);
 		for (uint64_t i = 0; i < events; i++) {
 			sd_write_lock(&c->request_lock);
 			req = list_first_entry(&c->request_list,
@@ -246,163 +389,302 @@ static void *request_handler(void *data)
 	pthread_exit(NULL);
 }
 
-static struct sheep_request *fetch_first_inflight_request(struct sd_cluster *c)
+/*
+ * Free the request.  The aiocb may be gone already, so the caller has to
+ * pass the cluster.
+ */
+void put_sheep_request(struct sd_cluster *c, struct sheep_request *req)
 {
-	struct sheep_request *req;
+	bool sent = !!req->conn;
 
-	sd_write_lock(&c->inflight_lock);
-	if (!list_empty(&c->inflight_list)) {
-		req = list_first_entry(&c->inflight_list, struct sheep_request,
-				       list);
-		list_del(&req->list);
-	} else {
-		req = NULL;
+	free(req);
+
+	/*
+	 * Requests sent while handling the reply were counted before, so
+	 * sd_disconnect() doesn't see zero until everything is done.
+	 */
+	if (sent && uatomic_sub_return(&c->nr_inflight, 1) == 0 &&
+	    uatomic_is_true(&c->stop_reply_handler)) {
+		sd_mutex_lock(&c->drain_lock);
+		sd_cond_signal(&c->drain_cond);
+		sd_mutex_unlock(&c->drain_lock);
 	}
-	sd_rw_unlock(&c->inflight_lock);
-	return req;
 }
 
-static struct sheep_request *fetch_inflight_request(struct sd_cluster *c,
-						    uint32_t seq_num)
+int end_sheep_request(struct sheep_request *req)
 {
-	struct sheep_request *req;
+	struct sheep_aiocb *aiocb = req->aiocb;
+	struct sd_cluster *c = aiocb->request->cluster;
 
-	sd_write_lock(&c->inflight_lock);
-	list_for_each_entry(req, &c->inflight_list, list) {
-		if (req->seq_num == seq_num) {
-			list_del(&req->list);
-			goto out;
+	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
+		aiocb->aio_done_func(aiocb);
+
+	put_sheep_request(c, req);
+
+	return 0;
+}
+
+/* Fail the requests which were sent on the broken connection */
+static void fail_inflight_requests(struct sd_conn *conn)
+{
+	struct sd_cluster *c = conn->cluster;
+	struct sheep_request *req;
+	struct hlist_node *n;
+	LIST_HEAD(failed);
+
+	for (int i = 0; i < SD_INFLIGHT_HASH_SIZE; i++) {
+		struct sd_inflight_bucket *bucket = c->inflight + i;
+
+		sd_mutex_lock(&bucket->lock);
+		hlist_for_each_entry(req, n, &bucket->head, hash) {
+			if (req->conn != conn)
+				continue;
+			hlist_del(&req->hash);
+			list_add_tail(&req->list, &failed);
 		}
+		sd_mutex_unlock(&bucket->lock);
+	}
+
+	list_for_each_entry(req, &failed, list) {
+		list_del(&req->list);
+		fail_sheep_request(req, SD_RES_EIO);
 	}
-	req = NULL;
-out:
-	sd_rw_unlock(&c->inflight_lock);
-	return req;
 }
 
-int end_sheep_request(struct sheep_request *req)
+static int discard_data(int fd, uint32_t len)
 {
-	struct sheep_aiocb *aiocb = req->aiocb;
+	char buf[4096];
 
-	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
-		aiocb->aio_done_func(aiocb);
+	while (len > 0) {
+		uint32_t n = min(len, (uint32_t)sizeof(buf));
 
-	free(req);
+		if (xread(fd, buf, n) != n)
+			return -1;
+		len -= n;
+	}
 
 	return 0;
 }
 
+/* Complete the request with the reply of sheep */
+void complete_sheep_request(struct sheep_request *req, struct sd_rsp *rsp)
+{
+	struct sheep_aiocb *aiocb = req->aiocb;
+	struct sd_cluster *c = aiocb->request->cluster;
+
+	if (rsp->result != SD_RES_SUCCESS && req->opcode != SHEEP_CTL) {
+		aiocb->ret = rsp->result;
+		if (req->opcode == VDI_CREATE)
+			/* let the writes waiting for the creation fail too */
+			submit_blocking_sheep_request(c, req->oid);
+		goto end_request;
+	}
+
+	aiocb->op = get_sd_op(req->opcode);
+	if (aiocb->op != NULL && !!aiocb->op->response_process)
+		aiocb->op->response_process(req, rsp);
+
+end_request:
+	end_sheep_request(req);
+}
 
 /* FIXME: add auto-reconnect support */
-static int sheep_handle_reply(struct sd_cluster *c)
+static int sheep_handle_reply(struct sd_conn *conn)
 {
+	struct sd_cluster *c = conn->cluster;
 	struct sd_rsp rsp = {};
 	struct sheep_request *req;
-	struct sheep_aiocb *aiocb;
 	int ret;
 
-	ret = xread(c->sockfd, (char *)&rsp, sizeof(rsp));
-	if (ret < 0) {
-		req = fetch_first_inflight_request(c);
-		if (req != NULL) {
-			req->aiocb->ret = SD_RES_EIO;
-			goto end_request;
-		}
-		goto err;
-	}
+	ret = xread(conn->sockfd, (char *)&rsp, sizeof(rsp));
+	if (ret != sizeof(rsp))
+		return -1;
 
 	req = fetch_inflight_request(c, rsp.id);
 	if (!req)
-		return 0;
+		return discard_data(conn->sockfd, rsp.data_length);
 
 	if (rsp.data_length > 0) {
-		ret = xread(c->sockfd, req->buf, req->length);
-		if (ret < 0) {
-			req->aiocb->ret = SD_RES_EIO;
-			goto end_request;
+		if (rsp.data_length > req->length ||
+		    xread(conn->sockfd, req->buf, rsp.data_length) !=
+		    rsp.data_length) {
+			fail_sheep_request(req, SD_RES_EIO);
+			return -1;
 		}
 	}
 
-	aiocb = req->aiocb;
-	aiocb->op = get_sd_op(req->opcode);
-	if (aiocb->op != NULL && !!aiocb->op->response_process)
-		ret = aiocb->op->response_process(req, &rsp);
-
-end_request:
-	end_sheep_request(req);
-err:
-	return ret;
+	if (req->parent)
+		peer_request_done(req, rsp.result);
+	else
+		complete_sheep_request(req, &rsp);
+	return 0;
 }
 
 static void *reply_handler(void *data)
 {
-	struct sd_cluster *c = data;
+	struct sd_conn *conn = data;
 
-	while (!uatomic_is_true(&c->stop_request_handler) ||
-	       !list_empty(&c->inflight_list)) {
-		bool empty;
+	while (sheep_handle_reply(conn) == 0)
+		;
 
-		uint64_t events;
-		events = eventfd_xread(c->reply_fd);
+	/* the connection is broken or shut down by sd_disconnect() */
+	uatomic_set_true(&conn->dead);
+	fail_inflight_requests(conn);
 
-		sd_read_lock(&c->inflight_lock);
-		empty = list_empty(&c->inflight_list);
-		sd_rw_unlock(&c->inflight_lock);
+	pthread_exit(NULL);
+}
 
-		if (empty)
-			continue;
+int connect_to_sheep(const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct linger linger_opt = {1, 0};
+	int fd, ret, value = 1;
 
-		for (uint64_t i = 0; i < events; i++)
-			sheep_handle_reply(c);
+	fd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+		return -SD_RES_SYSTEM_ERROR;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger_opt,
+			 sizeof(linger_opt));
+	if (ret < 0)
+		goto err;
+
+	ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+	if (ret < 0)
+		goto err;
 
+	ret = connect(fd, addr, addrlen);
+	if (ret < 0)
+		goto err;
+
+	return fd;
+err:
+	close(fd);
+	return -SD_RES_SYSTEM_ERROR;
+}
+
+/*
+ * Set up the connection on the socket and start its reply thread.  If it
+ * fails, the connection is marked dead.
+ */
+int init_sheep_conn(struct sd_conn *conn, struct sd_cluster *c, int fd)
+{
+	conn->cluster = c;
+	conn->sockfd = fd;
+	sd_init_mutex(&conn->submit_mutex);
+	if (fd >= 0 &&
+	    pthread_create(&conn->reply_thread, NULL, reply_handler, conn) == 0)
+		return SD_RES_SUCCESS;
+
+	if (fd >= 0)
+		close(fd);
+	conn->sockfd = -1;
+	uatomic_set_true(&conn->dead);
+	return -SD_RES_SYSTEM_ERROR;
+}
+
+void close_sheep_conn(struct sd_conn *conn)
+{
+	if (conn->sockfd >= 0) {
+		shutdown(conn->sockfd, SHUT_RDWR);
+		pthread_join(conn->reply_thread, NULL);
+		close(conn->sockfd);
 	}
-	pthread_exit(NULL);
+	sd_destroy_mutex(&conn->submit_mutex);
 }
 
-static int init_cluster_handlers(struct sd_cluster *c)
+static void destroy_cluster(struct sd_cluster *c)
 {
-	pthread_t thread;
-	int ret;
+	for (int i = 0; i < c->nr_conns; i++) {
+		struct sd_conn *conn = c->conns + i;
 
+		if (conn->sockfd >= 0)
+			close(conn->sockfd);
+		sd_destroy_mutex(&conn->submit_mutex);
+	}
+	for (int i = 0; i < SD_INFLIGHT_HASH_SIZE; i++)
+		sd_destroy_mutex(&c->inflight[i].lock);
+	sd_destroy_rw_lock(&c->request_lock);
+	sd_destroy_rw_lock(&c->blocking_lock);
+	sd_destroy_mutex(&c->drain_lock);
+	sd_destroy_cond(&c->drain_cond);
+	sd_destroy_mutex(&c->aio_lock);
+	if (c->request_fd >= 0)
+		close(c->request_fd);
+	if (c->aio_fd >= 0)
+		close(c->aio_fd);
+	free(c->conns);
+	free(c);
+}
+
+static struct sd_cluster *alloc_cluster(int nr_conns)
+{
+	struct sd_cluster *c = xzalloc(sizeof(*c));
+
+	c->nr_conns = nr_conns;
+	c->conns = xcalloc(nr_conns, sizeof(*c->conns));
+	for (int i = 0; i < nr_conns; i++) {
+		c->conns[i].cluster = c;
+		c->conns[i].sockfd = -1;
+		sd_init_mutex(&c->conns[i].submit_mutex);
+	}
+	for (int i = 0; i < SD_INFLIGHT_HASH_SIZE; i++) {
+		sd_init_mutex(&c->inflight[i].lock);
+		INIT_HLIST_HEAD(&c->inflight[i].head);
+	}
+	INIT_LIST_HEAD(&c->request_list);
+	INIT_LIST_HEAD(&c->blocking_list);
+	INIT_LIST_HEAD(&c->aio_completions);
+	sd_init_rw_lock(&c->request_lock);
+	sd_init_rw_lock(&c->blocking_lock);
+	sd_init_mutex(&c->drain_lock);
+	sd_cond_init(&c->drain_cond);
+	sd_init_mutex(&c->aio_lock);
 	c->request_fd = eventfd(0, 0);
-	if (c->request_fd < 0)
-		return -SD_RES_SYSTEM_ERROR;
+	c->aio_fd = eventfd(0, EFD_NONBLOCK);
 
-	c->reply_fd = eventfd(0, 0);
-	if (c->reply_fd < 0) {
-		close(c->request_fd);
+	return c;
+}
+
+static int init_cluster_handlers(struct sd_cluster *c)
+{
+	int ret, i;
+
+	ret = pthread_create(&c->request_thread, NULL, request_handler, c);
+	if (ret != 0)
 		return -SD_RES_SYSTEM_ERROR;
-	}
 
-	ret = pthread_create(&thread, NULL, request_handler, c);
-	if (ret < 0) {
-		close(c->request_fd);
-		close(c->reply_fd);
-		return ret;
-	}
-	c->request_thread = thread;
-	ret = pthread_create(&thread, NULL, reply_handler, c);
-	if (ret < 0) {
-		close(c->reply_fd);
-		uatomic_set_true(&c->stop_request_handler);
-		eventfd_xwrite(c->request_fd, 1);
-		pthread_join(c->request_thread, NULL);
-		return ret;
+	for (i = 0; i < c->nr_conns; i++) {
+		ret = pthread_create(&c->conns[i].reply_thread, NULL,
+				     reply_handler, c->conns + i);
+		if (ret != 0)
+			goto err;
 	}
-	c->reply_thread = thread;
 
 	return SD_RES_SUCCESS;
+err:
+	uatomic_set_true(&c->stop_request_handler);
+	eventfd_xwrite(c->request_fd, 1);
+	pthread_join(c->request_thread, NULL);
+	while (--i >= 0) {
+		shutdown(c->conns[i].sockfd, SHUT_RDWR);
+		pthread_join(c->conns[i].reply_thread, NULL);
+	}
+	return -SD_RES_SYSTEM_ERROR;
 }
 
-struct sd_cluster *sd_connect(char *host)
+struct sd_cluster *sd_connect_multi(char *host, int nr_conns)
 {
 	char *ip, *pt, *h = xstrdup(host);
 	unsigned port;
 	struct sockaddr_in addr;
-	struct linger linger_opt = {1, 0};
-	int fd, ret, value = 1;
+	int fd, ret;
 	struct sd_cluster *c;
 
+	if (nr_conns < 1) {
+		errno = SD_RES_INVALID_PARMS;
+		goto err;
+	}
+
 	ip = strtok(h, ":");
 	if (!ip) {
 		errno = SD_RES_INVALID_PARMS;
@@ -420,25 +702,6 @@ struct sd_cluster *sd_connect(char *host)
 		goto err;
 	}
 
-	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (fd < 0) {
-		errno = SD_RES_SYSTEM_ERROR;
-		goto err;
-	}
-
-	ret = setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger_opt,
-			 sizeof(linger_opt));
-	if (ret < 0) {
-		errno = SD_RES_SYSTEM_ERROR;
-		goto err_close;
-	}
-
-	ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
-	if (ret < 0) {
-		errno = SD_RES_SYSTEM_ERROR;
-		goto err_close;
-	}
-
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	ret = inet_pton(AF_INET, ip, &addr.sin_addr);
@@ -447,58 +710,65 @@ struct sd_cluster *sd_connect(char *host)
 		break;
 	default:
 		errno = SD_RES_INVALID_PARMS;
-		goto err_close;
+		goto err;
 	}
 
-	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-	if (ret < 0) {
+	c = alloc_cluster(nr_conns);
+	if (c->request_fd < 0 || c->aio_fd < 0) {
 		errno = SD_RES_SYSTEM_ERROR;
-		goto err_close;
+		goto err_destroy;
 	}
-
-	c = xzalloc(sizeof(*c));
-	c->sockfd = fd;
 	c->port = port;
 	memcpy(c->addr, &addr.sin_addr, INET_ADDRSTRLEN);
+
+	for (int i = 0; i < nr_conns; i++) {
+		fd = connect_to_sheep((struct sockaddr *)&addr, sizeof(addr));
+		if (fd < 0) {
+			errno = -fd;
+			goto err_destroy;
+		}
+		c->conns[i].sockfd = fd;
+	}
+
 	ret = init_cluster_handlers(c);
 	if (ret < 0) {
-		free(c);
 		errno = -ret;
-		goto err_close;
-	};
-	INIT_LIST_HEAD(&c->request_list);
-	INIT_LIST_HEAD(&c->inflight_list);
-	INIT_LIST_HEAD(&c->blocking_list);
-	sd_init_rw_lock(&c->request_lock);
-	sd_init_rw_lock(&c->inflight_lock);
-	sd_init_rw_lock(&c->blocking_lock);
-	sd_init_mutex(&c->submit_mutex);
+		goto err_destroy;
+	}
 
 	free(h);
 	return c;
-err_close:
-	close(fd);
+err_destroy:
+	destroy_cluster(c);
 err:
 	free(h);
 	return NULL;
 }
 
+struct sd_cluster *sd_connect(char *host)
+{
+	return sd_connect_multi(host, 1);
+}
+
 int sd_disconnect(struct sd_cluster *c)
 {
 	uatomic_set_true(&c->stop_request_handler);
-	uatomic_set_true(&c->stop_reply_handler);
 	eventfd_xwrite(c->request_fd, 1);
-	eventfd_xwrite(c->reply_fd, 1);
 	pthread_join(c->request_thread, NULL);
-	pthread_join(c->reply_thread, NULL);
-	sd_destroy_rw_lock(&c->request_lock);
-	sd_destroy_rw_lock(&c->inflight_lock);
-	sd_destroy_rw_lock(&c->blocking_lock);
-	sd_destroy_mutex(&c->submit_mutex);
-	close(c->request_fd);
-	close(c->reply_fd);
-	close(c->sockfd);
-	free(c);
+
+	/* wait for the replies to the requests we have sent */
+	uatomic_set_true(&c->stop_reply_handler);
+	sd_mutex_lock(&c->drain_lock);
+	while (uatomic_read(&c->nr_inflight) > 0)
+		sd_cond_wait(&c->drain_cond, &c->drain_lock);
+	sd_mutex_unlock(&c->drain_lock);
+
+	for (int i = 0; i < c->nr_conns; i++) {
+		shutdown(c->conns[i].sockfd, SHUT_RDWR);
+		pthread_join(c->conns[i].reply_thread, NULL);
+	}
+	destroy_direct(c->direct);
+	destroy_cluster(c);
 
 	return SD_RES_SUCCESS;
 }
@@ -25,23 +25,52 @@
 #include <arpa/inet.h>
 #include <sys/eventfd.h>
 
-struct sd_cluster {
+/* connection to sheep with its own reply thread */
+struct sd_conn {
+	struct sd_cluster *cluster;
 	int sockfd;
+	pthread_t reply_thread;
+	uatomic_bool dead;
+	struct sd_mutex submit_mutex;
+};
+
+/*
+ * In-flight requests are hashed by the oid, and the bucket is encoded in the
+ * low bits of the request id so that a reply can be matched without knowing
+ * the oid.
+ */
+#define SD_INFLIGHT_HASH_BITS	8
+#define SD_INFLIGHT_HASH_SIZE	(1U << SD_INFLIGHT_HASH_BITS)
+
+struct sd_inflight_bucket {
+	struct sd_mutex lock;
+	struct hlist_head head;
+};
+
+struct sd_cluster {
 	uint8_t addr[INET_ADDRSTRLEN];
 	unsigned int port;
 	uint32_t seq_num;
+	int nr_conns;
+	struct sd_conn *conns;
 	pthread_t request_thread;
-	pthread_t reply_thread;
-	int request_fd, reply_fd;
+	int request_fd;
 	struct list_head request_list;
-	struct list_head inflight_list;
 	struct list_head blocking_list;
+	struct sd_inflight_bucket inflight[SD_INFLIGHT_HASH_SIZE];
+	uint32_t nr_inflight;
+	struct sd_mutex drain_lock;
+	struct sd_cond drain_cond;
 	uatomic_bool stop_request_handler;
 	uatomic_bool stop_reply_handler;
 	struct sd_rw_lock request_lock;
-	struct sd_rw_lock inflight_lock;
 	struct sd_rw_lock blocking_lock;
-	struct sd_mutex submit_mutex;
+	/* completions of the asynchronous requests without callback */
+	int aio_fd;
+	struct list_head aio_completions;
+	struct sd_mutex aio_lock;
+	/* placement for the direct I/O, NULL if it is disabled */
+	struct sd_direct *direct;
 };
 
 struct sd_vdi {
@@ -61,6 +90,19 @@ struct sd_vdi {
  */
 struct sd_cluster *sd_connect(char *host);
 
+/*
+ * Connect to the specified Sheepdog cluster with multiple connections.
+ *
+ * @host: string in the form of IP:PORT that identify a valid Sheepdog cluster.
+ * @nr_conns: number of connections to open, each of which has its own thread
+ *            to receive replies.
+ *
+ * Requests are spread over the connections.  Return a cluster descriptor on
+ * success. Otherwise, return NULL in case of error and set errno as error
+ * code defined in sheepdog_proto.h.
+ */
+struct sd_cluster *sd_connect_multi(char *host, int nr_conns);
+
 /*
  * Disconnect to the specified sheepdog cluster.
  *
@@ -70,6 +112,23 @@ struct sd_cluster *sd_connect(char *host);
  */
 int sd_disconnect(struct sd_cluster *c);
 
+/*
+ * Send the reads and writes of the vdis directly to the sheep which store
+ * the objects.
+ *
+ * @c: pointer to the cluster descriptor.
+ *
+ * The library loads the node list of the cluster and computes where the data
+ * objects of the replicated vdis are, so that their data doesn't go through
+ * the sheep we are connected to.  The requests which can't be done directly
+ * are sent to it as before, e.g. when the node list has changed.  This needs
+ * the internal protocol of sheep, so the library must be built with the same
+ * version as the sheep.
+ *
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_enable_direct_io(struct sd_cluster *c);
+
 /*
  * Run the Sheepdog request on the specified cluster synchronously.
  *
@@ -118,6 +177,64 @@ int sd_vdi_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
 int sd_vdi_write(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
 		size_t count, off_t offset);
 
+/*
+ * Completion of an asynchronous request.
+ *
+ * @opaque: the pointer passed when the request was submitted.
+ * @ret: error code defined in sheepdog_proto.h.
+ *
+ * It is called by one of the library threads, so it must not block.
+ */
+typedef void (*sd_aio_done_t)(void *opaque, int ret);
+
+struct sd_aio_event {
+	void *opaque;
+	int ret;
+};
+
+/*
+ * Read from a vdi descriptor asynchronously.
+ *
+ * @done: called when the read completes.  If it is NULL, the completion is
+ *        queued to be reaped by sd_aio_reap() instead.
+ * @opaque: passed to @done or returned in the sd_aio_event.
+ *
+ * The other arguments are the same as sd_vdi_read().  Return SD_RES_SUCCESS
+ * if the request is submitted, or error code defined in sheepdog_proto.h.
+ */
+int sd_vdi_aio_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+		    size_t count, off_t offset, sd_aio_done_t done,
+		    void *opaque);
+
+/*
+ * Write to a vdi descriptor asynchronously.
+ *
+ * The arguments are the same as sd_vdi_aio_read().
+ */
+int sd_vdi_aio_write(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+		     size_t count, off_t offset, sd_aio_done_t done,
+		     void *opaque);
+
+/*
+ * Return a file descriptor which becomes readable when there are completions
+ * to reap, to be used with poll(2) or epoll(7).  Don't read from it.
+ *
+ * @c: pointer to the cluster descriptor.
+ */
+int sd_aio_fd(struct sd_cluster *c);
+
+/*
+ * Reap the completions of the asynchronous requests submitted without
+ * callback.  It doesn't block.
+ *
+ * @c: pointer to the cluster descriptor.
+ * @events: array to store the completions.
+ * @nr: size of the array.
+ *
+ * Return the number of completions stored in @events.
+ */
+int sd_aio_reap(struct sd_cluster *c, struct sd_aio_event *events, int nr);
+
 /*
  * Close a vdi descriptor.
  *
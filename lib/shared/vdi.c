@@ -114,7 +114,8 @@ void queue_request(struct sd_request *req)
 
 void free_request(struct sd_request *req)
 {
-	close(req->efd);
+	if (req->efd >= 0)
+		close(req->efd);
 	free(req);
 }
 
@@ -140,6 +141,24 @@ struct sd_request *alloc_request(struct sd_cluster *c,
 	return req;
 }
 
+/* The request completes by calling 'done' or queueing to aio_completions */
+struct sd_request *alloc_aio_request(struct sd_cluster *c, void *data,
+	size_t count, uint8_t op, sd_aio_done_t done, void *opaque)
+{
+	struct sd_request *req = xzalloc(sizeof(*req));
+
+	req->efd = -1;
+	req->cluster = c;
+	req->data = data;
+	req->length = count;
+	req->opcode = op;
+	req->done = done;
+	req->opaque = opaque;
+	INIT_LIST_NODE(&req->list);
+
+	return req;
+}
+
 int sd_vdi_read(struct sd_cluster *c, struct sd_vdi *vdi,
 			void *buf, size_t count, off_t offset)
 {
@@ -182,6 +201,34 @@ int sd_vdi_write(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
 	return ret;
 }
 
+int sd_vdi_aio_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+		    size_t count, off_t offset, sd_aio_done_t done,
+		    void *opaque)
+{
+	struct sd_request *req = alloc_aio_request(c, buf, count, VDI_READ,
+						   done, opaque);
+
+	req->vdi = vdi;
+	req->offset = offset;
+	queue_request(req);
+
+	return SD_RES_SUCCESS;
+}
+
+int sd_vdi_aio_write(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+		     size_t count, off_t offset, sd_aio_done_t done,
+		     void *opaque)
+{
+	struct sd_request *req = alloc_aio_request(c, buf, count, VDI_WRITE,
+						   done, opaque);
+
+	req->vdi = vdi;
+	req->offset = offset;
+	queue_request(req);
+
+	return SD_RES_SUCCESS;
+}
+
 int sd_vdi_close(struct sd_cluster *c, struct sd_vdi *vdi)
 {
 	int ret;
@@ -517,3 +517,22 @@ void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd)
 	sockfd_cache_del_node(nid);
 	free(sfd);
 }
+
+/*
+ * Close a sockfd connected to the node which can't be reused, e.g. because
+ * the response of a request which we don't wait for any more is pending.
+ *
+ * Unlike sockfd_cache_del(), the node is considered to be alive.
+ */
+void sockfd_cache_discard(const struct node_id *nid, struct sockfd *sfd)
+{
+	if (sfd->idx == -1) {
+		sd_debug("%d", sfd->fd);
+		close(sfd->fd);
+		free(sfd);
+		return;
+	}
+
+	sockfd_cache_close(nid, sfd->idx);
+	free(sfd);
+}
@@ -270,6 +270,208 @@ out:
 	free(reqs);
 }
 
+/* Read from a remote replica and account the latency of its node */
+static int replica_read(struct request *req, const struct sd_node *node)
+{
+	struct sd_req fwd_hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
+	uint64_t sent;
+	int ret;
+
+	/*
+	 * We need to re-init it because rsp and req share the same
+	 * structure.
+	 */
+	gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
+	sent = clock_get_time();
+	node_load_begin(&node->nid);
+	ret = sheep_exec_req(&node->nid, &fwd_hdr, req->data);
+	node_load_end(&node->nid, sent, ret == SD_RES_SUCCESS,
+		      ret == SD_RES_NETWORK_ERROR);
+	slowlog_forward_done(req, node, sent);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	memcpy(&req->rp, rsp, sizeof(*rsp));
+	return ret;
+}
+
+#ifndef HAVE_ACCELIO
+
+struct hedged_read {
+	const struct sd_node *node;
+	struct sockfd *sfd;
+	void *buf;
+	uint64_t sent;
+};
+
+static int hedged_read_send(struct request *req, struct hedged_read *hr,
+			    const struct sd_node *node, void *buf)
+{
+	const struct node_id *nid = &node->nid;
+	struct sd_req hdr;
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	hr->node = node;
+	hr->buf = buf;
+	hr->sfd = sockfd_cache_get(nid);
+	if (!hr->sfd)
+		return SD_RES_NETWORK_ERROR;
+
+	hr->sent = clock_get_time();
+	node_load_begin(nid);
+	if (send_req(hr->sfd->fd, &hdr, NULL, 0, sheep_need_retry,
+		     req->rq.epoch, MAX_RETRY_COUNT)) {
+		sockfd_cache_del(nid, hr->sfd);
+		node_load_end(nid, hr->sent, false, true);
+		return SD_RES_NETWORK_ERROR;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int hedged_read_recv(struct request *req, struct hedged_read *hr,
+			    struct sd_rsp *rsp)
+{
+	const struct node_id *nid = &hr->node->nid;
+	int fd = hr->sfd->fd, ret;
+
+	if (do_read(fd, rsp, sizeof(*rsp), sheep_need_retry, req->rq.epoch,
+		    MAX_RETRY_COUNT) ||
+	    rsp->data_length > req->rq.data_length ||
+	    (rsp->data_length &&
+	     do_read(fd, hr->buf, rsp->data_length, sheep_need_retry,
+		     req->rq.epoch, MAX_RETRY_COUNT))) {
+		sd_err("remote node might have gone away");
+		sockfd_cache_del(nid, hr->sfd);
+		ret = SD_RES_NETWORK_ERROR;
+	} else {
+		sockfd_cache_put(nid, hr->sfd);
+		ret = rsp->result;
+	}
+	node_load_end(nid, hr->sent, ret == SD_RES_SUCCESS,
+		      ret == SD_RES_NETWORK_ERROR);
+	slowlog_forward_done(req, hr->node, hr->sent);
+
+	return ret;
+}
+
+/*
+ * We don't wait for the response of the slower read, so its connection can't
+ * be reused.  Its latency so far is only a lower bound of the latency of the
+ * node, so it isn't taken as a sample; it would pull the estimate down.
+ */
+static void hedged_read_cancel(struct request *req, struct hedged_read *hr)
+{
+	sockfd_cache_discard(&hr->node->nid, hr->sfd);
+	node_load_end(&hr->node->nid, hr->sent, false, false);
+	slowlog_forward_done(req, hr->node, hr->sent);
+}
+
+/*
+ * Read from the replica 'first' and, if it doesn't respond within the usual
+ * time of its node, send the read to the best of the other replicas 'nodes'
+ * too.  The first successful response is used.
+ *
+ * The replica which the second read is sent to is removed from 'nodes'.
+ */
+static int gateway_hedged_read(struct request *req, const struct sd_node *first,
+			       const struct sd_node **nodes, int *nr)
+{
+	struct hedged_read hr[2];
+	struct pollfd pfds[2];
+	struct sd_rsp rsp;
+	void *buf = NULL;
+	bool hedged = false;
+	int i, ret, pollret, nr_sent = 0, repeat = MAX_RETRY_COUNT;
+	int timeout = DIV_ROUND_UP(node_load_hedge_delay(&first->nid),
+				   1000 * 1000);
+
+	ret = hedged_read_send(req, &hr[0], first, req->data);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	nr_sent = 1;
+again:
+	for (i = 0; i < nr_sent; i++) {
+		pfds[i].fd = hr[i].sfd->fd;
+		pfds[i].events = POLLIN;
+	}
+	pollret = poll(pfds, nr_sent, timeout);
+	if (pollret < 0) {
+		if (errno == EINTR)
+			goto again;
+
+		panic("%m");
+	} else if (pollret == 0) {
+		timeout = 1000 * POLL_TIMEOUT;
+		if (!hedged && *nr > 0) {
+			hedged = true;
+			i = node_load_pick(nodes, *nr);
+			buf = xmalloc(req->rq.data_length);
+			if (hedged_read_send(req, &hr[nr_sent], nodes[i],
+					     buf) == SD_RES_SUCCESS)
+				nr_sent++;
+			nodes[i] = nodes[--(*nr)];
+			goto again;
+		}
+		if (sheep_need_retry(req->rq.epoch) && repeat) {
+			repeat--;
+			sd_warn("poll timeout, disks of some nodes or network "
+				"is busy. Going to poll-wait again");
+			goto again;
+		}
+
+		for (i = 0; i < nr_sent; i++) {
+			sockfd_cache_del(&hr[i].node->nid, hr[i].sfd);
+			node_load_end(&hr[i].node->nid, hr[i].sent, false,
+				      true);
+			slowlog_forward_done(req, hr[i].node, hr[i].sent);
+		}
+		ret = SD_RES_NETWORK_ERROR;
+		goto out;
+	}
+
+	for (i = 0; i < nr_sent; i++)
+		if (pfds[i].revents)
+			break;
+
+	ret = hedged_read_recv(req, &hr[i], &rsp);
+	if (ret == SD_RES_SUCCESS) {
+		if (hr[i].buf != req->data)
+			memcpy(req->data, hr[i].buf, rsp.data_length);
+		memcpy(&req->rp, &rsp, sizeof(rsp));
+	}
+	hr[i] = hr[--nr_sent];
+
+	if (ret == SD_RES_SUCCESS) {
+		if (nr_sent)
+			hedged_read_cancel(req, &hr[0]);
+	} else if (nr_sent)
+		goto again;
+out:
+	free(buf);
+	return ret;
+}
+
+static int gateway_read_replica(struct request *req, const struct sd_node *node,
+				const struct sd_node **nodes, int *nr)
+{
+	if (sys->hedged_read && *nr > 0 && node_load_hedge_delay(&node->nid))
+		return gateway_hedged_read(req, node, nodes, nr);
+
+	return replica_read(req, node);
+}
+
+#else	/* HAVE_ACCELIO */
+
+static int gateway_read_replica(struct request *req, const struct sd_node *node,
+				const struct sd_node **nodes, int *nr)
+{
+	return replica_read(req, node);
+}
+
+#endif	/* HAVE_ACCELIO */
+
 /*
  * Try our best to read one copy and read local first.
  *
@@ -279,52 +481,46 @@ out:
 static int gateway_replication_read(struct request *req)
 {
 	int i, ret = SD_RES_SUCCESS;
-	struct sd_req fwd_hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
 	const struct sd_vnode *v;
 	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	const struct sd_node *nodes[SD_MAX_COPIES], *node;
 	uint64_t oid = req->rq.obj.oid;
-	int nr_copies, j;
+	int nr_copies, nr = 0;
+	bool local_tried = false;
 
 	nr_copies = get_req_copy_number(req);
+	req->nr_fwd = 0;
 
 	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
-		if (!vnode_is_local(v))
+		if (!vnode_is_local(v)) {
+			nodes[nr++] = v->node;
 			continue;
+		}
+		if (local_tried)
+			continue;
+		local_tried = true;
 		ret = peer_read_obj(req);
 		if (ret == SD_RES_SUCCESS)
 			goto out;
 
 		sd_err("local read %016"PRIx64" failed, %s", oid,
 		       sd_strerror(ret));
-		break;
 	}
 
 	/*
-	 * Read random copy from cluster for better load balance, useful for
-	 * reading base VM's COW objects
+	 * Read the copy which is expected to respond first, which balances the
+	 * load of the nodes too, e.g. for reading base VM's COW objects.
 	 */
-	j = random();
-	for (i = 0; i < nr_copies; i++) {
-		int idx = (i + j) % nr_copies;
-
-		v = obj_vnodes[idx];
-		if (vnode_is_local(v))
-			continue;
-		/*
-		 * We need to re-init it because rsp and req share the same
-		 * structure.
-		 */
-		gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
-		ret = sheep_exec_req(&v->node->nid, &fwd_hdr, req->data);
-		if (ret != SD_RES_SUCCESS)
-			continue;
+	while (nr > 0) {
+		i = node_load_pick(nodes, nr);
+		node = nodes[i];
+		nodes[i] = nodes[--nr];
 
-		/* Read success */
-		memcpy(&req->rp, rsp, sizeof(*rsp));
-		break;
+		ret = gateway_read_replica(req, node, nodes, &nr);
+		if (ret == SD_RES_SUCCESS)
+			break;
 	}
 out:
 	return ret;
@@ -337,6 +533,9 @@ struct forward_info_entry {
 	const struct node_id *nid;
 	struct sockfd *sfd;
 	void *buf;
+	const struct sd_node *node;	/* NULL if not logged to slowlog */
+	uint64_t sent;
+	int *result;			/* result of the node, if not NULL */
 };
 
 struct forward_info {
@@ -352,14 +551,36 @@ static inline void forward_info_update(struct forward_info *fi, int pos)
 		sizeof(struct forward_info_entry) * (fi->nr_sent - pos));
 }
 
-static inline void finish_one_entry(struct forward_info *fi, int i)
+static inline void forward_info_stamp(struct forward_info *fi, int i,
+				      struct request *req, bool failed)
 {
+	if (!fi->ent[i].node)
+		return;
+
+	node_load_end(fi->ent[i].nid, fi->ent[i].sent, false, failed);
+	slowlog_forward_done(req, fi->ent[i].node, fi->ent[i].sent);
+}
+
+static inline void forward_info_result(struct forward_info *fi, int i,
+				       int result)
+{
+	if (fi->ent[i].result)
+		*fi->ent[i].result = result;
+}
+
+static inline void finish_one_entry(struct forward_info *fi, int i,
+				    struct request *req)
+{
+	forward_info_stamp(fi, i, req, false);
 	sockfd_cache_put(fi->ent[i].nid, fi->ent[i].sfd);
 	forward_info_update(fi, i);
 }
 
-static inline void finish_one_entry_err(struct forward_info *fi, int i)
+static inline void finish_one_entry_err(struct forward_info *fi, int i,
+					struct request *req)
 {
+	forward_info_stamp(fi, i, req, true);
+	forward_info_result(fi, i, SD_RES_NETWORK_ERROR);
 	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
 	forward_info_update(fi, i);
 }
@@ -425,8 +646,11 @@ again:
 
 		nr_sent = fi->nr_sent;
 		/* XXX Blindly close all the connections */
-		for (i = 0; i < nr_sent; i++)
+		for (i = 0; i < nr_sent; i++) {
+			forward_info_stamp(fi, i, req, true);
+			forward_info_result(fi, i, SD_RES_NETWORK_ERROR);
 			sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
+		}
 
 		return SD_RES_NETWORK_ERROR;
 	}
@@ -440,14 +664,14 @@ again:
 		sd_debug("%d, revents %x", i, re);
 		if (re & (POLLERR | POLLHUP | POLLNVAL)) {
 			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_entry_err(fi, i);
+			finish_one_entry_err(fi, i, req);
 			goto out;
 		}
 		if (do_read(pi.pfds[i].fd, rsp, sizeof(*rsp), sheep_need_retry,
 			    req->rq.epoch, MAX_RETRY_COUNT)) {
 			sd_err("remote node might have gone away");
 			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_entry_err(fi, i);
+			finish_one_entry_err(fi, i, req);
 			goto out;
 		}
 
@@ -460,7 +684,7 @@ again:
 				    MAX_RETRY_COUNT)) {
 				sd_err("remote node might have gone away");
 				err_ret = SD_RES_NETWORK_ERROR;
-				finish_one_entry_err(fi, i);
+				finish_one_entry_err(fi, i, req);
 				goto out;
 			}
 		}
@@ -470,7 +694,8 @@ again:
 			       sd_strerror(ret));
 			err_ret = ret;
 		}
-		finish_one_entry(fi, i);
+		forward_info_result(fi, i, ret);
+		finish_one_entry(fi, i, req);
 	}
 out:
 	if (fi->nr_sent > 0)
@@ -489,18 +714,135 @@ static inline void forward_info_init(struct forward_info *fi, size_t nr_to_send)
 
 static inline void
 forward_info_advance(struct forward_info *fi, const struct node_id *nid,
-		     struct sockfd *sfd, void *buf)
+		     struct sockfd *sfd, void *buf, const struct sd_node *node,
+		     uint64_t sent)
 {
 	fi->ent[fi->nr_sent].nid = nid;
 	fi->ent[fi->nr_sent].pfd.fd = sfd->fd;
 	fi->ent[fi->nr_sent].pfd.events = POLLIN;
 	fi->ent[fi->nr_sent].sfd = sfd;
 	fi->ent[fi->nr_sent].buf = buf;
+	fi->ent[fi->nr_sent].node = node;
+	fi->ent[fi->nr_sent].sent = sent;
+	fi->ent[fi->nr_sent].result = NULL;
 	fi->nr_sent++;
 }
 
 #endif	/* HAVE_ACCELIO */
 
+/*
+ * Nodes which were sent writes of a vdi since its last flush.  They are
+ * tracked only in write-back mode so that a flush reaches just the replicas
+ * which hold dirty objects of the vdi.
+ *
+ * Every distinct set of nodes a write was sent to is kept too, as indexes
+ * into 'nids'.  A flush succeeds only if at least one node of each set synced
+ * its disks, i.e. every dirty object has a durable replica.
+ */
+struct flush_set {
+	struct rb_node rb;
+	int nr;
+	uint16_t idx[SD_MAX_COPIES];
+};
+
+struct flush_vdi {
+	struct rb_node rb;
+	uint32_t vid;
+	int nr_nids, end;
+	struct node_id *nids;
+	struct rb_root sets;
+};
+
+static struct rb_root flush_vdi_root = RB_ROOT;
+static struct sd_mutex flush_vdi_lock = SD_MUTEX_INITIALIZER;
+
+static int flush_vdi_cmp(const struct flush_vdi *a, const struct flush_vdi *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int flush_set_cmp(const struct flush_set *a, const struct flush_set *b)
+{
+	int ret = intcmp(a->nr, b->nr);
+
+	if (ret)
+		return ret;
+	return memcmp(a->idx, b->idx, sizeof(a->idx[0]) * a->nr);
+}
+
+static int flush_vdi_nid_idx(struct flush_vdi *fv, const struct node_id *nid)
+{
+	int i;
+
+	for (i = 0; i < fv->nr_nids; i++)
+		if (!node_id_cmp(&fv->nids[i], nid))
+			return i;
+
+	if (fv->nr_nids >= fv->end) {
+		fv->end = fv->end ? fv->end * 2 : SD_MAX_COPIES;
+		fv->nids = xrealloc(fv->nids, sizeof(*fv->nids) * fv->end);
+	}
+	fv->nids[fv->nr_nids] = *nid;
+	return fv->nr_nids++;
+}
+
+static void flush_vdi_add_nids(uint32_t vid, const struct node_id **nids,
+			       int nr)
+{
+	struct flush_vdi key = { .vid = vid }, *fv;
+	struct flush_set set = { .nr = nr }, *fs;
+	int i;
+
+	sd_mutex_lock(&flush_vdi_lock);
+	fv = rb_search(&flush_vdi_root, &key, rb, flush_vdi_cmp);
+	if (!fv) {
+		fv = xzalloc(sizeof(*fv));
+		fv->vid = vid;
+		INIT_RB_ROOT(&fv->sets);
+		rb_insert(&flush_vdi_root, fv, rb, flush_vdi_cmp);
+	}
+
+	for (i = 0; i < nr; i++)
+		set.idx[i] = flush_vdi_nid_idx(fv, nids[i]);
+
+	if (!rb_search(&fv->sets, &set, rb, flush_set_cmp)) {
+		fs = xmalloc(sizeof(*fs));
+		*fs = set;
+		rb_insert(&fv->sets, fs, rb, flush_set_cmp);
+	}
+	sd_mutex_unlock(&flush_vdi_lock);
+}
+
+static void flush_vdi_add(uint32_t vid, const struct sd_node **nodes, int nr)
+{
+	const struct node_id *nids[SD_MAX_COPIES];
+	int i;
+
+	for (i = 0; i < nr; i++)
+		nids[i] = &nodes[i]->nid;
+	flush_vdi_add_nids(vid, nids, nr);
+}
+
+static struct flush_vdi *flush_vdi_detach(uint32_t vid)
+{
+	struct flush_vdi key = { .vid = vid }, *fv;
+
+	sd_mutex_lock(&flush_vdi_lock);
+	fv = rb_search(&flush_vdi_root, &key, rb, flush_vdi_cmp);
+	if (fv)
+		rb_erase(&fv->rb, &flush_vdi_root);
+	sd_mutex_unlock(&flush_vdi_lock);
+
+	return fv;
+}
+
+static void flush_vdi_free(struct flush_vdi *fv)
+{
+	rb_destroy(&fv->sets, struct flush_set, rb);
+	free(fv->nids);
+	free(fv);
+}
+
 static int gateway_forward_request(struct request *req)
 {
 	int i, err_ret = SD_RES_SUCCESS;
@@ -515,8 +857,9 @@ static int gateway_forward_request(struct request *req)
 	struct xio_forward_info xio_fi;
 #else
 	unsigned wlen;
-	int ret;
+	int ret, local = -1;
 	struct forward_info fi;
+	struct sd_req local_hdr;
 #endif
 
 	sd_debug("%016"PRIx64, oid);
@@ -552,11 +895,31 @@ static int gateway_forward_request(struct request *req)
 		nr_to_send = ds;
 	}
 
+	if (is_writeback_obj(oid) &&
+	    (req->rq.opcode == SD_OP_WRITE_OBJ ||
+	     req->rq.opcode == SD_OP_CREATE_AND_WRITE_OBJ))
+		flush_vdi_add(oid_to_vid(oid), target_nodes, nr_to_send);
+
 #ifndef HAVE_ACCELIO
 
+	req->nr_fwd = 0;
 	for (i = 0; i < nr_to_send; i++) {
 		struct sockfd *sfd;
 		const struct node_id *nid;
+		uint64_t sent;
+
+		hdr.data_length = reqs[i].dlen;
+		wlen = reqs[i].wlen;
+		hdr.obj.offset = reqs[i].off;
+		hdr.obj.ec_index = i;
+		hdr.obj.copy_policy = req->rq.obj.copy_policy;
+
+		/* The local copy is done below while the others are sent */
+		if (node_is_local(target_nodes[i])) {
+			local_hdr = hdr;
+			local = i;
+			continue;
+		}
 
 		nid = &target_nodes[i]->nid;
 		sfd = sockfd_cache_get(nid);
@@ -565,21 +928,33 @@ static int gateway_forward_request(struct request *req)
 			break;
 		}
 
-		hdr.data_length = reqs[i].dlen;
-		wlen = reqs[i].wlen;
-		hdr.obj.offset = reqs[i].off;
-		hdr.obj.ec_index = i;
-		hdr.obj.copy_policy = req->rq.obj.copy_policy;
+		sent = clock_get_time();
+		node_load_begin(nid);
 		ret = send_req(sfd->fd, &hdr, reqs[i].buf, wlen,
 			       sheep_need_retry, req->rq.epoch,
 			       MAX_RETRY_COUNT);
 		if (ret) {
+			node_load_end(nid, sent, false, true);
 			sockfd_cache_del_node(nid);
 			err_ret = SD_RES_NETWORK_ERROR;
 			sd_debug("fail %d", ret);
 			break;
 		}
-		forward_info_advance(&fi, nid, sfd, reqs[i].buf);
+		forward_info_advance(&fi, nid, sfd, reqs[i].buf,
+				     target_nodes[i], sent);
+	}
+
+	if (local >= 0) {
+		uint64_t sent = clock_get_time();
+
+		ret = exec_local_peer_req(req, &local_hdr, reqs[local].buf);
+		slowlog_forward_done(req, target_nodes[local], sent);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("local %s %016"PRIx64" failed, %s",
+			       op_name(get_sd_op(local_hdr.opcode)), oid,
+			       sd_strerror(ret));
+			err_ret = ret;
+		}
 	}
 
 	sd_debug("nr_sent %d, err %x", fi.nr_sent, err_ret);
@@ -647,6 +1022,107 @@ out:
 	return err_ret;
 }
 
+/*
+ * Put back the sets of 'fv' which no node acknowledged, so that the next flush
+ * of the vdi retries them.
+ */
+static int flush_vdi_check(struct flush_vdi *fv, const int *results)
+{
+	const struct node_id *nids[SD_MAX_COPIES];
+	struct flush_set *fs;
+	int i, err_ret = SD_RES_SUCCESS;
+
+	rb_for_each_entry(fs, &fv->sets, rb) {
+		for (i = 0; i < fs->nr; i++)
+			if (results[fs->idx[i]] == SD_RES_SUCCESS)
+				break;
+		if (i < fs->nr)
+			continue;
+
+		for (i = 0; i < fs->nr; i++)
+			nids[i] = &fv->nids[fs->idx[i]];
+		flush_vdi_add_nids(fv->vid, nids, fs->nr);
+		if (err_ret == SD_RES_SUCCESS)
+			err_ret = results[fs->idx[0]];
+	}
+
+	return err_ret;
+}
+
+/*
+ * Flush a vdi in write-back mode: every replica which has been sent writes of
+ * the vdi since its last flush syncs the disks holding them.
+ *
+ * A replica which can't be reached is recovered from the others, so the flush
+ * succeeds as long as each dirty object has at least one replica synced.
+ */
+int gateway_flush_vdi(struct request *req)
+{
+	uint32_t vid = oid_to_vid(req->rq.obj.oid);
+	struct flush_vdi *fv = flush_vdi_detach(vid);
+	struct sd_req hdr;
+	int i, ret, *results;
+#ifndef HAVE_ACCELIO
+	struct forward_info fi;
+#endif
+
+	if (!fv)
+		return SD_RES_SUCCESS;
+
+	sd_debug("flush %"PRIx32" on %d nodes", vid, fv->nr_nids);
+
+	results = xmalloc(sizeof(*results) * fv->nr_nids);
+	for (i = 0; i < fv->nr_nids; i++)
+		results[i] = SD_RES_NETWORK_ERROR;
+
+#ifndef HAVE_ACCELIO
+	sd_init_req(&hdr, SD_OP_FLUSH_PEER);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.epoch = req->rq.epoch;
+	hdr.data_length = sizeof(vid);
+
+	forward_info_init(&fi, fv->nr_nids);
+	for (i = 0; i < fv->nr_nids; i++) {
+		const struct node_id *nid = &fv->nids[i];
+		struct sockfd *sfd;
+
+		sfd = sockfd_cache_get(nid);
+		if (!sfd)
+			continue;
+
+		ret = send_req(sfd->fd, &hdr, &vid, sizeof(vid),
+			       sheep_need_retry, req->rq.epoch,
+			       MAX_RETRY_COUNT);
+		if (ret) {
+			sockfd_cache_del_node(nid);
+			continue;
+		}
+		forward_info_advance(&fi, nid, sfd, &vid, NULL, 0);
+		fi.ent[fi.nr_sent - 1].result = &results[i];
+	}
+
+	if (fi.nr_sent > 0)
+		wait_forward_request(&fi, req);
+#else
+	for (i = 0; i < fv->nr_nids; i++) {
+		sd_init_req(&hdr, SD_OP_FLUSH_PEER);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.epoch = req->rq.epoch;
+		hdr.data_length = sizeof(vid);
+
+		results[i] = sheep_exec_req(&fv->nids[i], &hdr, &vid);
+	}
+#endif
+
+	ret = flush_vdi_check(fv, results);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to flush %"PRIx32", %s", vid, sd_strerror(ret));
+
+	free(results);
+	flush_vdi_free(fv);
+	return ret;
+}
+
 static int prepare_obj_refcnt(const struct sd_req *hdr, uint32_t *vids,
 			      struct generation_reference *refs)
 {
@@ -907,6 +1383,18 @@ static int gateway_handle_cow(struct request *req)
 	char *buf;
 	int ret;
 
+	/*
+	 * The replicas create the object from the parent object themselves,
+	 * so only the written data is sent to them.  See peer_cow_write_obj().
+	 * The strips of erasure coded objects are encoded from the whole
+	 * object here.
+	 */
+	if (!is_erasure_oid(oid)) {
+		if (req_hdr->data_length == len)
+			req_hdr->flags &= ~SD_FLAG_CMD_COW;
+		return gateway_forward_request(req);
+	}
+
 	buf = valloc(len);
 	if(unlikely(!buf)) {
 		ret = SD_RES_NO_MEM;
@@ -557,6 +557,7 @@ int kv_create_bucket(const char *account, const char *bucket)
 	}
 
 	sys->cdrv->lock(account_vid);
+	sd_inode_cache_hold(account_vid);
 	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
 	ret = sd_lookup_vdi(vdi_name, &vid);
 	if (ret == SD_RES_SUCCESS) {
@@ -569,6 +570,7 @@ int kv_create_bucket(const char *account, const char *bucket)
 
 	ret = bucket_create(account, account_vid, bucket);
 out:
+	sd_inode_cache_release(account_vid);
 	sys->cdrv->unlock(account_vid);
 	return ret;
 }
@@ -618,6 +620,7 @@ int kv_delete_bucket(const char *account, const char *bucket)
 	}
 
 	sys->cdrv->lock(account_vid);
+	sd_inode_cache_hold(account_vid);
 	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
 
 	ret = sd_lookup_vdi(vdi_name, &vid);
@@ -625,6 +628,7 @@ int kv_delete_bucket(const char *account, const char *bucket)
 		goto out;
 	ret = bucket_delete(account, account_vid, bucket);
 out:
+	sd_inode_cache_release(account_vid);
 	sys->cdrv->unlock(account_vid);
 	return ret;
 }
@@ -734,18 +738,14 @@ static int onode_allocate_extents(struct kv_onode *onode,
 			onode->o_extent[idx - 1].data_len += reserv_len;
 	}
 	count = DIV_ROUND_UP((req->data_length - reserv_len), SD_DATA_OBJ_SIZE);
-	sys->cdrv->lock(data_vid);
 	ret = oalloc_new_prepare(data_vid, &start, count);
-	sys->cdrv->unlock(data_vid);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("oalloc_new_prepare failed for %s, %s", onode->name,
 		       sd_strerror(ret));
 		goto out;
 	}
 
-	sys->cdrv->lock(data_vid);
 	ret = oalloc_new_finish(data_vid, start, count);
-	sys->cdrv->unlock(data_vid);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("oalloc_new_finish failed for %s, %s", onode->name,
 		       sd_strerror(ret));
@@ -1039,7 +1039,6 @@ static int onode_free_data(struct kv_onode *onode)
 
 	/* it don't need to free data for inlined onode */
 	if (!onode->inlined) {
-		sys->cdrv->lock(data_vid);
 		for (i = 0; i < onode->nr_extent; i++) {
 			ret = oalloc_free(data_vid, onode->o_extent[i].start,
 					  onode->o_extent[i].count);
@@ -1050,7 +1049,6 @@ static int onode_free_data(struct kv_onode *onode)
 				       onode->o_extent[i].count,
 				       onode->name);
 		}
-		sys->cdrv->unlock(data_vid);
 	}
 	return ret;
 }
@@ -1161,7 +1159,9 @@ static int onode_lookup(struct kv_onode *onode, uint32_t ovid, const char *name)
 	int ret;
 
 	sys->cdrv->lock(ovid);
+	sd_inode_cache_hold(ovid);
 	ret = onode_lookup_nolock(onode, ovid, name);
+	sd_inode_cache_release(ovid);
 	sys->cdrv->unlock(ovid);
 
 	return ret;
@@ -1264,6 +1264,7 @@ static int onode_allocate_space(struct http_request *req, const char *account,
 	int ret;
 
 	sys->cdrv->lock(bucket_vid);
+	sd_inode_cache_hold(bucket_vid);
 	ret = onode_lookup_nolock(onode, bucket_vid, name);
 	if (ret == SD_RES_SUCCESS) {
 		/* if the exists onode has not been uploaded complete */
@@ -1307,6 +1308,7 @@ static int onode_allocate_space(struct http_request *req, const char *account,
 	ret = onode_create_and_update_bnode(req, account, bucket_vid, bucket,
 					    data_vid, onode);
 out:
+	sd_inode_cache_release(bucket_vid);
 	sys->cdrv->unlock(bucket_vid);
 	return ret;
 }
@@ -1322,6 +1324,7 @@ static int onode_append_space(struct http_request *req, const char *account,
 	bool object_exists = false;
 
 	sys->cdrv->lock(bucket_vid);
+	sd_inode_cache_hold(bucket_vid);
 	ret = onode_lookup_nolock(onode, bucket_vid, name);
 
 	if (ret == SD_RES_SUCCESS) {
@@ -1367,6 +1370,7 @@ static int onode_append_space(struct http_request *req, const char *account,
 		}
 	}
 out:
+	sd_inode_cache_release(bucket_vid);
 	sys->cdrv->unlock(bucket_vid);
 	return ret;
 }
@@ -1387,6 +1391,7 @@ int kv_complete_object(struct http_request *req, const char *account,
 	onode = xzalloc(sizeof(*onode));
 
 	sys->cdrv->lock(bucket_vid);
+	sd_inode_cache_hold(bucket_vid);
 	ret = onode_lookup_nolock(onode, bucket_vid, object);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("Failed to lookup onode %s (%s)", object,
@@ -1404,6 +1409,7 @@ int kv_complete_object(struct http_request *req, const char *account,
 		goto out;
 	}
 out:
+	sd_inode_cache_release(bucket_vid);
 	sys->cdrv->unlock(bucket_vid);
 	return ret;
 }
@@ -15,23 +15,37 @@
 #include "http.h"
 
 /*
- * Meta Object tracks the free information of data vdi for the object allocation
- * in a free list. Free list is a redundant structure for bitmap for faster
- * allocation.
+ * The data vdi is split into allocation groups so that concurrent allocations
+ * don't serialize on a single meta object. The first object of the vdi is a
+ * super object which describes the layout, followed by one meta object per
+ * group and then the data objects of all the groups:
+ *
+ * +-------+-------+-------+-----+-------+---------+---------+-----+
+ * | super | meta0 | meta1 | ... | metaN | group 0 | group 1 | ... |
+ * +-------+-------+-------+-----+-------+---------+---------+-----+
+ *
+ * Each group has its own meta object which tracks the free information of the
+ * group in a free list and a bitmap. Free list is a redundant structure for
+ * bitmap for faster allocation. The bitmap is always updated first, so the free
+ * list can only be behind it after a crash, and it is rebuilt from the bitmap
+ * when they disagree. Meta objects are created at the first use of the group,
+ * so small buckets only pay for the groups they actually use.
  *
  *            +-------------------------------+
  *            |                               |
  *            |  sorted list               v------v
- * +--------------------------------+-----------------------+     +--------+
- * | Header | fd1 | fd2 | ... | fdN | .... object data .... | <-- | bitmap |
- * +--------------------------------+-----------------------+     +---------
- * |<--           4M             -->|
+ * +--------------------------------+-----------------------+--------+
+ * | Header | fd1 | fd2 | ... | fdN | ..................... | bitmap |
+ * +--------------------------------+-----------------------+--------+
+ * |<--                            4M                            -->|
  *
- * Best-fit algorithm for allocation and merge and sort the free list at
- * deallocation. One simple sorted list is efficient enough for extent based
- * invariable user object.
+ * Best-fit algorithm for allocation, and the freed extent is merged with its
+ * neighbors in place at deallocation. One simple sorted list per group is
+ * efficient enough for extent based invariable user object.
  *
- * XXX: Add allocation group for scalability and solve the meta size limitation
+ * Data vdis created before allocation groups don't have the super object; the
+ * whole vdi is then handled as a single group whose meta object (without
+ * bitmap) is the first object.
  */
 
 struct header {
@@ -44,6 +58,46 @@ struct free_desc {
 	uint64_t count;
 };
 
+struct oalloc_super {
+	uint64_t magic;
+	uint64_t nr_groups;
+	uint64_t group_size;
+	uint64_t data_start;
+};
+
+struct oalloc_group {
+	uint32_t vid;
+	uint64_t meta_idx;  /* index of the meta object */
+	uint64_t start;     /* first object index of the group */
+	uint64_t end;       /* last object index of the group + 1 */
+	uint64_t max_free;  /* max number of free descriptors */
+	bool has_bitmap;
+};
+
+struct oalloc_bitmap {
+	unsigned long *map;
+	uint64_t offset;    /* byte offset of map in the bitmap area */
+	uint64_t len;
+	uint64_t first;     /* first bit of the range in map */
+	uint64_t last;      /* last bit of the range in map + 1 */
+};
+
+#define OALLOC_MAGIC 0x6f616c6c6f637632ULL /* "oallocv2" */
+
+#define OALLOC_GROUP_SHIFT 20
+#define OALLOC_GROUP_SIZE (UINT64_C(1) << OALLOC_GROUP_SHIFT)
+#define OALLOC_NR_GROUPS (MAX_DATA_OBJS >> OALLOC_GROUP_SHIFT)
+
+/*
+ * Concurrent allocations are spread over this many groups. Each allocation
+ * starts at one of the stripes and only spills over to the other groups when
+ * its stripe is full.
+ */
+#define OALLOC_NR_STRIPES 16
+
+#define BITMAP_SIZE (OALLOC_GROUP_SIZE / BITS_PER_BYTE)
+#define BITMAP_OFFSET (SD_DATA_OBJ_SIZE - BITMAP_SIZE)
+
 static inline uint32_t oalloc_meta_length(struct header *hd)
 {
 	return sizeof(struct header) + sizeof(struct free_desc) * hd->nr_free;
@@ -55,108 +109,569 @@ static inline uint32_t oalloc_meta_length(struct header *hd)
 #define MAX_FREE_DESC ((SD_DATA_OBJ_SIZE - sizeof(struct header)) / \
 		       sizeof(struct free_desc))
 
-/*
- * Initialize the data vdi
- *
- * @vid: the vdi where the allocator resides
- */
-int oalloc_init(uint32_t vid)
+#define MAX_GROUP_FREE_DESC ((BITMAP_OFFSET - sizeof(struct header)) / \
+			     sizeof(struct free_desc))
+
+static inline bool is_legacy_layout(const struct oalloc_super *sb)
+{
+	return sb->magic != OALLOC_MAGIC;
+}
+
+static inline uint64_t group_lock_id(const struct oalloc_group *grp)
+{
+	/* The old layout is protected by the vdi-wide lock as before */
+	if (!grp->has_bitmap)
+		return grp->vid;
+	return vid_to_data_oid(grp->vid, grp->meta_idx);
+}
+
+static int oalloc_read_super(uint32_t vid, struct oalloc_super *sb)
+{
+	uint64_t oid = vid_to_data_oid(vid, 0);
+	int ret;
+
+	ret = sd_read_object(oid, (char *)sb, sizeof(*sb), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read super %016" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		return ret;
+	}
+
+	if (is_legacy_layout(sb)) {
+		sb->nr_groups = 1;
+		sb->group_size = MAX_DATA_OBJS - 1;
+		sb->data_start = 1;
+	}
+	return SD_RES_SUCCESS;
+}
+
+static void oalloc_get_group(uint32_t vid, const struct oalloc_super *sb,
+			     uint64_t gid, struct oalloc_group *grp)
+{
+	grp->vid = vid;
+	if (is_legacy_layout(sb)) {
+		grp->meta_idx = 0;
+		grp->start = 1;
+		grp->end = MAX_DATA_OBJS;
+		grp->max_free = MAX_FREE_DESC;
+		grp->has_bitmap = false;
+		return;
+	}
+
+	grp->meta_idx = 1 + gid;
+	grp->start = sb->data_start + gid * sb->group_size;
+	grp->end = min(grp->start + sb->group_size, (uint64_t)MAX_DATA_OBJS);
+	grp->max_free = MAX_GROUP_FREE_DESC;
+	grp->has_bitmap = true;
+}
+
+static uint64_t oalloc_find_gid(const struct oalloc_super *sb, uint64_t idx)
+{
+	if (is_legacy_layout(sb))
+		return 0;
+	return (idx - sb->data_start) / sb->group_size;
+}
+
+static int oalloc_update_inode(uint32_t vid, uint64_t idx)
 {
-	struct strbuf buf = STRBUF_INIT;
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
+	int ret;
+
+	sys->cdrv->lock(vid);
+	sd_inode_cache_hold(vid);
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     sizeof(*inode), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read inode, %" PRIx32", %s", vid,
+		       sd_strerror(ret));
+		goto out;
+	}
+	sd_inode_set_vid(inode, idx, vid);
+	ret = sd_inode_write_vid(inode, idx, vid, vid, 0, false, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update inode, %" PRIx32", %s", vid,
+		       sd_strerror(ret));
+out:
+	sd_inode_cache_release(vid);
+	sys->cdrv->unlock(vid);
+	free(inode);
+	return ret;
+}
+
+/* Create the meta object of the group with a single free extent */
+static int group_create_meta(const struct oalloc_group *grp)
+{
+	struct strbuf buf = STRBUF_INIT;
 	struct header hd = {
 		.nr_free = 1,
 	};
 	struct free_desc fd = {
-		.start = 1, /* Use first object as the meta object */
-		.count = MAX_DATA_OBJS - 1,
+		.start = grp->start,
+		.count = grp->end - grp->start,
 	};
+	uint64_t oid = vid_to_data_oid(grp->vid, grp->meta_idx);
 	int ret;
 
 	strbuf_add(&buf, &hd, sizeof(hd));
 	strbuf_add(&buf, &fd, sizeof(fd));
 
-	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
-			     sizeof(*inode), 0);
+	sd_debug("%016" PRIx64 ", start %" PRIu64 ", end %" PRIu64, oid,
+		 grp->start, grp->end);
+	ret = sd_write_object(oid, buf.buf, buf.len, 0, true);
 	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read inode, %" PRIx32", %s", vid,
+		sd_err("failed to create meta %016" PRIx64 ", %s", oid,
 		       sd_strerror(ret));
 		goto out;
 	}
-	ret = sd_write_object(vid_to_data_oid(vid, 0), buf.buf,
-			      buf.len, 0, true);
+	ret = oalloc_update_inode(grp->vid, grp->meta_idx);
+out:
+	strbuf_release(&buf);
+	return ret;
+}
+
+/*
+ * Read the header and the free list of the group. The returned buffer has a
+ * room for one more free descriptor.
+ *
+ * Caller must hold the group lock.
+ */
+static int group_read_meta(const struct oalloc_group *grp, char **meta)
+{
+	uint64_t oid = vid_to_data_oid(grp->vid, grp->meta_idx);
+	struct header hd;
+	uint32_t len;
+	int ret;
+
+	ret = sd_read_object(oid, (char *)&hd, sizeof(hd), 0);
+	if (ret == SD_RES_NO_OBJ && grp->has_bitmap) {
+		ret = group_create_meta(grp);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		ret = sd_read_object(oid, (char *)&hd, sizeof(hd), 0);
+	}
 	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to create meta object for %" PRIx32", %s", vid,
+		sd_err("failed to read meta %016" PRIx64 ", %s", oid,
 		       sd_strerror(ret));
-		goto out;
+		return ret;
 	}
-	sd_inode_set_vid(inode, 0, vid);
-	ret = sd_inode_write_vid(inode, 0, vid, vid, 0, false, false);
+
+	len = oalloc_meta_length(&hd);
+	*meta = xmalloc(len + sizeof(struct free_desc));
+	ret = sd_read_object(oid, *meta, len, 0);
 	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to update inode, %" PRIx32", %s", vid,
+		sd_err("failed to read meta %016" PRIx64 ", %s", oid,
 		       sd_strerror(ret));
-		goto out;
+		free(*meta);
 	}
-out:
-	strbuf_release(&buf);
-	free(inode);
 	return ret;
 }
 
+static int group_write_meta(const struct oalloc_group *grp, char *meta)
+{
+	uint64_t oid = vid_to_data_oid(grp->vid, grp->meta_idx);
+	struct header *hd = (struct header *)meta;
+	int ret;
+
+	ret = sd_write_object(oid, meta, oalloc_meta_length(hd), 0, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update meta %016" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+	return ret;
+}
+
+/* Read the words of the group bitmap which cover [start, start + count) */
+static int group_read_bitmap(const struct oalloc_group *grp, uint64_t start,
+			     uint64_t count, struct oalloc_bitmap *bm)
+{
+	uint64_t oid = vid_to_data_oid(grp->vid, grp->meta_idx);
+	uint64_t first = start - grp->start, last = first + count;
+	int ret;
+
+	bm->offset = round_down(first, BITS_PER_LONG) / BITS_PER_BYTE;
+	bm->len = round_up(last, BITS_PER_LONG) / BITS_PER_BYTE - bm->offset;
+	bm->first = first - bm->offset * BITS_PER_BYTE;
+	bm->last = last - bm->offset * BITS_PER_BYTE;
+	bm->map = xmalloc(bm->len);
+
+	ret = sd_read_object(oid, (char *)bm->map, bm->len,
+			     BITMAP_OFFSET + bm->offset);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read bitmap %016" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		free(bm->map);
+	}
+	return ret;
+}
+
+static int group_write_bitmap(const struct oalloc_group *grp,
+			      struct oalloc_bitmap *bm)
+{
+	uint64_t oid = vid_to_data_oid(grp->vid, grp->meta_idx);
+	int ret;
+
+	ret = sd_write_object(oid, (char *)bm->map, bm->len,
+			      BITMAP_OFFSET + bm->offset, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update bitmap %016" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+	free(bm->map);
+	return ret;
+}
+
+/* Return the number of bits in the range which are not equal to 'set' */
+static uint64_t bitmap_count_mismatch(struct oalloc_bitmap *bm, bool set)
+{
+	uint64_t nr, mismatch = 0;
+
+	for (nr = bm->first; nr < bm->last; nr++)
+		if (!!test_bit(nr, bm->map) != set)
+			mismatch++;
+	return mismatch;
+}
+
+static void bitmap_fill(struct oalloc_bitmap *bm, bool set)
+{
+	uint64_t nr;
+
+	for (nr = bm->first; nr < bm->last; nr++) {
+		if (set)
+			set_bit(nr, bm->map);
+		else
+			clear_bit(nr, bm->map);
+	}
+}
+
 /*
- * Allocate the objects and update the free list.
+ * Rebuild the free list of the group from its bitmap and write it back. The
+ * returned buffer has a room for one more free descriptor.
  *
- * Callers are expected to call oalloc_new_finish() to update the inode bitmap
- * after filling up the data.
- *
- * @vid: the vdi where the allocator resides
- * @start: start index of the objects to allocate
- * @count: number of the objects to allocate
+ * Caller must hold the group lock.
  */
-int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count)
+static int group_rebuild_meta(const struct oalloc_group *grp, char **meta)
 {
-	char *meta = xvalloc(SD_DATA_OBJ_SIZE);
+	struct oalloc_bitmap bm;
 	struct header *hd;
-	struct free_desc *fd;
-	uint64_t oid = vid_to_data_oid(vid, 0), i;
+	struct free_desc *fds;
+	uint64_t nr, end, lost = 0;
 	int ret;
 
-	ret = sd_read_object(oid, meta, SD_DATA_OBJ_SIZE, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read meta %016" PRIx64 ", %s", oid,
-		       sd_strerror(ret));
-		goto out;
+	ret = group_read_bitmap(grp, grp->start, grp->end - grp->start, &bm);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	*meta = xzalloc(sizeof(*hd) + sizeof(*fds) * (grp->max_free + 1));
+	hd = (struct header *)*meta;
+	fds = HEADER_TO_FREE_DESC(hd);
+
+	/* The free list is sorted by start in descending order */
+	for (nr = bm.last; nr > bm.first;) {
+		if (test_bit(nr - 1, bm.map)) {
+			hd->used++;
+			nr--;
+			continue;
+		}
+
+		end = nr;
+		while (nr > bm.first && !test_bit(nr - 1, bm.map))
+			nr--;
+		if (hd->nr_free == grp->max_free) {
+			/* too fragmented, leak the rest rather than fail */
+			hd->used += end - nr;
+			lost += end - nr;
+			continue;
+		}
+		fds[hd->nr_free].start = grp->start + nr - bm.first;
+		fds[hd->nr_free].count = end - nr;
+		hd->nr_free++;
 	}
+	free(bm.map);
 
-	hd = (struct header *)meta;
-	fd = (struct free_desc *)(meta + oalloc_meta_length(hd)) - 1;
-	sd_debug("used %"PRIu64", nr_free %"PRIu64, hd->used, hd->nr_free);
-	for (i = 0; i < hd->nr_free; i++, fd--) {
+	sd_warn("rebuilt the free list of %" PRIx32 " at %" PRIu64 " from the"
+		" bitmap, used %" PRIu64 ", nr_free %" PRIu64 ", lost %" PRIu64,
+		grp->vid, grp->start, hd->used, hd->nr_free, lost);
+	ret = group_write_meta(grp, *meta);
+	if (ret != SD_RES_SUCCESS)
+		free(*meta);
+	return ret;
+}
+
+/*
+ * Pick the smallest free extent which can hold 'count' objects. The lower
+ * extent wins when sizes are equal, which keeps the group densely packed.
+ */
+static struct free_desc *find_best_fit(struct header *hd, uint64_t count)
+{
+	struct free_desc *fd = HEADER_TO_FREE_DESC(hd), *best = NULL;
+	uint64_t i;
+
+	for (i = 0; i < hd->nr_free; i++, fd++) {
 		sd_debug("start %"PRIu64", count %"PRIu64, fd->start,
 			 fd->count);
-		if (fd->count > count)
-			break;
+		if (fd->count < count)
+			continue;
+		if (!best || fd->count <= best->count)
+			best = fd;
 	}
-	if (i == hd->nr_free) {
+	return best;
+}
+
+/* Allocate 'count' objects from the group. Caller must hold the group lock. */
+static int group_alloc(const struct oalloc_group *grp, uint64_t *start,
+		       uint64_t count)
+{
+	struct oalloc_bitmap bm;
+	struct header *hd;
+	struct free_desc *fd, *tail;
+	bool rebuilt = false;
+	char *meta;
+	int ret;
+
+	ret = group_read_meta(grp, &meta);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+again:
+	hd = (struct header *)meta;
+	sd_debug("meta %" PRIu64 ", used %"PRIu64", nr_free %"PRIu64,
+		 grp->meta_idx, hd->used, hd->nr_free);
+	fd = find_best_fit(hd, count);
+	if (!fd) {
 		ret = SD_RES_NO_SPACE;
 		goto out;
 	}
 
 	*start = fd->start;
+	if (grp->has_bitmap) {
+		ret = group_read_bitmap(grp, *start, count, &bm);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		/* The free list is behind the bitmap after a crash */
+		if (bitmap_count_mismatch(&bm, false)) {
+			free(bm.map);
+			if (rebuilt) {
+				ret = SD_RES_EIO;
+				goto out;
+			}
+			free(meta);
+			ret = group_rebuild_meta(grp, &meta);
+			if (ret != SD_RES_SUCCESS)
+				return ret;
+			rebuilt = true;
+			goto again;
+		}
+		bitmap_fill(&bm, true);
+		ret = group_write_bitmap(grp, &bm);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
 	fd->start += count;
 	fd->count -= count;
 	hd->used += count;
+	if (fd->count == 0) {
+		tail = (struct free_desc *)(meta + oalloc_meta_length(hd));
+		memmove(fd, fd + 1, (tail - fd - 1) * sizeof(*fd));
+		hd->nr_free--;
+	}
 
 	/* Update the meta object */
-	ret = sd_write_object(oid, meta, oalloc_meta_length(hd), 0, false);
-	if (ret != SD_RES_SUCCESS)
-		sd_err("failed to update meta %016"PRIx64 ", %s", oid,
-		       sd_strerror(ret));
+	ret = group_write_meta(grp, meta);
 out:
 	free(meta);
 	return ret;
 }
 
+/*
+ * Insert the freed extent into the free list which is sorted by start in
+ * descending order, merging it with the adjacent extents if possible.
+ */
+static int update_and_merge_free_desc(char *meta, uint64_t start,
+				      uint64_t count,
+				      const struct oalloc_group *grp)
+{
+	struct header *hd = (struct header *)meta;
+	struct free_desc *fds = HEADER_TO_FREE_DESC(hd), *hi, *lo;
+	uint64_t left = 0, right = hd->nr_free, mid, pos;
+
+	/* Find the first extent which starts below 'start' */
+	while (left < right) {
+		mid = (left + right) / 2;
+		if (fds[mid].start < start)
+			right = mid;
+		else
+			left = mid + 1;
+	}
+	pos = left;
+	hi = pos > 0 ? fds + pos - 1 : NULL;
+	lo = pos < hd->nr_free ? fds + pos : NULL;
+
+	if ((hi && start + count > hi->start) ||
+	    (lo && lo->start + lo->count > start)) {
+		sd_emerg("bad free descriptor found at %"PRIx32", start %"
+			 PRIu64", count %"PRIu64, grp->vid, start, count);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	if (hi && start + count == hi->start) {
+		if (lo && lo->start + lo->count == start) {
+			lo->count += count + hi->count;
+			memmove(hi, lo, sizeof(*lo) * (hd->nr_free - pos));
+			hd->nr_free--;
+		} else {
+			hi->start = start;
+			hi->count += count;
+		}
+	} else if (lo && lo->start + lo->count == start) {
+		lo->count += count;
+	} else {
+		if (hd->nr_free >= grp->max_free)
+			return SD_RES_NO_SPACE;
+
+		memmove(fds + pos + 1, fds + pos,
+			sizeof(*fds) * (hd->nr_free - pos));
+		fds[pos].start = start;
+		fds[pos].count = count;
+		hd->nr_free++;
+	}
+
+	hd->used -= count;
+	return SD_RES_SUCCESS;
+}
+
+/* Free the objects of the group. Caller must hold the group lock. */
+static int group_free(const struct oalloc_group *grp, uint64_t start,
+		      uint64_t count)
+{
+	struct oalloc_bitmap bm;
+	char *meta;
+	int ret;
+
+	if (grp->has_bitmap) {
+		ret = group_read_bitmap(grp, start, count, &bm);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		if (bitmap_count_mismatch(&bm, true)) {
+			sd_err("objects to free are not allocated at %" PRIx32
+			       ", start %" PRIu64 ", count %" PRIu64, grp->vid,
+			       start, count);
+			free(bm.map);
+			/*
+			 * This is a double free, or the retry of a free which
+			 * crashed before the free list was updated.  Bring the
+			 * free list in line with the bitmap for the latter.
+			 */
+			ret = group_rebuild_meta(grp, &meta);
+			if (ret == SD_RES_SUCCESS)
+				free(meta);
+			return SD_RES_INVALID_PARMS;
+		}
+		bitmap_fill(&bm, false);
+		ret = group_write_bitmap(grp, &bm);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	ret = group_read_meta(grp, &meta);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	ret = update_and_merge_free_desc(meta, start, count, grp);
+	if (ret == SD_RES_SUCCESS)
+		ret = group_write_meta(grp, meta);
+	else if (ret == SD_RES_INVALID_PARMS && grp->has_bitmap) {
+		/* The free list disagrees with the bitmap, which is freed */
+		free(meta);
+		ret = group_rebuild_meta(grp, &meta);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	sd_debug("used %"PRIu64", nr_free %"PRIu64,
+		 ((struct header *)meta)->used, ((struct header *)meta)->nr_free);
+	free(meta);
+	return ret;
+}
+
+/*
+ * Initialize the data vdi
+ *
+ * @vid: the vdi where the allocator resides
+ */
+int oalloc_init(uint32_t vid)
+{
+	struct oalloc_super sb = {
+		.magic = OALLOC_MAGIC,
+		.nr_groups = OALLOC_NR_GROUPS,
+		.group_size = OALLOC_GROUP_SIZE,
+		.data_start = 1 + OALLOC_NR_GROUPS,
+	};
+	int ret;
+
+	ret = sd_write_object(vid_to_data_oid(vid, 0), (char *)&sb,
+			      sizeof(sb), 0, true);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to create super object for %" PRIx32", %s", vid,
+		       sd_strerror(ret));
+		return ret;
+	}
+
+	return oalloc_update_inode(vid, 0);
+}
+
+static uint64_t oalloc_first_stripe(void)
+{
+	static uint32_t rotor;
+	uint64_t hval = sd_hash(&sys->this_node.nid,
+				sizeof(sys->this_node.nid));
+
+	return (hval + uatomic_add_return(&rotor, 1)) % OALLOC_NR_STRIPES;
+}
+
+/*
+ * Allocate the objects and update the free list.
+ *
+ * Callers are expected to call oalloc_new_finish() to update the inode bitmap
+ * after filling up the data. The allocation group is locked internally, so
+ * concurrent allocations from the same vdi can go to different groups.
+ *
+ * @vid: the vdi where the allocator resides
+ * @start: start index of the objects to allocate
+ * @count: number of the objects to allocate
+ */
+int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count)
+{
+	struct oalloc_super sb;
+	struct oalloc_group grp;
+	uint64_t first, stripe, gid, i;
+	int ret;
+
+	ret = oalloc_read_super(vid, &sb);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (count > sb.group_size) {
+		sd_err("too many objects to allocate, %" PRIu64, count);
+		return SD_RES_NO_SPACE;
+	}
+
+	first = is_legacy_layout(&sb) ? 0 : oalloc_first_stripe();
+	for (i = 0; i < min(sb.nr_groups, (uint64_t)OALLOC_NR_STRIPES); i++) {
+		stripe = (first + i) % OALLOC_NR_STRIPES;
+		for (gid = stripe; gid < sb.nr_groups;
+		     gid += OALLOC_NR_STRIPES) {
+			oalloc_get_group(vid, &sb, gid, &grp);
+			if (grp.end - grp.start < count)
+				continue;
+
+			sys->cdrv->lock(group_lock_id(&grp));
+			ret = group_alloc(&grp, start, count);
+			sys->cdrv->unlock(group_lock_id(&grp));
+			if (ret != SD_RES_NO_SPACE)
+				return ret;
+		}
+	}
+
+	return SD_RES_NO_SPACE;
+}
+
 /*
  * Update the inode map of the vid
  *
@@ -169,6 +684,8 @@ int oalloc_new_finish(uint32_t vid, uint64_t start, uint64_t count)
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
 	int ret;
 
+	sys->cdrv->lock(vid);
+	sd_inode_cache_hold(vid);
 	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
 			     sizeof(*inode), 0);
 	if (ret != SD_RES_SUCCESS) {
@@ -187,67 +704,47 @@ int oalloc_new_finish(uint32_t vid, uint64_t start, uint64_t count)
 		goto out;
 	}
 out:
+	sd_inode_cache_release(vid);
+	sys->cdrv->unlock(vid);
 	free(inode);
 	return ret;
 }
 
-static int free_desc_cmp(struct free_desc *a, struct free_desc *b)
-{
-	return -intcmp(a->start, b->start);
-}
+#define OALLOC_MAX_INFLIGHT_REMOVES 64
 
-static inline int update_and_merge_free_desc(char *meta, uint64_t start,
-					     uint64_t count, uint32_t vid)
+static int oalloc_remove_objects(uint32_t vid, uint64_t start, uint64_t count)
 {
-	struct header *hd = (struct header *)meta;
-	struct free_desc *tail, *fd = HEADER_TO_FREE_DESC(hd);
-	uint64_t i, j;
-
-	/* Try our best to merge it in place, or append it to tail */
-	for (i = 0; i < hd->nr_free; i++) {
-		if (start + count == fd->start) {
-			fd->start = start;
-			fd->count += count;
-			break;
-		} else if(fd->start + fd->count == start) {
-			fd->count +=count;
-			break;
+	struct request_iocb *iocb = NULL;
+	uint64_t i;
+	int ret = SD_RES_SUCCESS, res;
+
+	for (i = 0; i < count; i++) {
+		struct sd_req hdr;
+
+		if (!iocb) {
+			iocb = local_req_init();
+			if (!iocb)
+				return SD_RES_SYSTEM_ERROR;
 		}
-		fd++;
-	}
 
-	if (i == hd->nr_free) {
-		if (hd->nr_free >= MAX_FREE_DESC)
-			return SD_RES_NO_SPACE;
+		sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
+		hdr.obj.oid = vid_to_data_oid(vid, start + i);
+		exec_local_req_async(&hdr, NULL, iocb);
 
-		tail = (struct free_desc *)(meta + oalloc_meta_length(hd));
-		tail->start = start;
-		tail->count = count;
-		hd->nr_free++;
-	}
+		if ((i + 1) % OALLOC_MAX_INFLIGHT_REMOVES && i + 1 < count)
+			continue;
 
-	hd->used -= count;
-	xqsort(HEADER_TO_FREE_DESC(hd), hd->nr_free, free_desc_cmp);
-
-	/* Merge as hard as we can */
-	j = hd->nr_free - 1;
-	tail = (struct free_desc *)(meta + oalloc_meta_length(hd)) - 1;
-	for (i = 0; i < j; i++, tail--) {
-		struct free_desc *front = tail - 1;
-
-		sd_debug("start %"PRIu64", count %"PRIu64, tail->start,
-			 tail->count);
-		if (tail->start + tail->count > front->start)
-			sd_emerg("bad free descriptor found at %"PRIx32, vid);
-		if (tail->start + tail->count == front->start) {
-			front->start = tail->start;
-			front->count += tail->count;
-			memmove(tail, tail + 1, sizeof(*tail) * i);
-			hd->nr_free--;
-		}
+		res = local_req_wait(iocb);
+		iocb = NULL;
+		/*
+		 * return the error code if it does not
+		 * success or can't find obj.
+		 */
+		if (res != SD_RES_SUCCESS && res != SD_RES_NO_OBJ)
+			ret = res;
 	}
 
-	return SD_RES_SUCCESS;
+	return ret;
 }
 
 /*
@@ -261,17 +758,32 @@ static inline int update_and_merge_free_desc(char *meta, uint64_t start,
  */
 int oalloc_free(uint32_t vid, uint64_t start, uint64_t count)
 {
-	char *meta = xvalloc(SD_DATA_OBJ_SIZE);
-	struct header *hd;
-	uint64_t oid = vid_to_data_oid(vid, 0), i;
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
-	int ret;
+	struct oalloc_super sb;
+	struct oalloc_group grp;
+	int ret, err;
+
+	ret = oalloc_read_super(vid, &sb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
 
+	oalloc_get_group(vid, &sb, oalloc_find_gid(&sb, start), &grp);
+	if (start < grp.start || start + count > grp.end) {
+		sd_err("bad extent to free at %" PRIx32 ", start %" PRIu64
+		       ", count %" PRIu64, vid, start, count);
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+
+	sys->cdrv->lock(vid);
+	sd_inode_cache_hold(vid);
 	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
 			     sizeof(*inode), 0);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to read inode, %016" PRIx64 ", %s",
 		       vid_to_vdi_oid(vid), sd_strerror(ret));
+		sd_inode_cache_release(vid);
+		sys->cdrv->unlock(vid);
 		goto out;
 	}
 
@@ -280,49 +792,26 @@ int oalloc_free(uint32_t vid, uint64_t start, uint64_t count)
 	sd_inode_set_vid_range(inode, start, (start + count - 1), 0);
 
 	ret = sd_inode_write(inode, 0, false, false);
+	sd_inode_cache_release(vid);
+	sys->cdrv->unlock(vid);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to update inode, %016" PRIx64", %s",
 		       vid_to_vdi_oid(vid), sd_strerror(ret));
 		goto out;
 	}
 
-	ret = sd_read_object(oid, meta, SD_DATA_OBJ_SIZE, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read meta %016" PRIx64 ", %s", oid,
-		       sd_strerror(ret));
-		goto out;
-	}
-
-	ret = update_and_merge_free_desc(meta, start, count, vid);
+	/* Objects are not reachable from the inode anymore */
+	ret = oalloc_remove_objects(vid, start, count);
 	if (ret != SD_RES_SUCCESS)
-		goto out;
-
-	/* XXX use aio to speed up remove of objects */
-	for (i = 0; i < count; i++) {
-		struct sd_req hdr;
-		int res;
-
-		sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
-		hdr.obj.oid = vid_to_data_oid(vid, start + i);
-		res = exec_local_req(&hdr, NULL);
-		/*
-		 * return the error code if it does not
-		 * success or can't find obj.
-		 */
-		if (res != SD_RES_SUCCESS && res != SD_RES_NO_OBJ)
-			ret = res;
-	}
-
-	hd = (struct header *)meta;
-	ret = sd_write_object(oid, meta, oalloc_meta_length(hd), 0, false);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to update meta %016"PRIx64 ", %s", oid,
+		sd_err("failed to remove objects of %" PRIx32 ", %s", vid,
 		       sd_strerror(ret));
-		goto out;
-	}
-	sd_debug("used %"PRIu64", nr_free %"PRIu64, hd->used, hd->nr_free);
+
+	sys->cdrv->lock(group_lock_id(&grp));
+	err = group_free(&grp, start, count);
+	sys->cdrv->unlock(group_lock_id(&grp));
+	if (ret == SD_RES_SUCCESS)
+		ret = err;
 out:
-	free(meta);
 	free(inode);
 	return ret;
 }
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * I/O scheduler of the local disks
+ *
+ * The store I/O of this node is classed as foreground reads and writes for
+ * the gateways, recovery, and background work like the removal of objects.
+ * Foreground I/O never waits.  The other classes run without limit while a
+ * disk has no foreground I/O, and otherwise share a window of concurrent I/Os
+ * per disk, of which background work can use half.
+ *
+ * The window is adapted to the foreground latency of the disk like the
+ * congestion window of TCP.  Every ADJUST_PERIOD, it is halved if the moving
+ * average of the latency is above sys->io_latency, and grows by one if it is
+ * below and the window is used up.  So recovery runs at full speed on an idle
+ * disk and backs off as soon as it slows down the guests.
+ *
+ * The workers wait for their turn in iosched_begin(), so it must not be
+ * called for I/O which other I/O of lower classes may wait for.
+ */
+
+#include "sheep_priv.h"
+
+/* gain of the moving average of the foreground latency, 1/8 */
+#define FG_LAT_SHIFT	3
+
+#define ADJUST_PERIOD	(100ULL * 1000000)
+
+/* a disk is idle when it has had no foreground I/O for this long */
+#define IDLE_TIME	(100ULL * 1000000)
+
+#define MAX_WINDOW	64
+
+struct iosched_disk {
+	struct rb_node rb;
+	char *path;
+
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	int nr_waiting;
+	int inflight[NR_IO_CLASSES];
+	int window;
+	uint64_t fg_lat;	/* ns */
+	uint64_t last_fg;	/* when foreground I/O was last seen */
+	uint64_t last_adjust;
+};
+
+static struct rb_root iosched_root = RB_ROOT;
+static struct sd_rw_lock iosched_lock = SD_RW_LOCK_INITIALIZER;
+
+static int iosched_disk_cmp(const struct iosched_disk *a,
+			    const struct iosched_disk *b)
+{
+	return strcmp(a->path, b->path);
+}
+
+/* Entries are never freed, so the returned pointer stays valid */
+static struct iosched_disk *get_iosched_disk(const char *path)
+{
+	struct iosched_disk key = { .path = (char *)path }, *d, *old;
+
+	sd_read_lock(&iosched_lock);
+	d = rb_search(&iosched_root, &key, rb, iosched_disk_cmp);
+	sd_rw_unlock(&iosched_lock);
+	if (d)
+		return d;
+
+	d = xzalloc(sizeof(*d));
+	d->path = xstrdup(path);
+	sd_init_mutex(&d->lock);
+	sd_cond_init(&d->cond);
+	d->window = 1;
+	sd_write_lock(&iosched_lock);
+	old = rb_insert(&iosched_root, d, rb, iosched_disk_cmp);
+	sd_rw_unlock(&iosched_lock);
+	if (old) {
+		sd_destroy_cond(&d->cond);
+		sd_destroy_mutex(&d->lock);
+		free(d->path);
+		free(d);
+		d = old;
+	}
+
+	return d;
+}
+
+static inline bool is_foreground(enum io_class class)
+{
+	return class == IO_CLASS_READ || class == IO_CLASS_WRITE;
+}
+
+static inline int nr_foreground(const struct iosched_disk *d)
+{
+	return d->inflight[IO_CLASS_READ] + d->inflight[IO_CLASS_WRITE];
+}
+
+static inline bool disk_is_idle(const struct iosched_disk *d, uint64_t now)
+{
+	return !nr_foreground(d) && now - d->last_fg >= IDLE_TIME;
+}
+
+static bool iosched_admit(const struct iosched_disk *d, enum io_class class,
+			  uint64_t now)
+{
+	int nr_low = d->inflight[IO_CLASS_RECOVERY] +
+		d->inflight[IO_CLASS_BACKGROUND];
+
+	if (disk_is_idle(d, now))
+		return true;
+	if (nr_low >= d->window)
+		return false;
+	if (class == IO_CLASS_BACKGROUND)
+		return d->inflight[IO_CLASS_BACKGROUND] < (d->window + 1) / 2;
+
+	return true;
+}
+
+static void adjust_window(struct iosched_disk *d, uint64_t now)
+{
+	int nr_low = d->inflight[IO_CLASS_RECOVERY] +
+		d->inflight[IO_CLASS_BACKGROUND];
+
+	if (now - d->last_adjust < ADJUST_PERIOD)
+		return;
+	d->last_adjust = now;
+
+	if (d->fg_lat > (uint64_t)sys->io_latency * 1000000) {
+		if (d->window > 1)
+			sd_debug("%s: foreground latency %"PRIu64" us, "
+				 "window %d", d->path, d->fg_lat / 1000,
+				 d->window / 2);
+		d->window = max(d->window / 2, 1);
+	} else if ((d->nr_waiting || nr_low >= d->window) &&
+		   d->window < MAX_WINDOW)
+		d->window++;
+}
+
+/*
+ * Wait until I/O of 'class' can be issued to the disk of 'oid'.  The ticket
+ * has to be passed to iosched_end() when the I/O is done.
+ */
+worker_fn void iosched_begin(struct io_ticket *t, uint64_t oid,
+			     enum io_class class)
+{
+	struct iosched_disk *d;
+	uint64_t now;
+
+	t->disk = NULL;
+	t->class = class;
+	if (!sys->io_latency)
+		return;
+
+	d = get_iosched_disk(md_get_object_dir(oid));
+	sd_mutex_lock(&d->lock);
+	now = clock_get_time();
+	if (is_foreground(class))
+		d->last_fg = now;
+	else {
+		d->nr_waiting++;
+		while (!iosched_admit(d, class, now)) {
+			if (nr_foreground(d))
+				sd_cond_wait(&d->cond, &d->lock);
+			else
+				/* until the disk gets idle */
+				sd_cond_wait_timeout_ms(&d->cond, &d->lock,
+					DIV_ROUND_UP(d->last_fg + IDLE_TIME -
+						     now, 1000000));
+			now = clock_get_time();
+		}
+		d->nr_waiting--;
+	}
+	d->inflight[class]++;
+	sd_mutex_unlock(&d->lock);
+
+	t->disk = d;
+	t->start = now;
+}
+
+worker_fn void iosched_end(struct io_ticket *t)
+{
+	struct iosched_disk *d = t->disk;
+	uint64_t now = clock_get_time();
+	int64_t delta;
+
+	if (!d)
+		return;
+
+	sd_mutex_lock(&d->lock);
+	d->inflight[t->class]--;
+	if (is_foreground(t->class) && now > t->start) {
+		delta = (int64_t)(now - t->start) - (int64_t)d->fg_lat;
+		if (d->fg_lat)
+			d->fg_lat += delta >> FG_LAT_SHIFT;
+		else
+			d->fg_lat = now - t->start;
+		d->last_fg = now;
+		adjust_window(d, now);
+	}
+	if (d->nr_waiting)
+		sd_cond_broadcast(&d->cond);
+	sd_mutex_unlock(&d->lock);
+}
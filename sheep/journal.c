@@ -184,6 +184,8 @@ static int replay_journal_entry(struct journal_descriptor *jd)
 		ret = -1;
 		goto out;
 	}
+	/* the scrubber computes the checksums again */
+	csum_drop(fd);
 out:
 	free(buf);
 	close(fd);
@@ -15,13 +15,157 @@
 
 #define ROOT_IDX (sd_hash("/", 1) % MAX_DATA_OBJS)
 
+/* Bytes of the data embedded in the inode object, i.e. dentries of directories */
+static uint64_t inode_inline_size(const struct inode *inode)
+{
+	if (inode->flags & INODE_FLAG_EXTENT)
+		return 0;
+	return min(inode->size, (uint64_t)INODE_DATA_SIZE);
+}
+
+/*
+ * Inode cache
+ *
+ * The headers and extents of the inodes, and the dentries of directories, are
+ * cached and written through, so getattr, lookup and readdir don't have to
+ * read the inode objects again and again. Entries expire after ICACHE_TTL in
+ * case the file system is modified by the nfs server of another node.
+ */
+#define ICACHE_TTL (3ULL * 1000000000)	/* in nanoseconds */
+#define ICACHE_MAX_BYTES (64 * 1024 * 1024)
+
+struct icache_entry {
+	struct rb_node rb;
+	struct list_node lru;
+	uint64_t ino;
+	uint64_t stamp;	/* when the entry was filled */
+	uint64_t len;	/* bytes of the inode cached */
+	struct inode *inode;
+};
+
+static struct rb_root icache_root = RB_ROOT;
+static LIST_HEAD(icache_lru);
+static uint64_t icache_bytes;
+static struct sd_mutex icache_lock = SD_MUTEX_INITIALIZER;
+
+static int icache_cmp(const struct icache_entry *a,
+		      const struct icache_entry *b)
+{
+	return intcmp(a->ino, b->ino);
+}
+
+static struct icache_entry *icache_search(uint64_t ino)
+{
+	struct icache_entry key = { .ino = ino };
+
+	return rb_search(&icache_root, &key, rb, icache_cmp);
+}
+
+static void icache_remove(struct icache_entry *entry)
+{
+	rb_erase(&entry->rb, &icache_root);
+	list_del(&entry->lru);
+	icache_bytes -= entry->len;
+	free(entry->inode);
+	free(entry);
+}
+
+/*
+ * Copy the cached inode to 'inode'. Only the header and extents are copied
+ * unless 'full' is set, in which case the inline data is required too.
+ */
+static bool icache_get(uint64_t ino, struct inode *inode, bool full)
+{
+	struct icache_entry *entry;
+	bool hit = false;
+
+	sd_mutex_lock(&icache_lock);
+	entry = icache_search(ino);
+	if (!entry)
+		goto out;
+
+	if (clock_get_time() - entry->stamp > ICACHE_TTL) {
+		icache_remove(entry);
+		goto out;
+	}
+
+	if (!full)
+		memcpy(inode, entry->inode, INODE_META_SIZE);
+	else if (entry->len == INODE_META_SIZE +
+		 inode_inline_size(entry->inode))
+		memcpy(inode, entry->inode, entry->len);
+	else
+		goto out;
+
+	list_move_tail(&entry->lru, &icache_lru);
+	hit = true;
+out:
+	sd_mutex_unlock(&icache_lock);
+	return hit;
+}
+
+/*
+ * Update the cache with the first 'len' bytes of 'inode', which have just been
+ * read from or written to the inode object.
+ */
+static void icache_put(const struct inode *inode, uint64_t len)
+{
+	struct icache_entry *entry;
+
+	sd_mutex_lock(&icache_lock);
+	entry = icache_search(inode->ino);
+	if (entry && len <= entry->len) {
+		memcpy(entry->inode, inode, len);
+		if (len >= INODE_META_SIZE) {
+			icache_bytes -= entry->len - len;
+			entry->len = len;
+			entry->stamp = clock_get_time();
+		}
+		list_move_tail(&entry->lru, &icache_lru);
+		goto out;
+	}
+
+	if (entry)
+		icache_remove(entry);
+	else if (len < INODE_META_SIZE)
+		/* Header only, we don't know the extents */
+		goto out;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->ino = inode->ino;
+	entry->stamp = clock_get_time();
+	entry->len = len;
+	entry->inode = xmalloc(len);
+	memcpy(entry->inode, inode, len);
+	rb_insert(&icache_root, entry, rb, icache_cmp);
+	list_add_tail(&entry->lru, &icache_lru);
+	icache_bytes += len;
+
+	while (icache_bytes > ICACHE_MAX_BYTES) {
+		entry = list_first_entry(&icache_lru, struct icache_entry, lru);
+		icache_remove(entry);
+	}
+out:
+	sd_mutex_unlock(&icache_lock);
+}
+
+static void icache_invalidate(uint64_t ino)
+{
+	struct icache_entry *entry;
+
+	sd_mutex_lock(&icache_lock);
+	entry = icache_search(ino);
+	if (entry)
+		icache_remove(entry);
+	sd_mutex_unlock(&icache_lock);
+}
+
 struct inode_data {
 	struct sd_inode *sd_inode;
 	struct inode *inode;
 	const char *name;
 	uint32_t vid;
 	uint32_t idx;
-	bool create;
 };
 
 static struct inode_data *prepare_inode_data(struct inode *inode, uint32_t vid,
@@ -50,18 +194,16 @@ static int inode_do_create(struct inode_data *id)
 	uint32_t idx = id->idx;
 	uint32_t vid = sd_inode->vdi_id;
 	uint64_t oid = vid_to_data_oid(vid, idx);
-	bool create = id->create;
 	int ret;
 
 	inode->ino = oid;
 	ret = sd_write_object(oid, (char *)inode, INODE_META_SIZE + inode->size,
-			      0, create);
+			      0, true);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to create object, %016" PRIx64, oid);
 		goto out;
 	}
-	if (!create)
-		goto out;
+	icache_put(inode, INODE_META_SIZE + inode_inline_size(inode));
 
 	sd_inode_set_vid(sd_inode, idx, vid);
 	ret = sd_inode_write_vid(sd_inode, idx, vid, vid, 0, false, false);
@@ -77,9 +219,8 @@ out:
 static int inode_lookup(struct inode_data *idata)
 {
 	struct sd_inode *sd_inode = idata->sd_inode;
-	uint32_t tmp_vid, idx, vid = idata->vid;
+	uint32_t idx, vid = idata->vid;
 	uint64_t hval, i;
-	bool create = true;
 	const char *name = idata->name;
 	int ret;
 
@@ -94,28 +235,18 @@ static int inode_lookup(struct inode_data *idata)
 	hval = sd_hash(name, strlen(name));
 	for (i = 0; i < MAX_DATA_OBJS; i++) {
 		idx = (hval + i) % MAX_DATA_OBJS;
-		tmp_vid = sd_inode_get_vid(sd_inode, idx);
-		if (tmp_vid) {
-			uint64_t oid = vid_to_data_oid(vid, idx);
-			uint64_t block;
-
-			ret = sd_read_object(oid, (char *)&block, sizeof(block),
-					     0);
-			if (ret != SD_RES_SUCCESS)
-				goto err;
-			if (block == 0) {
-				create = false;
-				goto out;
-			}
-		} else
+		/*
+		 * Allocated slots hold either inodes or file data objects, so
+		 * only unallocated ones can be used for a new inode.
+		 */
+		if (!sd_inode_get_vid(sd_inode, idx))
 			break;
 	}
 	if (i == MAX_DATA_OBJS) {
 		ret = SD_RES_NO_SPACE;
 		goto err;
 	}
-out:
-	idata->create = create;
+
 	idata->idx = idx;
 	return SD_RES_SUCCESS;
 err:
@@ -129,23 +260,46 @@ static inline int inode_create(struct inode *inode, uint32_t vid,
 	int ret;
 
 	sys->cdrv->lock(vid);
+	sd_inode_cache_hold(vid);
 	ret = inode_lookup(id);
 	if (ret == SD_RES_SUCCESS)
 		ret = inode_do_create(id);
 	else
 		sd_err("failed to lookup %s", name);
+	sd_inode_cache_release(vid);
 	sys->cdrv->unlock(vid);
 	finish_inode_data(id);
 	return ret;
 }
 
-static void dentry_add(struct inode *parent, struct dentry *dentry)
+/*
+ * Append the dentry to the directory. Only the new dentry and the header are
+ * written back instead of the whole directory.
+ *
+ * @parent: the directory, read by fs_read_inode_full()
+ */
+static int dentry_append(struct inode *parent, struct dentry *dentry)
 {
-	uint8_t *tail = parent->data + parent->size;
+	uint64_t offset = parent->size;
+	int ret;
+
+	if (offset + sizeof(*dentry) > INODE_DATA_SIZE)
+		return SD_RES_NO_SPACE;
+
+	memcpy(parent->data + offset, dentry, sizeof(*dentry));
+	ret = sd_write_object(parent->ino, (char *)dentry, sizeof(*dentry),
+			      INODE_META_SIZE + offset, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to write %016" PRIx64 " %s", parent->ino,
+		       sd_strerror(ret));
+		return ret;
+	}
 
-	parent->nlink++;
-	memcpy(tail, dentry, sizeof(*dentry));
 	parent->size += sizeof(*dentry);
+	ret = fs_write_inode_hdr(parent);
+	if (ret == SD_RES_SUCCESS)
+		icache_put(parent, INODE_META_SIZE + parent->size);
+	return ret;
 }
 
 int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
@@ -153,10 +307,11 @@ int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
 	uint64_t myino, pino = parent->ino;
 	uint32_t vid = oid_to_vid(pino);
 	struct inode_data *id = prepare_inode_data(inode, vid, name);
-	struct dentry *entry;
+	struct dentry *entry, new = {};
 	int ret;
 
 	sys->cdrv->lock(vid);
+	sd_inode_cache_hold(vid);
 	ret = inode_lookup(id);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to lookup %s", name);
@@ -180,20 +335,18 @@ int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
 
 	if (unlikely(inode == parent))
 		inode->nlink++; /* I'm root */
-	else {
-		struct dentry new = {
-			.ino = myino,
-			.nlen = strlen(name),
-		};
-		pstrcpy(new.name, NFS_MAXNAMLEN, name);
-		dentry_add(parent, &new);
-	}
 
 	ret = inode_do_create(id);
-	if (ret != SD_RES_SUCCESS)
+	if (ret != SD_RES_SUCCESS || inode == parent)
 		goto out;
-	ret = fs_write_inode_full(parent);
+
+	new.ino = myino;
+	new.nlen = strlen(name);
+	pstrcpy(new.name, NFS_MAXNAMLEN, name);
+	parent->nlink++;
+	ret = dentry_append(parent, &new);
 out:
+	sd_inode_cache_release(vid);
 	sys->cdrv->unlock(vid);
 	finish_inode_data(id);
 	return ret;
@@ -220,28 +373,54 @@ uint64_t fs_root_ino(uint32_t vid)
 	return vid_to_data_oid(vid, ROOT_IDX);
 }
 
-static struct inode *inode_read(uint64_t ino, uint64_t size)
+static void wb_apply_attr(struct inode *inode);
+
+static struct inode *inode_read(uint64_t ino, bool full)
 {
-	struct inode *inode = xmalloc(size);
+	struct inode *inode;
+	uint64_t len;
 	long ret;
 
-	ret = sd_read_object(ino, (char *)inode, size, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read %016" PRIx64 " %s", ino, sd_strerror(ret));
-		free(inode);
-		inode = (struct inode *)-ret;
+	inode = xmalloc(full ? sizeof(*inode) : INODE_META_SIZE);
+	if (icache_get(ino, inode, full))
+		goto out;
+
+	ret = sd_read_object(ino, (char *)inode, INODE_META_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+	len = INODE_META_SIZE;
+
+	if (full && inode_inline_size(inode)) {
+		ret = sd_read_object(ino, (char *)inode->data,
+				     inode_inline_size(inode), INODE_META_SIZE);
+		if (ret != SD_RES_SUCCESS)
+			goto err;
+		len += inode_inline_size(inode);
 	}
+	icache_put(inode, len);
+out:
+	wb_apply_attr(inode);
 	return inode;
+err:
+	sd_err("failed to read %016" PRIx64 " %s", ino, sd_strerror(ret));
+	free(inode);
+	return (struct inode *)-ret;
 }
 
 struct inode *fs_read_inode_hdr(uint64_t ino)
 {
-	return inode_read(ino, INODE_HDR_SIZE);
+	return inode_read(ino, false);
 }
 
+struct inode *fs_read_inode_meta(uint64_t ino)
+{
+	return inode_read(ino, false);
+}
+
+/* Read the inode with the inline data, i.e. the dentries of a directory */
 struct inode *fs_read_inode_full(uint64_t ino)
 {
-	return inode_read(ino, sizeof(struct inode));
+	return inode_read(ino, true);
 }
 
 static int inode_write(struct inode *inode, uint64_t size)
@@ -250,8 +429,11 @@ static int inode_write(struct inode *inode, uint64_t size)
 	int ret;
 
 	ret = sd_write_object(oid, (char *)inode, size, 0, 0);
-	if (ret != SD_RES_SUCCESS)
+	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to write %016" PRIx64" %s", oid, sd_strerror(ret));
+		icache_invalidate(oid);
+	} else
+		icache_put(inode, size);
 
 	return ret;
 }
@@ -261,9 +443,14 @@ int fs_write_inode_hdr(struct inode *inode)
 	return inode_write(inode, INODE_HDR_SIZE);
 }
 
+int fs_write_inode_meta(struct inode *inode)
+{
+	return inode_write(inode, INODE_META_SIZE);
+}
+
 int fs_write_inode_full(struct inode *inode)
 {
-	return inode_write(inode, sizeof(*inode));
+	return inode_write(inode, INODE_META_SIZE + inode_inline_size(inode));
 }
 
 int fs_read_dir(struct inode *inode, uint64_t offset,
@@ -318,6 +505,7 @@ int fs_create_file(uint64_t pino, struct inode *new, const char *name)
 	struct dentry *dentry;
 	int ret;
 
+	new->flags |= INODE_FLAG_EXTENT;
 	ret = inode_create(new, vid, name);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
@@ -326,22 +514,573 @@ int fs_create_file(uint64_t pino, struct inode *new, const char *name)
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
-	dentry = (struct dentry *)(inode->data + inode->size);
-	pstrcpy(dentry->name, NFS_MAXNAMLEN, name);
+	dentry = xzalloc(sizeof(*dentry));
 	dentry->ino = new->ino;
-	inode->size += sizeof(*dentry);
+	dentry->nlen = strlen(name);
+	pstrcpy(dentry->name, NFS_MAXNAMLEN, name);
+
+	ret = dentry_append(inode, dentry);
+	free(dentry);
+	free(inode);
+	return ret;
+}
+
+/*
+ * Number of data objects mapped ahead of the write position, at most. Mapping
+ * only marks the indexes in the vdi, objects are created at the first write.
+ */
+#define EXTENT_PREALLOC_MAX 16
+
+static uint64_t extent_nr_mapped(struct inode *inode)
+{
+	uint64_t nr = 0;
+
+	for (int i = 0; i < inode->extent_count; i++)
+		nr += inode->extent[i].count;
+	return nr;
+}
+
+/* Return the number of unallocated indexes from 'idx', up to 'max' */
+static uint64_t free_run(struct sd_inode *sd_inode, uint64_t idx,
+			 uint64_t max)
+{
+	uint64_t run = 0;
+
+	while (run < max && idx + run < MAX_DATA_OBJS &&
+	       !sd_inode_get_vid(sd_inode, idx + run))
+		run++;
+	return run;
+}
+
+/*
+ * Map 'nr' more data objects at the end of the file. The last extent is grown
+ * in place if the following indexes are free, otherwise a new extent is
+ * started at an index derived from the inode number.
+ */
+static int extent_map(struct inode *inode, uint64_t nr)
+{
+	struct sd_inode *sd_inode = xmalloc(sizeof(*sd_inode));
+	uint32_t vid = oid_to_vid(inode->ino);
+	uint64_t idx, run, hval, mapped = 0, i;
+	struct extent *ext;
+	int ret;
+
+	sys->cdrv->lock(vid);
+	sd_inode_cache_hold(vid);
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)sd_inode,
+			     sizeof(*sd_inode), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read %" PRIx32 " %s", vid,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	if (inode->extent_count) {
+		ext = inode->extent + inode->extent_count - 1;
+		idx = ext->start + ext->count;
+		run = free_run(sd_inode, idx, nr);
+		if (run) {
+			sd_inode_set_vid_range(sd_inode, idx, idx + run - 1,
+					       vid);
+			ext->count += run;
+			mapped += run;
+		}
+	}
+
+	hval = sd_hash(&inode->ino, sizeof(inode->ino));
+	while (mapped < nr) {
+		if (inode->extent_count >= INODE_MAX_EXTENT) {
+			sd_err("too many extents for %016" PRIx64, inode->ino);
+			ret = SD_RES_NO_SPACE;
+			break;
+		}
+
+		hval = sd_hash_next(hval);
+		for (i = 0; i < MAX_DATA_OBJS; i++) {
+			idx = (hval + i) % MAX_DATA_OBJS;
+			run = free_run(sd_inode, idx, nr - mapped);
+			if (run)
+				break;
+		}
+		if (i == MAX_DATA_OBJS) {
+			ret = SD_RES_NO_SPACE;
+			break;
+		}
+
+		sd_inode_set_vid_range(sd_inode, idx, idx + run - 1, vid);
+		ext = inode->extent + inode->extent_count++;
+		ext->start = idx;
+		ext->count = run;
+		mapped += run;
+	}
+
+	sd_debug("%016" PRIx64 " mapped %" PRIu64 ", %" PRIu16 " extents",
+		 inode->ino, mapped, inode->extent_count);
+	if (mapped) {
+		int err = sd_inode_write(sd_inode, 0, false, false);
+
+		if (err != SD_RES_SUCCESS) {
+			sd_err("failed to update sd inode, %016" PRIx64,
+			       vid_to_vdi_oid(vid));
+			ret = err;
+		}
+	}
+out:
+	sd_inode_cache_release(vid);
+	sys->cdrv->unlock(vid);
+	free(sd_inode);
+	return ret;
+}
+
+static int data_object_rw(uint64_t oid, char *buf, uint32_t len,
+			  uint64_t offset, bool is_read)
+{
+	struct sd_req hdr;
+	int ret;
+
+	if (is_read)
+		sd_init_req(&hdr, SD_OP_READ_OBJ);
+	else {
+		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+	}
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+
+	ret = exec_local_req(&hdr, buf);
+	if (ret != SD_RES_NO_OBJ)
+		return ret;
+
+	/* Data objects are created lazily, so holes read as zero */
+	if (is_read) {
+		memset(buf, 0, len);
+		return SD_RES_SUCCESS;
+	}
+
+	sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+
+	return exec_local_req(&hdr, buf);
+}
+
+/* I/O to a data object, issued in parallel with the others of a request */
+struct extent_io {
+	uint64_t oid;
+	char *buf;
+	uint32_t len;
+	uint64_t offset;
+	bool is_read;
+	int result;
+	struct request_iocb *iocb;
+
+	struct work work;
+};
+
+static void extent_io_work(struct work *work)
+{
+	struct extent_io *eio = container_of(work, struct extent_io, work);
+
+	eio->result = data_object_rw(eio->oid, eio->buf, eio->len,
+				     eio->offset, eio->is_read);
+}
+
+static void extent_io_main(struct work *work)
+{
+	struct extent_io *eio = container_of(work, struct extent_io, work);
+
+	if (unlikely(eio->result != SD_RES_SUCCESS)) {
+		sd_err("failed to %s %016" PRIx64 ", %s",
+		       eio->is_read ? "read" : "write", eio->oid,
+		       sd_strerror(eio->result));
+		eio->iocb->result = eio->result;
+	}
+
+	eventfd_xwrite(eio->iocb->efd, 1);
+	free(eio);
+}
+
+static void extent_io_submit(struct request_iocb *iocb, uint64_t oid,
+			     char *buf, uint32_t len, uint64_t offset,
+			     bool is_read)
+{
+	struct extent_io *eio = xzalloc(sizeof(*eio));
+
+	eio->oid = oid;
+	eio->buf = buf;
+	eio->len = len;
+	eio->offset = offset;
+	eio->is_read = is_read;
+	eio->iocb = iocb;
+	eio->work.fn = extent_io_work;
+	eio->work.done = extent_io_main;
+
+	queue_work(sys->areq_wqueue, &eio->work);
+	iocb->count++;
+}
+
+/*
+ * Read or write the file data mapped by the extents. I/O spanning several data
+ * objects is issued to them in parallel.
+ */
+static int extent_rw(struct inode *inode, char *buf, uint64_t count,
+		     uint64_t offset, bool is_read)
+{
+	uint32_t vid = oid_to_vid(inode->ino);
+	uint64_t idx = offset / SD_DATA_OBJ_SIZE, done = 0, len;
+	uint32_t off = offset % SD_DATA_OBJ_SIZE;
+	struct extent *ext = inode->extent;
+	struct extent *end = inode->extent + inode->extent_count;
+	struct request_iocb *iocb = NULL;
+	uint64_t oid;
+	int ret = SD_RES_SUCCESS;
+
+	while (ext < end && idx >= ext->count) {
+		idx -= ext->count;
+		ext++;
+	}
+
+	if (off + count > SD_DATA_OBJ_SIZE)
+		iocb = local_req_init();
+
+	while (done < count) {
+		len = min(count - done, (uint64_t)SD_DATA_OBJ_SIZE - off);
+		if (ext == end) {
+			/* Beyond the mapped range, e.g. after truncate up */
+			if (!is_read)
+				ret = SD_RES_NO_SPACE;
+			else
+				memset(buf + done, 0, count - done);
+			break;
+		}
+
+		oid = vid_to_data_oid(vid, ext->start + idx);
+		if (iocb)
+			extent_io_submit(iocb, oid, buf + done, len, off,
+					 is_read);
+		else {
+			ret = data_object_rw(oid, buf + done, len, off,
+					     is_read);
+			if (ret != SD_RES_SUCCESS) {
+				sd_err("failed to %s %016" PRIx64 ", %s",
+				       is_read ? "read" : "write", oid,
+				       sd_strerror(ret));
+				break;
+			}
+		}
+
+		done += len;
+		off = 0;
+		if (++idx == ext->count) {
+			ext++;
+			idx = 0;
+		}
+	}
+
+	if (iocb) {
+		int err = local_req_wait(iocb);
+
+		if (err != SD_RES_SUCCESS)
+			ret = err;
+	}
+	return ret;
+}
+
+static int extent_write(struct inode *inode, char *buf, uint64_t count,
+			uint64_t offset, bool *meta_dirty)
+{
+	uint64_t need = DIV_ROUND_UP(offset + count, SD_DATA_OBJ_SIZE);
+	uint64_t mapped = extent_nr_mapped(inode), nr;
+	int ret;
+
+	if (need > mapped) {
+		/* Map ahead of sequential writers to keep extents long */
+		nr = min(mapped, (uint64_t)EXTENT_PREALLOC_MAX);
+		nr = max(need - mapped, nr);
+		ret = extent_map(inode, nr);
+		/* Running out of extents only matters for the requested range */
+		if (ret != SD_RES_SUCCESS && extent_nr_mapped(inode) < need)
+			return ret;
+		inode->used = extent_nr_mapped(inode) * SD_DATA_OBJ_SIZE;
+		*meta_dirty = true;
+	}
+
+	return extent_rw(inode, buf, count, offset, false);
+}
+
+/*
+ * Move the data embedded in the inode object of an old file out to extents.
+ * This happens once, when the file grows beyond the embedded area.
+ */
+static int inline_to_extent(struct inode *inode)
+{
+	uint64_t size = min(inode->size, (uint64_t)INODE_DATA_SIZE);
+	char *buf;
+	bool meta_dirty;
+	int ret;
+
+	sd_info("move data of %016" PRIx64 " to extents", inode->ino);
+
+	inode->flags |= INODE_FLAG_EXTENT;
+	inode->extent_count = 0;
+	inode->used = 0;
+	if (!size)
+		return SD_RES_SUCCESS;
+
+	buf = xmalloc(size);
+	ret = sd_read_object(inode->ino, buf, size, INODE_META_SIZE);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = extent_write(inode, buf, size, 0, &meta_dirty);
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Write buffer
+ *
+ * UNSTABLE writes are gathered per file in memory and written back when the
+ * client sends COMMIT, so that many small writes end up in a few large ones to
+ * the data objects. The buffered ranges are sorted by offset and merged when
+ * they overlap or are adjacent. Buffered data is written back anyway when it
+ * grows too large or gets too old. Clients find out about a lost buffer by the
+ * write verifier, which changes when sheep restarts.
+ *
+ * The buffer is only accessed by the nfs thread except for the lookup by
+ * inode_read(), which is protected by wb_lock.
+ */
+#define WB_FILE_MAX_BYTES (32 * 1024 * 1024)
+#define WB_MAX_BYTES (256 * 1024 * 1024)
+#define WB_EXPIRE (5ULL * 1000000000)	/* in nanoseconds */
+
+struct wb_range {
+	struct list_node list;
+	uint64_t offset;
+	uint64_t len;
+	uint64_t alloc;	/* size of buf */
+	char *buf;
+};
+
+struct wb_file {
+	struct rb_node rb;
+	struct list_node list;	/* on wb_files, oldest first */
+	uint64_t ino;
+	uint64_t size;	/* file size including the buffered data */
+	uint64_t mtime;
+	uint64_t dirty;	/* bytes buffered */
+	uint64_t stamp;	/* when the first range was buffered */
+	struct list_head ranges;
+};
+
+static struct rb_root wb_root = RB_ROOT;
+static LIST_HEAD(wb_files);
+static uint64_t wb_bytes;
+static struct sd_mutex wb_lock = SD_MUTEX_INITIALIZER;
+
+static int wb_cmp(const struct wb_file *a, const struct wb_file *b)
+{
+	return intcmp(a->ino, b->ino);
+}
+
+static struct wb_file *wb_lookup(uint64_t ino)
+{
+	struct wb_file key = { .ino = ino }, *wb;
+
+	sd_mutex_lock(&wb_lock);
+	wb = rb_search(&wb_root, &key, rb, wb_cmp);
+	sd_mutex_unlock(&wb_lock);
+	return wb;
+}
+
+/* Show the size and mtime of the buffered writes in the attributes */
+static void wb_apply_attr(struct inode *inode)
+{
+	struct wb_file *wb = wb_lookup(inode->ino);
+
+	if (wb) {
+		inode->size = wb->size;
+		inode->mtime = wb->mtime;
+	}
+}
+
+static struct wb_file *wb_get(struct inode *inode)
+{
+	struct wb_file *wb = wb_lookup(inode->ino);
+
+	if (wb)
+		return wb;
+
+	wb = xzalloc(sizeof(*wb));
+	wb->ino = inode->ino;
+	wb->size = inode->size;
+	wb->mtime = inode->mtime;
+	wb->stamp = clock_get_time();
+	INIT_LIST_HEAD(&wb->ranges);
+
+	sd_mutex_lock(&wb_lock);
+	rb_insert(&wb_root, wb, rb, wb_cmp);
+	list_add_tail(&wb->list, &wb_files);
+	sd_mutex_unlock(&wb_lock);
+	return wb;
+}
+
+static void wb_put(struct wb_file *wb)
+{
+	struct wb_range *r;
+
+	list_for_each_entry(r, &wb->ranges, list) {
+		list_del(&r->list);
+		free(r->buf);
+		free(r);
+	}
+
+	sd_mutex_lock(&wb_lock);
+	rb_erase(&wb->rb, &wb_root);
+	list_del(&wb->list);
+	wb_bytes -= wb->dirty;
+	sd_mutex_unlock(&wb_lock);
+	free(wb);
+}
+
+static void wb_range_free(struct wb_file *wb, struct wb_range *r)
+{
+	list_del(&r->list);
+	wb->dirty -= r->len;
+	wb_bytes -= r->len;
+	free(r->buf);
+	free(r);
+}
+
+/* Buffer [offset, offset + count), merging it with the ranges it touches */
+static void wb_add(struct wb_file *wb, const char *buf, uint64_t count,
+		   uint64_t offset)
+{
+	uint64_t start = offset, end = offset + count;
+	struct wb_range *r, *first = NULL, *next = NULL;
+	struct list_node *pos;
+
+	list_for_each_entry(r, &wb->ranges, list) {
+		if (r->offset + r->len < start)
+			continue;
+		if (r->offset > end) {
+			next = r;
+			break;
+		}
+		if (!first)
+			first = r;
+		start = min(start, r->offset);
+		end = max(end, r->offset + r->len);
+	}
+
+	/* Sequential writes extend the range in front of them */
+	if (first && first->offset == start &&
+	    first->list.next == (next ? &next->list : &wb->ranges.n)) {
+		if (end - start > first->alloc) {
+			first->alloc = max(end - start, first->alloc * 2);
+			first->buf = xrealloc(first->buf, first->alloc);
+		}
+		memcpy(first->buf + offset - start, buf, count);
+		wb->dirty += end - start - first->len;
+		wb_bytes += end - start - first->len;
+		first->len = end - start;
+		return;
+	}
+
+	r = xzalloc(sizeof(*r));
+	r->offset = start;
+	r->len = r->alloc = end - start;
+	r->buf = xmalloc(r->alloc);
+
+	/* Take over the data of the ranges merged into the new one */
+	if (first) {
+		struct wb_range *old;
+
+		list_for_each_entry(old, &wb->ranges, list) {
+			if (old->offset < start)
+				continue;
+			if (old->offset >= end)
+				break;
+			memcpy(r->buf + old->offset - start, old->buf,
+			       old->len);
+			wb_range_free(wb, old);
+		}
+	}
+	memcpy(r->buf + offset - start, buf, count);
+
+	pos = next ? next->list.prev : wb->ranges.n.prev;
+	__list_add(&r->list, pos, pos->next);
+	wb->dirty += r->len;
+	wb_bytes += r->len;
+}
+
+/* Copy the buffered data in [offset, offset + count) over 'buf' */
+static void wb_read(struct wb_file *wb, char *buf, uint64_t count,
+		    uint64_t offset)
+{
+	uint64_t end = offset + count, s, e;
+	struct wb_range *r;
+
+	list_for_each_entry(r, &wb->ranges, list) {
+		if (r->offset >= end)
+			break;
+		s = max(offset, r->offset);
+		e = min(end, r->offset + r->len);
+		if (s < e)
+			memcpy(buf + s - offset, r->buf + s - r->offset, e - s);
+	}
+}
 
-	ret = fs_write_inode_full(inode);
+static int wb_flush(struct wb_file *wb)
+{
+	struct inode *inode;
+	struct wb_range *r;
+	bool meta_dirty = false;
+	int ret;
+
+	sd_debug("%016" PRIx64 ", %" PRIu64 " bytes", wb->ino, wb->dirty);
+
+	inode = fs_read_inode_meta(wb->ino);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	list_for_each_entry(r, &wb->ranges, list) {
+		ret = extent_write(inode, r->buf, r->len, r->offset,
+				   &meta_dirty);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		wb_range_free(wb, r);
+	}
+
+	inode->size = wb->size;
+	inode->mtime = wb->mtime;
+	if (meta_dirty)
+		ret = fs_write_inode_meta(inode);
+	else
+		ret = fs_write_inode_hdr(inode);
+	if (ret == SD_RES_SUCCESS)
+		wb_put(wb);
+out:
 	free(inode);
 	return ret;
 }
 
-/* TODO: support extent */
+
+/*
+ * Read the file data, including the buffered writes
+ *
+ * @inode: the inode of the file, read by fs_read_inode_meta() at least
+ */
 int64_t fs_read(struct inode *inode, void *buffer, uint64_t count,
 		uint64_t offset)
 {
-	uint8_t *start = inode->data + offset;
+	struct wb_file *wb;
 	int64_t done = count;
+	int ret;
 
 	if (offset >= inode->size || count == 0)
 		return 0;
@@ -349,30 +1088,127 @@ int64_t fs_read(struct inode *inode, void *buffer, uint64_t count,
 	if (offset + count > inode->size)
 		done = inode->size - offset;
 
-	memcpy(buffer, start, done);
+	if (inode->flags & INODE_FLAG_EXTENT)
+		ret = extent_rw(inode, buffer, done, offset, true);
+	else
+		ret = sd_read_object(inode->ino, buffer, done,
+				     INODE_META_SIZE + offset);
+	if (ret != SD_RES_SUCCESS)
+		return -1;
+
+	wb = wb_lookup(inode->ino);
+	if (wb)
+		wb_read(wb, buffer, done, offset);
 
 	return done;
 }
 
+/*
+ * Write the file data
+ *
+ * Only the written range of the data objects and the inode header are written
+ * back. The extent area of the inode is written too if new data objects are
+ * mapped.
+ *
+ * @inode: the inode of the file, read by fs_read_inode_meta() at least
+ */
 int64_t fs_write(struct inode *inode, void *buffer, uint64_t count,
 		 uint64_t offset)
 {
-	uint8_t *start = inode->data + offset;
 	int64_t done = count;
+	bool meta_dirty = false;
 	int ret;
 
 	if (count == 0)
 		return 0;
 
-	memcpy(start, buffer, done);
-
 	/* TODO: lock inode */
+	if (!(inode->flags & INODE_FLAG_EXTENT) &&
+	    offset + count > INODE_DATA_SIZE) {
+		ret = inline_to_extent(inode);
+		if (ret != SD_RES_SUCCESS)
+			return -1;
+		meta_dirty = true;
+	}
+
+	if (inode->flags & INODE_FLAG_EXTENT)
+		ret = extent_write(inode, buffer, count, offset, &meta_dirty);
+	else
+		ret = sd_write_object(inode->ino, buffer, count,
+				      INODE_META_SIZE + offset, false);
+	if (ret != SD_RES_SUCCESS)
+		return -1;
+
 	if ((offset + done) > inode->size)
 		inode->size = offset + done;
 
 	inode->mtime = time(NULL);
-	ret = fs_write_inode_full(inode);
+	if (meta_dirty)
+		ret = fs_write_inode_meta(inode);
+	else
+		ret = fs_write_inode_hdr(inode);
 	if (ret != SD_RES_SUCCESS)
 		done = -1;
 	return done;
 }
+
+/*
+ * Buffer the write to the file data until fs_commit()
+ *
+ * @inode: the inode of the file, read by fs_read_inode_meta() at least
+ */
+int64_t fs_write_unstable(struct inode *inode, void *buffer, uint64_t count,
+			  uint64_t offset)
+{
+	struct wb_file *wb;
+	int ret = SD_RES_SUCCESS;
+
+	if (count == 0)
+		return 0;
+
+	/* Files with inline data are rare and small, just write them */
+	if (!(inode->flags & INODE_FLAG_EXTENT))
+		return fs_write(inode, buffer, count, offset);
+
+	wb = wb_get(inode);
+	wb_add(wb, buffer, count, offset);
+	wb->size = max(wb->size, offset + count);
+	wb->mtime = time(NULL);
+	inode->size = wb->size;
+	inode->mtime = wb->mtime;
+
+	if (wb->dirty > WB_FILE_MAX_BYTES)
+		ret = wb_flush(wb);
+
+	while (ret == SD_RES_SUCCESS && wb_bytes > WB_MAX_BYTES) {
+		wb = list_first_entry(&wb_files, struct wb_file, list);
+		ret = wb_flush(wb);
+	}
+
+	return ret == SD_RES_SUCCESS ? count : -1;
+}
+
+/* Write back the buffered data of the file */
+int fs_commit(uint64_t ino)
+{
+	struct wb_file *wb = wb_lookup(ino);
+
+	if (!wb)
+		return SD_RES_SUCCESS;
+
+	return wb_flush(wb);
+}
+
+/* Write back the files buffered for longer than WB_EXPIRE */
+void fs_flush_expired(void)
+{
+	uint64_t now = clock_get_time();
+	struct wb_file *wb;
+
+	list_for_each_entry(wb, &wb_files, list) {
+		if (now - wb->stamp < WB_EXPIRE)
+			break;
+		if (wb_flush(wb) != SD_RES_SUCCESS)
+			break;
+	}
+}
@@ -15,15 +15,27 @@
 
 #include "sheep_priv.h"
 
+/*
+ * Extent of the file data. Data objects of the extents are laid out back to
+ * back in the file, i.e. the first extent maps the file from offset zero, the
+ * second one from the end of the first one, and so on.
+ */
 struct extent {
-	uint64_t start;
-	uint64_t count;
+	uint64_t start;	/* Index of the first data object */
+	uint64_t count;	/* Number of data objects */
 };
 
 #define INODE_HDR_SIZE    SECTOR_SIZE
 #define INODE_EXTENT_SIZE (BLOCK_SIZE * 2)
 #define INODE_META_SIZE (INODE_HDR_SIZE + INODE_EXTENT_SIZE)
 #define INODE_DATA_SIZE (SD_DATA_OBJ_SIZE - INODE_META_SIZE)
+#define INODE_MAX_EXTENT (INODE_EXTENT_SIZE / sizeof(struct extent))
+
+/*
+ * File data is stored in data objects mapped by extent[]. Directories and the
+ * regular files created before extent support keep their data in data[].
+ */
+#define INODE_FLAG_EXTENT 0x0001
 
 struct inode {
 	union {
@@ -39,11 +51,12 @@ struct inode {
 			uint64_t mtime;	/* Modification time */
 			uint64_t ino;   /* Inode number */
 			uint16_t extent_count; /* Number of extents */
+			uint16_t flags;	/* INODE_FLAG_XXX */
 		};
 		uint8_t __pad1[INODE_HDR_SIZE];
 	};
 	union {
-		struct extent extent[0];
+		struct extent extent[INODE_MAX_EXTENT];
 		uint8_t __pad2[INODE_EXTENT_SIZE];
 	};
 	uint8_t data[INODE_DATA_SIZE];
@@ -58,8 +71,10 @@ struct dentry {
 int fs_make_root(uint32_t vid);
 uint64_t fs_root_ino(uint32_t vid);
 struct inode *fs_read_inode_hdr(uint64_t ino);
+struct inode *fs_read_inode_meta(uint64_t ino);
 struct inode *fs_read_inode_full(uint64_t ino);
 int fs_write_inode_hdr(struct inode *inode);
+int fs_write_inode_meta(struct inode *inode);
 int fs_write_inode_full(struct inode *inode);
 int fs_read_dir(struct inode *inode, uint64_t offset,
 		int (*dentry_reader)(struct inode *, struct dentry *, void *),
@@ -68,6 +83,10 @@ struct dentry *fs_lookup_dir(struct inode *inode, const char *name);
 int fs_create_file(uint64_t pino, struct inode *new, const char *name);
 int64_t fs_read(struct inode *inode, void *buffer, uint64_t count, uint64_t);
 int64_t fs_write(struct inode *inode, void *buffer, uint64_t count, uint64_t);
+int64_t fs_write_unstable(struct inode *inode, void *buffer, uint64_t count,
+			  uint64_t);
+int fs_commit(uint64_t ino);
+void fs_flush_expired(void);
 int fs_create_dir(struct inode *inode, const char *name, struct inode *parent);
 
 #endif
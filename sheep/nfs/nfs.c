@@ -14,33 +14,6 @@
 #include "sheep_priv.h"
 #include "nfs.h"
 
-/*
- * Comment from Linux kernel nfsd for RPC payload size
- *
- * Maximum payload size supported by a kernel RPC server.
- * This is use to determine the max number of pages nfsd is
- * willing to return in a single READ operation.
- *
- * These happen to all be powers of 2, which is not strictly
- * necessary but helps enforce the real limitation, which is
- * that they should be multiples of PAGE_CACHE_SIZE.
- *
- * For UDP transports, a block plus NFS,RPC, and UDP headers
- * has to fit into the IP datagram limit of 64K.  The largest
- * feasible number for all known page sizes is probably 48K,
- * but we choose 32K here.  This is the same as the historical
- * Linux limit; someone who cares more about NFS/UDP performance
- * can test a larger number.
- *
- * For TCP transports we have more freedom.  A size of 1MB is
- * chosen to match the client limit.  Other OSes are known to
- * have larger limits, but those numbers are probably beyond
- * the point of diminishing returns.
- */
-#define RPCSVC_MAXPAYLOAD	(1*1024*1024u)
-#define RPCSVC_MAXPAYLOAD_TCP	RPCSVC_MAXPAYLOAD
-#define RPCSVC_MAXPAYLOAD_UDP	(32*1024u)
-
 static inline struct svc_fh *get_svc_fh(struct nfs_arg *argp)
 {
 	struct nfs_fh3 *nfh = (struct nfs_fh3 *)argp;
@@ -82,53 +55,59 @@ void *nfs3_null(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_getattr(struct svc_req *req, struct nfs_arg *argp)
 {
-	static GETATTR3res result;
+	GETATTR3res *result = nfs_alloc(req, sizeof(*result));
 	struct svc_fh *fh = get_svc_fh(argp);
-	struct fattr3 *post = &result.GETATTR3res_u.resok.obj_attributes;
+	struct fattr3 *post = &result->GETATTR3res_u.resok.obj_attributes;
 	struct inode *inode;
 
 	inode = fs_read_inode_hdr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
 
 	update_post_attr(inode, post);
-	result.status = NFS3_OK;
+	result->status = NFS3_OK;
 
 	free(inode);
 out:
-	return &result;
+	return result;
 }
 
 /* FIXME: Add nanotime support */
 void *nfs3_setattr(struct svc_req *req, struct nfs_arg *argp)
 {
-	static SETATTR3res result;
+	SETATTR3res *result = nfs_alloc(req, sizeof(*result));
 	SETATTR3args *arg = &argp->setattr;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct sattr3 *sattr = &arg->new_attributes;
-	struct post_op_attr *poa = &result.SETATTR3res_u.resok.obj_wcc.after;
+	struct post_op_attr *poa = &result->SETATTR3res_u.resok.obj_wcc.after;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *inode;
 	int ret;
 
 	sd_debug("%016"PRIx64, fh->ino);
 
+	/* Buffered writes must not extend the file after truncate */
+	if (sattr->size.set_it && fs_commit(fh->ino) != SD_RES_SUCCESS) {
+		result->status = NFS3ERR_IO;
+		goto out;
+	}
+
 	inode = fs_read_inode_hdr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
@@ -144,21 +123,21 @@ void *nfs3_setattr(struct svc_req *req, struct nfs_arg *argp)
 
 	ret = fs_write_inode_hdr(inode);
 	if (ret != SD_RES_SUCCESS)
-		result.status = NFS3ERR_IO;
+		result->status = NFS3ERR_IO;
 	else
-		result.status = NFS3_OK;
+		result->status = NFS3_OK;
 
 	poa->attributes_follow = true;
 	update_post_attr(inode, post);
 	free(inode);
 out:
-	return &result;
+	return result;
 }
 
 void *nfs3_lookup(struct svc_req *req, struct nfs_arg *argp)
 {
-	static LOOKUP3res result;
-	static struct svc_fh den_fh;
+	LOOKUP3res *result = nfs_alloc(req, sizeof(*result));
+	struct svc_fh *den_fh = nfs_alloc(req, sizeof(*den_fh));
 	LOOKUP3args *arg = &argp->lookup;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct inode *inode;
@@ -171,16 +150,16 @@ void *nfs3_lookup(struct svc_req *req, struct nfs_arg *argp)
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
 
 	if (!S_ISDIR(inode->mode)) {
-		result.status = NFS3ERR_NOTDIR;
+		result->status = NFS3ERR_NOTDIR;
 		goto out_free;
 	}
 
@@ -188,30 +167,30 @@ void *nfs3_lookup(struct svc_req *req, struct nfs_arg *argp)
 	if (IS_ERR(dentry)) {
 		switch (PTR_ERR(dentry)) {
 		case SD_RES_NOT_FOUND:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out_free;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out_free;
 		}
 	}
 
-	result.status = NFS3_OK;
-	den_fh.ino = dentry->ino;
-	set_svc_fh(&result.LOOKUP3res_u.resok.object, &den_fh);
+	result->status = NFS3_OK;
+	den_fh->ino = dentry->ino;
+	set_svc_fh(&result->LOOKUP3res_u.resok.object, den_fh);
 out_free:
 	free(inode);
 out:
-	return &result;
+	return result;
 }
 
 /* FIXME: implement UNIX ACL */
 void *nfs3_access(struct svc_req *req, struct nfs_arg *argp)
 {
-	static ACCESS3res result;
+	ACCESS3res *result = nfs_alloc(req, sizeof(*result));
 	ACCESS3args *arg = &argp->access;
 	struct svc_fh *fh = get_svc_fh(argp);
-	struct post_op_attr *poa = &result.ACCESS3res_u.resok.obj_attributes;
+	struct post_op_attr *poa = &result->ACCESS3res_u.resok.obj_attributes;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	uint32_t access;
 	struct inode *inode;
@@ -220,10 +199,10 @@ void *nfs3_access(struct svc_req *req, struct nfs_arg *argp)
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
@@ -237,12 +216,12 @@ void *nfs3_access(struct svc_req *req, struct nfs_arg *argp)
 		access &= ~ACCESS3_EXECUTE;
 	}
 
-	result.status = NFS3_OK;
-	result.ACCESS3res_u.resok.access = access & arg->access;
+	result->status = NFS3_OK;
+	result->ACCESS3res_u.resok.access = access & arg->access;
 
 	free(inode);
 out:
-	return &result;
+	return result;
 }
 
 void *nfs3_readlink(struct svc_req *req, struct nfs_arg *argp)
@@ -250,61 +229,62 @@ void *nfs3_readlink(struct svc_req *req, struct nfs_arg *argp)
 	return NULL;
 }
 
-static char nfs_read_buffer[RPCSVC_MAXPAYLOAD];
-
 void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 {
-	static READ3res result;
+	READ3res *result = nfs_alloc(req, sizeof(*result));
 	READ3args *arg = &argp->read;
 	struct svc_fh *fh = get_svc_fh(argp);
-	uint64_t offset = arg->offset, count = arg->count;
+	uint64_t offset = arg->offset;
+	uint64_t count = min(arg->count, (count3)RPCSVC_MAXPAYLOAD);
 	struct post_op_attr *poa =
-		&result.READ3res_u.resok.file_attributes;
+		&result->READ3res_u.resok.file_attributes;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *inode;
+	char *buffer;
 	int ret;
 
 	sd_debug("%016"PRIx64"count %"PRIu64" offset %"PRIu64, fh->ino,
 		 count, offset);
 
-	inode = fs_read_inode_full(fh->ino);
+	inode = fs_read_inode_meta(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
 
-	ret = fs_read(inode, nfs_read_buffer, count, offset);
+	buffer = nfs_alloc(req, count);
+	ret = fs_read(inode, buffer, count, offset);
 	if (ret < 0) {
-		result.status = NFS3ERR_IO;
+		result->status = NFS3ERR_IO;
 		goto out_free;
 	}
-	result.status = NFS3_OK;
-	result.READ3res_u.resok.count = ret;
-	result.READ3res_u.resok.eof = ret < count;
-	result.READ3res_u.resok.data.data_val = nfs_read_buffer;
-	result.READ3res_u.resok.data.data_len = ret;
+	result->status = NFS3_OK;
+	result->READ3res_u.resok.count = ret;
+	result->READ3res_u.resok.eof = ret < count;
+	result->READ3res_u.resok.data.data_val = buffer;
+	result->READ3res_u.resok.data.data_len = ret;
 	poa->attributes_follow = true;
 	update_post_attr(inode, post);
 out_free:
 	free(inode);
 out:
-	return &result;
+	return result;
 }
 
 void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 {
-	static WRITE3res result;
+	WRITE3res *result = nfs_alloc(req, sizeof(*result));
 	WRITE3args *arg = &argp->write;
 	struct svc_fh *fh = get_svc_fh(argp);
 	uint64_t offset = arg->offset, count = arg->count;
 	struct post_op_attr *poa =
-		&result.WRITE3res_u.resok.file_wcc.after;
+		&result->WRITE3res_u.resok.file_wcc.after;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *inode;
 	int64_t done;
@@ -313,46 +293,56 @@ void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 	sd_debug("%016"PRIx64" count %"PRIu64" offset %"PRIu64" stable %d",
 		 fh->ino, count, offset, arg->stable);
 
-	inode = fs_read_inode_full(fh->ino);
+	/* Stable writes must not be overwritten by older buffered ones */
+	if (arg->stable != UNSTABLE && fs_commit(fh->ino) != SD_RES_SUCCESS) {
+		result->status = NFS3ERR_IO;
+		goto out;
+	}
+
+	inode = fs_read_inode_meta(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
 
-	done = fs_write(inode, buffer, count, offset);
+	if (arg->stable == UNSTABLE)
+		done = fs_write_unstable(inode, buffer, count, offset);
+	else
+		done = fs_write(inode, buffer, count, offset);
 	if (done < 0) {
-		result.status = NFS3ERR_IO;
+		result->status = NFS3ERR_IO;
 		goto out_free;
 	}
-	result.status = NFS3_OK;
-	result.WRITE3res_u.resok.count = done;
-	result.WRITE3res_u.resok.committed = FILE_SYNC;
-	memcpy(&result.WRITE3res_u.resok.verf, &nfs_boot_time,
+	result->status = NFS3_OK;
+	result->WRITE3res_u.resok.count = done;
+	result->WRITE3res_u.resok.committed =
+		arg->stable == UNSTABLE ? UNSTABLE : FILE_SYNC;
+	memcpy(&result->WRITE3res_u.resok.verf, &nfs_boot_time,
 	       sizeof(nfs_boot_time));
 	poa->attributes_follow = true;
 	update_post_attr(inode, post);
 out_free:
 	free(inode);
 out:
-	return &result;
+	return result;
 }
 
 /* FIXME: support GUARDED and EXCLUSIVE */
 void *nfs3_create(struct svc_req *req, struct nfs_arg *argp)
 {
-	static CREATE3res result;
-	static struct svc_fh file_fh;
+	CREATE3res *result = nfs_alloc(req, sizeof(*result));
+	struct svc_fh *file_fh = nfs_alloc(req, sizeof(*file_fh));
 	CREATE3args *arg = &argp->create;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct sattr3 *sattr = &arg->how.createhow3_u.obj_attributes;
 	struct post_op_attr *poa =
-		&result.CREATE3res_u.resok.obj_attributes;
+		&result->CREATE3res_u.resok.obj_attributes;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *new = xzalloc(sizeof(*new));
 	char *name = arg->where.name;
@@ -365,35 +355,35 @@ void *nfs3_create(struct svc_req *req, struct nfs_arg *argp)
 	new->uid = 0;
 	new->gid = 0;
 	new->size = 0;
-	new->used = INODE_DATA_SIZE;
+	new->used = 0;
 	new->ctime = new->atime = new->mtime = time(NULL);
 
 	ret = fs_create_file(fh->ino, new, name);
 	if (ret != SD_RES_SUCCESS) {
-		result.status = NFS3ERR_IO;
+		result->status = NFS3ERR_IO;
 		goto out;
 	}
 
-	file_fh.ino = new->ino;
+	file_fh->ino = new->ino;
 
-	result.status = NFS3_OK;
-	result.CREATE3res_u.resok.obj.handle_follows = true;
-	set_svc_fh(&result.CREATE3res_u.resok.obj.post_op_fh3_u.handle,
-		   &file_fh);
+	result->status = NFS3_OK;
+	result->CREATE3res_u.resok.obj.handle_follows = true;
+	set_svc_fh(&result->CREATE3res_u.resok.obj.post_op_fh3_u.handle,
+		   file_fh);
 	poa->attributes_follow = true;
 	update_post_attr(new, post);
 out:
-	return &result;
+	return result;
 }
 
 void *nfs3_mkdir(struct svc_req *req, struct nfs_arg *argp)
 {
-	static MKDIR3res result;
-	static struct svc_fh file_fh;
+	MKDIR3res *result = nfs_alloc(req, sizeof(*result));
+	struct svc_fh *file_fh = nfs_alloc(req, sizeof(*file_fh));
 	MKDIR3args *arg = &argp->mkdir;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct post_op_attr *poa =
-		&result.MKDIR3res_u.resok.obj_attributes;
+		&result->MKDIR3res_u.resok.obj_attributes;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *new = xzalloc(sizeof(*new)), *parent;
 	char *name = arg->where.name;
@@ -405,16 +395,16 @@ void *nfs3_mkdir(struct svc_req *req, struct nfs_arg *argp)
 	if (IS_ERR(parent)) {
 		switch (PTR_ERR(parent)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
 
 	if (!S_ISDIR(parent->mode)) {
-		result.status = NFS3ERR_NOTDIR;
+		result->status = NFS3ERR_NOTDIR;
 		goto out_free_parent;
 	}
 
@@ -427,15 +417,15 @@ void *nfs3_mkdir(struct svc_req *req, struct nfs_arg *argp)
 
 	ret = fs_create_dir(new, name, parent);
 	if (ret != SD_RES_SUCCESS) {
-		result.status = NFS3ERR_IO;
+		result->status = NFS3ERR_IO;
 		goto out_free_parent;
 	}
 
-	file_fh.ino = new->ino;
-	result.status = NFS3_OK;
-	result.MKDIR3res_u.resok.obj.handle_follows = true;
-	set_svc_fh(&result.MKDIR3res_u.resok.obj.post_op_fh3_u.handle,
-		   &file_fh);
+	file_fh->ino = new->ino;
+	result->status = NFS3_OK;
+	result->MKDIR3res_u.resok.obj.handle_follows = true;
+	set_svc_fh(&result->MKDIR3res_u.resok.obj.post_op_fh3_u.handle,
+		   file_fh);
 	poa->attributes_follow = true;
 	update_post_attr(new, post);
 
@@ -443,7 +433,7 @@ out_free_parent:
 	free(parent);
 out:
 	free(new);
-	return &result;
+	return result;
 }
 
 void *nfs3_symlink(struct svc_req *req, struct nfs_arg *argp)
@@ -453,39 +443,39 @@ void *nfs3_symlink(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_mknod(struct svc_req *req, struct nfs_arg *argp)
 {
-	static MKNOD3res result;
+	MKNOD3res *result = nfs_alloc(req, sizeof(*result));
 
-	result.status = NFS3ERR_NOTSUPP;
+	result->status = NFS3ERR_NOTSUPP;
 
-	return &result;
+	return result;
 }
 
 /* TODO: implement btree or hash based kv store to manage dentries */
 void *nfs3_remove(struct svc_req *req, struct nfs_arg *argp)
 {
-	static REMOVE3res result;
+	REMOVE3res *result = nfs_alloc(req, sizeof(*result));
 
-	result.status = NFS3ERR_NOTSUPP;
+	result->status = NFS3ERR_NOTSUPP;
 
-	return &result;
+	return result;
 }
 
 void *nfs3_rmdir(struct svc_req *req, struct nfs_arg *argp)
 {
-	static RMDIR3res result;
+	RMDIR3res *result = nfs_alloc(req, sizeof(*result));
 
-	result.status = NFS3ERR_NOTSUPP;
+	result->status = NFS3ERR_NOTSUPP;
 
-	return &result;
+	return result;
 }
 
 void *nfs3_rename(struct svc_req *req, struct nfs_arg *argp)
 {
-	static RENAME3res result;
+	RENAME3res *result = nfs_alloc(req, sizeof(*result));
 
-	result.status = NFS3ERR_NOTSUPP;
+	result->status = NFS3ERR_NOTSUPP;
 
-	return &result;
+	return result;
 }
 
 void *nfs3_link(struct svc_req *req, struct nfs_arg *argp)
@@ -496,9 +486,6 @@ void *nfs3_link(struct svc_req *req, struct nfs_arg *argp)
 /* Linux NFS client will issue at most 32k count for readdir on my test */
 #define ENTRY3_MAX_LEN (32*1024)
 
-static char entry3_buffer[ENTRY3_MAX_LEN];
-static char entry3_name[ENTRY3_MAX_LEN];
-
 /*
  * static READDIR3resok size with XDR overhead
  *
@@ -525,6 +512,7 @@ struct dir_reader_d {
 	uint32_t count;
 	uint32_t used;
 	entry3 *entries;
+	char *names;
 	uint32_t iter;
 };
 
@@ -541,8 +529,8 @@ static int nfs_dentry_reader(struct inode *inode, struct dentry *dentry,
 		return SD_RES_AGAIN;
 
 	d->entries[iter].fileid = dentry->ino;
-	strcpy(&entry3_name[iter * NFS_MAXNAMLEN], dentry->name);
-	d->entries[iter].name = &entry3_name[iter * NFS_MAXNAMLEN];
+	strcpy(&d->names[iter * NFS_MAXNAMLEN], dentry->name);
+	d->entries[iter].name = &d->names[iter * NFS_MAXNAMLEN];
 	d->entries[iter].cookie = offset;
 	d->entries[iter].nextentry = NULL;
 	if (iter > 0)
@@ -555,11 +543,11 @@ static int nfs_dentry_reader(struct inode *inode, struct dentry *dentry,
 
 void *nfs3_readdir(struct svc_req *req, struct nfs_arg *argp)
 {
-	static READDIR3res result;
+	READDIR3res *result = nfs_alloc(req, sizeof(*result));
 	READDIR3args *arg = &argp->readdir;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct post_op_attr *poa =
-		&result.READDIR3res_u.resok.dir_attributes;
+		&result->READDIR3res_u.resok.dir_attributes;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *inode;
 	struct dir_reader_d wd;
@@ -572,58 +560,180 @@ void *nfs3_readdir(struct svc_req *req, struct nfs_arg *argp)
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
-			result.status = NFS3ERR_NOENT;
+			result->status = NFS3ERR_NOENT;
 			goto out;
 		default:
-			result.status = NFS3ERR_IO;
+			result->status = NFS3ERR_IO;
 			goto out;
 		}
 	}
 
 	if (!S_ISDIR(inode->mode)) {
-		result.status = NFS3ERR_NOTDIR;
+		result->status = NFS3ERR_NOTDIR;
 		goto out_free;
 	}
 
 	wd.count = arg->count;
-	wd.entries = (entry3 *)entry3_buffer;
+	wd.entries = nfs_alloc(req, ENTRY3_MAX_LEN);
+	wd.names = nfs_alloc(req, ENTRY3_MAX_LEN);
 	wd.iter = 0;
 	wd.used = RESOK_SIZE;
 	ret = fs_read_dir(inode, arg->cookie, nfs_dentry_reader, &wd);
 	switch (ret) {
 	case SD_RES_SUCCESS:
-		result.status = NFS3_OK;
-		result.READDIR3res_u.resok.reply.eof = true;
+		result->status = NFS3_OK;
+		result->READDIR3res_u.resok.reply.eof = true;
 		break;
 	case SD_RES_AGAIN:
-		result.status = NFS3_OK;
+		result->status = NFS3_OK;
 		break;
 	default:
-		result.status = NFS3ERR_IO;
+		result->status = NFS3ERR_IO;
 		goto out_free;
 	}
 
-	result.READDIR3res_u.resok.reply.entries = wd.entries;
+	result->READDIR3res_u.resok.reply.entries = wd.entries;
 	poa->attributes_follow = true;
 	update_post_attr(inode, post);
 out_free:
 	free(inode);
 out:
-	return &result;
+	return result;
+}
+
+/*
+ * static entryplus3 size with XDR overhead
+ *
+ * ENTRY_SIZE, 88 bytes attributes with 4 bytes attributes_follow, 4 bytes
+ * handle_follows, 4 bytes handle length and the handle
+ */
+#define ENTRYPLUS_SIZE (ENTRY_SIZE + 92 + 8 + sizeof(struct svc_fh))
+
+#define ENTRYPLUS3_MAX 512
+
+struct dir_plus_reader_d {
+	uint32_t dircount;
+	uint32_t maxcount;
+	uint32_t dirused;
+	uint32_t used;
+	entryplus3 *entries;
+	char (*names)[NFS_MAXNAMLEN];
+	struct svc_fh *fhs;
+	uint32_t iter;
+};
+
+/* Attributes of the entries are served from the inode cache of fs.c */
+static int nfs_dentry_plus_reader(struct inode *inode, struct dentry *dentry,
+				  void *data)
+{
+	struct dir_plus_reader_d *d = data;
+	uint32_t iter = d->iter;
+	uint64_t offset = (uint8_t *)(dentry + 1) - inode->data;
+	entryplus3 *entry = d->entries + iter;
+	struct post_op_attr *poa = &entry->name_attributes;
+	struct inode *child;
+
+	if (iter == ENTRYPLUS3_MAX)
+		return SD_RES_AGAIN;
+
+	d->dirused += ENTRY_SIZE + NAME_SIZE(dentry->name);
+	d->used += ENTRYPLUS_SIZE + NAME_SIZE(dentry->name);
+	if (d->dirused > d->dircount || d->used > d->maxcount)
+		return SD_RES_AGAIN;
+
+	entry->fileid = dentry->ino;
+	pstrcpy(d->names[iter], NFS_MAXNAMLEN, dentry->name);
+	entry->name = d->names[iter];
+	entry->cookie = offset;
+	entry->nextentry = NULL;
+
+	child = fs_read_inode_hdr(dentry->ino);
+	poa->attributes_follow = !IS_ERR(child);
+	if (!IS_ERR(child)) {
+		update_post_attr(child, &poa->post_op_attr_u.attributes);
+		free(child);
+	}
+	d->fhs[iter].ino = dentry->ino;
+	entry->name_handle.handle_follows = true;
+	set_svc_fh(&entry->name_handle.post_op_fh3_u.handle,
+		   d->fhs + iter);
+
+	if (iter > 0)
+		d->entries[iter - 1].nextentry = entry;
+	d->iter++;
+
+	return SD_RES_SUCCESS;
 }
 
 void *nfs3_readdirplus(struct svc_req *req, struct nfs_arg *argp)
 {
-	static READDIRPLUS3res result;
+	READDIRPLUS3res *result = nfs_alloc(req, sizeof(*result));
+	READDIRPLUS3args *arg = &argp->readdirplus;
+	struct svc_fh *fh = get_svc_fh(argp);
+	struct post_op_attr *poa =
+		&result->READDIRPLUS3res_u.resok.dir_attributes;
+	struct fattr3 *post = &poa->post_op_attr_u.attributes;
+	struct inode *inode;
+	struct dir_plus_reader_d wd;
+	int ret;
 
-	result.status = NFS3ERR_NOTSUPP;
+	sd_debug("%016"PRIx64" dircount %"PRIu32", maxcount %"PRIu32
+		 ", at %"PRIu64, fh->ino, (uint32_t)arg->dircount,
+		 (uint32_t)arg->maxcount, arg->cookie);
 
-	return &result;
+	inode = fs_read_inode_full(fh->ino);
+	if (IS_ERR(inode)) {
+		switch (PTR_ERR(inode)) {
+		case SD_RES_NO_OBJ:
+			result->status = NFS3ERR_NOENT;
+			goto out;
+		default:
+			result->status = NFS3ERR_IO;
+			goto out;
+		}
+	}
+
+	if (!S_ISDIR(inode->mode)) {
+		result->status = NFS3ERR_NOTDIR;
+		goto out_free;
+	}
+
+	wd.dircount = arg->dircount;
+	wd.maxcount = arg->maxcount;
+	wd.dirused = 0;
+	wd.used = RESOK_SIZE;
+	wd.entries = nfs_alloc(req, sizeof(*wd.entries) * ENTRYPLUS3_MAX);
+	wd.names = nfs_alloc(req, sizeof(*wd.names) * ENTRYPLUS3_MAX);
+	wd.fhs = nfs_alloc(req, sizeof(*wd.fhs) * ENTRYPLUS3_MAX);
+	wd.iter = 0;
+	result->READDIRPLUS3res_u.resok.reply.eof = false;
+	ret = fs_read_dir(inode, arg->cookie, nfs_dentry_plus_reader, &wd);
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		result->status = NFS3_OK;
+		result->READDIRPLUS3res_u.resok.reply.eof = true;
+		break;
+	case SD_RES_AGAIN:
+		result->status = NFS3_OK;
+		break;
+	default:
+		result->status = NFS3ERR_IO;
+		goto out_free;
+	}
+
+	result->READDIRPLUS3res_u.resok.reply.entries =
+		wd.iter ? wd.entries : NULL;
+	poa->attributes_follow = true;
+	update_post_attr(inode, post);
+out_free:
+	free(inode);
+out:
+	return result;
 }
 
 void *nfs3_fsstat(struct svc_req *req, struct nfs_arg *argp)
 {
-	static FSSTAT3res result;
+	FSSTAT3res *result = nfs_alloc(req, sizeof(*result));
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct sd_inode *sd_inode = xmalloc(sizeof(*sd_inode));
 	uint32_t vid = oid_to_vid(fh->ino);
@@ -635,7 +745,7 @@ void *nfs3_fsstat(struct svc_req *req, struct nfs_arg *argp)
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to read %" PRIx32 " %s", vid,
 		       sd_strerror(ret));
-		result.status = NFS3ERR_IO;
+		result->status = NFS3ERR_IO;
 		goto out;
 	}
 
@@ -643,18 +753,18 @@ void *nfs3_fsstat(struct svc_req *req, struct nfs_arg *argp)
 
 	sd_debug("%"PRIx32" contains %lu objects", vid, my);
 
-	result.status = NFS3_OK;
-	result.FSSTAT3res_u.resok.tbytes = SD_MAX_VDI_SIZE;
-	result.FSSTAT3res_u.resok.fbytes = SD_MAX_VDI_SIZE -
+	result->status = NFS3_OK;
+	result->FSSTAT3res_u.resok.tbytes = SD_MAX_VDI_SIZE;
+	result->FSSTAT3res_u.resok.fbytes = SD_MAX_VDI_SIZE -
 					my * SD_DATA_OBJ_SIZE;
-	result.FSSTAT3res_u.resok.abytes = SD_MAX_VDI_SIZE -
+	result->FSSTAT3res_u.resok.abytes = SD_MAX_VDI_SIZE -
 					my * SD_DATA_OBJ_SIZE;
-	result.FSSTAT3res_u.resok.tfiles = MAX_DATA_OBJS;
-	result.FSSTAT3res_u.resok.ffiles = MAX_DATA_OBJS - my;
-	result.FSSTAT3res_u.resok.afiles = MAX_DATA_OBJS - my;
+	result->FSSTAT3res_u.resok.tfiles = MAX_DATA_OBJS;
+	result->FSSTAT3res_u.resok.ffiles = MAX_DATA_OBJS - my;
+	result->FSSTAT3res_u.resok.afiles = MAX_DATA_OBJS - my;
 out:
 	free(sd_inode);
-	return &result;
+	return result;
 }
 
 static uint32_t get_max_size(struct svc_req *req)
@@ -677,47 +787,80 @@ out:
 
 void *nfs3_fsinfo(struct svc_req *req, struct nfs_arg *argp)
 {
-	static FSINFO3res result;
+	FSINFO3res *result = nfs_alloc(req, sizeof(*result));
 	uint32_t maxsize = get_max_size(req);
 
-	result.status = NFS3_OK;
-	result.FSINFO3res_u.resok.obj_attributes.attributes_follow = false;
-	result.FSINFO3res_u.resok.rtmax = maxsize;
-	result.FSINFO3res_u.resok.rtpref = maxsize;
-	result.FSINFO3res_u.resok.rtmult = BLOCK_SIZE;
-	result.FSINFO3res_u.resok.wtmax = maxsize;
-	result.FSINFO3res_u.resok.wtpref = maxsize;
-	result.FSINFO3res_u.resok.wtmult = BLOCK_SIZE;
-	result.FSINFO3res_u.resok.dtpref = BLOCK_SIZE;
-	result.FSINFO3res_u.resok.maxfilesize = SD_MAX_VDI_SIZE;
-	result.FSINFO3res_u.resok.time_delta.seconds = 1;
-	result.FSINFO3res_u.resok.time_delta.nseconds = 0;
-	result.FSINFO3res_u.resok.properties = FSF3_HOMOGENEOUS;
-
-	return &result;
+	result->status = NFS3_OK;
+	result->FSINFO3res_u.resok.obj_attributes.attributes_follow = false;
+	result->FSINFO3res_u.resok.rtmax = maxsize;
+	result->FSINFO3res_u.resok.rtpref = maxsize;
+	result->FSINFO3res_u.resok.rtmult = BLOCK_SIZE;
+	result->FSINFO3res_u.resok.wtmax = maxsize;
+	result->FSINFO3res_u.resok.wtpref = maxsize;
+	result->FSINFO3res_u.resok.wtmult = BLOCK_SIZE;
+	result->FSINFO3res_u.resok.dtpref = BLOCK_SIZE;
+	result->FSINFO3res_u.resok.maxfilesize = SD_MAX_VDI_SIZE;
+	result->FSINFO3res_u.resok.time_delta.seconds = 1;
+	result->FSINFO3res_u.resok.time_delta.nseconds = 0;
+	result->FSINFO3res_u.resok.properties = FSF3_HOMOGENEOUS;
+
+	return result;
 }
 
 void *nfs3_pathconf(struct svc_req *req, struct nfs_arg *argp)
 {
-	static PATHCONF3res result;
-
-	result.status = NFS3_OK;
-	result.PATHCONF3res_u.resok.obj_attributes.attributes_follow = false;
-	result.PATHCONF3res_u.resok.linkmax = UINT32_MAX;
-	result.PATHCONF3res_u.resok.name_max = NFS_MAXNAMLEN;
-	result.PATHCONF3res_u.resok.no_trunc = true;
-	result.PATHCONF3res_u.resok.chown_restricted = false;
-	result.PATHCONF3res_u.resok.case_insensitive = false;
-	result.PATHCONF3res_u.resok.case_preserving = true;
-
-	return &result;
+	PATHCONF3res *result = nfs_alloc(req, sizeof(*result));
+
+	result->status = NFS3_OK;
+	result->PATHCONF3res_u.resok.obj_attributes.attributes_follow = false;
+	result->PATHCONF3res_u.resok.linkmax = UINT32_MAX;
+	result->PATHCONF3res_u.resok.name_max = NFS_MAXNAMLEN;
+	result->PATHCONF3res_u.resok.no_trunc = true;
+	result->PATHCONF3res_u.resok.chown_restricted = false;
+	result->PATHCONF3res_u.resok.case_insensitive = false;
+	result->PATHCONF3res_u.resok.case_preserving = true;
+
+	return result;
 }
 
+/* The buffered writes of the whole file are committed regardless of range */
 void *nfs3_commit(struct svc_req *req, struct nfs_arg *argp)
 {
-	static COMMIT3res result;
+	COMMIT3res *result = nfs_alloc(req, sizeof(*result));
+	COMMIT3args *arg = &argp->commit;
+	struct svc_fh *fh = get_svc_fh(argp);
+	struct post_op_attr *poa = &result->COMMIT3res_u.resok.file_wcc.after;
+	struct fattr3 *post = &poa->post_op_attr_u.attributes;
+	struct inode *inode;
+	int ret;
 
-	result.status = NFS3ERR_NOTSUPP;
+	sd_debug("%016"PRIx64" count %"PRIu32" offset %"PRIu64, fh->ino,
+		 (uint32_t)arg->count, arg->offset);
 
-	return &result;
+	ret = fs_commit(fh->ino);
+	if (ret != SD_RES_SUCCESS) {
+		result->status = NFS3ERR_IO;
+		goto out;
+	}
+
+	inode = fs_read_inode_hdr(fh->ino);
+	if (IS_ERR(inode)) {
+		switch (PTR_ERR(inode)) {
+		case SD_RES_NO_OBJ:
+			result->status = NFS3ERR_NOENT;
+			goto out;
+		default:
+			result->status = NFS3ERR_IO;
+			goto out;
+		}
+	}
+
+	result->status = NFS3_OK;
+	memcpy(&result->COMMIT3res_u.resok.verf, &nfs_boot_time,
+	       sizeof(nfs_boot_time));
+	poa->attributes_follow = true;
+	update_post_attr(inode, post);
+	free(inode);
+out:
+	return result;
 }
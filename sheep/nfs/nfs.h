@@ -31,6 +31,33 @@
 #define NFSMODE_SOCK 0140000
 #define NFSMODE_FIFO 0010000
 
+/*
+ * Comment from Linux kernel nfsd for RPC payload size
+ *
+ * Maximum payload size supported by a kernel RPC server.
+ * This is use to determine the max number of pages nfsd is
+ * willing to return in a single READ operation.
+ *
+ * These happen to all be powers of 2, which is not strictly
+ * necessary but helps enforce the real limitation, which is
+ * that they should be multiples of PAGE_CACHE_SIZE.
+ *
+ * For UDP transports, a block plus NFS,RPC, and UDP headers
+ * has to fit into the IP datagram limit of 64K.  The largest
+ * feasible number for all known page sizes is probably 48K,
+ * but we choose 32K here.  This is the same as the historical
+ * Linux limit; someone who cares more about NFS/UDP performance
+ * can test a larger number.
+ *
+ * For TCP transports we have more freedom.  A size of 1MB is
+ * chosen to match the client limit.  Other OSes are known to
+ * have larger limits, but those numbers are probably beyond
+ * the point of diminishing returns.
+ */
+#define RPCSVC_MAXPAYLOAD	(1*1024*1024u)
+#define RPCSVC_MAXPAYLOAD_TCP	RPCSVC_MAXPAYLOAD
+#define RPCSVC_MAXPAYLOAD_UDP	(32*1024u)
+
 #define NFS3_FHSIZE 64
 #define NFS3_COOKIEVERFSIZE 8
 #define NFS3_CREATEVERFSIZE 8
@@ -999,6 +1026,7 @@ extern void *nfs3_fsstat(struct svc_req *req, struct nfs_arg *argp);
 extern void *nfs3_fsinfo(struct svc_req *req, struct nfs_arg *argp);
 extern void *nfs3_pathconf(struct svc_req *req, struct nfs_arg *argp);
 extern void *nfs3_commit(struct svc_req *req, struct nfs_arg *argp);
+extern void *nfs_alloc(struct svc_req *req, size_t size);
 
 /* the xdr functions */
 
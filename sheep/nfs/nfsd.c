@@ -14,6 +14,7 @@
 #include "sheep_priv.h"
 #include "nfs.h"
 #include <rpc/pmap_clnt.h>
+#include <netinet/tcp.h>
 
 typedef void *(*svc_func)(struct svc_req *, struct nfs_arg *argp);
 
@@ -23,42 +24,45 @@ struct svc_handler {
 	xdrproc_t    encoder; /* XDR encode result */
 	unsigned int count;	 /* call count */
 	const char *name;       /* handler name */
+	bool update;		/* modifies the file system */
 };
 
-#define NFS_HANDLER(name)			\
+#define NFS_HANDLER(name, update)		\
 {						\
 	(svc_func)  nfs3_##name,		\
 	(xdrproc_t) xdr_##name##_args,		\
 	(xdrproc_t) xdr_##name##_res,		\
 	0,					\
 	"nfs3."#name,				\
+	update,					\
 }
 
 static struct svc_handler nfs3_handlers[] = {
-	NFS_HANDLER(null),
-	NFS_HANDLER(getattr),
-	NFS_HANDLER(setattr),
-	NFS_HANDLER(lookup),
-	NFS_HANDLER(access),
-	NFS_HANDLER(readlink),
-	NFS_HANDLER(read),
-	NFS_HANDLER(write),
-	NFS_HANDLER(create),
-	NFS_HANDLER(mkdir),
-	NFS_HANDLER(symlink),
-	NFS_HANDLER(mknod),
-	NFS_HANDLER(remove),
-	NFS_HANDLER(rmdir),
-	NFS_HANDLER(rename),
-	NFS_HANDLER(link),
-	NFS_HANDLER(readdir),
-	NFS_HANDLER(readdirplus),
-	NFS_HANDLER(fsstat),
-	NFS_HANDLER(fsinfo),
-	NFS_HANDLER(pathconf),
-	NFS_HANDLER(commit),
+	NFS_HANDLER(null, false),
+	NFS_HANDLER(getattr, false),
+	NFS_HANDLER(setattr, true),
+	NFS_HANDLER(lookup, false),
+	NFS_HANDLER(access, false),
+	NFS_HANDLER(readlink, false),
+	NFS_HANDLER(read, false),
+	NFS_HANDLER(write, true),
+	NFS_HANDLER(create, true),
+	NFS_HANDLER(mkdir, true),
+	NFS_HANDLER(symlink, true),
+	NFS_HANDLER(mknod, true),
+	NFS_HANDLER(remove, true),
+	NFS_HANDLER(rmdir, true),
+	NFS_HANDLER(rename, true),
+	NFS_HANDLER(link, true),
+	NFS_HANDLER(readdir, false),
+	NFS_HANDLER(readdirplus, false),
+	NFS_HANDLER(fsstat, false),
+	NFS_HANDLER(fsinfo, false),
+	NFS_HANDLER(pathconf, false),
+	NFS_HANDLER(commit, true),
 };
 
+/* The mount handlers are only called by the nfs thread */
 #define MOUNT_HANDLER(name, arg, res)		\
 {						\
 	(svc_func)  mount3_##name,		\
@@ -66,6 +70,7 @@ static struct svc_handler nfs3_handlers[] = {
 	(xdrproc_t) xdr_##res,			\
 	0,					\
 	"mount3."#name,				\
+	false,					\
 }
 
 static struct svc_handler mount3_handlers[] = {
@@ -77,42 +82,415 @@ static struct svc_handler mount3_handlers[] = {
 	MOUNT_HANDLER(export, null_args, exports),
 };
 
+/*
+ * NFS over TCP is served by the transport below instead of the svc library.
+ * A transport of the library keeps the state of the one request it serves,
+ * like the xid to reply with, so it can't have several requests in flight.
+ *
+ * The nfs thread receives the requests of a connection and decodes them.
+ * Each request is then served by nfs_wqueue, and the worker sends the reply
+ * itself.  The replies of a connection are serialized by nfs_conn->lock and
+ * might be sent in a different order than the requests, as RPC allows.
+ *
+ * Handlers which modify the file system exclude each other and the others by
+ * nfs_lock.  UDP and the mount protocol are still served by the svc library,
+ * one request at a time on the nfs thread.
+ */
+#define NFS_MAX_MSG_SIZE (RPCSVC_MAXPAYLOAD + 64 * 1024)
+#define RPC_LAST_FRAG 0x80000000U
+
+struct nfs_conn {
+	SVCXPRT xprt;		/* for the handlers which look at the socket */
+	struct sd_mutex lock;	/* serializes the replies */
+	refcnt_t refcnt;
+	struct list_node list;
+
+	/* the record being received */
+	uint32_t marker;
+	uint32_t marker_done;
+	uint32_t frag_len;
+	uint32_t frag_done;
+	char *msg;
+	uint32_t msg_len;
+};
+
+struct nfs_mem {
+	struct nfs_mem *next;
+	char data[];
+};
+
+struct nfs_req {
+	struct svc_req rq;
+	struct nfs_arg arg;
+	struct svc_handler *handler;
+	struct nfs_mem *mem;	/* freed with the request */
+	uint32_t xid;
+	struct nfs_conn *conn;
+	struct work work;
+};
+
+static struct sd_rw_lock nfs_lock = SD_RW_LOCK_INITIALIZER;
+static struct work_queue *nfs_wqueue;
+static int nfs_listen_fd = -1;
+static LIST_HEAD(nfs_conn_list);
+
+/* Allocate zeroed memory which lives until the reply to 'req' is sent */
+void *nfs_alloc(struct svc_req *req, size_t size)
+{
+	struct nfs_req *nreq = container_of(req, struct nfs_req, rq);
+	struct nfs_mem *mem = xzalloc(sizeof(*mem) + size);
+
+	mem->next = nreq->mem;
+	nreq->mem = mem;
+	return mem->data;
+}
+
+static struct nfs_req *nfs_req_alloc(struct svc_handler *handler)
+{
+	struct nfs_req *req = xzalloc(sizeof(*req));
+
+	req->handler = handler;
+	return req;
+}
+
+static void nfs_conn_put(struct nfs_conn *conn)
+{
+	if (refcount_dec(&conn->refcnt) > 0)
+		return;
+
+	close(conn->xprt.xp_fd);
+	sd_destroy_mutex(&conn->lock);
+	free(conn->msg);
+	free(conn);
+}
+
+static void nfs_req_free(struct nfs_req *req)
+{
+	struct nfs_mem *mem, *next;
+
+	xdr_free(req->handler->decoder, (caddr_t)&req->arg);
+	for (mem = req->mem; mem; mem = next) {
+		next = mem->next;
+		free(mem);
+	}
+	if (req->conn)
+		nfs_conn_put(req->conn);
+	free(req);
+}
+
+static void *nfs_call(struct nfs_req *req)
+{
+	struct svc_handler *handler = req->handler;
+	void *result;
+
+	sd_debug("%s", handler->name);
+
+	uatomic_inc(&handler->count);
+	if (handler->update)
+		sd_write_lock(&nfs_lock);
+	else
+		sd_read_lock(&nfs_lock);
+	result = handler->func(&req->rq, &req->arg);
+	sd_rw_unlock(&nfs_lock);
+
+	return result;
+}
+
+static void nfs_conn_reply(struct nfs_conn *conn, uint32_t xid,
+			   enum accept_stat stat, xdrproc_t encoder,
+			   void *result)
+{
+	struct rpc_msg reply = {};
+	uint32_t len, size;
+	char *buf;
+	XDR xdrs;
+
+	reply.rm_xid = xid;
+	reply.rm_direction = REPLY;
+	reply.rm_reply.rp_stat = MSG_ACCEPTED;
+	reply.acpted_rply.ar_verf = _null_auth;
+	reply.acpted_rply.ar_stat = stat;
+	if (stat == SUCCESS) {
+		reply.acpted_rply.ar_results.where = result;
+		reply.acpted_rply.ar_results.proc = encoder;
+	} else if (stat == PROG_MISMATCH) {
+		reply.acpted_rply.ar_vers.low = NFS_V3;
+		reply.acpted_rply.ar_vers.high = NFS_V3;
+	}
+
+	size = xdr_sizeof((xdrproc_t)xdr_replymsg, &reply);
+	buf = xmalloc(sizeof(uint32_t) + size);
+	xdrmem_create(&xdrs, buf + sizeof(uint32_t), size, XDR_ENCODE);
+	if (!xdr_replymsg(&xdrs, &reply)) {
+		sd_err("failed to encode the reply to %" PRIx32, xid);
+		goto out;
+	}
+	len = xdr_getpos(&xdrs);
+	*(uint32_t *)buf = htonl(RPC_LAST_FRAG | len);
+
+	/* A broken connection is noticed and closed by the nfs thread */
+	sd_mutex_lock(&conn->lock);
+	if (xwrite(conn->xprt.xp_fd, buf, sizeof(uint32_t) + len) < 0)
+		sd_debug("failed to reply to %" PRIx32 ", %m", xid);
+	sd_mutex_unlock(&conn->lock);
+out:
+	xdr_destroy(&xdrs);
+	free(buf);
+}
+
+static void nfs_req_work(struct work *work)
+{
+	struct nfs_req *req = container_of(work, struct nfs_req, work);
+	void *result;
+
+	result = nfs_call(req);
+	if (result)
+		nfs_conn_reply(req->conn, req->xid, SUCCESS,
+			       req->handler->encoder, result);
+}
+
+static void nfs_req_done(struct work *work)
+{
+	struct nfs_req *req = container_of(work, struct nfs_req, work);
+
+	nfs_req_free(req);
+}
+
+/*
+ * Decode the call in 'msg' and queue it.  Return false if the connection
+ * should be closed.
+ */
+static bool nfs_conn_handle(struct nfs_conn *conn, char *msg, uint32_t len)
+{
+	char cred[MAX_AUTH_BYTES], verf[MAX_AUTH_BYTES];
+	struct rpc_msg call = {};
+	struct nfs_req *req;
+	uint32_t proc;
+	bool ret = true;
+	XDR xdrs;
+
+	xdrmem_create(&xdrs, msg, len, XDR_DECODE);
+	call.rm_call.cb_cred.oa_base = cred;
+	call.rm_call.cb_verf.oa_base = verf;
+	if (!xdr_callmsg(&xdrs, &call) || call.rm_direction != CALL ||
+	    call.rm_call.cb_rpcvers != RPC_MSG_VERSION) {
+		sd_err("invalid rpc call");
+		ret = false;
+		goto out;
+	}
+
+	proc = call.rm_call.cb_proc;
+	if (call.rm_call.cb_prog != NFS_PROGRAM) {
+		nfs_conn_reply(conn, call.rm_xid, PROG_UNAVAIL, NULL, NULL);
+		goto out;
+	}
+	if (call.rm_call.cb_vers != NFS_V3) {
+		nfs_conn_reply(conn, call.rm_xid, PROG_MISMATCH, NULL, NULL);
+		goto out;
+	}
+	if (proc >= ARRAY_SIZE(nfs3_handlers)) {
+		nfs_conn_reply(conn, call.rm_xid, PROC_UNAVAIL, NULL, NULL);
+		goto out;
+	}
+
+	req = nfs_req_alloc(nfs3_handlers + proc);
+	if (!nfs3_handlers[proc].decoder(&xdrs, &req->arg)) {
+		sd_err("failed to decode the arguments of %s",
+		       nfs3_handlers[proc].name);
+		nfs_conn_reply(conn, call.rm_xid, GARBAGE_ARGS, NULL, NULL);
+		nfs_req_free(req);
+		goto out;
+	}
+
+	req->rq.rq_prog = NFS_PROGRAM;
+	req->rq.rq_vers = NFS_V3;
+	req->rq.rq_proc = proc;
+	req->rq.rq_xprt = &conn->xprt;
+	req->xid = call.rm_xid;
+	refcount_inc(&conn->refcnt);
+	req->conn = conn;
+	req->work.fn = nfs_req_work;
+	req->work.done = nfs_req_done;
+	queue_work(nfs_wqueue, &req->work);
+out:
+	xdr_destroy(&xdrs);
+	return ret;
+}
+
+/*
+ * Receive what is readable of the current record of the connection, which is
+ * made of fragments prefixed by their length.  Return false if the connection
+ * is closed or broken.
+ */
+static bool nfs_conn_recv(struct nfs_conn *conn)
+{
+	int fd = conn->xprt.xp_fd;
+	ssize_t n;
+	char *msg;
+	uint32_t len;
+
+	if (conn->marker_done < sizeof(conn->marker)) {
+		n = recv(fd, (char *)&conn->marker + conn->marker_done,
+			 sizeof(conn->marker) - conn->marker_done, 0);
+		if (n <= 0)
+			goto closed;
+		conn->marker_done += n;
+		if (conn->marker_done < sizeof(conn->marker))
+			return true;
+
+		conn->frag_len = ntohl(conn->marker) & ~RPC_LAST_FRAG;
+		conn->frag_done = 0;
+		if (conn->msg_len + conn->frag_len > NFS_MAX_MSG_SIZE) {
+			sd_err("too large rpc record, %" PRIu32,
+			       conn->msg_len + conn->frag_len);
+			return false;
+		}
+		conn->msg = xrealloc(conn->msg,
+				     conn->msg_len + conn->frag_len);
+	} else {
+		n = recv(fd, conn->msg + conn->msg_len + conn->frag_done,
+			 conn->frag_len - conn->frag_done, 0);
+		if (n <= 0)
+			goto closed;
+		conn->frag_done += n;
+	}
+
+	if (conn->frag_done < conn->frag_len)
+		return true;
+
+	conn->msg_len += conn->frag_len;
+	conn->marker_done = 0;
+	if (!(ntohl(conn->marker) & RPC_LAST_FRAG))
+		return true;
+
+	msg = conn->msg;
+	len = conn->msg_len;
+	conn->msg = NULL;
+	conn->msg_len = 0;
+	if (!nfs_conn_handle(conn, msg, len)) {
+		free(msg);
+		return false;
+	}
+	free(msg);
+	return true;
+closed:
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n < 0)
+		sd_debug("failed to receive, %m");
+	return false;
+}
+
+static void nfs_conn_close(struct nfs_conn *conn)
+{
+	list_del(&conn->list);
+	/* fail the replies in flight, the fd is closed with the last one */
+	shutdown(conn->xprt.xp_fd, SHUT_RDWR);
+	nfs_conn_put(conn);
+}
+
+static void nfs_accept(void)
+{
+	struct nfs_conn *conn;
+	int fd, on = 1;
+
+	fd = accept(nfs_listen_fd, NULL, NULL);
+	if (fd < 0) {
+		sd_err("failed to accept, %m");
+		return;
+	}
+	if (fd >= FD_SETSIZE) {
+		sd_err("too many connections");
+		close(fd);
+		return;
+	}
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		sd_warn("failed to set TCP_NODELAY, %m");
+
+	conn = xzalloc(sizeof(*conn));
+	conn->xprt.xp_fd = fd;
+	sd_init_mutex(&conn->lock);
+	refcount_set(&conn->refcnt, 1);
+	list_add_tail(&conn->list, &nfs_conn_list);
+}
+
+static int nfs_listen_tcp(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	socklen_t len = sizeof(addr);
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		sd_err("failed to create a socket, %m");
+		return -1;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		sd_err("failed to listen, %m");
+		goto err;
+	}
+
+	if (!pmap_set(NFS_PROGRAM, NFS_V3, IPPROTO_TCP,
+		      ntohs(addr.sin_port))) {
+		sd_err("pmap_set tcp, failed");
+		goto err;
+	}
+
+	nfs_listen_fd = fd;
+	sd_info("nfs service listen at %d, proto tcp", ntohs(addr.sin_port));
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
+
 static void svc_dispatcher(struct svc_req *reg, SVCXPRT *transp)
 {
-	struct nfs_arg arg = {};
 	int prog = reg->rq_prog, vers = reg->rq_vers, proc = reg->rq_proc;
 	struct svc_handler *handlers;
+	struct nfs_req *req;
+	size_t nr_handlers;
 	void *result;
 
-	if (prog == NFS_PROGRAM && vers == NFS_V3)
+	if (prog == NFS_PROGRAM && vers == NFS_V3) {
 		handlers = nfs3_handlers;
-	else if (prog == MOUNT_PROGRAM && vers == MOUNT_V3)
+		nr_handlers = ARRAY_SIZE(nfs3_handlers);
+	} else if (prog == MOUNT_PROGRAM && vers == MOUNT_V3) {
 		handlers = mount3_handlers;
-	else {
+		nr_handlers = ARRAY_SIZE(mount3_handlers);
+	} else {
 		sd_err("invalid protocol %d, version %d", prog, vers);
 		return;
 	}
 
-	sd_debug("%s", handlers[proc].name);
+	if (proc >= nr_handlers) {
+		svcerr_noproc(transp);
+		return;
+	}
 
-	if (!svc_getargs(transp, handlers[proc].decoder, (caddr_t)&arg)) {
+	req = nfs_req_alloc(handlers + proc);
+	req->rq = *reg;
+	if (!svc_getargs(transp, handlers[proc].decoder, (caddr_t)&req->arg)) {
 		sd_err("svc_getargs failed");
 		svcerr_decode(transp);
+		free(req);
 		return;
 	}
 
-	handlers[proc].count++;
-	result = handlers[proc].func(reg, &arg);
+	result = nfs_call(req);
 	if (result && !svc_sendreply(transp, handlers[proc].encoder,
 				     result)) {
 		sd_err("svc_sendreply failed");
 		svcerr_systemerr(transp);
 	}
 
-	if (!svc_freeargs(transp, handlers[proc].decoder, (caddr_t)&arg))
-		panic("unable to free arguments");
-
-	return;
+	nfs_req_free(req);
 }
 
 static int nfs_init_transport(void)
@@ -135,18 +513,8 @@ static int nfs_init_transport(void)
 	}
 	sd_info("nfs service listen at %d, proto udp", nfs_trans->xp_port);
 
-	nfs_trans = svctcp_create(RPC_ANYSOCK, 0, 0);
-	if (!nfs_trans) {
-		sd_err("svctcp_create failed");
-		return -1;
-	}
-
-	if (!svc_register(nfs_trans, NFS_PROGRAM, NFS_V3, svc_dispatcher,
-			  IPPROTO_TCP)) {
-		sd_err("svc_register tcp, failed");
+	if (nfs_listen_tcp() < 0)
 		return -1;
-	}
-	sd_info("nfs service listen at %d, proto tcp", nfs_trans->xp_port);
 
 	nfs_trans = svcudp_create(RPC_ANYSOCK);
 	if (!nfs_trans) {
@@ -176,6 +544,61 @@ static int nfs_init_transport(void)
 	return 0;
 }
 
+/*
+ * svc_run() which also serves the NFS connections over TCP, and with a timeout
+ * to write back the buffered writes which clients don't commit in time
+ */
+static void nfs_svc_run(void)
+{
+	struct nfs_conn *conn;
+	fd_set readfds, svcfds;
+	struct timeval tv;
+	bool svc_ready;
+	int ret, fd;
+
+	for (;;) {
+		readfds = svc_fdset;
+		FD_SET(nfs_listen_fd, &readfds);
+		list_for_each_entry(conn, &nfs_conn_list, list)
+			FD_SET(conn->xprt.xp_fd, &readfds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		ret = select(FD_SETSIZE, &readfds, NULL, NULL, &tv);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			sd_err("select failed, %m");
+			return;
+		}
+
+		if (ret > 0) {
+			list_for_each_entry(conn, &nfs_conn_list, list) {
+				if (FD_ISSET(conn->xprt.xp_fd, &readfds) &&
+				    !nfs_conn_recv(conn))
+					nfs_conn_close(conn);
+			}
+			if (FD_ISSET(nfs_listen_fd, &readfds))
+				nfs_accept();
+
+			FD_ZERO(&svcfds);
+			svc_ready = false;
+			for (fd = 0; fd < FD_SETSIZE; fd++) {
+				if (FD_ISSET(fd, &readfds) &&
+				    FD_ISSET(fd, &svc_fdset)) {
+					FD_SET(fd, &svcfds);
+					svc_ready = true;
+				}
+			}
+			if (svc_ready)
+				svc_getreqset(&svcfds);
+		}
+
+		sd_write_lock(&nfs_lock);
+		fs_flush_expired();
+		sd_rw_unlock(&nfs_lock);
+	}
+}
+
 static void *nfsd(void *ignored)
 {
 	int err;
@@ -183,8 +606,7 @@ static void *nfsd(void *ignored)
 	if (nfs_init_transport() < 0)
 		goto out;
 
-	/* FIXME: glibc doesn't support multi-threaded svc API */
-	svc_run();
+	nfs_svc_run();
 
 	sd_err("svc_run exited");
 out:
@@ -201,6 +623,10 @@ int nfs_init(const char *options)
 	sd_thread_t t;
 	int err;
 
+	nfs_wqueue = create_work_queue("nfs", WQ_DYNAMIC);
+	if (!nfs_wqueue)
+		return -1;
+
 	err = sd_thread_create("nfs", &t, nfsd, NULL);
 	if (err) {
 		sd_err("%s", strerror(err));
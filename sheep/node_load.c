@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load of the other nodes as seen by this gateway
+ *
+ * For every node we forward requests to, we count the requests in flight and
+ * keep a moving average of the read latency with its mean deviation, which
+ * are computed like the smoothed RTT of TCP (RFC 6298).  The gateway reads
+ * from the replica which is expected to respond first and, if hedged reads
+ * are enabled, sends a second read to another replica when the first one
+ * isn't done after the tail latency of its node.
+ *
+ * The estimates are updated by the worker threads without locking.  A sample
+ * can be lost by concurrent updates, which doesn't matter for an average.
+ */
+
+#include "sheep_priv.h"
+
+/* gains of the moving averages, 1/8 and 1/4 as TCP */
+#define SRTT_SHIFT	3
+#define RTTVAR_SHIFT	2
+
+/* a node is considered unhealthy for this long after a failed request */
+#define NODE_ERROR_HOLDOFF	(10ULL * 1000000000)
+
+/*
+ * One of this many reads goes to a random healthy replica so that the
+ * estimates of the nodes which aren't chosen don't get stale.
+ */
+#define NODE_PROBE_RATE		16
+
+/* don't hedge reads which normally complete in less than this (ns) */
+#define HEDGE_MIN_DELAY		(1000 * 1000)
+
+struct node_load {
+	struct rb_node rb;
+	struct node_id nid;
+	int inflight;
+	uint64_t srtt;		/* ns, 0 if there is no sample yet */
+	uint64_t rttvar;	/* ns */
+	uint64_t error_time;
+};
+
+static struct rb_root node_load_root = RB_ROOT;
+static struct sd_rw_lock node_load_lock = SD_RW_LOCK_INITIALIZER;
+
+static int node_load_cmp(const struct node_load *a, const struct node_load *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
+}
+
+/* Entries are never freed, so the returned pointer stays valid */
+static struct node_load *get_node_load(const struct node_id *nid)
+{
+	struct node_load key = { .nid = *nid }, *load, *old;
+
+	sd_read_lock(&node_load_lock);
+	load = rb_search(&node_load_root, &key, rb, node_load_cmp);
+	sd_rw_unlock(&node_load_lock);
+	if (load)
+		return load;
+
+	load = xzalloc(sizeof(*load));
+	load->nid = *nid;
+	sd_write_lock(&node_load_lock);
+	old = rb_insert(&node_load_root, load, rb, node_load_cmp);
+	sd_rw_unlock(&node_load_lock);
+	if (old) {
+		free(load);
+		load = old;
+	}
+
+	return load;
+}
+
+void node_load_begin(const struct node_id *nid)
+{
+	uatomic_inc(&get_node_load(nid)->inflight);
+}
+
+/*
+ * Account the completion of a request sent to the node at 'sent'.  If 'read'
+ * is true, its latency is added to the read estimate of the node.
+ */
+void node_load_end(const struct node_id *nid, uint64_t sent, bool read,
+		   bool failed)
+{
+	struct node_load *load = get_node_load(nid);
+	uint64_t now = clock_get_time();
+	int64_t lat, srtt, rttvar, delta;
+
+	uatomic_dec(&load->inflight);
+
+	if (failed) {
+		uatomic_set(&load->error_time, now);
+		return;
+	}
+	if (!read || now < sent)
+		return;
+
+	lat = now - sent;
+	srtt = uatomic_read(&load->srtt);
+	rttvar = uatomic_read(&load->rttvar);
+	if (!srtt) {
+		srtt = lat;
+		rttvar = lat / 2;
+	} else {
+		delta = lat - srtt;
+		srtt += delta >> SRTT_SHIFT;
+		rttvar += (llabs(delta) - rttvar) >> RTTVAR_SHIFT;
+	}
+	uatomic_set(&load->srtt, max(srtt, (int64_t)1));
+	uatomic_set(&load->rttvar, rttvar);
+}
+
+static inline bool node_load_healthy(struct node_load *load, uint64_t now)
+{
+	uint64_t error_time = uatomic_read(&load->error_time);
+
+	return !error_time || now - error_time > NODE_ERROR_HOLDOFF;
+}
+
+/*
+ * Return the index of the node which is expected to complete a read first.
+ *
+ * Each request in flight is assumed to take the average latency of the node.
+ * Nodes without samples are preferred to get one, and nodes which failed
+ * recently are chosen only if all the nodes did.
+ */
+int node_load_pick(const struct sd_node **nodes, int nr)
+{
+	uint64_t now = clock_get_time(), cost, best_cost = UINT64_MAX;
+	int start = random() % nr, best = start;
+	struct node_load *load;
+
+	if (random() % NODE_PROBE_RATE == 0 &&
+	    node_load_healthy(get_node_load(&nodes[start]->nid), now))
+		return start;
+
+	for (int i = 0; i < nr; i++) {
+		int idx = (start + i) % nr;
+
+		load = get_node_load(&nodes[idx]->nid);
+		cost = uatomic_read(&load->srtt) *
+			(uatomic_read(&load->inflight) + 1);
+		if (!node_load_healthy(load, now))
+			cost = UINT64_MAX - 1;
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = idx;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Return how long to wait for a read from the node before sending another
+ * one to a different replica, or 0 if we don't know the node well enough.
+ *
+ * srtt + 2 * rttvar is about the 95th percentile for normally distributed
+ * latencies, since the mean deviation is about 0.8 times the standard one.
+ */
+uint64_t node_load_hedge_delay(const struct node_id *nid)
+{
+	struct node_load *load = get_node_load(nid);
+	uint64_t srtt = uatomic_read(&load->srtt);
+
+	if (!srtt)
+		return 0;
+
+	return max(srtt + 2 * uatomic_read(&load->rttvar),
+		   (uint64_t)HEDGE_MIN_DELAY);
+}
@@ -143,6 +143,67 @@ out:
 	return ret;
 }
 
+static bool obj_is_placed_on(uint64_t oid, struct vnode_info *vinfo,
+			     const struct sd_req *hdr)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	const struct node_id *nid;
+	int i, nr_copies;
+
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	oid_to_vnodes(oid, &vinfo->vroot, nr_copies, vnodes);
+	for (i = 0; i < nr_copies; i++) {
+		nid = &vnodes[i]->node->nid;
+		if (nid->port == hdr->obj_list.port &&
+		    memcmp(nid->addr, hdr->obj_list.addr, sizeof(nid->addr)) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Return the cached oids greater than hdr->obj_list.cursor which the node
+ * hdr->obj_list.addr:port holds a replica of at hdr->obj_list.tgt_epoch, in
+ * ascending order.  The response is filled up to hdr->data_length, so the
+ * requester has to ask again from the last returned oid while it gets full
+ * responses.
+ */
+int get_obj_list_filtered(const struct sd_req *hdr, struct sd_rsp *rsp,
+			  void *data, struct vnode_info *vinfo)
+{
+	struct objlist_cache_entry *entry, key = {
+		.oid = hdr->obj_list.cursor + 1,
+	};
+	uint64_t *oids = data;
+	uint32_t nr = 0, max = hdr->data_length / sizeof(uint64_t);
+	struct rb_node *n;
+
+	if (hdr->obj_list.tgt_epoch != sys_epoch()) {
+		sd_debug("epoch mismatch %" PRIu32 ", %" PRIu32,
+			 hdr->obj_list.tgt_epoch, sys_epoch());
+		return before(hdr->obj_list.tgt_epoch, sys_epoch()) ?
+			SD_RES_OLD_NODE_VER : SD_RES_NEW_NODE_VER;
+	}
+
+	sd_read_lock(&obj_list_cache.lock);
+	entry = rb_nsearch(&obj_list_cache.root, &key, node,
+			   objlist_cache_cmp);
+	/* rb_nsearch() wraps around to the first entry */
+	if (entry && entry->oid < key.oid)
+		entry = NULL;
+
+	for (n = entry ? &entry->node : NULL; n && nr < max; n = rb_next(n)) {
+		entry = rb_entry(n, struct objlist_cache_entry, node);
+		if (obj_is_placed_on(entry->oid, vinfo, hdr))
+			oids[nr++] = entry->oid;
+	}
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	rsp->data_length = nr * sizeof(uint64_t);
+	return SD_RES_SUCCESS;
+}
+
 static void objlist_deletion_work(struct work *work)
 {
 	struct objlist_deletion_work *ow =
@@ -548,6 +548,12 @@ static int local_get_obj_list(struct request *req)
 	return get_obj_list(&req->rq, &req->rp, req->data);
 }
 
+static int local_get_obj_list_filtered(struct request *req)
+{
+	return get_obj_list_filtered(&req->rq, &req->rp, req->data,
+				     req->vinfo);
+}
+
 static int local_get_epoch(struct request *req)
 {
 	uint32_t epoch = req->rq.obj.tgt_epoch;
@@ -859,7 +865,8 @@ static int local_get_hash(struct request *request)
 		return SD_RES_NO_SUPPORT;
 
 	return sd_store->get_hash(req->obj.oid, req->obj.tgt_epoch,
-				  rsp->hash.digest);
+				  rsp->hash.digest,
+				  req->flags & SD_FLAG_CMD_CRC32C);
 }
 
 static int local_sd_stat(const struct sd_req *req, struct sd_rsp *rsp,
@@ -870,10 +877,45 @@ static int local_sd_stat(const struct sd_req *req, struct sd_rsp *rsp,
 	return SD_RES_SUCCESS;
 }
 
-/* Return SD_RES_INVALID_PARMS to ask client not to send flush req again */
+static int local_get_slow_reqs(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+	rsp->data_length = slowlog_get(data, req->data_length,
+				       req->flags & SD_FLAG_CMD_DEL);
+	return SD_RES_SUCCESS;
+}
+
+static int cluster_set_vdi_qos(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+	if (req->data_length < sizeof(struct sd_vdi_qos))
+		return SD_RES_INVALID_PARMS;
+
+	qos_set(req->vdi.base_vdi_id, data);
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_vdi_qos(const struct sd_req *req, struct sd_rsp *rsp,
+			     void *data, const struct sd_node *sender)
+{
+	if (req->data_length < sizeof(struct sd_vdi_qos_stat))
+		return SD_RES_INVALID_PARMS;
+
+	qos_get_stat(req->vdi.base_vdi_id, data);
+	rsp->data_length = sizeof(struct sd_vdi_qos_stat);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Return SD_RES_INVALID_PARMS to ask client not to send flush req again unless
+ * we are in write-back mode, where the flush has to reach the replicas.
+ */
 static int local_flush_vdi(struct request *req)
 {
-	return SD_RES_INVALID_PARMS;
+	if (!is_writeback_mode())
+		return SD_RES_INVALID_PARMS;
+
+	return gateway_flush_vdi(req);
 }
 
 static int local_discard_obj(struct request *req)
@@ -916,7 +958,20 @@ static int local_flush_and_del(struct request *req)
 static int local_trace_enable(const struct sd_req *req, struct sd_rsp *rsp,
 			      void *data, const struct sd_node *sender)
 {
-	return trace_enable(data);
+	char *name = data, *opts = NULL;
+	size_t len;
+
+	/* the tracer name can be followed by its options */
+	len = strnlen(name, req->data_length);
+	if (len + 1 < req->data_length) {
+		opts = name + len + 1;
+		if (strnlen(opts, req->data_length - len - 1) ==
+		    req->data_length - len - 1)
+			return SD_RES_INVALID_PARMS;
+	} else if (len == req->data_length)
+		return SD_RES_INVALID_PARMS;
+
+	return trace_enable(name, opts);
 }
 
 static int local_trace_disable(const struct sd_req *req, struct sd_rsp *rsp,
@@ -967,6 +1022,45 @@ static int peer_remove_obj(struct request *req)
 	return sd_store->remove_object(oid, ec_index);
 }
 
+static int peer_flush_vdi(struct request *req)
+{
+	uint32_t vid = *(uint32_t *)req->data;
+
+	return dirty_vdi_sync(vid);
+}
+
+/*
+ * Remove a batch of objects which the sender has found to be placed on this
+ * node.  Missing objects are not an error because the batch can be retried
+ * object by object after a partial failure.
+ */
+static int peer_remove_objs(struct request *req)
+{
+	uint64_t *oids = (uint64_t *)req->data;
+	int i, n = req->rq.data_length / sizeof(uint64_t);
+	int ret = SD_RES_SUCCESS, err;
+
+	for (i = 0; i < n; i++) {
+		uint8_t ec_index = local_ec_index(req->vinfo, oids[i]);
+		struct io_ticket ticket;
+
+		if (is_erasure_oid(oids[i]) && ec_index == SD_MAX_COPIES)
+			continue;
+
+		objlist_cache_remove(oids[i]);
+		iosched_begin(&ticket, oids[i], IO_CLASS_BACKGROUND);
+		err = sd_store->remove_object(oids[i], ec_index);
+		iosched_end(&ticket);
+		if (err != SD_RES_SUCCESS && err != SD_RES_NO_OBJ) {
+			sd_err("failed to remove %016" PRIx64 ", %s", oids[i],
+			       sd_strerror(err));
+			ret = err;
+		}
+	}
+
+	return ret;
+}
+
 int peer_read_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
@@ -991,6 +1085,11 @@ int peer_read_obj(struct request *req)
 		goto out;
 
 	rsp->data_length = hdr->data_length;
+	if (hdr->flags & SD_FLAG_CMD_SPARSE) {
+		rsp->data_length = sparse_pack(req->data, hdr->data_length);
+		if (rsp->data_length < hdr->data_length)
+			rsp->flags |= SD_FLAG_CMD_SPARSE;
+	}
 out:
 	return ret;
 }
@@ -1007,21 +1106,78 @@ static int peer_write_obj(struct request *req)
 	iocb.offset = hdr->obj.offset;
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
+	iocb.writeback = is_writeback_obj(oid);
 
 	return sd_store->write(oid, &iocb);
 }
 
+/*
+ * Create an object of a cloned vdi as a copy of its parent object and write
+ * the request data to it.  The parent is copied locally if this node has it,
+ * otherwise it is read from the cluster.
+ */
+static int peer_cow_write_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t oid = hdr->obj.oid, cow_oid = hdr->obj.cow_oid;
+	size_t len = get_objsize(oid, get_vdi_object_size(oid_to_vid(oid)));
+	struct siocb iocb = { };
+	char *buf;
+	int ret;
+
+	iocb.epoch = hdr->epoch;
+	iocb.ec_index = hdr->obj.ec_index;
+	iocb.copy_policy = hdr->obj.copy_policy;
+	iocb.writeback = is_writeback_obj(oid);
+
+	/* the journal can't replay the copy of the parent */
+	if (!uatomic_is_true(&sys->use_journal) &&
+	    sd_store->exist(cow_oid, iocb.ec_index)) {
+		iocb.buf = req->data;
+		iocb.length = hdr->data_length;
+		iocb.offset = hdr->obj.offset;
+		iocb.cow_oid = cow_oid;
+		ret = sd_store->create_and_write(oid, &iocb);
+		if (ret != SD_RES_NO_OBJ)
+			return ret;
+		sd_debug("%016"PRIx64" has gone, read it from the cluster",
+			 cow_oid);
+	}
+
+	buf = xvalloc(len);
+	ret = sd_read_object(cow_oid, buf, len, 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read the parent %016"PRIx64" of %016"PRIx64
+		       ", %s", cow_oid, oid, sd_strerror(ret));
+		goto out;
+	}
+	memcpy(buf + hdr->obj.offset, req->data, hdr->data_length);
+
+	iocb.buf = buf;
+	iocb.length = len;
+	iocb.offset = 0;
+	iocb.cow_oid = 0;
+	ret = sd_store->create_and_write(oid, &iocb);
+out:
+	free(buf);
+	return ret;
+}
+
 static int peer_create_and_write_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 	struct siocb iocb = { };
 
+	if (hdr->flags & SD_FLAG_CMD_COW)
+		return peer_cow_write_obj(req);
+
 	iocb.epoch = hdr->epoch;
 	iocb.buf = req->data;
 	iocb.length = hdr->data_length;
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
 	iocb.offset = hdr->obj.offset;
+	iocb.writeback = is_writeback_obj(hdr->obj.oid);
 
 	return sd_store->create_and_write(hdr->obj.oid, &iocb);
 }
@@ -1237,7 +1393,7 @@ out:
 static int local_repair_replica(struct request *req)
 {
 	int ret;
-	struct node_id nid;
+	struct node_id nid = {};
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	struct siocb iocb = { 0 };
@@ -1252,6 +1408,13 @@ static int local_repair_replica(struct request *req)
 
 	memcpy(nid.addr, req->rq.forw.addr, sizeof(nid.addr));
 	nid.port = req->rq.forw.port;
+
+	/*
+	 * The writes of the object are blocked before the copy is read, so that
+	 * each one is either in the copy or applied after the replacement.
+	 */
+	if (sys->checksum)
+		csum_replace_begin(oid);
 	ret = sheep_exec_req(&nid, &hdr, buf);
 	if (ret == SD_RES_SUCCESS) {
 		sd_debug("read object %016"PRIx64" from %s successfully, "
@@ -1271,6 +1434,8 @@ static int local_repair_replica(struct request *req)
 				addr_to_str(nid.addr, nid.port),
 				sd_strerror(ret));
 	}
+	if (sys->checksum)
+		csum_replace_end(oid);
 
 	free(buf);
 	return ret;
@@ -1677,6 +1842,12 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_obj_list,
 	},
 
+	[SD_OP_GET_OBJ_LIST_FILTERED] = {
+		.name = "GET_OBJ_LIST_FILTERED",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_obj_list_filtered,
+	},
+
 	[SD_OP_GET_EPOCH] = {
 		.name = "GET_EPOCH",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1769,6 +1940,24 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_sd_stat,
 	},
 
+	[SD_OP_GET_SLOW_REQS] = {
+		.name = "GET_SLOW_REQS",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_get_slow_reqs,
+	},
+
+	[SD_OP_SET_VDI_QOS] = {
+		.name = "SET_VDI_QOS",
+		.type = SD_OP_TYPE_CLUSTER,
+		.process_main = cluster_set_vdi_qos,
+	},
+
+	[SD_OP_GET_VDI_QOS] = {
+		.name = "GET_VDI_QOS",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_get_vdi_qos,
+	},
+
 	[SD_OP_GET_LOGLEVEL] = {
 		.name = "GET_LOGLEVEL",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1907,6 +2096,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = peer_remove_obj,
 	},
 
+	[SD_OP_FLUSH_PEER] = {
+		.name = "FLUSH_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_flush_vdi,
+	},
+
+	[SD_OP_REMOVE_PEERS] = {
+		.name = "REMOVE_PEERS",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_remove_objs,
+	},
+
 	[SD_OP_DECREF_PEER] = {
 		.name = "DECREF_PEER",
 		.type = SD_OP_TYPE_PEER,
@@ -1984,16 +2185,49 @@ bool has_process_main(const struct sd_op_template *op)
 	return op != NULL && !!op->process_main;
 }
 
+static enum io_class peer_io_class(const struct sd_req *hdr)
+{
+	/* a guest request is blocked on the urgent recovery reads */
+	if (hdr->flags & SD_FLAG_CMD_RECOVERY &&
+	    !(hdr->flags & SD_FLAG_CMD_URGENT))
+		return IO_CLASS_RECOVERY;
+
+	switch (hdr->opcode) {
+	case SD_OP_REMOVE_PEER:
+		return IO_CLASS_BACKGROUND;
+	case SD_OP_CREATE_AND_WRITE_PEER:
+	case SD_OP_WRITE_PEER:
+	case SD_OP_DECREF_PEER:
+		return IO_CLASS_WRITE;
+	default:
+		return IO_CLASS_READ;
+	}
+}
+
 void do_process_work(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
+	bool sched = is_peer_op(req->op) && req->rq.obj.oid;
+	struct io_ticket ticket;
 	int ret = SD_RES_SUCCESS;
 
 	sd_debug("%x, %016" PRIx64", %"PRIu32, req->rq.opcode, req->rq.obj.oid,
 		 req->rq.epoch);
 
+	req->stamp[REQ_STAMP_WORK] = clock_get_time();
+
+	if (sched)
+		iosched_begin(&ticket, req->rq.obj.oid,
+			      peer_io_class(&req->rq));
+	if (is_gateway_op(req->op) || is_peer_op(req->op))
+		trace_set_req_id(req->rq.obj.req_id);
 	if (req->op->process_work)
 		ret = req->op->process_work(req);
+	trace_set_req_id(0);
+	if (sched)
+		iosched_end(&ticket);
+
+	req->stamp[REQ_STAMP_DONE] = clock_get_time();
 
 	if (ret != SD_RES_SUCCESS) {
 		sd_debug("failed: %x, %016" PRIx64" , %u, %s", req->rq.opcode,
@@ -2003,6 +2237,43 @@ void do_process_work(struct work *work)
 	req->rp.result = ret;
 }
 
+/*
+ * Execute a peer request to the local replica of a gateway request in the
+ * worker of the gateway request, instead of sending it to this node over a
+ * loopback connection and queueing it to the peer work queue again.
+ *
+ * The gateway request has waited for the recovery of the object if needed,
+ * so only the epoch has to be checked again as queue_peer_request() does.
+ */
+worker_fn int exec_local_peer_req(struct request *req, struct sd_req *hdr,
+				  void *data)
+{
+	struct request peer = {
+		.rq = *hdr,
+		.op = get_sd_op(hdr->opcode),
+		.data = data,
+		.data_length = hdr->data_length,
+		.local = true,
+		.vinfo = req->vinfo,
+	};
+	uint32_t epoch = sys_epoch();
+	struct io_ticket ticket;
+	int ret;
+
+	if (before(hdr->epoch, epoch)) {
+		sd_debug("old node version %u, %u (%s)", epoch, hdr->epoch,
+			 op_name(peer.op));
+		req->rp.epoch = epoch;
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	iosched_begin(&ticket, hdr->obj.oid, peer_io_class(hdr));
+	ret = peer.op->process_work(&peer);
+	iosched_end(&ticket);
+
+	return ret;
+}
+
 int do_process_main(const struct sd_op_template *op, const struct sd_req *req,
 		    struct sd_rsp *rsp, void *data,
 		    const struct sd_node *sender)
@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * QoS of the vdis at the gateway
+ *
+ * The limits of a vdi are stored in its SD_VDI_QOS_ATTR_KEY attribute, so
+ * they are shared by the snapshots of the vdi, which are grouped by the hash
+ * of their name like the attributes.  A node loads the limits of a group when
+ * it first sees a data object of one of its vdis, and 'dog vdi qos' notifies
+ * every node of the new limits with SD_OP_SET_VDI_QOS.
+ *
+ * The gateway requests of data objects wait in the queue of their group until
+ *  - the token buckets of the group have enough tokens for the request, which
+ *    are implemented with the generic cell rate algorithm (GCRA), and
+ *  - less than sys->qos_depth requests are in flight, if it is set.  The
+ *    groups share the gateway workers in proportion to their weights by
+ *    start-time fair queuing.
+ *
+ * Requests issued by sheep itself bypass QoS, since the gateway workers may
+ * wait for them.  Everything here is only touched in the main thread.
+ */
+
+#include "sheep_priv.h"
+
+/* the cost of a request for fair queuing is its length plus this */
+#define QOS_REQ_COST 4096
+
+enum qos_vdi_state {
+	QOS_VDI_UNKNOWN,	/* the group isn't known */
+	QOS_VDI_LOADING,
+	QOS_VDI_LOADED,
+};
+
+struct qos_group {
+	struct rb_node rb;
+	uint32_t id;		/* sd_hash_vdi() of the vdi name */
+	bool loaded;		/* limits are known */
+	struct sd_vdi_qos qos;
+
+	uint64_t iops_tat;	/* theoretical arrival times of GCRA, ns */
+	uint64_t bps_tat;
+	uint64_t finish;	/* virtual finish time of the last request */
+
+	struct list_head queue;
+	struct list_node active_list;	/* linked while the queue isn't empty */
+	struct sd_vdi_qos_stat stat;
+};
+
+/* the group of the data objects of a vdi */
+struct qos_vdi {
+	struct rb_node rb;
+	uint32_t vid;
+	enum qos_vdi_state state;
+	struct qos_group *group;
+	struct list_head pending;	/* requests waiting for the group */
+};
+
+struct qos_load_work {
+	struct work work;
+	struct qos_vdi *qv;
+	uint32_t id;
+	struct sd_vdi_qos qos;
+	int ret;
+};
+
+static struct rb_root qos_vdi_root = RB_ROOT;
+static struct rb_root qos_group_root = RB_ROOT;
+static LIST_HEAD(active_groups);
+static uint64_t qos_vtime;	/* start time of the last dispatched request */
+static int qos_inflight;
+
+static void qos_timer_fn(void *data);
+static struct timer qos_timer = { .callback = qos_timer_fn };
+static uint64_t qos_timer_deadline;
+
+static int qos_vdi_cmp(const struct qos_vdi *a, const struct qos_vdi *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int qos_group_cmp(const struct qos_group *a, const struct qos_group *b)
+{
+	return intcmp(a->id, b->id);
+}
+
+/* Entries are never freed, like the vdi states */
+static struct qos_vdi *get_qos_vdi(uint32_t vid)
+{
+	struct qos_vdi key = { .vid = vid }, *qv;
+
+	qv = rb_search(&qos_vdi_root, &key, rb, qos_vdi_cmp);
+	if (qv)
+		return qv;
+
+	qv = xzalloc(sizeof(*qv));
+	qv->vid = vid;
+	INIT_LIST_HEAD(&qv->pending);
+	rb_insert(&qos_vdi_root, qv, rb, qos_vdi_cmp);
+
+	return qv;
+}
+
+static struct qos_group *find_qos_group(uint32_t id)
+{
+	struct qos_group key = { .id = id };
+
+	return rb_search(&qos_group_root, &key, rb, qos_group_cmp);
+}
+
+static struct qos_group *get_qos_group(uint32_t id)
+{
+	struct qos_group *g = find_qos_group(id);
+
+	if (g)
+		return g;
+
+	g = xzalloc(sizeof(*g));
+	g->id = id;
+	INIT_LIST_HEAD(&g->queue);
+	INIT_LIST_NODE(&g->active_list);
+	rb_insert(&qos_group_root, g, rb, qos_group_cmp);
+
+	return g;
+}
+
+static inline uint32_t req_len(const struct request *req)
+{
+	return req->rq.data_length;
+}
+
+/*
+ * Return when a request of 'cost' tokens conforms to a bucket whose
+ * theoretical arrival time is 'tat', or 0 if the bucket has no limit.
+ *
+ * A request larger than the burst only has to wait for a full bucket.
+ */
+static uint64_t bucket_ready(uint64_t tat, double cost, uint64_t rate,
+			     uint64_t burst)
+{
+	double interval, slack;
+
+	if (!rate)
+		return 0;
+	if (!burst)
+		burst = rate;
+
+	interval = 1e9 / rate;
+	slack = (burst - min(cost, (double)burst)) * interval;
+	if (slack >= tat)
+		return 0;
+
+	return tat - (uint64_t)slack;
+}
+
+static void bucket_charge(uint64_t *tat, double cost, uint64_t rate,
+			  uint64_t now)
+{
+	if (!rate)
+		return;
+
+	*tat = max(*tat, now) + (uint64_t)(cost * 1e9 / rate);
+}
+
+static uint64_t qos_ready_time(const struct qos_group *g,
+			       const struct request *req)
+{
+	return max(bucket_ready(g->iops_tat, 1, g->qos.iops,
+				g->qos.iops_burst),
+		   bucket_ready(g->bps_tat, req_len(req), g->qos.bps,
+				g->qos.bps_burst));
+}
+
+static inline uint64_t qos_start_tag(const struct qos_group *g)
+{
+	return max(qos_vtime, g->finish);
+}
+
+static void qos_dispatch_request(struct qos_group *g, struct request *req,
+				 uint64_t now)
+{
+	uint64_t wait = now - req->qos_time;
+
+	list_del(&req->request_list);
+	if (list_empty(&g->queue))
+		list_del(&g->active_list);
+
+	bucket_charge(&g->iops_tat, 1, g->qos.iops, now);
+	bucket_charge(&g->bps_tat, req_len(req), g->qos.bps, now);
+
+	qos_vtime = qos_start_tag(g);
+	g->finish = qos_vtime + (QOS_REQ_COST + req_len(req)) /
+		max(g->qos.weight, 1U);
+
+	g->stat.nr_queued--;
+	g->stat.nr_reqs++;
+	g->stat.bytes += req_len(req);
+	g->stat.wait_time += wait;
+	sys->stat.q.queued_nr--;
+	sys->stat.q.total_nr++;
+	sys->stat.q.wait_time += wait;
+	if (req->qos_throttled) {
+		g->stat.nr_throttled++;
+		sys->stat.q.throttled_nr++;
+	}
+
+	req->qos_inflight = true;
+	qos_inflight++;
+	queue_work(sys->gateway_wqueue, &req->work);
+}
+
+static void qos_arm_timer(uint64_t deadline, uint64_t now)
+{
+	if (qos_timer_deadline && qos_timer_deadline <= deadline)
+		return;
+
+	qos_timer_deadline = deadline;
+	add_timer(&qos_timer, DIV_ROUND_UP(deadline - now, 1000000));
+}
+
+/*
+ * Send the waiting requests to the gateway workers.  Among the groups whose
+ * first request conforms to their limits, the one with the smallest start
+ * tag goes first.
+ */
+static void qos_dispatch(void)
+{
+	uint64_t now = clock_get_time(), next = UINT64_MAX;
+
+	while (!sys->qos_depth || qos_inflight < sys->qos_depth) {
+		struct qos_group *g, *best = NULL;
+		struct request *req;
+		uint64_t ready;
+
+		list_for_each_entry(g, &active_groups, active_list) {
+			req = list_first_entry(&g->queue, struct request,
+					       request_list);
+			ready = qos_ready_time(g, req);
+			if (ready > now) {
+				req->qos_throttled = true;
+				next = min(next, ready);
+				continue;
+			}
+			if (!best || qos_start_tag(g) < qos_start_tag(best))
+				best = g;
+		}
+		if (!best)
+			break;
+
+		req = list_first_entry(&best->queue, struct request,
+				       request_list);
+		qos_dispatch_request(best, req, now);
+	}
+
+	if (next != UINT64_MAX)
+		qos_arm_timer(next, now);
+}
+
+static void qos_timer_fn(void *data)
+{
+	qos_timer_deadline = 0;
+	qos_dispatch();
+}
+
+static void qos_enqueue(struct qos_group *g, struct request *req)
+{
+	if (list_empty(&g->queue))
+		list_add_tail(&g->active_list, &active_groups);
+	list_add_tail(&req->request_list, &g->queue);
+	g->stat.nr_queued++;
+}
+
+static worker_fn void qos_load_work(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct sd_inode *inode = xmalloc(SD_INODE_HEADER_SIZE);
+	struct sheepdog_vdi_attr *vattr = xzalloc(sizeof(*vattr));
+	uint32_t attrid;
+	int ret;
+
+	ret = sd_read_object(vid_to_vdi_oid(lw->qv->vid), (char *)inode,
+			     SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	lw->id = sd_hash_vdi(inode->name);
+	pstrcpy(vattr->name, sizeof(vattr->name), inode->name);
+	pstrcpy(vattr->key, sizeof(vattr->key), SD_VDI_QOS_ATTR_KEY);
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, lw->id, &attrid,
+			   inode->create_time, false, false, false);
+	if (ret == SD_RES_NO_OBJ) {
+		/* no limits */
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = sd_read_object(vid_to_attr_oid(lw->id, attrid), (char *)vattr,
+			     SD_ATTR_OBJ_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	memcpy(&lw->qos, vattr->value,
+	       min((size_t)vattr->value_len, sizeof(lw->qos)));
+out:
+	lw->ret = ret;
+	free(vattr);
+	free(inode);
+}
+
+static main_fn void qos_load_done(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct qos_vdi *qv = lw->qv;
+	struct request *req;
+
+	if (lw->ret != SD_RES_SUCCESS) {
+		/* try again with the next request */
+		sd_err("failed to load QoS of vdi %"PRIx32", %s", qv->vid,
+		       sd_strerror(lw->ret));
+		qv->state = QOS_VDI_UNKNOWN;
+		list_for_each_entry(req, &qv->pending, request_list) {
+			sys->stat.q.queued_nr--;
+			queue_work(sys->gateway_wqueue, &req->work);
+		}
+		INIT_LIST_HEAD(&qv->pending);
+		goto out;
+	}
+
+	qv->group = get_qos_group(lw->id);
+	qv->state = QOS_VDI_LOADED;
+	if (!qv->group->loaded) {
+		/* SD_OP_SET_VDI_QOS may have updated the limits meanwhile */
+		qv->group->qos = lw->qos;
+		qv->group->loaded = true;
+	}
+
+	list_for_each_entry(req, &qv->pending, request_list)
+		qos_enqueue(qv->group, req);
+	INIT_LIST_HEAD(&qv->pending);
+	qos_dispatch();
+out:
+	free(lw);
+}
+
+/* Queue a gateway request of a data object, which is set up by the caller */
+main_fn void qos_queue_request(struct request *req)
+{
+	struct qos_vdi *qv = get_qos_vdi(oid_to_vid(req->rq.obj.oid));
+	struct qos_load_work *lw;
+
+	req->qos_scheduled = true;
+	req->qos_time = clock_get_time();
+	sys->stat.q.queued_nr++;
+
+	switch (qv->state) {
+	case QOS_VDI_LOADED:
+		qos_enqueue(qv->group, req);
+		qos_dispatch();
+		break;
+	case QOS_VDI_LOADING:
+		list_add_tail(&req->request_list, &qv->pending);
+		break;
+	case QOS_VDI_UNKNOWN:
+		list_add_tail(&req->request_list, &qv->pending);
+		qv->state = QOS_VDI_LOADING;
+
+		lw = xzalloc(sizeof(*lw));
+		lw->qv = qv;
+		lw->work.fn = qos_load_work;
+		lw->work.done = qos_load_done;
+		queue_work(sys->areq_wqueue, &lw->work);
+		break;
+	}
+}
+
+main_fn void qos_request_done(struct request *req)
+{
+	req->qos_inflight = false;
+	qos_inflight--;
+	if (sys->qos_depth)
+		qos_dispatch();
+}
+
+main_fn void qos_set(uint32_t id, const struct sd_vdi_qos *qos)
+{
+	struct qos_group *g = get_qos_group(id);
+
+	g->qos = *qos;
+	g->loaded = true;
+	qos_dispatch();
+}
+
+main_fn void qos_get_stat(uint32_t id, struct sd_vdi_qos_stat *stat)
+{
+	struct qos_group *g = find_qos_group(id);
+
+	if (!g) {
+		memset(stat, 0, sizeof(*stat));
+		return;
+	}
+
+	*stat = g->stat;
+	stat->qos = g->qos;
+}
@@ -44,6 +44,7 @@ struct recovery_obj_work {
 	uint8_t local_sha1[SHA1_DIGEST_SIZE];
 
 	bool wildcard;
+	bool urgent;	/* a request is waiting for the object */
 };
 
 /*
@@ -157,12 +158,19 @@ static bool invalid_node(const struct sd_node *n, struct vnode_info *info)
 	return true;
 }
 
+/* The peer schedules the urgent reads as foreground ones */
+static inline uint16_t recovery_read_flags(const struct recovery_obj_work *row)
+{
+	return SD_FLAG_CMD_RECOVERY | (row->urgent ? SD_FLAG_CMD_URGENT : 0);
+}
+
 static int search_erasure_object(uint64_t oid, uint8_t idx,
 				 struct rb_root *nroot,
-				 struct recovery_work *rw,
+				 struct recovery_obj_work *row,
 				 uint32_t tgt_epoch,
 				 void *buf)
 {
+	struct recovery_work *rw = &row->base;
 	struct sd_req hdr;
 	unsigned rlen = get_store_objsize(oid);
 	struct sd_node *n;
@@ -173,7 +181,7 @@ static int search_erasure_object(uint64_t oid, uint8_t idx,
 			continue;
 		sd_init_req(&hdr, SD_OP_READ_PEER);
 		hdr.epoch = epoch;
-		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		hdr.flags = recovery_read_flags(row);
 		hdr.data_length = rlen;
 		hdr.obj.oid = oid;
 		hdr.obj.tgt_epoch = tgt_epoch;
@@ -202,7 +210,7 @@ static void *read_erasure_object(uint64_t oid, uint8_t idx,
 	int ret;
 again:
 	if (unlikely(old->nr_zones < edp)) {
-		if (search_erasure_object(oid, idx, &old->nroot, rw,
+		if (search_erasure_object(oid, idx, &old->nroot, row,
 					  tgt_epoch, buf)
 		    == SD_RES_SUCCESS)
 			goto done;
@@ -216,7 +224,7 @@ again:
 		goto rollback;
 	sd_init_req(&hdr, SD_OP_READ_PEER);
 	hdr.epoch = epoch;
-	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.flags = recovery_read_flags(row);
 	hdr.data_length = rlen;
 	hdr.obj.oid = oid;
 	hdr.obj.tgt_epoch = tgt_epoch;
@@ -250,6 +258,21 @@ done:
 	return buf;
 }
 
+/* Store a recovered object, giving way to the foreground I/O of the disk */
+static int store_recovered_object(struct recovery_obj_work *row,
+				  const struct siocb *iocb)
+{
+	struct io_ticket ticket;
+	int ret;
+
+	iosched_begin(&ticket, row->oid,
+		      row->urgent ? IO_CLASS_WRITE : IO_CLASS_RECOVERY);
+	ret = sd_store->create_and_write(row->oid, iocb);
+	iosched_end(&ticket);
+
+	return ret;
+}
+
 /*
  * Read object from targeted node and store it in the local node.
  *
@@ -301,10 +324,10 @@ static int recover_object_from(struct recovery_obj_work *row,
 	rlen = get_store_objsize(oid);
 	buf = xvalloc(rlen);
 
-	/* recover from remote replica */
+	/* recover from remote replica, without the zero chunks */
 	sd_init_req(&hdr, SD_OP_READ_PEER);
 	hdr.epoch = epoch;
-	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.flags = recovery_read_flags(row) | SD_FLAG_CMD_SPARSE;
 	if (wildcard)
 		hdr.flags |= SD_FLAG_CMD_WILDCARD;
 	hdr.data_length = rlen;
@@ -313,11 +336,15 @@ static int recover_object_from(struct recovery_obj_work *row,
 
 	ret = sheep_exec_req(&node->nid, &hdr, buf);
 	if (ret == SD_RES_SUCCESS) {
+		if (rsp->flags & SD_FLAG_CMD_SPARSE) {
+			sparse_unpack(buf, rsp->data_length, rlen);
+			rsp->data_length = rlen;
+		}
 		iocb.epoch = epoch;
 		iocb.length = rsp->data_length;
 		iocb.offset = rsp->obj.offset;
 		iocb.buf = buf;
-		ret = sd_store->create_and_write(oid, &iocb);
+		ret = store_recovered_object(row, &iocb);
 	}
 
 	free(buf);
@@ -587,7 +614,7 @@ static int recover_erasure_object(struct recovery_obj_work *row)
 	iocb.offset = 0;
 	iocb.buf = buf;
 	iocb.ec_index = idx;
-	ret = sd_store->create_and_write(oid, &iocb);
+	ret = store_recovered_object(row, &iocb);
 	free(buf);
 out:
 	return ret;
@@ -625,7 +652,8 @@ static void recover_object_work(struct work *work)
 	if (!is_erasure_oid(oid))
 		for (epoch = sys_epoch() - 1; epoch >= last_gathered_epoch;
 		     epoch--) {
-			ret = sd_store->get_hash(oid, epoch, row->local_sha1);
+			ret = sd_store->get_hash(oid, epoch, row->local_sha1,
+						 false);
 			if (ret == SD_RES_SUCCESS) {
 				sd_debug("replica found in local at epoch %d",
 					 epoch);
@@ -665,6 +693,7 @@ static inline void direct_queue_recovery_work(uint64_t oid)
 	row = xzalloc(sizeof(*row));
 	row->oid = oid;
 	row->wildcard = rinfo->wildcard;
+	row->urgent = true;
 
 	rw = &row->base;
 	rw->work.fn = recover_object_work;
@@ -1158,6 +1187,93 @@ static void screen_object_list(struct recovery_list_work *rlw,
 	xqsort(rlw->oids, rlw->count, obj_cmp);
 }
 
+/* Number of oids asked for by one SD_OP_GET_OBJ_LIST_FILTERED */
+#define FILTERED_LIST_CHUNK (UINT64_C(1) << 16)
+
+/*
+ * Fetch the objects of node e which this node holds a replica of at the
+ * epoch.  The peer filters its list with the placement of the epoch and
+ * returns it in sorted chunks, so only the oids we need are transferred.
+ *
+ * Return NULL if e can't filter the list for us, e.g. because its epoch is
+ * different from ours.
+ */
+static uint64_t *fetch_filtered_object_list(struct sd_node *e, uint32_t epoch,
+					    size_t *nr_oids)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	size_t nr = 0, end = FILTERED_LIST_CHUNK, n;
+	uint64_t *oids = xmalloc(end * sizeof(uint64_t)), cursor = 0;
+	int ret;
+
+	sd_debug("%s", addr_to_str(e->nid.addr, e->nid.port));
+
+	do {
+		if (nr + FILTERED_LIST_CHUNK > end) {
+			end *= 2;
+			oids = xrealloc(oids, end * sizeof(uint64_t));
+		}
+
+		sd_init_req(&hdr, SD_OP_GET_OBJ_LIST_FILTERED);
+		hdr.data_length = FILTERED_LIST_CHUNK * sizeof(uint64_t);
+		hdr.epoch = epoch;
+		hdr.obj_list.cursor = cursor;
+		memcpy(hdr.obj_list.addr, sys->this_node.nid.addr,
+		       sizeof(hdr.obj_list.addr));
+		hdr.obj_list.port = sys->this_node.nid.port;
+		hdr.obj_list.tgt_epoch = epoch;
+		ret = sheep_exec_req(&e->nid, &hdr, oids + nr);
+		if (ret != SD_RES_SUCCESS) {
+			sd_info("cannot get filtered object list from %s, %s",
+				addr_to_str(e->nid.addr, e->nid.port),
+				sd_strerror(ret));
+			free(oids);
+			return NULL;
+		}
+
+		n = rsp->data_length / sizeof(uint64_t);
+		nr += n;
+		if (n)
+			cursor = oids[nr - 1];
+	} while (n == FILTERED_LIST_CHUNK);
+
+	*nr_oids = nr;
+	sd_debug("%zu", nr);
+	return oids;
+}
+
+/*
+ * Merge the sorted list of oids into the already sorted list of objects to be
+ * recovered, skipping the duplicates.
+ */
+static void merge_object_list(struct recovery_list_work *rlw,
+			      const uint64_t *oids, size_t nr_oids)
+{
+	uint64_t *old = rlw->oids, i = 0, j = 0, count = 0;
+
+	while ((rlw->count + nr_oids + 1) * sizeof(uint64_t) >
+	       list_buffer_size)
+		list_buffer_size *= 2;
+	rlw->oids = xmalloc(list_buffer_size);
+
+	while (i < rlw->count || j < nr_oids) {
+		uint64_t oid;
+
+		if (j == nr_oids || (i < rlw->count && old[i] <= oids[j])) {
+			oid = old[i++];
+			if (j < nr_oids && oids[j] == oid)
+				j++;
+		} else
+			oid = oids[j++];
+
+		rlw->oids[count++] = oid;
+	}
+
+	rlw->count = count;
+	free(old);
+}
+
 static int vnode_to_node_idx(struct sd_vnode *vnode, int nr_nodes,
 			     struct sd_node *nodes)
 {
@@ -1306,6 +1422,13 @@ again:
 			goto out;
 		}
 
+		oids = fetch_filtered_object_list(node, rw->epoch, &nr_oids);
+		if (oids) {
+			merge_object_list(rlw, oids, nr_oids);
+			free(oids);
+			continue;
+		}
+
 		oids = fetch_object_list(node, rw->epoch, &nr_oids);
 		if (!oids)
 			continue;
@@ -10,6 +10,7 @@
  */
 
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 
 #include "sheep_priv.h"
 
@@ -97,6 +98,9 @@ static void gateway_op_done(struct work *work)
 	struct request *req = container_of(work, struct request, work);
 	struct sd_req *hdr = &req->rq;
 
+	if (req->qos_inflight)
+		qos_request_done(req);
+
 	switch (req->rp.result) {
 	case SD_RES_OLD_NODE_VER:
 		if (req->rp.epoch > sys->cinfo.epoch) {
@@ -280,6 +284,18 @@ static void queue_peer_request(struct request *req)
 			return;
 		if (request_in_recovery(req))
 			return;
+	} else if (req->rq.opcode == SD_OP_REMOVE_PEERS) {
+		if (check_request_epoch(req) < 0)
+			return;
+		/*
+		 * The objects of the batch can't wait on recovery one by one,
+		 * so let the sender fall back to the per-object removal.
+		 */
+		if (node_in_recovery()) {
+			req->rp.result = SD_RES_NODE_IN_RECOVERY;
+			put_request(req);
+			return;
+		}
 	}
 
 	if (req->rq.flags & SD_FLAG_CMD_RECOVERY)
@@ -288,7 +304,8 @@ static void queue_peer_request(struct request *req)
 	req->work.fn = do_process_work;
 	req->work.done = io_op_done;
 
-	if (req->rq.opcode == SD_OP_REMOVE_PEER)
+	if (req->rq.opcode == SD_OP_REMOVE_PEER ||
+	    req->rq.opcode == SD_OP_REMOVE_PEERS)
 		queue_work(sys->remove_peer_wqueue, &req->work);
 	else
 		queue_work(sys->peer_wqueue, &req->work);
@@ -340,6 +357,9 @@ static void queue_gateway_request(struct request *req)
 		queue_work(sys->remove_wqueue, &req->work);
 	else if (hdr->flags & SD_FLAG_CMD_FWD)
 		queue_work(sys->gateway_fwd_wqueue, &req->work);
+	else if (is_data_obj(hdr->obj.oid) && !req->local &&
+		 !req->qos_scheduled)
+		qos_queue_request(req);
 	else
 		queue_work(sys->gateway_wqueue, &req->work);
 	return;
@@ -478,6 +498,7 @@ void queue_request(struct request *req)
 
 	req->vinfo = get_vnode_info();
 	stat_request_begin(req);
+	slowlog_begin(req);
 	if (is_peer_op(req->op)) {
 		queue_peer_request(req);
 	} else if (is_gateway_op(req->op)) {
@@ -506,11 +527,14 @@ void requeue_request(struct request *req)
 		put_vnode_info(req->vinfo);
 		req->vinfo = NULL;
 	}
+	/* the forwarded peers refer to the old vnode info */
+	req->nr_fwd = 0;
 	stat_request_end(req);
 	queue_request(req);
 }
 
 static void clear_client_info(struct client_info *ci);
+static void reactor_queue_reply(struct request *req);
 
 static struct request *alloc_local_request(void *data, int data_length)
 {
@@ -696,9 +720,13 @@ main_fn void put_request(struct request *req)
 		return;
 
 	stat_request_end(req);
+	slowlog_end(req);
 
 	if (req->local)
 		eventfd_xwrite(req->local_req_efd, 1);
+	else if (ci->type == CLIENT_INFO_TYPE_REACTOR)
+		/* the connection belongs to the reactor */
+		reactor_queue_reply(req);
 	else {
 		if (ci->conn.dead) {
 			/*
@@ -788,6 +816,23 @@ static void rx_work(struct work *work)
 	tracepoint(request, rx_work, conn->fd, work, req, hdr.opcode);
 }
 
+static void log_rx_request(struct client_info *ci, struct request *req)
+{
+	if (is_logging_op(get_sd_op(req->rq.opcode))) {
+		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, data=%s",
+			req,
+			ci->conn.fd,
+			ci->conn.ipstr, ci->conn.port,
+			op_name(get_sd_op(req->rq.opcode)),
+			data_to_str(req->data, req->rq.data_length));
+	} else {
+		sd_debug("%d, %s:%d",
+			 ci->conn.fd,
+			 ci->conn.ipstr,
+			 ci->conn.port);
+	}
+}
+
 static void rx_main(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
@@ -810,22 +855,27 @@ static void rx_main(struct work *work)
 		sd_err("switch on receiving flag failure, "
 				"connection maybe closed");
 
-	if (is_logging_op(get_sd_op(req->rq.opcode))) {
-		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, data=%s",
+	log_rx_request(ci, req);
+	tracepoint(request, rx_main, ci->conn.fd, work, req);
+	queue_request(req);
+}
+
+static void log_tx_request(struct client_info *ci, struct request *req)
+{
+	if (is_logging_op(req->op)) {
+		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, result=%02X",
 			req,
 			ci->conn.fd,
-			ci->conn.ipstr, ci->conn.port,
-			op_name(get_sd_op(req->rq.opcode)),
-			data_to_str(req->data, req->rq.data_length));
+			ci->conn.ipstr,
+			ci->conn.port,
+			op_name(req->op),
+			req->rp.result);
 	} else {
 		sd_debug("%d, %s:%d",
 			 ci->conn.fd,
 			 ci->conn.ipstr,
 			 ci->conn.port);
 	}
-
-	tracepoint(request, rx_main, ci->conn.fd, work, req);
-	queue_request(req);
 }
 
 static void tx_work(struct work *work)
@@ -867,21 +917,7 @@ static void tx_main(struct work *work)
 
 	refcount_dec(&ci->refcnt);
 
-	if (is_logging_op(ci->tx_req->op)) {
-		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, result=%02X",
-			ci->tx_req,
-			ci->conn.fd,
-			ci->conn.ipstr,
-			ci->conn.port,
-			op_name(ci->tx_req->op),
-			ci->tx_req->rp.result);
-	} else {
-		sd_debug("%d, %s:%d",
-			 ci->conn.fd,
-			 ci->conn.ipstr,
-			 ci->conn.port);
-	}
-
+	log_tx_request(ci, ci->tx_req);
 	free_request(ci->tx_req);
 	ci->tx_req = NULL;
 
@@ -1026,6 +1062,390 @@ static void client_handler(int fd, int events, void *data)
 	}
 }
 
+/*
+ * Reactors
+ *
+ * With 'sheep -e N', the connections of the clients are spread over N reactor
+ * threads instead of being handled by the main thread and the net workers.
+ * Each reactor has its own event loop and reads the requests from, and writes
+ * the responses to, its connections with non-blocking I/O, so a request costs
+ * neither epoll_ctl() calls nor trips to the net work queue.
+ *
+ * The received requests are passed to the main thread in batches through the
+ * completion queue of the reactor, and the main thread passes the completed
+ * requests back through the reply queue.  A connection is only touched by its
+ * reactor, except for its address, which doesn't change.
+ *
+ * Only the socket I/O is sharded.  The main thread still dispatches every
+ * request with queue_request() and completes it in
+ * worker_thread_request_done(), because the epoch checks, the wait queues of
+ * recovery, QoS and the statistics are main thread state, so it is still the
+ * bottleneck at high IOPS.
+ */
+
+/* the number of requests read from a connection per event */
+#define REACTOR_RX_BATCH 32
+
+struct reactor {
+	sd_thread_t thread;
+	int efd;		/* wakes up the reactor */
+	int done_efd;		/* wakes up the main thread */
+
+	struct sd_mutex lock;
+	struct list_head new_clients;	/* accepted by the main thread */
+	struct list_head replies;	/* completed by the main thread */
+	struct list_head rx_reqs;	/* received by the reactor */
+};
+
+static struct reactor *reactors;
+static int next_reactor;
+
+/* Return the bytes read, 0 if the read would block, or -1 on errors */
+static ssize_t reactor_read(int fd, void *buf, size_t len)
+{
+	ssize_t ret = read(fd, buf, len);
+
+	if (ret > 0)
+		return ret;
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (ret < 0)
+		sd_debug("failed to read from the client, %m");
+
+	return -1;
+}
+
+/*
+ * Read the requests which have arrived on the connection and add them to
+ * 'reqs'.  Return false if the connection is closed.
+ */
+static bool reactor_rx(struct client_info *ci, struct list_head *reqs)
+{
+	struct request *req;
+	ssize_t ret;
+	size_t off;
+
+	for (int nr = 0; nr < REACTOR_RX_BATCH; nr++) {
+		while (ci->rx_done < sizeof(ci->rx_hdr)) {
+			ret = reactor_read(ci->conn.fd,
+					   (char *)&ci->rx_hdr + ci->rx_done,
+					   sizeof(ci->rx_hdr) - ci->rx_done);
+			if (ret <= 0)
+				return ret == 0;
+			ci->rx_done += ret;
+		}
+
+		if (!ci->rx_req) {
+			req = alloc_request(ci, ci->rx_hdr.data_length);
+			if (!req) {
+				sd_err("failed to allocate request");
+				return false;
+			}
+			/* use le_to_cpu */
+			memcpy(&req->rq, &ci->rx_hdr, sizeof(req->rq));
+			ci->rx_req = req;
+		}
+
+		req = ci->rx_req;
+		if (req->rq.flags & SD_FLAG_CMD_WRITE) {
+			off = ci->rx_done - sizeof(ci->rx_hdr);
+			while (off < req->rq.data_length) {
+				ret = reactor_read(ci->conn.fd,
+						   (char *)req->data + off,
+						   req->rq.data_length - off);
+				if (ret <= 0)
+					return ret == 0;
+				off += ret;
+				ci->rx_done += ret;
+			}
+		}
+
+		list_add_tail(&req->request_list, reqs);
+		ci->rx_req = NULL;
+		ci->rx_done = 0;
+	}
+
+	return true;
+}
+
+/*
+ * Send the completed requests of the connection until the socket is full.
+ * Return false if the connection is closed.
+ */
+static bool reactor_tx(struct client_info *ci)
+{
+	struct connection *conn = &ci->conn;
+	struct request *req;
+	struct iovec iov[2];
+	size_t len;
+	ssize_t ret;
+	int nr_iov;
+
+	while (ci->tx_req || !list_empty(&ci->done_reqs)) {
+		if (!ci->tx_req) {
+			req = list_first_entry(&ci->done_reqs, struct request,
+					       request_list);
+			list_del(&req->request_list);
+			ci->tx_req = req;
+			ci->tx_done = 0;
+
+			/* use cpu_to_le */
+			memcpy(&ci->tx_rsp, &req->rp, sizeof(ci->tx_rsp));
+			ci->tx_rsp.epoch = sys->cinfo.epoch;
+			ci->tx_rsp.opcode = req->rq.opcode;
+			ci->tx_rsp.id = req->rq.id;
+		}
+
+		req = ci->tx_req;
+		len = sizeof(ci->tx_rsp) + ci->tx_rsp.data_length;
+		if (ci->tx_done < sizeof(ci->tx_rsp)) {
+			iov[0].iov_base = (char *)&ci->tx_rsp + ci->tx_done;
+			iov[0].iov_len = sizeof(ci->tx_rsp) - ci->tx_done;
+			iov[1].iov_base = req->data;
+			iov[1].iov_len = ci->tx_rsp.data_length;
+			nr_iov = ci->tx_rsp.data_length ? 2 : 1;
+		} else {
+			off_t off = ci->tx_done - sizeof(ci->tx_rsp);
+
+			iov[0].iov_base = (char *)req->data + off;
+			iov[0].iov_len = ci->tx_rsp.data_length - off;
+			nr_iov = 1;
+		}
+
+		ret = writev(conn->fd, iov, nr_iov);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			sd_debug("failed to send a response, %m");
+			return false;
+		}
+		ci->tx_done += ret;
+		if (ci->tx_done < len)
+			continue;
+
+		log_tx_request(ci, req);
+		free_request(req);
+		ci->tx_req = NULL;
+	}
+
+	/* wait for the socket to get writable if the response is partial */
+	if (ci->tx_req && !(conn->events & EPOLLOUT))
+		return conn_tx_on(conn) == 0;
+	if (!ci->tx_req && conn->events & EPOLLOUT)
+		return conn_tx_off(conn) == 0;
+
+	return true;
+}
+
+static void reactor_put_client(struct client_info *ci)
+{
+	if (ci->conn.dead && refcount_read(&ci->refcnt) == 0)
+		destroy_client(ci);
+}
+
+static void reactor_clear_client(struct client_info *ci)
+{
+	struct request *req;
+
+	if (ci->conn.dead)
+		return;
+
+	sd_debug("connection from %s:%d seems to be dead", ci->conn.ipstr,
+		 ci->conn.port);
+	ci->conn.dead = true;
+	unregister_event(ci->conn.fd);
+
+	if (ci->rx_req)
+		free_request(ci->rx_req);
+	if (ci->tx_req)
+		free_request(ci->tx_req);
+	list_for_each_entry(req, &ci->done_reqs, request_list) {
+		list_del(&req->request_list);
+		free_request(req);
+	}
+
+	/* the requests in the main thread drop their references later */
+	reactor_put_client(ci);
+}
+
+static void reactor_client_handler(int fd, int events, void *data)
+{
+	struct client_info *ci = data;
+	struct reactor *r = ci->reactor;
+	LIST_HEAD(reqs);
+	bool empty;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		goto dead;
+
+	if (events & EPOLLIN) {
+		bool alive = reactor_rx(ci, &reqs);
+
+		if (!list_empty(&reqs)) {
+			sd_mutex_lock(&r->lock);
+			empty = list_empty(&r->rx_reqs);
+			list_splice_tail_init(&reqs, &r->rx_reqs);
+			sd_mutex_unlock(&r->lock);
+			if (empty)
+				eventfd_xwrite(r->done_efd, 1);
+		}
+		if (!alive)
+			goto dead;
+	}
+
+	if (events & EPOLLOUT && !reactor_tx(ci))
+		goto dead;
+
+	return;
+dead:
+	reactor_clear_client(ci);
+}
+
+static void reactor_handler(int fd, int events, void *data)
+{
+	struct reactor *r = data;
+	struct client_info *ci;
+	struct request *req;
+	LIST_HEAD(new_clients);
+	LIST_HEAD(replies);
+
+	eventfd_xread(fd);
+
+	sd_mutex_lock(&r->lock);
+	list_splice_init(&r->new_clients, &new_clients);
+	list_splice_init(&r->replies, &replies);
+	sd_mutex_unlock(&r->lock);
+
+	list_for_each_entry(ci, &new_clients, reactor_list) {
+		list_del(&ci->reactor_list);
+		if (register_event(ci->conn.fd, reactor_client_handler, ci)) {
+			ci->conn.dead = true;
+			reactor_put_client(ci);
+		}
+	}
+
+	list_for_each_entry(req, &replies, request_list) {
+		ci = req->ci;
+		list_del(&req->request_list);
+		if (ci->conn.dead) {
+			free_request(req);
+			reactor_put_client(ci);
+			continue;
+		}
+
+		list_add_tail(&req->request_list, &ci->done_reqs);
+		/* otherwise, the socket is full and EPOLLOUT resumes it */
+		if (!(ci->conn.events & EPOLLOUT) && !reactor_tx(ci))
+			reactor_clear_client(ci);
+	}
+}
+
+static void *reactor_main(void *arg)
+{
+	struct reactor *r = arg;
+
+	if (init_event(EPOLL_SIZE) < 0)
+		panic("failed to initialize the event loop of the reactor");
+	if (register_event(r->efd, reactor_handler, r) < 0)
+		panic("failed to register the event of the reactor");
+
+	for (;;)
+		event_loop(-1);
+
+	return NULL;
+}
+
+/* Pass the completed request back to the reactor of its connection */
+static main_fn void reactor_queue_reply(struct request *req)
+{
+	struct reactor *r = req->ci->reactor;
+	bool empty;
+
+	sd_mutex_lock(&r->lock);
+	empty = list_empty(&r->replies);
+	list_add_tail(&req->request_list, &r->replies);
+	sd_mutex_unlock(&r->lock);
+
+	if (empty)
+		eventfd_xwrite(r->efd, 1);
+}
+
+static main_fn void reactor_rx_handler(int fd, int events, void *data)
+{
+	struct reactor *r = data;
+	struct request *req;
+	LIST_HEAD(reqs);
+
+	eventfd_xread(fd);
+
+	sd_mutex_lock(&r->lock);
+	list_splice_init(&r->rx_reqs, &reqs);
+	sd_mutex_unlock(&r->lock);
+
+	list_for_each_entry(req, &reqs, request_list) {
+		list_del(&req->request_list);
+		log_rx_request(req->ci, req);
+		queue_request(req);
+	}
+}
+
+static main_fn void reactor_add_client(struct client_info *ci)
+{
+	struct reactor *r = reactors + next_reactor;
+	bool empty;
+
+	next_reactor = (next_reactor + 1) % sys->nr_reactors;
+
+	ci->type = CLIENT_INFO_TYPE_REACTOR;
+	ci->reactor = r;
+
+	sd_mutex_lock(&r->lock);
+	empty = list_empty(&r->new_clients);
+	list_add_tail(&ci->reactor_list, &r->new_clients);
+	sd_mutex_unlock(&r->lock);
+
+	if (empty)
+		eventfd_xwrite(r->efd, 1);
+}
+
+int init_reactors(void)
+{
+	if (!sys->nr_reactors)
+		return 0;
+
+	reactors = xcalloc(sys->nr_reactors, sizeof(*reactors));
+	for (int i = 0; i < sys->nr_reactors; i++) {
+		struct reactor *r = reactors + i;
+
+		sd_init_mutex(&r->lock);
+		INIT_LIST_HEAD(&r->new_clients);
+		INIT_LIST_HEAD(&r->replies);
+		INIT_LIST_HEAD(&r->rx_reqs);
+
+		r->efd = eventfd(0, EFD_NONBLOCK);
+		r->done_efd = eventfd(0, EFD_NONBLOCK);
+		if (r->efd < 0 || r->done_efd < 0) {
+			sd_err("failed to create an eventfd, %m");
+			return -1;
+		}
+
+		if (register_event(r->done_efd, reactor_rx_handler, r) < 0) {
+			sd_err("failed to register the event of the reactor");
+			return -1;
+		}
+
+		if (sd_thread_create_with_idx("reactor", &r->thread,
+					      reactor_main, r) < 0) {
+			sd_err("failed to create a reactor thread, %m");
+			return -1;
+		}
+	}
+
+	sd_info("%d reactors do the socket I/O of the clients",
+		sys->nr_reactors);
+	return 0;
+}
+
 static void listen_handler(int listen_fd, int events, void *data)
 {
 	struct sockaddr_storage from;
@@ -1061,6 +1481,18 @@ static void listen_handler(int listen_fd, int events, void *data)
 		return;
 	}
 
+	if (sys->nr_reactors) {
+		/* the reactor sets up the event of the connection */
+		ret = set_nonblocking(fd);
+		if (ret) {
+			destroy_client(ci);
+			return;
+		}
+		reactor_add_client(ci);
+		sd_debug("accepted a new connection: %d", fd);
+		return;
+	}
+
 	ret = register_event(fd, client_handler, ci);
 	if (ret) {
 		destroy_client(ci);
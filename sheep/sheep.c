@@ -20,8 +20,9 @@
 #include "xio.h"
 #endif
 
-#define EPOLL_SIZE 4096
 #define DEFAULT_OBJECT_DIR "/tmp"
+#define DEFAULT_IO_LATENCY 20 /* ms */
+#define DEFAULT_SCRUB_RATE 10 /* MB/s */
 #define LOG_FILE_NAME "sheep.log"
 
 LIST_HEAD(cluster_drivers);
@@ -89,7 +90,8 @@ static const char log_help[] =
 "\tdir=: path to the location of sheep.log\n"
 "\tlevel=: log level of sheep.log\n"
 "\tformat=: log format type\n"
-"\tdst=: log destination type\n\n"
+"\tdst=: log destination type\n"
+"\trings=: number of per-thread log buffers, 0 disables them\n\n"
 "if dir is not specified, use metastore directory\n\n"
 "Available log levels:\n"
 "  Level      Description\n"
@@ -119,6 +121,38 @@ static const char recovery_help[] =
 "\tinterval=: object recovery interval time (millisec)\n"
 "Example:\n\t$ sheep -R max=50,interval=1000 ...\n";
 
+static const char io_latency_help[] =
+"Example:\n\t$ sheep -L 10 ...\n"
+"\tlimit the recovery and the removal of objects on a disk while the\n"
+"\tforeground I/O of the disk takes more than 10 ms on average.  They run\n"
+"\tat full speed while the disk has no foreground I/O.  0 disables this.\n";
+
+static const char reactors_help[] =
+"Example:\n\t$ sheep -e 4 ...\n"
+"\tread the requests from and write the responses to the client\n"
+"\tconnections in 4 threads, each with its own event loop.  The main\n"
+"\tthread still dispatches and completes all the requests.  Without this\n"
+"\toption, the main thread and the network workers do the socket I/O.\n";
+
+static const char qos_depth_help[] =
+"Example:\n\t$ sheep -Q 32 ...\n"
+"\tqueue the gateway requests of data objects when 32 of them are in\n"
+"\tflight, and serve the vdis in proportion to their QoS weights\n"
+"\tset by 'dog vdi qos'.  The IOPS and bandwidth limits of the vdis are\n"
+"\tenforced regardless of this option.\n";
+
+static const char checksum_help[] =
+"Example:\n\t$ sheep -C ...\n"
+"\tkeep the CRC-32C checksums of the blocks of the objects, and verify\n"
+"\tthem on read.  The objects which don't match them are read from and\n"
+"\trepaired by the other replicas.\n";
+
+static const char scrub_help[] =
+"Example:\n\t$ sheep -C -S 20 ...\n"
+"\tverify all the objects of each disk with their checksums in the\n"
+"\tbackground at 20 MB/s per disk, and at most once a day.  0 disables\n"
+"\tthis.\n";
+
 static const char vnodes_help[] =
 "Example:\n\t$ sheep -V 128\n"
 "\tset number of vnodes\n";
@@ -126,13 +160,22 @@ static const char vnodes_help[] =
 static struct sd_option sheep_options[] = {
 	{'b', "bindaddr", true, "specify IP address of interface to listen on",
 	 bind_help},
+	{'B', "writeback", false, "drop O_SYNC for write of data objects and "
+	 "sync them when the guest flushes the vdi"},
 	{'c', "cluster", true,
 	 "specify the cluster driver (default: "DEFAULT_CLUSTER_DRIVER")",
 	 cluster_help},
+	{'C', "checksum", false, "keep and verify the checksums of the objects",
+	 checksum_help},
 	{'D', "directio", false, "use direct IO for backend store"},
+	{'e', "reactors", true, "specify the number of threads which do the "
+	 "socket I/O of the clients (default: 0, the main thread)",
+	 reactors_help},
 	{'f', "foreground", false, "make the program run in foreground"},
 	{'g', "gateway", false, "make the program run as a gateway mode"},
 	{'h', "help", false, "display this help and exit"},
+	{'H', "hedged-read", false, "read from another replica too when a "
+	 "replica is slower than usual"},
 	{'i', "ioaddr", true, "use separate network card to handle IO requests"
 	 " (default: disabled)", ioaddr_help},
 	{'j', "journal", true, "use journal file to log all the write "
@@ -140,6 +183,9 @@ static struct sd_option sheep_options[] = {
 	{'l', "log", true,
 	 "specify the log level, the log directory and the log format"
 	 "(log level default: 6 [SDOG_INFO])", log_help},
+	{'L', "io-latency", true, "specify the latency target of the "
+	 "foreground I/O of the disks in milliseconds (default: 20)",
+	 io_latency_help},
 	{'n', "nosync", false, "drop O_SYNC for write of backend"},
 	{'p', "port", true, "specify the TCP port on which to listen "
 	 "(default: 7000)"},
@@ -148,8 +194,13 @@ static struct sd_option sheep_options[] = {
 	{'r', "http", true, "enable http service. (default: disabled)",
 	 http_help},
 #endif
+	{'Q', "qos-depth", true, "specify the number of gateway requests in "
+	 "flight above which the vdis share the gateway by their QoS weights "
+	 "(default: 0, unlimited)", qos_depth_help},
 	{'R', "recovery", true, "specify the recovery speed throttling",
 	 recovery_help},
+	{'S', "scrub", true, "specify the rate of the scrubbing of each disk "
+	 "in MB/s (default: 10 with -C)", scrub_help},
 	{'u', "upgrade", false, "upgrade to the latest data layout"},
 	{'v', "version", false, "show the version"},
 	{'V', "vnodes", true, "set number of vnodes", vnodes_help},
@@ -340,11 +391,27 @@ static int log_dst_parser(const char *s)
 	return 0;
 }
 
+static int log_rings_parser(const char *s)
+{
+	char *p;
+	long nr;
+
+	nr = strtol(s, &p, 10);
+	if (s == p || *p != '\0' || nr < 0 || nr > INT_MAX) {
+		sd_err("Invalid number of log rings '%s'", s);
+		return -1;
+	}
+
+	sd_log_nr_rings = nr;
+	return 0;
+}
+
 static struct option_parser log_parsers[] = {
 	{ "level=", log_level_parser },
 	{ "dir=", log_dir_parser },
 	{ "format=", log_format_parser },
 	{ "dst=", log_dst_parser },
+	{ "rings=", log_rings_parser },
 	{ NULL, NULL },
 };
 
@@ -604,6 +671,8 @@ static int create_work_queues(void)
 	sys->deletion_wqueue = create_ordered_work_queue("deletion");
 	sys->block_wqueue = create_ordered_work_queue("block");
 	sys->md_wqueue = create_ordered_work_queue("md");
+	sys->md_rebalance_wqueue = create_ordered_work_queue("md_rebalance");
+	sys->scrub_wqueue = create_work_queue("scrub", WQ_DYNAMIC);
 	if (wq_async_threads) {
 		sd_info("# of threads in async_req workqueue: %d", wq_async_threads);
 		sys->areq_wqueue = create_fixed_work_queue("async_req", wq_async_threads);
@@ -613,7 +682,9 @@ static int create_work_queues(void)
 	}
 	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->recovery_wqueue ||
 	    !sys->deletion_wqueue || !sys->block_wqueue || !sys->md_wqueue ||
-	    !sys->areq_wqueue || !sys->peer_wqueue || !sys->reclaim_wqueue ||
+	    !sys->md_rebalance_wqueue || !sys->scrub_wqueue ||
+	    !sys->areq_wqueue ||
+	    !sys->peer_wqueue || !sys->reclaim_wqueue ||
 	    !sys->gateway_fwd_wqueue)
 			return -1;
 
@@ -798,6 +869,9 @@ int main(int argc, char **argv)
 	sys->rthrottling.queue_work_interval = 0;
 	sys->rthrottling.throttling = false;
 
+	sys->io_latency = DEFAULT_IO_LATENCY;
+	sys->scrub_rate = DEFAULT_SCRUB_RATE;
+
 	install_crash_handler(crash_handler);
 	signal(SIGPIPE, SIG_IGN);
 
@@ -830,6 +904,37 @@ int main(int argc, char **argv)
 		case 'n':
 			sys->nosync = true;
 			break;
+		case 'B':
+			sys->writeback = true;
+			break;
+		case 'H':
+			sys->hedged_read = true;
+			break;
+		case 'L':
+			sys->io_latency = str_to_u32(optarg);
+			if (errno != 0) {
+				sd_err("Invalid I/O latency target '%s'",
+				       optarg);
+				exit(1);
+			}
+			break;
+		case 'C':
+			sys->checksum = true;
+			break;
+		case 'S':
+			sys->scrub_rate = str_to_u32(optarg);
+			if (errno != 0) {
+				sd_err("Invalid scrub rate '%s'", optarg);
+				exit(1);
+			}
+			break;
+		case 'Q':
+			sys->qos_depth = str_to_u16(optarg);
+			if (errno != 0) {
+				sd_err("Invalid QoS depth '%s'", optarg);
+				exit(1);
+			}
+			break;
 		case 'y':
 			if (!str_to_addr(optarg, sys->this_node.nid.addr)) {
 				sd_err("Invalid address: '%s'", optarg);
@@ -840,6 +945,14 @@ int main(int argc, char **argv)
 		case 'D':
 			sys->backend_dio = true;
 			break;
+		case 'e':
+			sys->nr_reactors = str_to_u16(optarg);
+			if (errno != 0) {
+				sd_err("Invalid number of reactors '%s'",
+				       optarg);
+				exit(1);
+			}
+			break;
 		case 'f':
 			daemonize = false;
 			break;
@@ -1160,6 +1273,10 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_journal;
 
+	ret = init_reactors();
+	if (ret)
+		goto cleanup_journal;
+
 	ret = sockfd_init();
 	if (ret)
 		goto cleanup_journal;
@@ -1168,6 +1285,10 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_journal;
 
+	ret = init_csum();
+	if (ret)
+		goto cleanup_journal;
+
 	ret = trace_init();
 	if (ret)
 		goto cleanup_journal;
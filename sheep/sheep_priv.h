@@ -64,8 +64,12 @@
 #define worker_fn
 #endif
 
+/* the size of the epoll events of the main thread and the reactors */
+#define EPOLL_SIZE 4096
+
 enum client_info_type {
 	CLIENT_INFO_TYPE_DEFAULT = 1,
+	CLIENT_INFO_TYPE_REACTOR,
 #ifdef HAVE_ACCELIO
 	CLIENT_INFO_TYPE_XIO,
 #endif
@@ -86,6 +90,14 @@ struct client_info {
 
 	refcnt_t refcnt;
 
+	/* states of CLIENT_INFO_TYPE_REACTOR, see request.c */
+	struct reactor *reactor;
+	struct list_node reactor_list;
+	struct sd_req rx_hdr;
+	size_t rx_done;		/* bytes of the request received */
+	struct sd_rsp tx_rsp;
+	size_t tx_done;		/* bytes of the response sent */
+
 #ifdef HAVE_ACCELIO
 	struct xio_msg *xio_req;
 #endif
@@ -98,6 +110,14 @@ enum REQUST_STATUS {
 	REQUEST_DROPPED
 };
 
+/* stages of a request recorded for the slow request log, see slowlog.c */
+enum req_stamp {
+	REQ_STAMP_QUEUE,	/* queued in the main thread */
+	REQ_STAMP_WORK,		/* picked up by a worker */
+	REQ_STAMP_DONE,		/* finished by the worker */
+	NR_REQ_STAMPS,
+};
+
 enum store_id {
 	PLAIN_STORE,
 	TREE_STORE
@@ -133,6 +153,19 @@ struct request {
 	struct work work;
 	enum REQUST_STATUS status;
 	bool stat; /* true if this request is during stat */
+
+	uint64_t stamp[NR_REQ_STAMPS];
+	/* QoS state of a gateway request, see qos.c */
+	uint64_t qos_time;	/* when it was queued */
+	bool qos_scheduled;
+	bool qos_throttled;
+	bool qos_inflight;
+	/* the peers a gateway request was forwarded to */
+	int nr_fwd;
+	struct {
+		const struct sd_node *node;
+		uint32_t latency;	/* in us */
+	} fwd[SD_MAX_COPIES];
 };
 
 struct system_info {
@@ -159,6 +192,13 @@ struct system_info {
 
 	bool gateway_only;
 	bool nosync;
+	bool writeback;
+	bool hedged_read;
+	int nr_reactors;
+	int qos_depth;
+	uint32_t io_latency; /* ms, target of the I/O scheduler */
+	bool checksum;
+	uint32_t scrub_rate; /* MB/s per disk */
 
 	struct recovery_throttling rthrottling;
 
@@ -175,6 +215,8 @@ struct system_info {
 	struct work_queue *recovery_notify_wqueue;
 	struct work_queue *block_wqueue;
 	struct work_queue *md_wqueue;
+	struct work_queue *md_rebalance_wqueue;
+	struct work_queue *scrub_wqueue;
 	struct work_queue *areq_wqueue;
 #ifdef HAVE_HTTP
 	struct work_queue *http_wqueue;
@@ -194,13 +236,18 @@ struct disk {
 };
 
 struct vdisk {
-	struct rb_node rb;
-	const struct disk *disk;
 	uint64_t hash;
+	const struct disk *disk;
+};
+
+/* vdisks sorted by hash, replaced as a whole when the disks change */
+struct vdisk_table {
+	size_t nr;
+	struct vdisk vdisks[];
 };
 
 struct md {
-	struct rb_root vroot;
+	struct vdisk_table *vdisks;	/* read without the lock */
 	struct rb_root root;
 	struct sd_rw_lock lock;
 	uint64_t space;
@@ -219,6 +266,10 @@ struct siocb {
 	uint8_t ec_index;
 	uint8_t copy_policy;
 	uint8_t wildcard;
+	/* create_and_write: the local object to copy before writing buf */
+	uint64_t cow_oid;
+	/* written by a gateway in write-back mode, made durable by a flush */
+	bool writeback;
 };
 
 /* This structure is used to pass parameters to vdi_* functions. */
@@ -257,7 +308,8 @@ struct store_driver {
 	int (*read)(uint64_t oid, const struct siocb *);
 	int (*format)(void);
 	int (*remove_object)(uint64_t oid, uint8_t ec_index);
-	int (*get_hash)(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+	int (*get_hash)(uint64_t oid, uint32_t epoch, uint8_t *digest,
+			bool crc32c);
 	/* Operations in recovery */
 	int (*link)(uint64_t oid, uint32_t tgt_epoch);
 	int (*update_epoch)(uint32_t epoch);
@@ -280,7 +332,8 @@ int default_update_epoch(uint32_t epoch);
 int default_cleanup(void);
 int default_format(void);
 int default_remove_object(uint64_t oid, uint8_t ec_index);
-int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *digest,
+		     bool crc32c);
 int default_purge_obj(void);
 
 int tree_init(void);
@@ -293,7 +346,8 @@ int tree_update_epoch(uint32_t epoch);
 int tree_cleanup(void);
 int tree_format(void);
 int tree_remove_object(uint64_t oid, uint8_t ec_index);
-int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *digest,
+		  bool crc32c);
 int tree_purge_obj(void);
 
 int for_each_object_in_wd(int (*func)(uint64_t, const char *, uint32_t,
@@ -304,6 +358,10 @@ int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 struct vnode_info *, void *arg),
 			     void *arg);
 int for_each_obj_path(int (*func)(const char *path));
+int for_each_object_in_path(const char *path,
+			    int (*func)(uint64_t, const char *, uint32_t,
+					uint8_t, struct vnode_info *, void *),
+			    bool cleanup, struct vnode_info *vinfo, void *arg);
 size_t get_store_objsize(uint64_t oid);
 
 extern struct list_head store_drivers;
@@ -335,6 +393,21 @@ static inline uint32_t sys_epoch(void)
 	return uatomic_read(&sys->cinfo.epoch);
 }
 
+/*
+ * In write-back mode, data objects are written without O_DSYNC and made
+ * durable when the guest flushes the vdi.
+ */
+static inline bool is_writeback_mode(void)
+{
+	return sys->writeback && !sys->nosync &&
+		!uatomic_is_true(&sys->use_journal);
+}
+
+static inline bool is_writeback_obj(uint64_t oid)
+{
+	return is_writeback_mode() && is_data_obj(oid);
+}
+
 static inline bool is_aligned_to_pagesize(void *p)
 {
 	return ((uintptr_t)p & (getpagesize() - 1)) == 0;
@@ -431,8 +504,16 @@ int leave_cluster(void);
 void queue_cluster_request(struct request *req);
 
 int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create);
+void dirty_vdi_mark(uint64_t oid);
+int dirty_vdi_sync(uint32_t vid);
+int sync_object_dir(const char *path);
 int err_to_sderr(const char *path, uint64_t oid, int err);
 int discard(int fd, uint64_t start, uint32_t end);
+int clone_object_file(int fd, const char *src);
+ssize_t xpread_sparse(int fd, void *buf, size_t len, off_t offset);
+ssize_t xpwrite_sparse(int fd, const void *buf, size_t len, off_t offset);
+uint32_t sparse_pack(void *buf, uint32_t len);
+void sparse_unpack(void *buf, uint32_t packed_len, uint32_t len);
 bool store_id_match(enum store_id id);
 
 int update_epoch_log(uint32_t epoch, struct sd_node *nodes, size_t nr_nodes);
@@ -461,6 +542,8 @@ void init_config_path(const char *base_path);
 int init_node_config_file(void);
 int init_config_file(void);
 int get_obj_list(const struct sd_req *, struct sd_rsp *, void *);
+int get_obj_list_filtered(const struct sd_req *, struct sd_rsp *, void *,
+			  struct vnode_info *);
 int objlist_cache_cleanup(uint32_t vid);
 void objlist_cache_format(void);
 
@@ -490,6 +573,7 @@ int exec_local_req_async(struct sd_req *rq, void *, struct request_iocb *);
 int local_req_wait(struct request_iocb *iocb);
 
 void local_request_init(void);
+int init_reactors(void);
 
 int objlist_cache_insert(uint64_t oid);
 void objlist_cache_remove(uint64_t oid);
@@ -517,6 +601,7 @@ bool is_logging_op(const struct sd_op_template *op);
 bool has_process_work(const struct sd_op_template *op);
 bool has_process_main(const struct sd_op_template *op);
 void do_process_work(struct work *work);
+int exec_local_peer_req(struct request *req, struct sd_req *hdr, void *data);
 int do_process_main(const struct sd_op_template *op, const struct sd_req *req,
 		    struct sd_rsp *rsp, void *data,
 		    const struct sd_node *sender);
@@ -542,7 +627,8 @@ static inline bool node_is_local(const struct sd_node *n)
  */
 static inline bool is_sparse_object(uint64_t oid)
 {
-	return is_ledger_object(oid) || is_vdi_obj(oid);
+	return is_ledger_object(oid) || is_vdi_obj(oid) ||
+		(is_data_obj(oid) && sys->cinfo.flags & SD_CLUSTER_FLAG_SPARSE);
 }
 
 /* gateway operations */
@@ -551,6 +637,7 @@ int gateway_write_obj(struct request *req);
 int gateway_create_and_write_obj(struct request *req);
 int gateway_remove_obj(struct request *req);
 int gateway_decref_object(struct request *req);
+int gateway_flush_vdi(struct request *req);
 
 bool is_erasure_oid(uint64_t oid);
 uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid);
@@ -578,6 +665,44 @@ void sheep_del_sockfd(const struct node_id *, struct sockfd *);
 int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data);
 bool sheep_need_retry(uint32_t epoch);
 
+/* node_load.c */
+void node_load_begin(const struct node_id *nid);
+void node_load_end(const struct node_id *nid, uint64_t sent, bool read,
+		   bool failed);
+int node_load_pick(const struct sd_node **nodes, int nr);
+uint64_t node_load_hedge_delay(const struct node_id *nid);
+
+/* slowlog.c */
+void slowlog_begin(struct request *req);
+void slowlog_end(struct request *req);
+void slowlog_forward_done(struct request *req, const struct sd_node *node,
+			  uint64_t sent);
+size_t slowlog_get(void *buf, size_t len, bool clear);
+
+/* iosched.c */
+enum io_class {
+	IO_CLASS_READ,		/* foreground */
+	IO_CLASS_WRITE,		/* foreground */
+	IO_CLASS_RECOVERY,
+	IO_CLASS_BACKGROUND,
+	NR_IO_CLASSES,
+};
+
+struct io_ticket {
+	struct iosched_disk *disk;
+	enum io_class class;
+	uint64_t start;
+};
+
+void iosched_begin(struct io_ticket *t, uint64_t oid, enum io_class class);
+void iosched_end(struct io_ticket *t);
+
+/* qos.c */
+void qos_queue_request(struct request *req);
+void qos_request_done(struct request *req);
+void qos_set(uint32_t id, const struct sd_vdi_qos *qos);
+void qos_get_stat(uint32_t id, struct sd_vdi_qos_stat *stat);
+
 /* journal_file.c */
 int journal_file_init(const char *path, size_t size, bool skip);
 void clean_journal_file(const char *p);
@@ -598,6 +723,23 @@ int md_unplug_disks(char *disks);
 uint64_t md_get_size(uint64_t *used);
 uint32_t md_nr_disks(void);
 
+/* checksum.c */
+int init_csum(void);
+int csum_create(int fd, uint64_t oid, const void *buf, uint64_t offset,
+		uint32_t len);
+int csum_rebuild(int fd, uint64_t oid);
+void csum_write_begin(uint64_t oid);
+int csum_write_end(int fd, uint64_t oid, uint64_t start, uint64_t end);
+void csum_write_cancel(uint64_t oid);
+void csum_replace_begin(uint64_t oid);
+void csum_replace_end(uint64_t oid);
+int csum_verify_read(int fd, uint64_t oid, const char *path,
+		     const struct siocb *iocb);
+void csum_drop(int fd);
+void csum_copy(const char *src, const char *dst);
+void csum_digest(const void *buf, size_t len, uint8_t *digest);
+void start_scrub(void);
+
 static inline bool is_stale_path(const char *path)
 {
 	return !!strstr(path, ".stale");
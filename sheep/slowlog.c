@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Slow request log
+ *
+ * Every gateway and peer request of an object records when it was queued,
+ * picked up by a worker, finished by the worker and completed.  When the
+ * request completes, it is kept in the log if it is one of the SLOWLOG_SIZE
+ * slowest requests of its type since the log was cleared.
+ *
+ * The gateway assigns an id to each request and passes it in the forwarded
+ * peer requests, so the peer entries of other nodes can be matched with the
+ * gateway entry, which also has the latency of every peer.
+ *
+ * The log is only touched in the main thread.
+ */
+
+#include "sheep_priv.h"
+
+#define SLOWLOG_SIZE 32
+
+struct slowlog {
+	struct sd_slow_req ent[SLOWLOG_SIZE];
+	int nr;
+	int fastest;	/* index of the fastest entry when the log is full */
+};
+
+static struct slowlog gateway_log, peer_log;
+static uint32_t next_req_id;
+
+static inline uint32_t ns_to_us(uint64_t start, uint64_t end)
+{
+	if (!start || end < start)
+		return 0;
+
+	return min((end - start) / 1000, (uint64_t)UINT32_MAX);
+}
+
+main_fn void slowlog_begin(struct request *req)
+{
+	if (req->stamp[REQ_STAMP_QUEUE])
+		/* requeued */
+		return;
+
+	req->stamp[REQ_STAMP_QUEUE] = clock_get_time();
+
+	if (is_gateway_op(req->op)) {
+		if (++next_req_id == 0)
+			next_req_id++;
+		req->rq.obj.req_id = next_req_id;
+	}
+}
+
+void slowlog_forward_done(struct request *req, const struct sd_node *node,
+			  uint64_t sent)
+{
+	if (req->nr_fwd >= ARRAY_SIZE(req->fwd))
+		return;
+
+	req->fwd[req->nr_fwd].node = node;
+	req->fwd[req->nr_fwd].latency = ns_to_us(sent, clock_get_time());
+	req->nr_fwd++;
+}
+
+static struct sd_slow_req *slowlog_slot(struct slowlog *log, uint32_t total)
+{
+	struct sd_slow_req *slot;
+
+	if (log->nr < SLOWLOG_SIZE)
+		slot = log->ent + log->nr++;
+	else if (log->ent[log->fastest].total < total)
+		slot = log->ent + log->fastest;
+	else
+		return NULL;
+
+	return slot;
+}
+
+static void slowlog_update_fastest(struct slowlog *log)
+{
+	if (log->nr < SLOWLOG_SIZE)
+		return;
+
+	log->fastest = 0;
+	for (int i = 1; i < log->nr; i++)
+		if (log->ent[i].total < log->ent[log->fastest].total)
+			log->fastest = i;
+}
+
+main_fn void slowlog_end(struct request *req)
+{
+	struct slowlog *log;
+	struct sd_slow_req *e;
+	uint64_t now = clock_get_time();
+	uint32_t total = ns_to_us(req->stamp[REQ_STAMP_QUEUE], now);
+
+	if (!req->op || !req->rq.obj.oid)
+		return;
+
+	if (is_gateway_op(req->op))
+		log = &gateway_log;
+	else if (is_peer_op(req->op))
+		log = &peer_log;
+	else
+		return;
+
+	e = slowlog_slot(log, total);
+	if (!e)
+		return;
+
+	memset(e, 0, sizeof(*e));
+	e->oid = req->rq.obj.oid;
+	e->time = req->stamp[REQ_STAMP_QUEUE];
+	e->req_id = req->rq.obj.req_id;
+	e->result = req->rp.result;
+	e->opcode = req->rq.opcode;
+	e->queue = ns_to_us(req->stamp[REQ_STAMP_QUEUE],
+			    req->stamp[REQ_STAMP_WORK]);
+	e->exec = ns_to_us(req->stamp[REQ_STAMP_WORK],
+			   req->stamp[REQ_STAMP_DONE]);
+	e->reply = ns_to_us(req->stamp[REQ_STAMP_DONE], now);
+	e->total = total;
+
+	if (log == &gateway_log) {
+		e->type = SD_SLOW_REQ_GATEWAY;
+		e->nr_peers = req->nr_fwd;
+		for (int i = 0; i < req->nr_fwd; i++) {
+			const struct node_id *nid = &req->fwd[i].node->nid;
+
+			memcpy(e->peers[i].addr, nid->addr, sizeof(nid->addr));
+			e->peers[i].port = nid->port;
+			e->peers[i].latency = req->fwd[i].latency;
+		}
+	} else {
+		e->type = SD_SLOW_REQ_PEER;
+		if (!req->local)
+			str_to_addr(req->ci->conn.ipstr, e->addr);
+	}
+
+	slowlog_update_fastest(log);
+}
+
+static size_t slowlog_copy(struct slowlog *log, char *buf, size_t len)
+{
+	size_t size = min(log->nr * sizeof(log->ent[0]),
+			  round_down(len, sizeof(log->ent[0])));
+
+	memcpy(buf, log->ent, size);
+
+	return size;
+}
+
+main_fn size_t slowlog_get(void *buf, size_t len, bool clear)
+{
+	size_t size;
+
+	size = slowlog_copy(&gateway_log, buf, len);
+	size += slowlog_copy(&peer_log, (char *)buf + size, len - size);
+
+	if (clear) {
+		gateway_log.nr = 0;
+		peer_log.nr = 0;
+	}
+
+	return size;
+}
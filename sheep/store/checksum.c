@@ -0,0 +1,765 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checksums of the objects
+ *
+ * With '-C', each object has the CRC-32C checksums of its blocks in the xattr
+ * CSUM_XATTR.  An object has at most CSUM_MAX_BLOCKS blocks of at least 4 KB,
+ * so the checksums of a 4 MB object are 2 KB.  Writes update the checksums of
+ * the blocks they touch, and reads verify them.  An object which doesn't match
+ * its checksums fails with SD_RES_CSUM_MISMATCH, so the gateway reads another
+ * replica, and the object is repaired from the other replicas with
+ * SD_OP_REPAIR_REPLICA.
+ *
+ * The checksums are computed from the file after the data is written, so they
+ * match whatever concurrent writes to a block leave on the disk.  The writers
+ * of an object share its stripe of csum_locks until they have updated the
+ * checksums, and a reader which sees a mismatch takes it exclusively and reads
+ * the blocks again before it reports the object.
+ *
+ * The checksums are written after the data and aren't synced with it, so the
+ * blocks being written when a node crashes can fail the verification; they are
+ * repaired like the corrupted ones.  Objects without checksums, e.g. the ones
+ * written before '-C' was given, are verified after the scrubber computes them.
+ *
+ * Scrubbing
+ *
+ * The scrubber reads every object of each disk at sys->scrub_rate and verifies
+ * it.  The reads are background I/O of the I/O scheduler, and a pass over a
+ * disk starts at most once a SCRUB_PERIOD.  It waits for the node to join the
+ * cluster, since the objects are purged by the format of the cluster.
+ */
+
+#include <sys/xattr.h>
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define CSUM_XATTR	"user.obj.csum"
+#define CSUM_MIN_SHIFT	12
+#define CSUM_MAX_BLOCKS	512
+#define CSUM_NR_LOCKS	256
+
+#define SCRUB_PERIOD	(24 * 60 * 60 * 1000) /* ms */
+#define SCRUB_RETRY	(10 * 1000) /* ms */
+
+struct csum_table {
+	uint8_t block_shift;
+	uint8_t __pad[3];
+	uint32_t nr_blocks;
+	uint32_t csum[CSUM_MAX_BLOCKS];
+};
+
+#define CSUM_HDR_SIZE	offsetof(struct csum_table, csum)
+
+static struct sd_rw_lock csum_locks[CSUM_NR_LOCKS];
+/* serializes the updates of the checksums by the writers */
+static struct sd_mutex csum_update_locks[CSUM_NR_LOCKS];
+
+/* bit 32 is set when the checksum of the zero block of a shift is known */
+static uint64_t zero_csum[64];
+
+static inline int csum_lock_idx(uint64_t oid)
+{
+	return sd_hash_oid(oid) % CSUM_NR_LOCKS;
+}
+
+static inline size_t csum_table_size(const struct csum_table *t)
+{
+	return CSUM_HDR_SIZE + t->nr_blocks * sizeof(t->csum[0]);
+}
+
+static void csum_table_init(struct csum_table *t, size_t size)
+{
+	int shift = CSUM_MIN_SHIFT;
+
+	while (DIV_ROUND_UP(size, 1UL << shift) > CSUM_MAX_BLOCKS)
+		shift++;
+
+	memset(t, 0, CSUM_HDR_SIZE);
+	t->block_shift = shift;
+	t->nr_blocks = DIV_ROUND_UP(size, 1UL << shift);
+}
+
+/* Return 1 if the object has the checksums, 0 if not, and -1 on error */
+static int get_csum_table(int fd, uint64_t oid, struct csum_table *t)
+{
+	ssize_t len = fgetxattr(fd, CSUM_XATTR, t, sizeof(*t));
+
+	if (len < 0) {
+		if (errno == ENODATA)
+			return 0;
+		sd_err("failed to get checksums of %016"PRIx64", %m", oid);
+		return -1;
+	}
+
+	if (len < CSUM_HDR_SIZE || len != csum_table_size(t) ||
+	    t->block_shift < CSUM_MIN_SHIFT || t->block_shift >= 32 ||
+	    (uint64_t)t->nr_blocks << t->block_shift <
+	    get_store_objsize(oid)) {
+		sd_err("invalid checksums of %016"PRIx64", ignored", oid);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Set the checksums of the object.  If it fails, the stale ones are removed
+ * not to fail the verification of the object.
+ */
+static int set_csum_table(int fd, uint64_t oid, const struct csum_table *t)
+{
+	if (fsetxattr(fd, CSUM_XATTR, t, csum_table_size(t), 0) == 0)
+		return 0;
+
+	sd_err("failed to set checksums of %016"PRIx64", %m", oid);
+	if (fremovexattr(fd, CSUM_XATTR) == 0 || errno == ENODATA)
+		return 0;
+
+	return -1;
+}
+
+static ssize_t csum_pread(int fd, uint64_t oid, void *buf, size_t len,
+			  off_t offset)
+{
+	ssize_t size;
+
+	if (is_sparse_object(oid))
+		size = xpread_sparse(fd, buf, len, offset);
+	else
+		size = xpread(fd, buf, len, offset);
+	if (size >= 0 && size < len)
+		/* beyond EOF */
+		memset((char *)buf + size, 0, len - size);
+
+	return size;
+}
+
+static uint32_t crc32c_zero(uint32_t crc, size_t len)
+{
+	static const char zero[4096];
+
+	for (size_t n; len > 0; len -= n) {
+		n = min(len, sizeof(zero));
+		crc = crc32c(crc, zero, n);
+	}
+
+	return crc;
+}
+
+static uint32_t zero_block_csum(int shift)
+{
+	uint64_t v = uatomic_read(&zero_csum[shift]);
+
+	if (!(v >> 32)) {
+		v = crc32c_zero(0, 1UL << shift) | (1ULL << 32);
+		uatomic_set(&zero_csum[shift], v);
+	}
+
+	return (uint32_t)v;
+}
+
+/* Compute the checksums of the blocks from 'first' to 'last' in the file */
+static int csum_blocks_from_file(int fd, uint64_t oid, struct csum_table *t,
+				 uint32_t first, uint32_t last)
+{
+	size_t bs = 1UL << t->block_shift, objsize = get_store_objsize(oid);
+	uint64_t start = (uint64_t)first << t->block_shift;
+	uint64_t end = min((uint64_t)last << t->block_shift, (uint64_t)objsize);
+	char *buf = xvalloc(end - start);
+	int ret = 0;
+
+	if (csum_pread(fd, oid, buf, end - start, start) < 0) {
+		sd_err("failed to read %016"PRIx64", %m", oid);
+		ret = -1;
+		goto out;
+	}
+
+	for (uint32_t i = first; i < last; i++) {
+		uint64_t s = (uint64_t)i << t->block_shift;
+
+		t->csum[i] = crc32c(0, buf + s - start, min(bs, end - s));
+	}
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Set the checksums of a new object, whose data is 'buf' at 'offset' and zero
+ * elsewhere.
+ */
+int csum_create(int fd, uint64_t oid, const void *buf, uint64_t offset,
+		uint32_t len)
+{
+	struct csum_table t;
+	size_t objsize = get_store_objsize(oid);
+	uint64_t end = offset + len;
+	const char *p = buf;
+
+	csum_table_init(&t, objsize);
+	for (uint32_t i = 0; i < t.nr_blocks; i++) {
+		uint64_t s = (uint64_t)i << t.block_shift;
+		uint64_t e = min(s + (1UL << t.block_shift), (uint64_t)objsize);
+		uint64_t lo = max(s, offset), hi = min(e, end);
+		uint32_t crc;
+
+		if (lo >= hi) {
+			t.csum[i] = e - s == 1UL << t.block_shift ?
+				zero_block_csum(t.block_shift) :
+				crc32c_zero(0, e - s);
+			continue;
+		}
+
+		crc = crc32c_zero(0, lo - s);
+		crc = crc32c(crc, p + lo - offset, hi - lo);
+		t.csum[i] = crc32c_zero(crc, e - hi);
+	}
+
+	return set_csum_table(fd, oid, &t);
+}
+
+/* Set the checksums of the object from its data in the file */
+int csum_rebuild(int fd, uint64_t oid)
+{
+	struct csum_table t;
+
+	csum_table_init(&t, get_store_objsize(oid));
+	if (csum_blocks_from_file(fd, oid, &t, 0, t.nr_blocks) < 0)
+		return -1;
+
+	return set_csum_table(fd, oid, &t);
+}
+
+void csum_write_begin(uint64_t oid)
+{
+	sd_read_lock(&csum_locks[csum_lock_idx(oid)]);
+}
+
+/* End a write which failed before it could open the object */
+void csum_write_cancel(uint64_t oid)
+{
+	sd_rw_unlock(&csum_locks[csum_lock_idx(oid)]);
+}
+
+/*
+ * Block the writes of an object while it is replaced as a whole, e.g. by a
+ * copy read from another replica.  A write which was acknowledged in between
+ * would go to the file being replaced and be lost.
+ */
+void csum_replace_begin(uint64_t oid)
+{
+	sd_write_lock(&csum_locks[csum_lock_idx(oid)]);
+}
+
+void csum_replace_end(uint64_t oid)
+{
+	sd_rw_unlock(&csum_locks[csum_lock_idx(oid)]);
+}
+
+/*
+ * Update the checksums of the blocks the write to [start, end) has touched.
+ * This must follow csum_write_begin().
+ */
+int csum_write_end(int fd, uint64_t oid, uint64_t start, uint64_t end)
+{
+	struct csum_table t;
+	int idx = csum_lock_idx(oid), ret;
+	uint32_t first, last;
+
+	sd_mutex_lock(&csum_update_locks[idx]);
+	ret = get_csum_table(fd, oid, &t);
+	if (ret <= 0)
+		goto out;
+
+	first = start >> t.block_shift;
+	last = min(DIV_ROUND_UP(end, 1UL << t.block_shift),
+		   (uint64_t)t.nr_blocks);
+	if (first >= last)
+		goto out;
+
+	if (csum_blocks_from_file(fd, oid, &t, first, last) == 0)
+		ret = set_csum_table(fd, oid, &t);
+	else
+		/* drop the checksums we can't update */
+		ret = fremovexattr(fd, CSUM_XATTR);
+out:
+	sd_mutex_unlock(&csum_update_locks[idx]);
+	sd_rw_unlock(&csum_locks[idx]);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Verify the blocks 'buf', the data of [offset, offset + len), touches.  The
+ * rest of the first and last blocks are read from the file.  Return 0 if they
+ * match, 1 with the block in 'bad' if not, and -1 on error.
+ */
+static int verify_blocks(int fd, uint64_t oid, const struct csum_table *t,
+			 const void *buf, uint64_t offset, uint32_t len,
+			 uint32_t *bad)
+{
+	size_t bs = 1UL << t->block_shift, objsize = get_store_objsize(oid);
+	uint64_t end = offset + len;
+	uint32_t last = min(DIV_ROUND_UP(end, bs), (uint64_t)t->nr_blocks);
+	const char *p = buf;
+	char *blk = NULL;
+	int ret = 0;
+
+	for (uint32_t i = offset >> t->block_shift; i < last; i++) {
+		uint64_t s = (uint64_t)i << t->block_shift;
+		uint64_t e = min(s + bs, (uint64_t)objsize);
+		uint64_t lo = max(s, offset), hi = min(e, end);
+		uint32_t crc;
+
+		if (lo == s && hi == e)
+			crc = crc32c(0, p + s - offset, e - s);
+		else {
+			if (!blk)
+				blk = xvalloc(bs);
+			if (csum_pread(fd, oid, blk, e - s, s) < 0) {
+				sd_err("failed to read %016"PRIx64", %m", oid);
+				ret = -1;
+				break;
+			}
+			crc = crc32c(0, blk, lo - s);
+			crc = crc32c(crc, p + lo - offset, hi - lo);
+			crc = crc32c(crc, blk + hi - s, e - hi);
+		}
+
+		if (crc != t->csum[i]) {
+			*bad = i;
+			ret = 1;
+			break;
+		}
+	}
+
+	free(blk);
+	return ret;
+}
+
+/*
+ * Read [offset, offset + len) again and verify it while no write to the object
+ * is in flight.
+ */
+static int verify_blocks_locked(int fd, uint64_t oid, void *buf,
+				uint64_t offset, uint32_t len, uint32_t *bad)
+{
+	struct csum_table t;
+	int idx = csum_lock_idx(oid), ret;
+
+	sd_write_lock(&csum_locks[idx]);
+	ret = get_csum_table(fd, oid, &t);
+	if (ret <= 0)
+		goto out;
+
+	if (csum_pread(fd, oid, buf, len, offset) < 0) {
+		sd_err("failed to read %016"PRIx64", %m", oid);
+		ret = -1;
+		goto out;
+	}
+	ret = verify_blocks(fd, oid, &t, buf, offset, len, bad);
+out:
+	sd_rw_unlock(&csum_locks[idx]);
+	return ret;
+}
+
+static void queue_csum_repair(uint64_t oid, uint8_t ec_index);
+
+static int csum_verify(int fd, uint64_t oid, uint8_t ec_index, const char *path,
+		       void *buf, uint64_t offset, uint32_t len)
+{
+	struct csum_table t;
+	uint32_t bad;
+	int ret;
+
+	ret = get_csum_table(fd, oid, &t);
+	if (ret == 0)
+		return SD_RES_SUCCESS;
+	if (ret > 0)
+		ret = verify_blocks(fd, oid, &t, buf, offset, len, &bad);
+	if (ret > 0)
+		ret = verify_blocks_locked(fd, oid, buf, offset, len, &bad);
+
+	if (ret < 0)
+		return err_to_sderr(path, oid, errno);
+	if (ret == 0)
+		return SD_RES_SUCCESS;
+
+	sd_err("%s doesn't match its checksum at %"PRIu64, path,
+	       (uint64_t)bad << t.block_shift);
+	if (!is_stale_path(path))
+		queue_csum_repair(oid, ec_index);
+
+	return SD_RES_CSUM_MISMATCH;
+}
+
+/* Verify the data 'iocb' has read from the object */
+int csum_verify_read(int fd, uint64_t oid, const char *path,
+		     const struct siocb *iocb)
+{
+	return csum_verify(fd, oid, iocb->ec_index, path, iocb->buf,
+			   iocb->offset, iocb->length);
+}
+
+/* The data of the object is changed without its checksums */
+void csum_drop(int fd)
+{
+	if (fremovexattr(fd, CSUM_XATTR) < 0 && errno != ENODATA)
+		sd_err("failed to remove checksums, %m");
+}
+
+/* Copy the checksums of the object 'src' to its copy 'dst' */
+void csum_copy(const char *src, const char *dst)
+{
+	struct csum_table t;
+	ssize_t len;
+
+	len = getxattr(src, CSUM_XATTR, &t, sizeof(t));
+	if (len < 0) {
+		if (errno != ENODATA)
+			sd_err("failed to get checksums of %s, %m", src);
+		return;
+	}
+
+	if (setxattr(dst, CSUM_XATTR, &t, len, 0) < 0)
+		sd_err("failed to set checksums of %s, %m", dst);
+}
+
+/*
+ * A digest of 'buf' for comparing replicas, which is much cheaper than sha1
+ * but not collision resistant: the CRC-32Cs of its five fifths.
+ */
+void csum_digest(const void *buf, size_t len, uint8_t *digest)
+{
+	const uint8_t *p = buf;
+	uint32_t crc;
+
+	for (int i = 0; i < 5; i++) {
+		size_t start = len * i / 5, end = len * (i + 1) / 5;
+
+		crc = htole32(crc32c(0, p + start, end - start));
+		memcpy(digest + i * sizeof(crc), &crc, sizeof(crc));
+	}
+}
+
+/*
+ * Repair
+ *
+ * A corrupted object is read from another replica and written again by
+ * SD_OP_REPAIR_REPLICA, which this node sends to itself for each of the other
+ * replicas until one succeeds.  The replicas are looked up in the main thread.
+ * Erasure coded objects can't be repaired this way; their strips are rebuilt
+ * only by the recovery.
+ */
+struct csum_repair {
+	struct work work;
+	struct list_node list;
+	uint64_t oid;
+	uint8_t ec_index;
+	struct vnode_info *vinfo;
+	int ret;
+};
+
+static LIST_HEAD(repair_list);
+static struct sd_mutex repair_lock = SD_MUTEX_INITIALIZER;
+
+static void csum_repair_work(struct work *work)
+{
+	struct csum_repair *rw = container_of(work, struct csum_repair, work);
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	const struct sd_node *n;
+	struct sd_req hdr;
+	int nr_copies;
+
+	rw->ret = SD_RES_NO_SUPPORT;
+	if (is_erasure_oid(rw->oid))
+		return;
+
+	rw->ret = SD_RES_NO_OBJ;
+	nr_copies = get_obj_copy_number(rw->oid, rw->vinfo->nr_zones);
+	oid_to_vnodes(rw->oid, &rw->vinfo->vroot, nr_copies, obj_vnodes);
+	for (int i = 0; i < nr_copies; i++) {
+		n = obj_vnodes[i]->node;
+		if (node_is_local(n))
+			continue;
+
+		sd_init_req(&hdr, SD_OP_REPAIR_REPLICA);
+		hdr.epoch = sys_epoch();
+		hdr.forw.oid = rw->oid;
+		memcpy(hdr.forw.addr, n->nid.addr, sizeof(hdr.forw.addr));
+		hdr.forw.port = n->nid.port;
+		rw->ret = sheep_exec_req(&sys->this_node.nid, &hdr, NULL);
+		if (rw->ret == SD_RES_SUCCESS)
+			break;
+	}
+}
+
+static void csum_repair_done(struct work *work)
+{
+	struct csum_repair *rw = container_of(work, struct csum_repair, work);
+
+	if (rw->ret == SD_RES_SUCCESS) {
+		sd_info("repaired %016"PRIx64, rw->oid);
+		uatomic_inc(&sys->stat.s.repaired_nr);
+	} else {
+		sd_err("failed to repair %016"PRIx64", %s", rw->oid,
+		       sd_strerror(rw->ret));
+		uatomic_inc(&sys->stat.s.unrepaired_nr);
+	}
+
+	if (rw->vinfo)
+		put_vnode_info(rw->vinfo);
+	sd_mutex_lock(&repair_lock);
+	list_del(&rw->list);
+	sd_mutex_unlock(&repair_lock);
+	free(rw);
+}
+
+static void csum_repair_start(struct work *work)
+{
+	struct csum_repair *rw = container_of(work, struct csum_repair, work);
+
+	rw->vinfo = get_vnode_info();
+	if (!rw->vinfo || sys->cinfo.status != SD_STATUS_OK) {
+		rw->ret = SD_RES_HALT;
+		csum_repair_done(work);
+		return;
+	}
+
+	rw->work.fn = csum_repair_work;
+	rw->work.done = csum_repair_done;
+	queue_work(sys->scrub_wqueue, &rw->work);
+}
+
+static void queue_csum_repair(uint64_t oid, uint8_t ec_index)
+{
+	struct csum_repair *rw;
+
+	sd_mutex_lock(&repair_lock);
+	list_for_each_entry(rw, &repair_list, list) {
+		if (rw->oid == oid && rw->ec_index == ec_index) {
+			sd_mutex_unlock(&repair_lock);
+			return;
+		}
+	}
+	rw = xzalloc(sizeof(*rw));
+	rw->oid = oid;
+	rw->ec_index = ec_index;
+	list_add_tail(&rw->list, &repair_list);
+	sd_mutex_unlock(&repair_lock);
+
+	uatomic_inc(&sys->stat.s.corrupt_nr);
+
+	/* look up the replicas in the main thread */
+	rw->work.done = csum_repair_start;
+	queue_work(sys->scrub_wqueue, &rw->work);
+}
+
+enum scrub_state {
+	SCRUB_IDLE,
+	SCRUB_RUNNING,
+	SCRUB_WAITING,		/* for the next pass */
+};
+
+struct scrub_disk {
+	struct rb_node rb;
+	char path[PATH_MAX];
+	enum scrub_state state;	/* written by the main thread */
+	uint64_t start;		/* of the current pass */
+	struct work work;
+	struct timer timer;
+
+	/* the current pass, written by the scrubber */
+	uint64_t nr_scanned;
+	uint64_t nr_bad;
+	uint64_t scanned_bytes;
+};
+
+static struct rb_root scrub_root = RB_ROOT;
+
+static int scrub_disk_cmp(const struct scrub_disk *a,
+			  const struct scrub_disk *b)
+{
+	return strcmp(a->path, b->path);
+}
+
+static int scrub_object(uint64_t oid, const char *dir, uint32_t epoch,
+			uint8_t ec_index, struct vnode_info *vinfo, void *arg)
+{
+	struct scrub_disk *sd = arg;
+	char path[PATH_MAX];
+	size_t size = get_store_objsize(oid);
+	uint64_t start = clock_get_monotonic(), deadline;
+	struct io_ticket t;
+	struct csum_table table;
+	void *buf;
+	int fd, ret;
+
+	if (is_erasure_oid(oid))
+		snprintf(path, sizeof(path), "%s/%016"PRIx64"_%d", dir, oid,
+			 ec_index);
+	else
+		snprintf(path, sizeof(path), "%s/%016"PRIx64, dir, oid);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			err_to_sderr(path, oid, errno);
+		/* removed or moved since the directory was read */
+		return SD_RES_SUCCESS;
+	}
+
+	buf = xvalloc(size);
+	iosched_begin(&t, oid, IO_CLASS_BACKGROUND);
+	if (csum_pread(fd, oid, buf, size, 0) < 0) {
+		sd_err("failed to read %s, %m", path);
+		err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	ret = get_csum_table(fd, oid, &table);
+	if (ret == 0) {
+		int idx = csum_lock_idx(oid);
+
+		/* no write to the object may be in flight */
+		sd_write_lock(&csum_locks[idx]);
+		if (get_csum_table(fd, oid, &table) == 0 &&
+		    csum_rebuild(fd, oid) < 0)
+			sd_err("failed to set checksums of %s", path);
+		sd_rw_unlock(&csum_locks[idx]);
+	} else if (ret > 0 &&
+		   csum_verify(fd, oid, ec_index, path, buf, 0, size) ==
+		   SD_RES_CSUM_MISMATCH)
+		sd->nr_bad++;
+
+	sd->nr_scanned++;
+	sd->scanned_bytes += size;
+	uatomic_inc(&sys->stat.s.scanned_nr);
+	uatomic_add(&sys->stat.s.scanned_bytes, size);
+out:
+	iosched_end(&t);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	free(buf);
+
+	deadline = start + size * 1000000000ULL /
+		((uint64_t)sys->scrub_rate * 1024 * 1024);
+	while (clock_get_monotonic() < deadline)
+		usleep(min((deadline - clock_get_monotonic()) / 1000,
+			   (uint64_t)1000000));
+
+	return SD_RES_SUCCESS;
+}
+
+static void scrub_work(struct work *work)
+{
+	struct scrub_disk *sd = container_of(work, struct scrub_disk, work);
+
+	sd->nr_scanned = 0;
+	sd->nr_bad = 0;
+	sd->scanned_bytes = 0;
+	for_each_object_in_path(sd->path, scrub_object, false, NULL, sd);
+}
+
+static void scrub_timer_fn(void *data)
+{
+	struct scrub_disk *sd = data;
+
+	sd->state = SCRUB_IDLE;
+	start_scrub();
+}
+
+static void scrub_done(struct work *work)
+{
+	struct scrub_disk *sd = container_of(work, struct scrub_disk, work);
+	uint64_t elapsed = (clock_get_monotonic() - sd->start) / 1000000;
+
+	sd_info("scrubbed %s, %"PRIu64" objects (%"PRIu64" bytes), %"PRIu64
+		" corrupted", sd->path, sd->nr_scanned, sd->scanned_bytes,
+		sd->nr_bad);
+
+	sd->state = SCRUB_WAITING;
+	/* a zero timeout would disarm the timer */
+	add_timer(&sd->timer, elapsed < SCRUB_PERIOD ?
+		  SCRUB_PERIOD - elapsed : 1);
+}
+
+static int start_scrub_disk(const char *path)
+{
+	struct scrub_disk key, *sd;
+
+	pstrcpy(key.path, sizeof(key.path), path);
+	sd = rb_search(&scrub_root, &key, rb, scrub_disk_cmp);
+	if (!sd) {
+		sd = xzalloc(sizeof(*sd));
+		pstrcpy(sd->path, sizeof(sd->path), path);
+		sd->work.fn = scrub_work;
+		sd->work.done = scrub_done;
+		sd->timer.callback = scrub_timer_fn;
+		sd->timer.data = sd;
+		rb_insert(&scrub_root, sd, rb, scrub_disk_cmp);
+	}
+
+	if (sd->state == SCRUB_IDLE) {
+		sd->state = SCRUB_RUNNING;
+		sd->start = clock_get_monotonic();
+		queue_work(sys->scrub_wqueue, &sd->work);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static void scrub_retry_fn(void *data)
+{
+	bool *armed = data;
+
+	*armed = false;
+	start_scrub();
+}
+
+/* Start scrubbing the disks which aren't being scrubbed */
+main_fn void start_scrub(void)
+{
+	static bool retry_armed;
+	static struct timer retry_timer = {
+		.callback = scrub_retry_fn,
+		.data = &retry_armed,
+	};
+
+	if (!sys->checksum || !sys->scrub_rate || sys->gateway_only)
+		return;
+
+	if (sys->cinfo.status != SD_STATUS_OK) {
+		if (!retry_armed) {
+			retry_armed = true;
+			add_timer(&retry_timer, SCRUB_RETRY);
+		}
+		return;
+	}
+
+	for_each_obj_path(start_scrub_disk);
+}
+
+int init_csum(void)
+{
+	if (!sys->checksum)
+		return 0;
+
+	for (int i = 0; i < CSUM_NR_LOCKS; i++) {
+		sd_init_rw_lock(&csum_locks[i]);
+		sd_init_mutex(&csum_update_locks[i]);
+	}
+
+	start_scrub();
+	return 0;
+}
@@ -11,9 +11,14 @@
 
 #include <libgen.h>
 #include <linux/falloc.h>
+#include <sys/ioctl.h>
 
 #include "sheep_priv.h"
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 char *obj_path;
 char *epoch_path;
 
@@ -32,7 +37,8 @@ int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create)
 	int syncflag = create ? O_SYNC : O_DSYNC;
 	int flags = syncflag | O_RDWR;
 
-	if (uatomic_is_true(&sys->use_journal) || sys->nosync == true)
+	if (uatomic_is_true(&sys->use_journal) || sys->nosync == true ||
+	    iocb->writeback)
 		flags &= ~syncflag;
 
 	if (sys->backend_dio && is_data_obj(oid) && iocb_is_aligned(iocb)) {
@@ -47,6 +53,224 @@ int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create)
 	return flags;
 }
 
+/*
+ * Disks which hold data objects written since the last flush of their vdi,
+ * tracked only in write-back mode.  A flush syncs every such disk once with
+ * syncfs(), which also persists the directory entries of new objects.
+ */
+struct dirty_vdi {
+	struct rb_node rb;
+	uint32_t vid;
+	int nr_paths;
+	char *paths[MD_MAX_DISK];
+};
+
+static struct rb_root dirty_vdi_root = RB_ROOT;
+static struct sd_mutex dirty_vdi_lock = SD_MUTEX_INITIALIZER;
+
+static int dirty_vdi_cmp(const struct dirty_vdi *a, const struct dirty_vdi *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static void __dirty_vdi_mark(uint32_t vid, const char *path)
+{
+	struct dirty_vdi key = { .vid = vid }, *dv;
+	int i;
+
+	sd_mutex_lock(&dirty_vdi_lock);
+	dv = rb_search(&dirty_vdi_root, &key, rb, dirty_vdi_cmp);
+	if (!dv) {
+		dv = xzalloc(sizeof(*dv));
+		dv->vid = vid;
+		rb_insert(&dirty_vdi_root, dv, rb, dirty_vdi_cmp);
+	}
+
+	for (i = 0; i < dv->nr_paths; i++)
+		if (strcmp(dv->paths[i], path) == 0)
+			goto out;
+
+	if (dv->nr_paths < MD_MAX_DISK)
+		dv->paths[dv->nr_paths++] = xstrdup(path);
+out:
+	sd_mutex_unlock(&dirty_vdi_lock);
+}
+
+void dirty_vdi_mark(uint64_t oid)
+{
+	__dirty_vdi_mark(oid_to_vid(oid), md_get_object_dir(oid));
+}
+
+int dirty_vdi_sync(uint32_t vid)
+{
+	struct dirty_vdi key = { .vid = vid }, *dv;
+	int i, fd, ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&dirty_vdi_lock);
+	dv = rb_search(&dirty_vdi_root, &key, rb, dirty_vdi_cmp);
+	if (dv)
+		rb_erase(&dv->rb, &dirty_vdi_root);
+	sd_mutex_unlock(&dirty_vdi_lock);
+
+	if (!dv)
+		return SD_RES_SUCCESS;
+
+	for (i = 0; i < dv->nr_paths; i++) {
+		fd = open(dv->paths[i], O_DIRECTORY | O_RDONLY);
+		if (fd < 0) {
+			sd_err("failed to open %s, %m", dv->paths[i]);
+			ret = SD_RES_EIO;
+			/* the next flush of the vdi retries the disk */
+			__dirty_vdi_mark(vid, dv->paths[i]);
+		} else {
+			if (syncfs(fd) < 0) {
+				sd_err("failed to sync %s, %m", dv->paths[i]);
+				/*
+				 * A disk with EIO is unplugged and its objects
+				 * are recovered, which writes them synchronously.
+				 */
+				if (errno == EIO)
+					md_handle_eio(dv->paths[i]);
+				else
+					__dirty_vdi_mark(vid, dv->paths[i]);
+				ret = SD_RES_EIO;
+			}
+			close(fd);
+		}
+		free(dv->paths[i]);
+	}
+	free(dv);
+
+	return ret;
+}
+
+/*
+ * Group commit of the directory entries of new objects
+ *
+ * Every created object has to be followed by fsync() of its directory, and
+ * concurrent creates in a directory share it.  A thread which finds no fsync
+ * in flight for the directory issues one, which covers every entry renamed
+ * into it so far.  The threads arriving meanwhile wait for it to finish, and
+ * then one of them issues the next fsync for all of them.  So each create
+ * still returns only after its entry is durable, but the directory is synced
+ * at most twice for any number of concurrent creates.
+ *
+ * Only the result of the last fsync is kept, so the next one isn't issued
+ * until every request it covered has read it.
+ */
+struct dir_sync {
+	struct rb_node rb;
+	char *path;
+
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	bool syncing;
+	uint64_t requested;	/* the sequence number of the last request */
+	uint64_t done;		/* requests up to this have been synced */
+	int err;		/* the result of the last fsync */
+	uint64_t nr_unread;	/* requests which haven't read 'err' yet */
+};
+
+static struct rb_root dir_sync_root = RB_ROOT;
+static struct sd_rw_lock dir_sync_lock = SD_RW_LOCK_INITIALIZER;
+
+static int dir_sync_cmp(const struct dir_sync *a, const struct dir_sync *b)
+{
+	return strcmp(a->path, b->path);
+}
+
+/* Entries are never freed, so the returned pointer stays valid */
+static struct dir_sync *get_dir_sync(const char *path)
+{
+	struct dir_sync key = { .path = (char *)path }, *ds, *old;
+
+	sd_read_lock(&dir_sync_lock);
+	ds = rb_search(&dir_sync_root, &key, rb, dir_sync_cmp);
+	sd_rw_unlock(&dir_sync_lock);
+	if (ds)
+		return ds;
+
+	ds = xzalloc(sizeof(*ds));
+	ds->path = xstrdup(path);
+	sd_init_mutex(&ds->lock);
+	sd_cond_init(&ds->cond);
+	sd_write_lock(&dir_sync_lock);
+	old = rb_insert(&dir_sync_root, ds, rb, dir_sync_cmp);
+	sd_rw_unlock(&dir_sync_lock);
+	if (old) {
+		sd_destroy_cond(&ds->cond);
+		sd_destroy_mutex(&ds->lock);
+		free(ds->path);
+		free(ds);
+		ds = old;
+	}
+
+	return ds;
+}
+
+static int fsync_dir(const char *path)
+{
+	int fd, ret;
+
+	fd = open(path, O_DIRECTORY | O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open directory %s: %m", path);
+		return errno;
+	}
+
+	ret = fsync(fd);
+	if (ret != 0) {
+		ret = errno;
+		sd_err("failed to write directory %s: %m", path);
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Make the entries renamed into the directory so far durable.  Return 0 on
+ * success, or the errno of the failure.
+ */
+int sync_object_dir(const char *path)
+{
+	struct dir_sync *ds = get_dir_sync(path);
+	uint64_t seq, target;
+	int ret;
+
+	sd_mutex_lock(&ds->lock);
+	seq = ++ds->requested;
+	for (;;) {
+		/* the last fsync covered 'seq' */
+		if (ds->done >= seq) {
+			ret = ds->err;
+			if (--ds->nr_unread == 0)
+				sd_cond_broadcast(&ds->cond);
+			break;
+		}
+		if (ds->syncing || ds->nr_unread > 0) {
+			sd_cond_wait(&ds->cond, &ds->lock);
+			continue;
+		}
+
+		ds->syncing = true;
+		target = ds->requested;
+		sd_mutex_unlock(&ds->lock);
+
+		ret = fsync_dir(ds->path);
+
+		sd_mutex_lock(&ds->lock);
+		ds->syncing = false;
+		ds->nr_unread = target - ds->done;
+		ds->done = target;
+		ds->err = ret;
+		sd_cond_broadcast(&ds->cond);
+	}
+	sd_mutex_unlock(&ds->lock);
+
+	return ret;
+}
+
 int err_to_sderr(const char *path, uint64_t oid, int err)
 {
 	struct stat s;
@@ -98,6 +322,226 @@ int discard(int fd, uint64_t start, uint32_t end)
 	return ret;
 }
 
+#define CLONE_COPY_SIZE (1024 * 1024)
+
+/*
+ * Make the new object file 'fd' a copy of the object file at 'src'.
+ *
+ * The data blocks are shared if the filesystem supports reflinks (e.g. btrfs
+ * and xfs) and both files are on it, otherwise they are copied.  Zero blocks
+ * aren't written, so the copy of a sparse object is sparse too.
+ *
+ * Return -1 with errno set on error.
+ */
+int clone_object_file(int fd, const char *src)
+{
+	int sfd, ret = -1;
+	struct stat st;
+	char *buf = NULL;
+	ssize_t size;
+
+	sfd = open(src, O_RDONLY);
+	if (sfd < 0)
+		return -1;
+
+	if (ioctl(fd, FICLONE, sfd) == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	if (fstat(sfd, &st) < 0 || xftruncate(fd, st.st_size) < 0)
+		goto out;
+
+	/* the destination may be opened with O_DIRECT */
+	buf = xvalloc(CLONE_COPY_SIZE);
+	for (off_t off = 0; off < st.st_size; off += size) {
+		uint64_t zero_off = 0;
+		uint32_t len;
+
+		size = xpread(sfd, buf, min((off_t)CLONE_COPY_SIZE,
+					    st.st_size - off), off);
+		if (size <= 0) {
+			if (size == 0)
+				errno = EIO;
+			goto out;
+		}
+		len = size;
+		find_zero_blocks(buf, &zero_off, &len);
+		if (!len)
+			continue;
+		if (xpwrite(fd, buf, size, off) != size)
+			goto out;
+	}
+	ret = 0;
+out:
+	free(buf);
+	close(sfd);
+	return ret;
+}
+
+static inline bool is_zero_chunk(const char *p, size_t len)
+{
+	return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+/*
+ * Read the object file 'fd' without reading its holes from the disk.  The
+ * holes are zero-filled in 'buf'.  Return 'len' on success as xpread() does
+ * for a complete read.
+ */
+ssize_t xpread_sparse(int fd, void *buf, size_t len, off_t offset)
+{
+	off_t pos = offset, end = offset + len, data, hole;
+	char *p = buf;
+	ssize_t size;
+
+	while (pos < end) {
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			if (errno != ENXIO)
+				/* SEEK_DATA isn't supported */
+				return xpread(fd, buf, len, offset);
+			data = end;
+		}
+		data = min(data, end);
+		memset(p + (pos - offset), 0, data - pos);
+		if (data == end)
+			break;
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return xpread(fd, buf, len, offset);
+		hole = min(hole, end);
+
+		size = xpread(fd, p + (data - offset), hole - data, data);
+		if (size < 0)
+			return size;
+		if (size < hole - data)
+			/* beyond EOF */
+			memset(p + (data - offset) + size, 0,
+			       hole - data - size);
+		pos = hole;
+	}
+
+	return len;
+}
+
+/*
+ * Write 'buf' to the new object file 'fd', leaving the chunks of the object
+ * which are all zero as holes.  Return 'len' on success as xpwrite() does.
+ */
+ssize_t xpwrite_sparse(int fd, const void *buf, size_t len, off_t offset)
+{
+	const char *p = buf;
+	size_t pos = 0, start = 0, n;
+	ssize_t size;
+
+	/* write each run of non-zero chunks from 'start' at once */
+	for (; pos <= len; pos += n) {
+		n = min(len - pos, SD_SPARSE_CHUNK_SIZE -
+			(size_t)(offset + pos) % SD_SPARSE_CHUNK_SIZE);
+		if (pos < len && !is_zero_chunk(p + pos, n))
+			continue;
+
+		if (pos > start) {
+			size = xpwrite(fd, p + start, pos - start,
+				       offset + start);
+			if (size != pos - start)
+				return size < 0 ? size : -1;
+		}
+		start = pos + n;
+		if (pos == len)
+			break;
+	}
+
+	return len;
+}
+
+static inline void sparse_set_bit(uint8_t *bmap, uint32_t i)
+{
+	bmap[i / 8] |= 1 << (i % 8);
+}
+
+static inline bool sparse_test_bit(const uint8_t *bmap, uint32_t i)
+{
+	return bmap[i / 8] & (1 << (i % 8));
+}
+
+/*
+ * Pack the object data read for the SD_FLAG_CMD_SPARSE request in place:
+ *
+ *   | non-zero chunks ... | bitmap of the non-zero chunks |
+ *
+ * Bit 'i' of the bitmap, for chunk 'i', is bit (i % 8) of byte (i / 8), so
+ * the layout doesn't depend on the word size or the byte order of the nodes.
+ *
+ * Return the packed length, or 'len' if packing doesn't make it shorter.
+ */
+uint32_t sparse_pack(void *buf, uint32_t len)
+{
+	uint32_t nr = DIV_ROUND_UP(len, SD_SPARSE_CHUNK_SIZE);
+	uint32_t bmap_len = DIV_ROUND_UP(nr, 8);
+	uint8_t *bmap = xzalloc(bmap_len);
+	uint32_t packed = 0, n;
+	char *p = buf;
+
+	for (uint32_t i = 0; i < nr; i++) {
+		uint32_t off = i * SD_SPARSE_CHUNK_SIZE;
+
+		n = min(len - off, (uint32_t)SD_SPARSE_CHUNK_SIZE);
+		if (is_zero_chunk(p + off, n))
+			continue;
+		sparse_set_bit(bmap, i);
+		packed += n;
+	}
+
+	if (packed + bmap_len >= len) {
+		packed = len;
+		goto out;
+	}
+
+	packed = 0;
+	for (uint32_t i = 0; i < nr; i++) {
+		uint32_t off = i * SD_SPARSE_CHUNK_SIZE;
+
+		if (!sparse_test_bit(bmap, i))
+			continue;
+		n = min(len - off, (uint32_t)SD_SPARSE_CHUNK_SIZE);
+		memmove(p + packed, p + off, n);
+		packed += n;
+	}
+	memcpy(p + packed, bmap, bmap_len);
+	packed += bmap_len;
+out:
+	free(bmap);
+	return packed;
+}
+
+/* Restore the 'len' bytes of object data packed by sparse_pack() */
+void sparse_unpack(void *buf, uint32_t packed_len, uint32_t len)
+{
+	uint32_t nr = DIV_ROUND_UP(len, SD_SPARSE_CHUNK_SIZE);
+	uint32_t bmap_len = DIV_ROUND_UP(nr, 8);
+	uint8_t *bmap = xmalloc(bmap_len);
+	uint32_t packed = packed_len - bmap_len, n;
+	char *p = buf;
+
+	memcpy(bmap, p + packed, bmap_len);
+
+	/* move the chunks backward so that they don't overwrite each other */
+	for (int i = nr - 1; i >= 0; i--) {
+		uint32_t off = i * SD_SPARSE_CHUNK_SIZE;
+
+		n = min(len - off, (uint32_t)SD_SPARSE_CHUNK_SIZE);
+		if (sparse_test_bit(bmap, i)) {
+			packed -= n;
+			memmove(p + off, p + packed, n);
+		} else
+			memset(p + off, 0, n);
+	}
+	free(bmap);
+}
+
 bool store_id_match(enum store_id id)
 {
 	return (sd_store->id == id);
@@ -18,11 +18,39 @@
 #define NONE_EXIST_PATH "/all/disks/are/broken/,ps/əʌo7/!"
 
 struct md md = {
-	.vroot = RB_ROOT,
 	.root = RB_ROOT,
 	.lock = SD_RW_LOCK_INITIALIZER,
 };
 
+/*
+ * The vdisk table is looked up without md.lock.  The writers, which hold the
+ * write lock, build a new table and publish it, then wait for the readers
+ * which may still be searching the old table before freeing it.
+ *
+ * A reader counts itself in md_readers[] of the current phase.  After
+ * publishing, a writer flips the phase and waits for the readers of the old
+ * one to drain, twice, like SRCU does: a reader which read the phase just
+ * before a flip may still count itself in the old slot afterwards.
+ *
+ * The callers keep using the path of the disk after the lookup, so removed
+ * disks are never freed.  They are kept in removed_root and reused when the
+ * same path is plugged again.
+ */
+static unsigned long md_readers[2];
+static unsigned long md_reader_phase;
+
+static struct rb_root removed_root = RB_ROOT;
+
+static void md_wait_readers(void)
+{
+	for (int i = 0; i < 2; i++) {
+		unsigned long phase = uatomic_add_return(&md_reader_phase, 1);
+
+		while (uatomic_read(&md_readers[(phase - 1) & 1]) > 0)
+			sched_yield();
+	}
+}
+
 static inline uint32_t nr_online_disks(void)
 {
 	uint32_t nr;
@@ -49,28 +77,53 @@ static int vdisk_cmp(const struct vdisk *d1, const struct vdisk *d2)
 	return intcmp(d1->hash, d2->hash);
 }
 
-static struct vdisk *vdisk_insert(struct vdisk *new)
+static struct vdisk_table *alloc_vdisk_table(size_t nr)
 {
-	return rb_insert(&md.vroot, new, rb, vdisk_cmp);
+	struct vdisk_table *t;
+
+	t = xmalloc(sizeof(*t) + sizeof(t->vdisks[0]) * nr);
+	t->nr = nr;
+
+	return t;
 }
 
-/* If v1_hash < hval <= v2_hash, then oid is resident in v2 */
-static struct vdisk *hval_to_vdisk(uint64_t hval)
+static void publish_vdisk_table(struct vdisk_table *t)
 {
-	struct vdisk dummy = { .hash = hval };
+	struct vdisk_table *old = uatomic_xchg_ptr(&md.vdisks, t);
 
-	return rb_nsearch(&md.vroot, &dummy, rb, vdisk_cmp);
+	if (old) {
+		md_wait_readers();
+		free(old);
+	}
 }
 
-static struct vdisk *oid_to_vdisk(uint64_t oid)
+/* If v1_hash < hval <= v2_hash, then oid is resident in v2 */
+static const struct vdisk *hval_to_vdisk(const struct vdisk_table *t,
+					 uint64_t hval)
 {
-	return hval_to_vdisk(sd_hash_oid(oid));
+	size_t lo = 0, hi = t->nr;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (t->vdisks[mid].hash < hval)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return t->vdisks + (lo == t->nr ? 0 : lo);
 }
 
-static void create_vdisks(const struct disk *disk)
+/* Return a copy of 'old' which has the vdisks of 'disk' merged into */
+static struct vdisk_table *merge_vdisks(const struct vdisk_table *old,
+					const struct disk *disk)
 {
 	uint64_t hval = sd_hash(disk->path, strlen(disk->path));
 	const struct sd_node *n = &sys->this_node;
+	size_t nr_old = old ? old->nr : 0, i = 0, j = 0, k = 0;
+	struct vdisk_table *new;
+	struct vdisk *v;
 	uint64_t node_hval;
 	int nr;
 
@@ -79,50 +132,59 @@ static void create_vdisks(const struct disk *disk)
 		hval = fnv_64a_64(node_hval, hval);
 		nr = DIV_ROUND_UP(disk->space, WEIGHT_MIN);
 		if (0 == n->nid.port)
-			return;
+			nr = 0;
 	} else
 		nr = vdisk_number(disk);
 
-	for (int i = 0; i < nr; i++) {
-		struct vdisk *v = xmalloc(sizeof(*v));
-
+	v = xmalloc(sizeof(*v) * nr);
+	for (int m = 0; m < nr; m++) {
 		hval = sd_hash_next(hval);
-		v->hash = hval;
-		v->disk = disk;
-		if (unlikely(vdisk_insert(v)))
+		v[m].hash = hval;
+		v[m].disk = disk;
+	}
+	xqsort(v, nr, vdisk_cmp);
+
+	/* merge the sorted vdisks into a copy of the table */
+	new = alloc_vdisk_table(nr_old + nr);
+	while (i < nr_old || j < nr) {
+		if (j == nr || (i < nr_old && old->vdisks[i].hash < v[j].hash))
+			new->vdisks[k++] = old->vdisks[i++];
+		else if (i == nr_old || v[j].hash < old->vdisks[i].hash)
+			new->vdisks[k++] = v[j++];
+		else
 			panic("vdisk hash collison");
 	}
+	free(v);
+
+	return new;
 }
 
-static inline void vdisk_free(struct vdisk *v)
+/* Publish a table which has the vdisks of 'disk' merged into */
+static void create_vdisks(const struct disk *disk)
 {
-	rb_erase(&v->rb, &md.vroot);
-	free(v);
+	publish_vdisk_table(merge_vdisks(md.vdisks, disk));
 }
 
+/* Publish a table which has the vdisks of 'disk' removed from */
 static void remove_vdisks(const struct disk *disk)
 {
-	uint64_t hval = sd_hash(disk->path, strlen(disk->path));
-	const struct sd_node *n = &sys->this_node;
-	uint64_t node_hval;
-	int nr;
+	const struct vdisk_table *old = md.vdisks;
+	struct vdisk_table *new;
+	size_t nr = 0, k = 0;
 
-	if (is_cluster_diskmode(&sys->cinfo)) {
-		node_hval = sd_hash(&n->nid, offsetof(typeof(n->nid), io_addr));
-		hval = fnv_64a_64(node_hval, hval);
-		nr = DIV_ROUND_UP(disk->space, WEIGHT_MIN);
-	} else
-		nr = vdisk_number(disk);
+	if (!old)
+		return;
 
-	for (int i = 0; i < nr; i++) {
-		struct vdisk *v;
+	for (size_t i = 0; i < old->nr; i++)
+		if (old->vdisks[i].disk != disk)
+			nr++;
 
-		hval = sd_hash_next(hval);
-		v = hval_to_vdisk(hval);
-		sd_assert(v->hash == hval);
+	new = alloc_vdisk_table(nr);
+	for (size_t i = 0; i < old->nr; i++)
+		if (old->vdisks[i].disk != disk)
+			new->vdisks[k++] = old->vdisks[i];
 
-		vdisk_free(v);
-	}
+	publish_vdisk_table(new);
 }
 
 static inline void trim_last_slash(char *path)
@@ -132,14 +194,19 @@ static inline void trim_last_slash(char *path)
 		path[strlen(path) - 1] = '\0';
 }
 
-static struct disk *path_to_disk(const char *path)
+static struct disk *lookup_disk(struct rb_root *root, const char *path)
 {
 	struct disk key = {};
 
 	pstrcpy(key.path, sizeof(key.path), path);
 	trim_last_slash(key.path);
 
-	return rb_search(&md.root, &key, rb, disk_cmp);
+	return rb_search(root, &key, rb, disk_cmp);
+}
+
+static struct disk *path_to_disk(const char *path)
+{
+	return lookup_disk(&md.root, path);
 }
 
 size_t get_store_objsize(uint64_t oid)
@@ -185,12 +252,10 @@ static int64_t find_string_integer(const char *str, const char *delimiter)
 }
 
 /* If cleanup is true, temporary objects will be removed */
-static int for_each_object_in_path(const char *path,
-				   int (*func)(uint64_t, const char *, uint32_t,
-					       uint8_t, struct vnode_info *,
-					       void *),
-				   bool cleanup, struct vnode_info *vinfo,
-				   void *arg)
+int for_each_object_in_path(const char *path,
+			    int (*func)(uint64_t, const char *, uint32_t,
+					uint8_t, struct vnode_info *, void *),
+			    bool cleanup, struct vnode_info *vinfo, void *arg)
 {
 	DIR *dir;
 	struct dirent *d;
@@ -222,6 +287,8 @@ static int for_each_object_in_path(const char *path,
 			if (S_ISDIR(s.st_mode)) {
 				ret = for_each_object_in_path(file_name,
 					func, cleanup, vinfo, arg);
+				if (ret != SD_RES_SUCCESS)
+					break;
 				continue;
 			}
 		}
@@ -350,12 +417,17 @@ bool md_add_disk(const char *path, bool purge)
 		return false;
 	}
 
-	new = xmalloc(sizeof(*new));
-	pstrcpy(new->path, PATH_MAX, path);
-	trim_last_slash(new->path);
+	new = lookup_disk(&removed_root, path);
+	if (new) {
+		rb_erase(&new->rb, &removed_root);
+	} else {
+		new = xmalloc(sizeof(*new));
+		pstrcpy(new->path, PATH_MAX, path);
+		trim_last_slash(new->path);
+	}
 	new->space = init_path_space(new->path, purge);
 	if (!new->space) {
-		free(new);
+		rb_insert(&removed_root, new, rb, disk_cmp);
 		return false;
 	}
 
@@ -375,7 +447,7 @@ static inline void md_remove_disk(struct disk *disk)
 	rb_erase(&disk->rb, &md.root);
 	md.nr_disks--;
 	remove_vdisks(disk);
-	free(disk);
+	rb_insert(&removed_root, disk, rb, disk_cmp);
 }
 
 uint64_t md_init_space(void)
@@ -383,26 +455,21 @@ uint64_t md_init_space(void)
 	return md.space;
 }
 
-static const char *md_get_object_dir_nolock(uint64_t oid)
-{
-	const struct vdisk *vd;
-
-	if (unlikely(md.nr_disks == 0))
-		return NONE_EXIST_PATH; /* To generate EIO */
-
-	vd = oid_to_vdisk(oid);
-	return vd->disk->path;
-}
-
 const char *md_get_object_dir(uint64_t oid)
 {
-	const char *p;
+	unsigned long phase = uatomic_read(&md_reader_phase) & 1;
+	const struct vdisk_table *t;
+	const char *path;
 
-	sd_read_lock(&md.lock);
-	p = md_get_object_dir_nolock(oid);
-	sd_rw_unlock(&md.lock);
+	uatomic_add_return(&md_readers[phase], 1);
+	t = uatomic_read(&md.vdisks);
+	if (unlikely(!t || t->nr == 0))
+		path = NONE_EXIST_PATH; /* To generate EIO */
+	else
+		path = hval_to_vdisk(t, sd_hash_oid(oid))->disk->path;
+	uatomic_sub_return(&md_readers[phase], 1);
 
-	return p;
+	return path;
 }
 
 struct process_path_arg {
@@ -538,6 +605,8 @@ struct md_work {
 	char path[PATH_MAX];
 };
 
+static void md_start_rebalance(void);
+
 static inline void kick_recover(void)
 {
 	struct vnode_info *vinfo = get_vnode_info();
@@ -570,6 +639,8 @@ out:
 		if (nr > 0) {
 			update_node_disks();
 			kick_recover();
+			md_start_rebalance();
+			start_scrub();
 		} else {
 			sd_warn("no disks available, going down");
 			leave_cluster();
@@ -614,12 +685,12 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 		if (!is_erasure_oid(oid)) {
 			snprintf(old, PATH_MAX, "%s/%016" PRIx64, path, oid);
 			snprintf(new, PATH_MAX, "%s/%016" PRIx64,
-				 md_get_object_dir_nolock(oid), oid);
+				 md_get_object_dir(oid), oid);
 		} else {
 			snprintf(old, PATH_MAX, "%s/%016" PRIx64"_%d", path,
 				 oid, ec_index);
 			snprintf(new, PATH_MAX, "%s/%016" PRIx64"_%d",
-				 md_get_object_dir_nolock(oid), oid, ec_index);
+				 md_get_object_dir(oid), oid, ec_index);
 		}
 	} else {
 		if (!is_erasure_oid(oid)) {
@@ -628,14 +699,14 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 				 oid, epoch);
 			snprintf(new, PATH_MAX,
 				 "%s/.stale/%016"PRIx64".%"PRIu32,
-				 md_get_object_dir_nolock(oid), oid, epoch);
+				 md_get_object_dir(oid), oid, epoch);
 		} else {
 			snprintf(old, PATH_MAX,
 				 "%s/.stale/%016"PRIx64"_%d.%"PRIu32, path,
 				 oid, ec_index, epoch);
 			snprintf(new, PATH_MAX,
 				 "%s/.stale/%016"PRIx64"_%d.%"PRIu32,
-				 md_get_object_dir_nolock(oid),
+				 md_get_object_dir(oid),
 				 oid, ec_index, epoch);
 		}
 	}
@@ -650,9 +721,23 @@ static int md_move_object(uint64_t oid, const char *old, const char *new)
 {
 	struct strbuf buf = STRBUF_INIT;
 	int fd, ret = -1;
-	size_t sz = get_store_objsize(oid);
-	const bool sparse = is_sparse_object(oid);
+	size_t sz;
+	bool sparse;
 
+	/*
+	 * Unlike rename(2), link(2) doesn't replace the object which is
+	 * already in the new place.  Copy the object if the disks are on
+	 * different file systems.
+	 */
+	if (link(old, new) == 0 || errno == EEXIST) {
+		unlink(old);
+		return 0;
+	}
+	if (errno != EXDEV)
+		sd_debug("failed to link %s to %s, %m", old, new);
+
+	sz = get_store_objsize(oid);
+	sparse = is_sparse_object(oid);
 	fd = open(old, O_RDONLY);
 	if (fd < 0) {
 		sd_err("failed to open %s", old);
@@ -672,7 +757,8 @@ static int md_move_object(uint64_t oid, const char *old, const char *new)
 			ret = -1;
 			goto out_close;
 		}
-	}
+	} else if (sys->checksum)
+		csum_copy(old, new);
 	unlink(old);
 	ret = 0;
 out_close:
@@ -698,7 +784,6 @@ static int md_check_and_move(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 	if (!strcmp(old, new))
 		return SD_RES_SUCCESS;
 
-	/* We can't use rename(2) across device */
 	if (md_move_object(oid, old, new) < 0) {
 		sd_err("move old %s to new %s failed", old, new);
 		return SD_RES_EIO;
@@ -723,6 +808,159 @@ static int scan_wd(uint64_t oid, uint32_t epoch, uint8_t ec_index)
 	return ret;
 }
 
+/*
+ * Rebalancing
+ *
+ * When the disks are plugged or unplugged, the objects whose vdisk has moved
+ * to another disk are moved in the background instead of on their first
+ * access.  The rebalancer scans the objects of each disk, including the stale
+ * ones, and moves the misplaced ones to the same relative directory of the
+ * disk they belong to now.  The moves are background I/O of the I/O scheduler,
+ * so they back off while the disks serve the guests.
+ *
+ * Objects accessed before the rebalancer reaches them are still moved by
+ * md_exist() and md_get_stale_path().
+ */
+static struct md_rebalance {
+	struct work work;
+	bool running;			/* written by the main thread */
+	uatomic_bool restart;		/* the disks changed again */
+
+	/* progress, written by the rebalancer */
+	uint32_t disk;
+	uint32_t nr_disks;
+	uint64_t nr_scanned;
+	uint64_t nr_moved;
+	uint64_t moved_bytes;
+} rebalance;
+
+struct rebalance_disk {
+	const char *root;		/* the disk being scanned */
+};
+
+static int rebalance_object(uint64_t oid, const char *dir, uint32_t epoch,
+			    uint8_t ec_index, struct vnode_info *vinfo,
+			    void *arg)
+{
+	struct rebalance_disk *rd = arg;
+	char name[NAME_MAX], old[PATH_MAX], new[PATH_MAX], target[PATH_MAX];
+	const char *rel = dir + strlen(rd->root);
+	struct io_ticket t;
+	struct stat st;
+	int len;
+
+	if (uatomic_is_true(&rebalance.restart))
+		return SD_RES_AGAIN;
+
+	uatomic_inc(&rebalance.nr_scanned);
+
+	pstrcpy(target, sizeof(target), md_get_object_dir(oid));
+	if (!strcmp(target, rd->root) || !strcmp(target, NONE_EXIST_PATH))
+		return SD_RES_SUCCESS;
+
+	len = snprintf(name, sizeof(name), "%016"PRIx64, oid);
+	if (is_erasure_oid(oid))
+		len += snprintf(name + len, sizeof(name) - len, "_%d",
+				ec_index);
+	if (epoch)
+		snprintf(name + len, sizeof(name) - len, ".%"PRIu32, epoch);
+
+	snprintf(old, sizeof(old), "%s/%s", dir, name);
+	len = snprintf(new, sizeof(new), "%s%s", target, rel);
+	if (len + 1 + strlen(name) >= sizeof(new)) {
+		sd_err("too long path to move %s to %s", old, target);
+		return SD_RES_SUCCESS;
+	}
+	if (*rel && xmkdir(new, sd_def_dmode) < 0) {
+		sd_err("can't mkdir for %s, %m", new);
+		return SD_RES_SUCCESS;
+	}
+	sprintf(new + len, "/%s", name);
+
+	if (stat(old, &st) < 0)
+		/* moved on access or removed */
+		return SD_RES_SUCCESS;
+
+	iosched_begin(&t, oid, IO_CLASS_BACKGROUND);
+	sd_read_lock(&md.lock);
+	if (md_move_object(oid, old, new) < 0)
+		sd_err("failed to move %s to %s", old, new);
+	else {
+		sd_debug("from %s to %s", old, new);
+		uatomic_inc(&rebalance.nr_moved);
+		uatomic_add(&rebalance.moved_bytes, st.st_size);
+	}
+	sd_rw_unlock(&md.lock);
+	iosched_end(&t);
+
+	return SD_RES_SUCCESS;
+}
+
+static void md_rebalance_work(struct work *work)
+{
+	const struct disk *disk;
+	char (*paths)[PATH_MAX];
+	char stale[PATH_MAX];
+	struct rebalance_disk rd;
+	int nr = 0, ret = SD_RES_SUCCESS;
+
+	/* the disks may be unplugged while they are scanned */
+	sd_read_lock(&md.lock);
+	paths = xmalloc(sizeof(*paths) * (md.nr_disks ? md.nr_disks : 1));
+	rb_for_each_entry(disk, &md.root, rb)
+		pstrcpy(paths[nr++], PATH_MAX, disk->path);
+	sd_rw_unlock(&md.lock);
+
+	uatomic_set(&rebalance.nr_disks, nr);
+	for (int i = 0; i < nr && ret == SD_RES_SUCCESS; i++) {
+		uatomic_set(&rebalance.disk, i);
+		rd.root = paths[i];
+		ret = for_each_object_in_path(paths[i], rebalance_object, false,
+					      NULL, &rd);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		snprintf(stale, sizeof(stale), "%s/.stale", paths[i]);
+		ret = for_each_object_in_path(stale, rebalance_object, false,
+					      NULL, &rd);
+	}
+
+	free(paths);
+}
+
+static void md_rebalance_done(struct work *work)
+{
+	if (uatomic_is_true(&rebalance.restart)) {
+		sd_info("disks changed, restarting the rebalancing");
+		uatomic_set_false(&rebalance.restart);
+		uatomic_set(&rebalance.nr_scanned, 0);
+		queue_work(sys->md_rebalance_wqueue, &rebalance.work);
+		return;
+	}
+
+	sd_info("rebalancing done, %"PRIu64" objects scanned, %"PRIu64
+		" objects (%"PRIu64" bytes) moved", rebalance.nr_scanned,
+		rebalance.nr_moved, rebalance.moved_bytes);
+	rebalance.running = false;
+}
+
+static main_fn void md_start_rebalance(void)
+{
+	if (rebalance.running) {
+		uatomic_set_true(&rebalance.restart);
+		return;
+	}
+
+	rebalance.running = true;
+	rebalance.disk = 0;
+	rebalance.nr_disks = 0;
+	rebalance.nr_scanned = 0;
+	rebalance.nr_moved = 0;
+	rebalance.moved_bytes = 0;
+	rebalance.work.fn = md_rebalance_work;
+	rebalance.work.done = md_rebalance_done;
+	queue_work(sys->md_rebalance_wqueue, &rebalance.work);
+}
+
 bool md_exist(uint64_t oid, uint8_t ec_index, char *path)
 {
 	if (md_access(path))
@@ -781,6 +1019,13 @@ uint32_t md_get_info(struct sd_md_info *info)
 	}
 	info->nr = md.nr_disks;
 	sd_rw_unlock(&md.lock);
+
+	info->rebalancing = uatomic_read(&rebalance.running);
+	info->rebalance_disk = uatomic_read(&rebalance.disk);
+	info->rebalance_nr_disks = uatomic_read(&rebalance.nr_disks);
+	info->rebalance_scanned = uatomic_read(&rebalance.nr_scanned);
+	info->rebalance_moved = uatomic_read(&rebalance.nr_moved);
+	info->rebalance_bytes = uatomic_read(&rebalance.moved_bytes);
 	return ret;
 }
 
@@ -799,8 +1044,8 @@ static inline void md_del_disk(const char *path)
 void update_node_disks(void)
 {
 	const struct disk *disk;
+	struct vdisk_table *t = NULL, *new;
 	int i = 0;
-	bool rb_empty = false;
 
 	if (!sys)
 		return;
@@ -815,14 +1060,14 @@ void update_node_disks(void)
 	}
 	sd_rw_unlock(&md.lock);
 
-	if (RB_EMPTY_ROOT(&md.vroot))
-		rb_empty = true;
+	/* the readers must never see a table with some of the disks missing */
 	sd_write_lock(&md.lock);
 	rb_for_each_entry(disk, &md.root, rb) {
-		if (!rb_empty)
-			remove_vdisks(disk);
-		create_vdisks(disk);
+		new = merge_vdisks(t, disk);
+		free(t);
+		t = new;
 	}
+	publish_vdisk_table(t ?: alloc_vdisk_table(0));
 	sd_rw_unlock(&md.lock);
 }
 #else
@@ -861,6 +1106,8 @@ out:
 		if (new_nr > 0) {
 			update_node_disks();
 			kick_recover();
+			md_start_rebalance();
+			start_scrub();
 		} else {
 			sd_warn("no disks plugged, going down");
 			leave_cluster();
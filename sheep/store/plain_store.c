@@ -119,9 +119,16 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 	if (!default_exist(oid, iocb->ec_index))
 		return err_to_sderr(path, oid, ENOENT);
 
+	/* a replacement of the object must not happen between open and write */
+	if (sys->checksum)
+		csum_write_begin(oid);
+
 	fd = open(path, flags, sd_def_fmode);
-	if (unlikely(fd < 0))
+	if (unlikely(fd < 0)) {
+		if (sys->checksum)
+			csum_write_cancel(oid);
 		return err_to_sderr(path, oid, errno);
+	}
 
 	if (trim_is_supported && is_sparse_object(oid)) {
 		if (default_trim(fd, oid, iocb, &offset, &len) < 0) {
@@ -137,8 +144,18 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
 		       iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
-		goto out;
 	}
+
+	if (sys->checksum &&
+	    csum_write_end(fd, oid, iocb->offset,
+			   iocb->offset + iocb->length) < 0 &&
+	    ret == SD_RES_SUCCESS)
+		ret = err_to_sderr(path, oid, errno);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (iocb->writeback)
+		dirty_vdi_mark(oid);
 out:
 	close(fd);
 	return ret;
@@ -271,13 +288,18 @@ static int default_read_from_path(uint64_t oid, const char *path,
 	if (fd < 0)
 		return err_to_sderr(path, oid, errno);
 
-	size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
+	if (is_sparse_object(oid))
+		size = xpread_sparse(fd, iocb->buf, iocb->length,
+				     iocb->offset);
+	else
+		size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
 	if (size < 0) {
 		sd_err("failed to read object %016"PRIx64", path=%s, offset=%"
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
 		       iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
-	}
+	} else if (sys->checksum)
+		ret = csum_verify_read(fd, oid, path, iocb);
 	close(fd);
 	return ret;
 }
@@ -346,6 +368,19 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		return err_to_sderr(path, oid, errno);
 	}
 
+	if (iocb->cow_oid) {
+		char src_path[PATH_MAX];
+
+		/* the zero blocks of the buffer overwrite the parent data */
+		get_store_path(iocb->cow_oid, iocb->ec_index, src_path);
+		if (clone_object_file(fd, src_path) < 0) {
+			sd_debug("failed to clone %s: %m", src_path);
+			ret = err_to_sderr(src_path, iocb->cow_oid, errno);
+			goto out;
+		}
+		goto write;
+	}
+
 	obj_size = get_store_objsize(oid);
 
 	trim_zero_blocks(iocb->buf, &offset, &len);
@@ -363,13 +398,28 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		}
 	}
 
-	ret = xpwrite(fd, iocb->buf, len, offset);
+write:
+	if (is_sparse_object(oid) && !iocb->cow_oid)
+		ret = xpwrite_sparse(fd, iocb->buf, len, offset);
+	else
+		ret = xpwrite(fd, iocb->buf, len, offset);
 	if (ret != len) {
 		sd_err("failed to write object. %m");
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
 
+	if (sys->checksum) {
+		if (iocb->cow_oid)
+			ret = csum_rebuild(fd, oid);
+		else
+			ret = csum_create(fd, oid, iocb->buf, offset, len);
+		if (ret < 0) {
+			ret = err_to_sderr(path, oid, errno);
+			goto out;
+		}
+	}
+
 	ret = rename(tmp_path, path);
 	if (ret < 0) {
 		sd_err("failed to rename %s to %s: %m", tmp_path, path);
@@ -384,23 +434,21 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		return SD_RES_SUCCESS;
 	}
 
-	pstrcpy(tmp_path, sizeof(tmp_path), path);
-	dir = dirname(tmp_path);
-	fd = open(dir, O_DIRECTORY | O_RDONLY);
-	if (fd < 0) {
-		sd_err("failed to open directory %s: %m", dir);
-		return err_to_sderr(path, oid, errno);
+	if (iocb->writeback) {
+		dirty_vdi_mark(oid);
+		objlist_cache_insert(oid);
+		return SD_RES_SUCCESS;
 	}
 
-	if (fsync(fd) != 0) {
-		sd_err("failed to write directory %s: %m", dir);
-		ret = err_to_sderr(path, oid, errno);
-		close(fd);
+	pstrcpy(tmp_path, sizeof(tmp_path), path);
+	dir = dirname(tmp_path);
+	ret = sync_object_dir(dir);
+	if (ret != 0) {
+		ret = err_to_sderr(path, oid, ret);
 		if (unlink(path) != 0)
 			sd_err("failed to unlink %s: %m", path);
 		return ret;
 	}
-	close(fd);
 	objlist_cache_insert(oid);
 	return SD_RES_SUCCESS;
 
@@ -589,7 +637,8 @@ static int get_object_path(uint64_t oid, uint32_t epoch, char *path,
 	return SD_RES_SUCCESS;
 }
 
-int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *digest,
+		     bool crc32c)
 {
 	int ret;
 	void *buf;
@@ -602,10 +651,11 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	if (is_readonly_obj) {
-		if (get_object_sha1(path, sha1) == 0) {
+	/* only sha1 is cached */
+	if (is_readonly_obj && !crc32c) {
+		if (get_object_sha1(path, digest) == 0) {
 			sd_debug("use cached sha1 digest %s",
-				 sha1_to_hex(sha1));
+				 sha1_to_hex(digest));
 			return SD_RES_SUCCESS;
 		}
 	}
@@ -625,14 +675,17 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 		return ret;
 	}
 
-	get_buffer_sha1(buf, length, sha1);
+	if (crc32c)
+		csum_digest(buf, length, digest);
+	else
+		get_buffer_sha1(buf, length, digest);
 	free(buf);
 
 	sd_debug("the message digest of %016"PRIx64" at epoch %d is %s", oid,
-		 epoch, sha1_to_hex(sha1));
+		 epoch, sha1_to_hex(digest));
 
-	if (is_readonly_obj)
-		set_object_sha1(path, sha1);
+	if (is_readonly_obj && !crc32c)
+		set_object_sha1(path, digest);
 
 	return ret;
 }
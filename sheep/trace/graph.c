@@ -12,9 +12,72 @@
  */
 
 #include "trace.h"
+#include "option.h"
 
 static __thread unsigned long long entry_time[SD_MAX_STACK_DEPTH];
 
+/*
+ * If a function filter is set, only the calls of the function and its
+ * callees are traced.  With sampling, one of every 'sample_rate' calls of
+ * the function is traced.  If a request filter is set, only the calls made
+ * while serving the gateway or peer requests with the id are traced.
+ */
+static const struct caller *filter_fn;
+static uint32_t filter_req_id;
+static unsigned long sample_rate = 1;
+static unsigned long nr_filtered_calls;
+static int filter_gen;
+
+static __thread int thread_filter_gen;
+static __thread int filter_depth = -1;
+static __thread bool filter_sampled;
+
+static inline bool graph_req_match(void)
+{
+	return !filter_req_id || trace_req_id == filter_req_id;
+}
+
+static bool graph_trace_enter(const struct caller *this_fn, int depth)
+{
+	if (!filter_fn)
+		return graph_req_match();
+
+	if (thread_filter_gen != filter_gen) {
+		/* the filter was changed after the last call */
+		thread_filter_gen = filter_gen;
+		filter_depth = -1;
+	}
+
+	if (filter_depth < 0) {
+		if (this_fn != filter_fn)
+			return false;
+
+		filter_depth = depth;
+		filter_sampled =
+			uatomic_add_return(&nr_filtered_calls, 1) %
+			sample_rate == 0;
+	}
+
+	return filter_sampled && graph_req_match();
+}
+
+static bool graph_trace_exit(const struct caller *this_fn, int depth)
+{
+	bool ret;
+
+	if (!filter_fn)
+		return graph_req_match();
+
+	if (thread_filter_gen != filter_gen || filter_depth < 0)
+		return false;
+
+	ret = filter_sampled;
+	if (depth == filter_depth)
+		filter_depth = -1;
+
+	return ret && graph_req_match();
+}
+
 static void graph_tracer_exit(const struct caller *this_fn, int depth)
 {
 	struct trace_graph_item trace = {
@@ -24,6 +87,9 @@ static void graph_tracer_exit(const struct caller *this_fn, int depth)
 		.return_time = clock_get_time(),
 	};
 
+	if (!graph_trace_exit(this_fn, depth))
+		return;
+
 	pstrcpy(trace.fname, sizeof(trace.fname), this_fn->name);
 	get_thread_name(trace.tname);
 
@@ -37,6 +103,9 @@ static void graph_tracer_enter(const struct caller *this_fn, int depth)
 		.depth = depth,
 	};
 
+	if (!graph_trace_enter(this_fn, depth))
+		return;
+
 	pstrcpy(trace.fname, sizeof(trace.fname), this_fn->name);
 	get_thread_name(trace.tname);
 
@@ -45,11 +114,86 @@ static void graph_tracer_enter(const struct caller *this_fn, int depth)
 	trace_buffer_push(sched_getcpu(), &trace);
 }
 
+static const struct caller *new_filter_fn;
+static uint32_t new_filter_req_id;
+static unsigned long new_sample_rate;
+
+static int graph_func_parser(const char *s)
+{
+	new_filter_fn = trace_lookup_name(s);
+	if (!new_filter_fn) {
+		sd_err("no such function, %s", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int graph_sample_parser(const char *s)
+{
+	char *p;
+
+	new_sample_rate = strtoul(s, &p, 10);
+	if (s == p || *p != '\0' || new_sample_rate == 0) {
+		sd_err("invalid sample rate, %s", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int graph_req_parser(const char *s)
+{
+	unsigned long req_id;
+	char *p;
+
+	req_id = strtoul(s, &p, 10);
+	if (s == p || *p != '\0' || req_id == 0 || req_id > UINT32_MAX) {
+		sd_err("invalid request id, %s", s);
+		return -1;
+	}
+	new_filter_req_id = req_id;
+
+	return 0;
+}
+
+static struct option_parser graph_parsers[] = {
+	{ "func=", graph_func_parser },
+	{ "sample=", graph_sample_parser },
+	{ "req=", graph_req_parser },
+	{ NULL, NULL },
+};
+
+/* called in the main thread while the graph tracer is disabled */
+static int graph_tracer_setup(char *opts)
+{
+	new_filter_fn = NULL;
+	new_filter_req_id = 0;
+	new_sample_rate = 1;
+
+	if (opts && opts[0] && option_parse(opts, ",", graph_parsers) < 0)
+		return SD_RES_INVALID_PARMS;
+
+	if (new_sample_rate > 1 && !new_filter_fn) {
+		sd_err("sampling needs a function filter");
+		return SD_RES_INVALID_PARMS;
+	}
+
+	filter_fn = new_filter_fn;
+	filter_req_id = new_filter_req_id;
+	sample_rate = new_sample_rate;
+	nr_filtered_calls = 0;
+	filter_gen++;
+
+	return SD_RES_SUCCESS;
+}
+
 static struct tracer graph_tracer = {
 	.name = "graph",
 
 	.enter = graph_tracer_enter,
 	.exit = graph_tracer_exit,
+	.setup = graph_tracer_setup,
 };
 
 tracer_register(graph_tracer);
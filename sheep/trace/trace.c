@@ -30,12 +30,35 @@ static __thread struct {
 static struct caller *callers;
 static size_t nr_callers;
 
-static struct strbuf *buffer;
-static struct sd_mutex *buffer_lock;
+/*
+ * Each CPU has a fixed-size ring of trace items.  Writers claim a slot with
+ * an atomic increment of head and never wait: when the ring is full the
+ * oldest items are overwritten.  The sequence number of a slot is set to its
+ * position + 1 after the item is written, so readers can detect slots which
+ * are being written or have been overwritten while they copy them.
+ */
+#define TRACE_RING_SIZE (1U << 14)	/* must be a power of 2 */
+
+struct trace_slot {
+	uint64_t seq;
+	struct trace_graph_item item;
+};
+
+struct trace_ring {
+	uint64_t head;
+	uint64_t tail;		/* protected by ring_read_lock */
+	struct trace_slot *slots;
+};
+
+static struct trace_ring *rings;
+static struct sd_mutex ring_read_lock = SD_MUTEX_INITIALIZER;
+static uint64_t nr_overwritten;
 static int nr_cpu;
 
 static __thread bool in_trace;
 
+__thread uint32_t trace_req_id;
+
 union instruction {
 	unsigned char start[INSN_SIZE];
 	struct {
@@ -83,6 +106,15 @@ static struct caller *trace_lookup_ip(unsigned long ip)
 	return xbsearch(&key, callers, nr_callers, caller_cmp);
 }
 
+const struct caller *trace_lookup_name(const char *name)
+{
+	for (int i = 0; i < nr_callers; i++)
+		if (strcmp(callers[i].name, name) == 0)
+			return callers + i;
+
+	return NULL;
+}
+
 void regist_tracer(struct tracer *tracer)
 {
 	list_add_tail(&tracer->list, &tracers);
@@ -186,9 +218,11 @@ static struct tracer *find_tracer(const char *name)
 	return NULL;
 }
 
-int trace_enable(const char *name)
+/* 'opts' is a comma separated list of the tracer specific options or NULL */
+int trace_enable(const char *name, char *opts)
 {
 	struct tracer *tracer = find_tracer(name);
+	int ret;
 
 	if (tracer == NULL) {
 		sd_debug("no such tracer, %s", name);
@@ -198,6 +232,15 @@ int trace_enable(const char *name)
 		return SD_RES_INVALID_PARMS;
 	}
 
+	if (tracer->setup) {
+		ret = tracer->setup(opts);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	} else if (opts) {
+		sd_debug("tracer %s doesn't take options", name);
+		return SD_RES_INVALID_PARMS;
+	}
+
 	uatomic_set_true(&tracer->enabled);
 
 	if (count_enabled_tracers() == 1) {
@@ -262,34 +305,80 @@ size_t trace_status(char *buf)
 	return p - buf;
 }
 
-int trace_buffer_pop(void *buf, uint32_t len)
+static size_t trace_ring_read(struct trace_ring *ring, char *buf, size_t len)
 {
-	int readin, count = 0, requested = len;
-	char *buff = (char *)buf;
-	int i;
+	uint64_t head = uatomic_read(&ring->head), pos = ring->tail, seq;
+	struct trace_slot *slot;
+	size_t done = 0;
 
-	for (i = 0; i < nr_cpu; i++) {
-		sd_mutex_lock(&buffer_lock[i]);
-		readin = strbuf_stripout(&buffer[i], buff, len);
-		sd_mutex_unlock(&buffer_lock[i]);
-		count += readin;
-		if (count == requested)
-			return count;
-		if (readin == 0)
+	if (head - pos > TRACE_RING_SIZE) {
+		nr_overwritten += head - TRACE_RING_SIZE - pos;
+		pos = head - TRACE_RING_SIZE;
+	}
+
+	for (; pos < head; pos++) {
+		if (len - done < sizeof(slot->item))
+			break;
+
+		slot = ring->slots + (pos & (TRACE_RING_SIZE - 1));
+		seq = uatomic_read(&slot->seq);
+		if (seq < pos + 1)
+			/* the writer hasn't finished yet, retry next time */
+			break;
+		if (seq > pos + 1) {
+			nr_overwritten++;
+			continue;
+		}
+
+		cmm_smp_rmb();
+		memcpy(buf + done, &slot->item, sizeof(slot->item));
+		cmm_smp_rmb();
+
+		if (uatomic_read(&slot->seq) != seq) {
+			nr_overwritten++;
 			continue;
+		}
+		done += sizeof(slot->item);
+	}
+	ring->tail = pos;
 
-		len -= readin;
-		buff += readin;
+	return done;
+}
+
+int trace_buffer_pop(void *buf, uint32_t len)
+{
+	size_t count = 0;
+	uint64_t overwritten;
+
+	sd_mutex_lock(&ring_read_lock);
+	overwritten = nr_overwritten;
+	for (int i = 0; i < nr_cpu; i++) {
+		count += trace_ring_read(rings + i, (char *)buf + count,
+					 len - count);
+		if (len - count < sizeof(struct trace_graph_item))
+			break;
 	}
+	overwritten = nr_overwritten - overwritten;
+	sd_mutex_unlock(&ring_read_lock);
+
+	if (overwritten)
+		sd_info("%" PRIu64 " trace items were overwritten before they"
+			" were read", overwritten);
 
 	return count;
 }
 
 void trace_buffer_push(int cpuid, struct trace_graph_item *item)
 {
-	sd_mutex_lock(&buffer_lock[cpuid]);
-	strbuf_add(&buffer[cpuid], item, sizeof(*item));
-	sd_mutex_unlock(&buffer_lock[cpuid]);
+	struct trace_ring *ring = rings + cpuid;
+	uint64_t pos = uatomic_add_return(&ring->head, 1) - 1;
+	struct trace_slot *slot = ring->slots + (pos & (TRACE_RING_SIZE - 1));
+
+	uatomic_set(&slot->seq, 0);
+	cmm_smp_wmb();
+	slot->item = *item;
+	cmm_smp_wmb();
+	uatomic_set(&slot->seq, pos + 1);
 }
 
 /* assume that mcount call exists in the first FIND_MCOUNT_RANGE bytes */
@@ -414,17 +503,16 @@ int trace_init(void)
 	nop_all_sites();
 
 #ifdef DEBUG
-	trace_enable("thread_checker");
-	trace_enable("loop_checker");
+	trace_enable("thread_checker", NULL);
+	trace_enable("loop_checker", NULL);
 #endif
 
-	nr_cpu = sysconf(_SC_NPROCESSORS_ONLN);
-	buffer = xzalloc(sizeof(*buffer) * nr_cpu);
-	buffer_lock = xzalloc(sizeof(*buffer_lock) * nr_cpu);
-	for (i = 0; i < nr_cpu; i++) {
-		strbuf_init(&buffer[i], 0);
-		sd_init_mutex(&buffer_lock[i]);
-	}
+	/* sched_getcpu() returns an index of all the configured CPUs */
+	nr_cpu = sysconf(_SC_NPROCESSORS_CONF);
+	rings = xzalloc(sizeof(*rings) * nr_cpu);
+	for (i = 0; i < nr_cpu; i++)
+		rings[i].slots = xzalloc(sizeof(struct trace_slot) *
+					 TRACE_RING_SIZE);
 
 	sd_info("trace support enabled. cpu count %d.", nr_cpu);
 	return 0;
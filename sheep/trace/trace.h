@@ -19,6 +19,8 @@ struct tracer {
 
 	void (*enter)(const struct caller *this_fn, int depth);
 	void (*exit)(const struct caller *this_fn, int depth);
+	/* called with the options of 'dog trace enable' before enabling */
+	int (*setup)(char *opts);
 
 	/* internal use only */
 	uatomic_bool enabled;
@@ -39,20 +41,30 @@ unsigned long trace_function_exit(void);
 #ifdef HAVE_TRACE
   int trace_init(void);
   void regist_tracer(struct tracer *tracer);
-  int trace_enable(const char *name);
+  const struct caller *trace_lookup_name(const char *name);
+  int trace_enable(const char *name, char *opts);
   int trace_disable(const char *name);
   size_t trace_status(char *buf);
   int trace_buffer_pop(void *buf, uint32_t len);
   void trace_buffer_push(int cpuid, struct trace_graph_item *item);
 
+  /* the id of the request which the thread serves, 0 if none */
+  extern __thread uint32_t trace_req_id;
+  static inline void trace_set_req_id(uint32_t req_id)
+  {
+	  trace_req_id = req_id;
+  }
+
 #else
   static inline int trace_init(void) { return 0; }
-  static inline int trace_enable(const char *name) { return 0; }
+  static inline int trace_enable(const char *name, char *opts)
+  { return 0; }
   static inline int trace_disable(const char *name) { return 0; }
   static inline size_t trace_status(char *buf) { return 0; }
   static inline int trace_buffer_pop(void *buf, uint32_t len) { return 0; }
   static inline void trace_buffer_push(
 	  int cpuid, struct trace_graph_item *item) { return; }
+  static inline void trace_set_req_id(uint32_t req_id) { return; }
 
 #endif /* HAVE_TRACE */
 
@@ -1709,6 +1709,8 @@ struct deletion_work {
 	uint32_t target_vid;
 	bool succeed;
 	int finish_fd;		/* eventfd for notifying finish */
+	uint32_t epoch;		/* the epoch 'vinfo' was built for */
+	struct vnode_info *vinfo;
 };
 
 static int notify_vdi_deletion(uint32_t vdi_id)
@@ -1728,16 +1730,89 @@ static int notify_vdi_deletion(uint32_t vdi_id)
 	return ret;
 }
 
+/*
+ * Data objects of a deleted vdi are removed in batches grouped by the nodes
+ * which hold their replicas.  Every round sends one SD_OP_REMOVE_PEERS to up
+ * to DELETE_MAX_INFLIGHT nodes at once and then collects their responses, so
+ * the nodes remove their objects in parallel instead of serving one removal
+ * at a time.
+ *
+ * The batches carry the epoch the placement was computed for.  If a node has
+ * moved on to a newer epoch, the objects of its batch are placed again with
+ * the nodes of the current epoch and sent in the next pass.  A batch which
+ * fails for any other reason (recovery, network error) is retried with the
+ * ordinary per-object removal, which goes through the gateway.
+ */
+#define DELETE_BATCH_SIZE	1024
+#define DELETE_MAX_INFLIGHT	16
+#define DELETE_MAX_FALLBACKS	64
+#define DELETE_MAX_PASSES	5
+
+struct delete_batch {
+	struct rb_node rb;
+	const struct sd_node *node;
+	uint64_t *oids;
+	uint32_t nr_oids, end;
+	uint32_t done;		/* number of oids already processed */
+	uint32_t nr_sent;	/* number of oids in the in-flight batch */
+	struct sockfd *sfd;
+	int result;
+};
+
 struct delete_arg {
 	const struct sd_inode *inode;
-	uint32_t *nr_deleted;
+	uint32_t epoch;
+	struct vnode_info *vinfo;
+	struct rb_root batches;
+	uint32_t nr_deleted;
+
+	/* objects to place again with the nodes of a newer epoch */
+	uint64_t *stale_oids;
+	uint32_t nr_stale, end_stale;
 };
 
+static int delete_batch_cmp(const struct delete_batch *a,
+			    const struct delete_batch *b)
+{
+	return node_cmp(a->node, b->node);
+}
+
+static void delete_batch_add(struct rb_root *root, const struct sd_node *node,
+			     uint64_t oid)
+{
+	struct delete_batch key = { .node = node }, *b;
+
+	b = rb_search(root, &key, rb, delete_batch_cmp);
+	if (!b) {
+		b = xzalloc(sizeof(*b));
+		b->node = node;
+		b->end = DELETE_BATCH_SIZE;
+		b->oids = xmalloc(sizeof(uint64_t) * b->end);
+		rb_insert(root, b, rb, delete_batch_cmp);
+	}
+
+	if (b->nr_oids >= b->end) {
+		b->end *= 2;
+		b->oids = xrealloc(b->oids, sizeof(uint64_t) * b->end);
+	}
+	b->oids[b->nr_oids++] = oid;
+}
+
+static void delete_place_object(struct delete_arg *darg, uint64_t oid)
+{
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int i, nr_copies;
+
+	nr_copies = get_obj_copy_number(oid, darg->vinfo->nr_zones);
+	oid_to_nodes(oid, &darg->vinfo->vroot, nr_copies, nodes);
+	for (i = 0; i < nr_copies; i++)
+		delete_batch_add(&darg->batches, nodes[i], oid);
+}
+
 static void delete_cb(struct sd_index *idx, void *arg, int ignore)
 {
 	struct delete_arg *darg = (struct delete_arg *)arg;
 	uint64_t oid;
-	int ret;
 
 	if (idx->vdi_id) {
 		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
@@ -1745,21 +1820,250 @@ static void delete_cb(struct sd_index *idx, void *arg, int ignore)
 			sd_debug("object %016" PRIx64 " is base's data, would"
 				 " not be deleted.", oid);
 		else {
-			ret = sd_remove_object(oid);
-			if (ret != SD_RES_SUCCESS)
-				sd_err("remove object %016" PRIx64 " fail, %d",
-				       oid, ret);
-			(*(darg->nr_deleted))++;
+			delete_place_object(darg, oid);
+			darg->nr_deleted++;
 		}
 	}
 }
 
+static void delete_add_stale(struct delete_arg *darg, const uint64_t *oids,
+			     uint32_t nr_oids)
+{
+	if (darg->nr_stale + nr_oids > darg->end_stale) {
+		darg->end_stale = max(darg->end_stale * 2,
+				      darg->nr_stale + nr_oids);
+		darg->stale_oids = xrealloc(darg->stale_oids,
+					    sizeof(uint64_t) *
+					    darg->end_stale);
+	}
+	memcpy(darg->stale_oids + darg->nr_stale, oids,
+	       sizeof(uint64_t) * nr_oids);
+	darg->nr_stale += nr_oids;
+}
+
+/*
+ * Place the stale objects with the nodes of the current epoch.  Return false
+ * if the nodes of the epoch can't be found.
+ */
+static bool delete_replace_stale(struct delete_arg *darg)
+{
+	uint32_t epoch = sys_epoch(), i, nr = 0;
+	struct vnode_info *vinfo;
+
+	vinfo = get_vnode_info_epoch(epoch, darg->vinfo);
+	if (!vinfo) {
+		sd_err("failed to get the nodes of epoch %" PRIu32, epoch);
+		return false;
+	}
+	put_vnode_info(darg->vinfo);
+	darg->vinfo = vinfo;
+	darg->epoch = epoch;
+
+	/* an object is stale on each of its replicas */
+	xqsort(darg->stale_oids, darg->nr_stale, oid_cmp);
+	for (i = 0; i < darg->nr_stale; i++) {
+		if (i > 0 && darg->stale_oids[i] == darg->stale_oids[i - 1])
+			continue;
+		delete_place_object(darg, darg->stale_oids[i]);
+		nr++;
+	}
+	sd_info("placing %" PRIu32 " objects again for epoch %" PRIu32, nr,
+		epoch);
+	darg->nr_stale = 0;
+
+	return true;
+}
+
+static int delete_objects_fallback(const uint64_t *oids, uint32_t nr_oids)
+{
+	struct request_iocb *iocb = NULL;
+	uint32_t i;
+	int ret = SD_RES_SUCCESS, res;
+
+	for (i = 0; i < nr_oids; i++) {
+		struct sd_req hdr;
+
+		if (!iocb) {
+			iocb = local_req_init();
+			if (!iocb)
+				return SD_RES_SYSTEM_ERROR;
+		}
+
+		sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
+		hdr.obj.oid = oids[i];
+		exec_local_req_async(&hdr, NULL, iocb);
+
+		if ((i + 1) % DELETE_MAX_FALLBACKS && i + 1 < nr_oids)
+			continue;
+
+		res = local_req_wait(iocb);
+		iocb = NULL;
+		if (res != SD_RES_SUCCESS && res != SD_RES_NO_OBJ)
+			ret = res;
+	}
+
+	return ret;
+}
+
+#ifndef HAVE_ACCELIO
+
+static void delete_batch_send(struct delete_batch *b, uint32_t epoch)
+{
+	const struct node_id *nid = &b->node->nid;
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_REMOVE_PEERS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.epoch = epoch;
+	hdr.data_length = sizeof(uint64_t) * b->nr_sent;
+
+	b->sfd = sockfd_cache_get(nid);
+	if (!b->sfd) {
+		b->result = SD_RES_NETWORK_ERROR;
+		return;
+	}
+
+	if (send_req(b->sfd->fd, &hdr, b->oids + b->done, hdr.data_length,
+		     sheep_need_retry, epoch, MAX_RETRY_COUNT)) {
+		sockfd_cache_del(nid, b->sfd);
+		b->sfd = NULL;
+		b->result = SD_RES_NETWORK_ERROR;
+	}
+}
+
+static int delete_batch_wait(struct delete_batch *b, uint32_t epoch)
+{
+	const struct node_id *nid = &b->node->nid;
+	struct sd_rsp rsp;
+
+	if (!b->sfd)
+		return b->result;
+
+	if (do_read(b->sfd->fd, &rsp, sizeof(rsp), sheep_need_retry, epoch,
+		    MAX_RETRY_COUNT)) {
+		sockfd_cache_del(nid, b->sfd);
+		b->sfd = NULL;
+		return SD_RES_NETWORK_ERROR;
+	}
+	sockfd_cache_put(nid, b->sfd);
+	b->sfd = NULL;
+
+	return rsp.result;
+}
+
+#else  /* HAVE_ACCELIO */
+
+static void delete_batch_send(struct delete_batch *b, uint32_t epoch)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_REMOVE_PEERS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.epoch = epoch;
+	hdr.data_length = sizeof(uint64_t) * b->nr_sent;
+
+	b->result = sheep_exec_req(&b->node->nid, &hdr, b->oids + b->done);
+}
+
+static int delete_batch_wait(struct delete_batch *b, uint32_t epoch)
+{
+	return b->result;
+}
+
+#endif	/* HAVE_ACCELIO */
+
+static void delete_objects(struct delete_arg *darg)
+{
+	struct delete_batch *b, *inflight[DELETE_MAX_INFLIGHT];
+	uint64_t total = 0, removed = 0;
+	uint32_t vid = darg->inode->vdi_id;
+	int i, nr, ret, reported = 0, pass = 0;
+
+again:
+	rb_for_each_entry(b, &darg->batches, rb)
+		total += b->nr_oids;
+
+	sd_info("removing %" PRIu32 " objects of vdi %" PRIx32 " from %"
+		PRIu64 " replicas at epoch %" PRIu32, darg->nr_deleted, vid,
+		total, darg->epoch);
+
+	do {
+		nr = 0;
+		rb_for_each_entry(b, &darg->batches, rb) {
+			if (b->done == b->nr_oids)
+				continue;
+			if (nr == DELETE_MAX_INFLIGHT)
+				break;
+
+			b->nr_sent = min(b->nr_oids - b->done,
+					 (uint32_t)DELETE_BATCH_SIZE);
+			b->result = SD_RES_SUCCESS;
+			delete_batch_send(b, darg->epoch);
+			inflight[nr++] = b;
+		}
+
+		for (i = 0; i < nr; i++) {
+			b = inflight[i];
+			ret = delete_batch_wait(b, darg->epoch);
+			if ((ret == SD_RES_OLD_NODE_VER ||
+			     ret == SD_RES_NEW_NODE_VER) &&
+			    pass + 1 < DELETE_MAX_PASSES) {
+				sd_debug("epoch %" PRIu32 " is stale on %s, %s",
+					 darg->epoch,
+					 addr_to_str(b->node->nid.addr,
+						     b->node->nid.port),
+					 sd_strerror(ret));
+				delete_add_stale(darg, b->oids + b->done,
+						 b->nr_sent);
+			} else if (ret != SD_RES_SUCCESS) {
+				sd_debug("batched removal on %s failed, %s",
+					 addr_to_str(b->node->nid.addr,
+						     b->node->nid.port),
+					 sd_strerror(ret));
+				ret = delete_objects_fallback(b->oids + b->done,
+							      b->nr_sent);
+				if (ret != SD_RES_SUCCESS)
+					sd_err("failed to remove objects of %"
+					       PRIx32 ", %s", vid,
+					       sd_strerror(ret));
+			}
+			b->done += b->nr_sent;
+			removed += b->nr_sent;
+		}
+
+		if (total && removed * 10 / total > reported) {
+			reported = removed * 10 / total;
+			sd_info("removed %" PRIu64 "%% of the objects of vdi %"
+				PRIx32, removed * 100 / total, vid);
+		}
+	} while (nr);
+
+	rb_for_each_entry(b, &darg->batches, rb)
+		free(b->oids);
+	rb_destroy(&darg->batches, struct delete_batch, rb);
+
+	if (darg->nr_stale) {
+		pass++;
+		if (delete_replace_stale(darg)) {
+			total = removed = 0;
+			reported = 0;
+			goto again;
+		}
+		ret = delete_objects_fallback(darg->stale_oids,
+					      darg->nr_stale);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("failed to remove objects of %" PRIx32 ", %s",
+			       vid, sd_strerror(ret));
+	}
+	free(darg->stale_oids);
+}
+
 static void delete_vdi_work(struct work *work)
 {
 	struct deletion_work *dw =
 		container_of(work, struct deletion_work, work);
 	int ret = 0;
-	uint32_t i, nr_deleted, nr_objs;
+	uint32_t i, nr_deleted = 0, nr_objs;
 	struct sd_inode *inode = NULL;
 	uint32_t vdi_id = dw->target_vid;
 
@@ -1784,7 +2088,7 @@ static void delete_vdi_work(struct work *work)
 
 	if (inode->store_policy == 0) {
 		nr_objs = count_data_objs(inode);
-		for (nr_deleted = 0, i = 0; i < nr_objs; i++) {
+		for (i = 0; i < nr_objs; i++) {
 			uint32_t vid = sd_inode_get_vid(inode, i);
 
 			if (vid) {
@@ -1798,8 +2102,18 @@ static void delete_vdi_work(struct work *work)
 		 * todo: generational reference counting is not supported by
 		 * hypervolume yet
 		 */
-		struct delete_arg arg = {inode, &nr_deleted};
+		struct delete_arg arg = {
+			.inode = inode,
+			.epoch = dw->epoch,
+			.vinfo = dw->vinfo,
+			.batches = RB_ROOT,
+		};
+
 		sd_inode_index_walk(inode, delete_cb, &arg);
+		delete_objects(&arg);
+		nr_deleted = arg.nr_deleted;
+		/* the objects may have been placed again at a newer epoch */
+		dw->vinfo = arg.vinfo;
 	}
 
 	if (vdi_is_deleted(inode))
@@ -1829,6 +2143,7 @@ static void delete_vdi_done(struct work *work)
 	if (!dw->succeed)
 		sd_err("deleting vdi: %x failed", dw->target_vid);
 	/* the deletion work is completed */
+	put_vnode_info(dw->vinfo);
 	free(dw);
 }
 
@@ -1849,6 +2164,15 @@ static int start_deletion(struct request *req, uint32_t vid)
 
 	dw->work.fn = delete_vdi_work;
 	dw->work.done = delete_vdi_done;
+	/* the batches must go out with the epoch of the nodes they're for */
+	dw->epoch = sys_epoch();
+	dw->vinfo = get_vnode_info_epoch(dw->epoch, req->vinfo);
+	if (!dw->vinfo) {
+		sd_err("failed to get the nodes of epoch %" PRIu32, dw->epoch);
+		close(finish_fd);
+		ret = SD_RES_SYSTEM_ERROR;
+		goto out;
+	}
 
 	queue_work(sys->deletion_wqueue, &dw->work);
 
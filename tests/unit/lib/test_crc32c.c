@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <unity.h>
+
+/* the static implementations are tested one by one */
+#include "crc32c.c"
+
+#define BUF_SIZE 4096
+
+static uint8_t buf[BUF_SIZE + 8];
+
+static void fill_buf(void)
+{
+	srand(1);
+	for (int i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+}
+
+static void test_crc32c_known_answer(void)
+{
+	TEST_ASSERT_EQUAL_HEX32(0xe3069283, crc32c(0, "123456789", 9));
+	TEST_ASSERT_EQUAL_HEX32(0, crc32c(0, "", 0));
+}
+
+static void test_crc32c_zeros(void)
+{
+	/* RFC 3720 B.4 */
+	memset(buf, 0, 32);
+	TEST_ASSERT_EQUAL_HEX32(0x8a9136aa, crc32c(0, buf, 32));
+	memset(buf, 0xff, 32);
+	TEST_ASSERT_EQUAL_HEX32(0x62a8ab43, crc32c(0, buf, 32));
+}
+
+static void test_crc32c_in_pieces(void)
+{
+	uint32_t whole, crc;
+
+	fill_buf();
+	whole = crc32c(0, buf, BUF_SIZE);
+	for (size_t split = 0; split <= BUF_SIZE; split += 509) {
+		crc = crc32c(0, buf, split);
+		crc = crc32c(crc, buf + split, BUF_SIZE - split);
+		TEST_ASSERT_EQUAL_HEX32(whole, crc);
+	}
+}
+
+static void test_crc32c_sse42_matches_sw(void)
+{
+#ifdef __x86_64__
+	if (!cpu_has_xmm4_2)
+		TEST_IGNORE_MESSAGE("no SSE4.2");
+
+	fill_buf();
+	/* every alignment of the start and length of the tail */
+	for (int off = 0; off < 8; off++)
+		for (size_t len = 0; len <= 64; len++)
+			TEST_ASSERT_EQUAL_HEX32(
+				crc32c_sw(~0U, buf + off, len),
+				crc32c_sse42(~0U, buf + off, len));
+	TEST_ASSERT_EQUAL_HEX32(crc32c_sw(~0U, buf + 3, BUF_SIZE),
+				crc32c_sse42(~0U, buf + 3, BUF_SIZE));
+#else
+	TEST_IGNORE_MESSAGE("not x86_64");
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+
+	RUN_TEST(test_crc32c_known_answer);
+	RUN_TEST(test_crc32c_zeros);
+	RUN_TEST(test_crc32c_in_pieces);
+	RUN_TEST(test_crc32c_sse42_matches_sw);
+
+	return UNITY_END();
+}
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unity.h>
+
+#include "util.h"
+#include "logger.h"
+
+#define NR_THREADS	8
+#define NR_MSGS		100
+
+#define BENCH_MSGS	20000
+
+static char log_dir[] = "/tmp/test_logger.XXXXXX";
+static char log_path[PATH_MAX];
+static pthread_barrier_t start_barrier, end_barrier;
+
+struct log_thread {
+	pthread_t thread;
+	int idx;
+	int nr_msgs;
+};
+
+static void *log_thread_main(void *arg)
+{
+	struct log_thread *t = arg;
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (int i = 0; i < t->nr_msgs; i++)
+		sd_info("thread %d message %d", t->idx, i);
+
+	/* don't release the ring before all the threads have claimed one */
+	pthread_barrier_wait(&end_barrier);
+
+	return NULL;
+}
+
+static double run_log_threads(int nr_rings, int nr_threads, int nr_msgs)
+{
+	struct log_thread *threads = xcalloc(nr_threads, sizeof(*threads));
+	struct timeval start, end;
+
+	unlink(log_path);
+	sd_log_nr_rings = nr_rings;
+	TEST_ASSERT_EQUAL_INT(0, log_init("test_logger", LOG_DST_DEFAULT,
+					  SDOG_INFO, log_path));
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+	pthread_barrier_init(&end_barrier, NULL, nr_threads + 1);
+
+	for (int i = 0; i < nr_threads; i++) {
+		threads[i].idx = i;
+		threads[i].nr_msgs = nr_msgs;
+		TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i].thread,
+							NULL, log_thread_main,
+							threads + i));
+	}
+	gettimeofday(&start, NULL);
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&end_barrier);
+	gettimeofday(&end, NULL);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	pthread_barrier_destroy(&start_barrier);
+	pthread_barrier_destroy(&end_barrier);
+	log_close();
+	free(threads);
+
+	return (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+/* every message must be written exactly once and in order per thread */
+static void check_log_counts(int nr_threads, const int *nr_msgs)
+{
+	int *next = xcalloc(nr_threads, sizeof(*next));
+	char line[MAX_MSG_SIZE];
+	FILE *fp;
+	int idx, seq;
+
+	fp = fopen(log_path, "r");
+	TEST_ASSERT_NOT_NULL(fp);
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "thread %d message %d", &idx, &seq) != 2)
+			continue;
+		TEST_ASSERT_TRUE(idx >= 0 && idx < nr_threads);
+		TEST_ASSERT_EQUAL_INT(next[idx], seq);
+		next[idx]++;
+	}
+	fclose(fp);
+
+	for (int i = 0; i < nr_threads; i++)
+		TEST_ASSERT_EQUAL_INT(nr_msgs[i], next[i]);
+	free(next);
+}
+
+static void check_log(int nr_threads, int nr_msgs)
+{
+	int *counts = xcalloc(nr_threads, sizeof(*counts));
+
+	for (int i = 0; i < nr_threads; i++)
+		counts[i] = nr_msgs;
+	check_log_counts(nr_threads, counts);
+	free(counts);
+}
+
+static void test_log_rings(void)
+{
+	run_log_threads(LOG_NR_RINGS, NR_THREADS, NR_MSGS);
+	check_log(NR_THREADS, NR_MSGS);
+}
+
+static void test_log_area(void)
+{
+	run_log_threads(0, NR_THREADS, NR_MSGS);
+	check_log(NR_THREADS, NR_MSGS);
+}
+
+static void test_log_rings_exhausted(void)
+{
+	/* the threads which can't get a ring share the semaphore area */
+	run_log_threads(2, NR_THREADS, NR_MSGS);
+	check_log(NR_THREADS, NR_MSGS);
+}
+
+static pthread_t ring_holder;
+
+static void *log_retry_thread_main(void *arg)
+{
+	struct log_thread *t = arg;
+
+	if (t->idx == 1)
+		/* let the first thread take the only ring */
+		pthread_barrier_wait(&start_barrier);
+
+	for (int i = 0; i < t->nr_msgs; i++) {
+		/* switch from the area to the ring which the first releases */
+		if (t->idx == 1 && i == t->nr_msgs / 3)
+			pthread_join(ring_holder, NULL);
+		sd_info("thread %d message %d", t->idx, i);
+		if (t->idx == 0 && i == 0)
+			pthread_barrier_wait(&start_barrier);
+	}
+
+	return NULL;
+}
+
+static void test_log_rings_retry(void)
+{
+	struct log_thread threads[2] = {
+		{ .idx = 0, .nr_msgs = NR_MSGS },
+		{ .idx = 1, .nr_msgs = NR_MSGS * 3 },
+	};
+
+	unlink(log_path);
+	sd_log_nr_rings = 1;
+	TEST_ASSERT_EQUAL_INT(0, log_init("test_logger", LOG_DST_DEFAULT,
+					  SDOG_INFO, log_path));
+	pthread_barrier_init(&start_barrier, NULL, 2);
+
+	TEST_ASSERT_EQUAL_INT(0, pthread_create(&ring_holder, NULL,
+						log_retry_thread_main,
+						threads));
+	TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[1].thread, NULL,
+						log_retry_thread_main,
+						threads + 1));
+	pthread_join(threads[1].thread, NULL);
+
+	pthread_barrier_destroy(&start_barrier);
+	log_close();
+
+	check_log_counts(2, (int []){ NR_MSGS, NR_MSGS * 3 });
+}
+
+/*
+ * Not a correctness test: compare how many log calls per second the threads
+ * can make with per-thread rings and with the semaphore protected area.
+ * Messages which don't fit are dropped in both cases.
+ */
+static void test_log_throughput(void)
+{
+	static const int nr_threads[] = { 1, 4, 16 };
+
+	for (int i = 0; i < ARRAY_SIZE(nr_threads); i++) {
+		int n = nr_threads[i];
+		double ring, area;
+
+		ring = run_log_threads(LOG_NR_RINGS, n, BENCH_MSGS);
+		area = run_log_threads(0, n, BENCH_MSGS);
+		printf("%2d threads: rings %.0f calls/s, semaphore %.0f calls/s\n",
+		       n, n * BENCH_MSGS / ring, n * BENCH_MSGS / area);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	if (!mkdtemp(log_dir))
+		return 1;
+	snprintf(log_path, sizeof(log_path), "%s/test.log", log_dir);
+
+	UNITY_BEGIN();
+
+	RUN_TEST(test_log_rings);
+	RUN_TEST(test_log_area);
+	RUN_TEST(test_log_rings_exhausted);
+	RUN_TEST(test_log_rings_retry);
+	RUN_TEST(test_log_throughput);
+
+	ret = UNITY_END();
+
+	unlink(log_path);
+	rmdir(log_dir);
+
+	return ret;
+}
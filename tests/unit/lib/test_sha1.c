@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <unity.h>
+
+/* sha1_mb() is tested directly, whatever get_buffers_sha1() would pick */
+#include "sha1_mb.c"
+
+/* the sha1 of 'len' bytes of 'a' */
+static const struct {
+	unsigned len;
+	const char *sha1;
+} vectors[] = {
+	{ 0, "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+	{ 55, "c1c8bbdc22796e28c0e15163d20899b65621d65a" },
+	{ 56, "c2db330f6083854c99d4b5bfb6e8f29f201be699" },
+	{ 64, "0098ba824b5c16427bd7a1122a5a442a25ec644d" },
+	{ 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+};
+
+#define NR_VECTORS ARRAY_SIZE(vectors)
+#define NR_BUFS (NR_VECTORS * 4)
+
+static unsigned char *bufs[NR_BUFS];
+static unsigned lens[NR_BUFS];
+static unsigned char sha1s[NR_BUFS * SHA1_DIGEST_SIZE];
+
+/* Interleave the vectors so that the lanes finish at different blocks */
+static void setup_bufs(void)
+{
+	for (int i = 0; i < NR_BUFS; i++) {
+		int v = (i * 3) % NR_VECTORS;
+
+		lens[i] = vectors[v].len;
+		bufs[i] = malloc(lens[i] + 1);
+		memset(bufs[i], 'a', lens[i]);
+	}
+	memset(sha1s, 0, sizeof(sha1s));
+}
+
+static void teardown_bufs(void)
+{
+	for (int i = 0; i < NR_BUFS; i++)
+		free(bufs[i]);
+}
+
+static const char *expected_sha1(unsigned len)
+{
+	for (int i = 0; i < NR_VECTORS; i++)
+		if (vectors[i].len == len)
+			return vectors[i].sha1;
+	return NULL;
+}
+
+static void assert_sha1s(int nr)
+{
+	for (int i = 0; i < nr; i++)
+		TEST_ASSERT_EQUAL_STRING(expected_sha1(lens[i]),
+				sha1_to_hex(sha1s + i * SHA1_DIGEST_SIZE));
+}
+
+static void test_get_buffer_sha1(void)
+{
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+
+	get_buffer_sha1((unsigned char *)"abc", 3, sha1);
+	TEST_ASSERT_EQUAL_STRING("a9993e364706816aba3e25717850c26c9cd0d89d",
+				 sha1_to_hex(sha1));
+
+	setup_bufs();
+	for (int i = 0; i < NR_VECTORS; i++) {
+		get_buffer_sha1(bufs[i], lens[i], sha1);
+		TEST_ASSERT_EQUAL_STRING(expected_sha1(lens[i]),
+					 sha1_to_hex(sha1));
+	}
+	teardown_bufs();
+}
+
+static void test_get_buffers_sha1(void)
+{
+	setup_bufs();
+	get_buffers_sha1(bufs, lens, NR_BUFS, sha1s);
+	assert_sha1s(NR_BUFS);
+	teardown_bufs();
+}
+
+static void test_sha1_mb(void)
+{
+#ifdef __x86_64__
+	if (sha1_mb_min_nr == INT_MAX)
+		TEST_IGNORE_MESSAGE("no AVX2");
+
+	setup_bufs();
+	/* fewer buffers than lanes, as many, and more */
+	for (int nr = 1; nr <= NR_BUFS; nr++) {
+		memset(sha1s, 0, sizeof(sha1s));
+		sha1_mb(bufs, lens, nr, sha1s);
+		assert_sha1s(nr);
+	}
+	teardown_bufs();
+#else
+	TEST_IGNORE_MESSAGE("not x86_64");
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+
+	RUN_TEST(test_get_buffer_sha1);
+	RUN_TEST(test_get_buffers_sha1);
+	RUN_TEST(test_sha1_mb);
+
+	return UNITY_END();
+}
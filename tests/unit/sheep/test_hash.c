@@ -395,15 +395,12 @@ static void disk3_setup(void)
 
 static size_t get_vdisks_array(struct vdisk *vdisks)
 {
-	struct vdisk *vdisk;
-	size_t nr = 0;
+	if (!md.vdisks)
+		return 0;
 
-	rb_for_each_entry(vdisk, &md.vroot, rb) {
-		nr++;
-		*vdisks++ = *vdisk;
-	}
+	memcpy(vdisks, md.vdisks->vdisks, sizeof(*vdisks) * md.vdisks->nr);
 
-	return nr;
+	return md.vdisks->nr;
 }
 
 START_TEST(test_disks_update)
@@ -418,7 +415,7 @@ START_TEST(test_disks_update)
 
 	gen_disks(disks, 0);
 
-	INIT_RB_ROOT(&md.vroot);
+	md.vdisks = NULL;
 	create_vdisks(disks);
 	nr_vdisks = get_vdisks_array(vdisks);
 	/* add 1 disk */
@@ -427,7 +424,7 @@ START_TEST(test_disks_update)
 	ck_assert(is_subset(vdisks_after, nr_vdisks_after, vdisks,
 			    nr_vdisks, vdisk_cmp));
 
-	INIT_RB_ROOT(&md.vroot);
+	md.vdisks = NULL;
 	for (int i = 0; i < 30; i++)
 		create_vdisks(disks + i);
 	nr_vdisks = get_vdisks_array(vdisks);
@@ -443,7 +440,7 @@ START_TEST(test_disks_update)
 	ck_assert(is_subset(vdisks_after, nr_vdisks_after, vdisks,
 			    nr_vdisks, vdisk_cmp));
 
-	INIT_RB_ROOT(&md.vroot);
+	md.vdisks = NULL;
 	create_vdisks(disks);
 	create_vdisks(disks + 1);
 	nr_vdisks = get_vdisks_array(vdisks);
@@ -453,7 +450,7 @@ START_TEST(test_disks_update)
 	ck_assert(is_subset(vdisks, nr_vdisks, vdisks_after,
 			    nr_vdisks_after, vdisk_cmp));
 
-	INIT_RB_ROOT(&md.vroot);
+	md.vdisks = NULL;
 	for (int i = 0; i < 50; i++)
 		create_vdisks(disks + i);
 	nr_vdisks = get_vdisks_array(vdisks);
@@ -479,19 +476,18 @@ END_TEST
 static void gen_data_from_disks(double *data, int idx)
 {
 	struct disk *disks;
-	struct vdisk *vdisk;
 	int nr_disks;
 	double *p = data;
 
 	disks = (struct disk *)malloc(sizeof(struct disk) * DATA_SIZE);
 
 	nr_disks = gen_disks(disks, idx);
-	INIT_RB_ROOT(&md.vroot);
+	md.vdisks = NULL;
 	for (int i = 0; i < nr_disks; i++)
 		create_vdisks(disks + i);
 
-	rb_for_each_entry(vdisk, &md.vroot, rb)
-		*p++ = vdisk->hash;
+	for (size_t i = 0; i < md.vdisks->nr; i++)
+		*p++ = md.vdisks->vdisks[i].hash;
 
 	ck_assert_int_eq(p - data, DATA_SIZE);
 
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2016 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * fio-like benchmark of a VDI through libsheepdog
+ *
+ * It keeps 'iodepth' asynchronous requests in flight over 'connections'
+ * connections for 'runtime' seconds, and reports the IOPS, the bandwidth and
+ * the latency percentiles of the reads and the writes.
+ *
+ * The 'create' mode writes the first block of each object in turn, so every
+ * write creates an object on the replicas if the vdi is fresh.  It stops at
+ * the end of the vdi.
+ */
+
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sheepdog.h"
+#include "sheep.h"
+
+enum { BENCH_READ, BENCH_WRITE };
+
+struct bench_io {
+	int rw;
+	uint64_t start;
+	char *buf;
+};
+
+struct bench_stat {
+	uint64_t nr_ios;
+	uint64_t *lat;		/* ns */
+	size_t lat_size;
+};
+
+static struct bench_opt {
+	int nr_conns;
+	int iodepth;
+	size_t bs;
+	uint64_t size;
+	int runtime;
+	bool random;
+	bool create;		/* one write per object */
+	int rwmixread;		/* percentage of reads */
+	bool direct;
+} opt = {
+	.nr_conns = 1,
+	.iodepth = 16,
+	.bs = 4096,
+	.runtime = 10,
+	.rwmixread = -1,
+};
+
+static struct bench_stat stats[2];
+static uint64_t next_offset, rand_state = 0x2545f4914f6cdd1dULL;
+static uint64_t object_size;
+
+static const struct option long_options[] = {
+	{"connections", required_argument, NULL, 'c'},
+	{"iodepth", required_argument, NULL, 'd'},
+	{"bs", required_argument, NULL, 'b'},
+	{"size", required_argument, NULL, 's'},
+	{"runtime", required_argument, NULL, 't'},
+	{"rw", required_argument, NULL, 'w'},
+	{"rwmixread", required_argument, NULL, 'm'},
+	{"direct", no_argument, NULL, 'D'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <host:port> <vdiname>\n"
+		"Options:\n"
+		"  -c, --connections=N  number of connections (default: 1)\n"
+		"  -d, --iodepth=N      number of requests in flight (default: 16)\n"
+		"  -b, --bs=SIZE        block size (default: 4k)\n"
+		"  -s, --size=SIZE      size of the region to access (default: vdi size)\n"
+		"  -t, --runtime=SEC    how long to run (default: 10)\n"
+		"  -w, --rw=MODE        read, write, rw, randread, randwrite, randrw\n"
+		"                       or create (default: read)\n"
+		"  -m, --rwmixread=PCT  percentage of reads for rw and randrw\n"
+		"                       (default: 50)\n"
+		"  -D, --direct         send the requests directly to the replicas\n"
+		"  -h, --help           display this help and exit\n", prog);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t bench_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t size = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		break;
+	}
+
+	return size;
+}
+
+static bool parse_rw(const char *mode)
+{
+	static const struct {
+		const char *name;
+		bool random;
+		int rwmixread;
+		bool create;
+	} modes[] = {
+		{"read", false, 100}, {"write", false, 0}, {"rw", false, 50},
+		{"randread", true, 100}, {"randwrite", true, 0},
+		{"randrw", true, 50}, {"create", false, 0, true},
+	};
+
+	for (int i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		if (strcmp(mode, modes[i].name))
+			continue;
+		opt.random = modes[i].random;
+		opt.create = modes[i].create;
+		/* --rwmixread only matters for the mixed modes */
+		if (modes[i].rwmixread != 50 || opt.rwmixread < 0)
+			opt.rwmixread = modes[i].rwmixread;
+		return true;
+	}
+
+	return false;
+}
+
+/* Return -1 when the create mode has reached the end of the vdi */
+static off_t next_io_offset(void)
+{
+	uint64_t nr_blocks = opt.size / opt.bs;
+	off_t offset;
+
+	if (opt.create) {
+		if (next_offset + opt.bs > opt.size)
+			return -1;
+		offset = next_offset;
+		next_offset += object_size;
+		return offset;
+	}
+
+	if (opt.random)
+		return (bench_rand() % nr_blocks) * opt.bs;
+
+	offset = next_offset;
+	next_offset += opt.bs;
+	if (next_offset + opt.bs > opt.size)
+		next_offset = 0;
+
+	return offset;
+}
+
+static int submit_io(struct sd_cluster *c, struct sd_vdi *vdi,
+		     struct bench_io *io)
+{
+	off_t offset = next_io_offset();
+
+	if (offset < 0)
+		return SD_RES_NO_SPACE;
+
+	io->rw = (int)(bench_rand() % 100) < opt.rwmixread ?
+		BENCH_READ : BENCH_WRITE;
+	io->start = now_ns();
+
+	if (io->rw == BENCH_READ)
+		return sd_vdi_aio_read(c, vdi, io->buf, opt.bs, offset,
+				       NULL, io);
+	return sd_vdi_aio_write(c, vdi, io->buf, opt.bs, offset, NULL, io);
+}
+
+static void account_io(struct bench_io *io, uint64_t now)
+{
+	struct bench_stat *st = stats + io->rw;
+
+	if (st->nr_ios == st->lat_size) {
+		st->lat_size = st->lat_size ? st->lat_size * 2 : 65536;
+		st->lat = realloc(st->lat, st->lat_size * sizeof(*st->lat));
+		if (!st->lat) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	st->lat[st->nr_ios++] = now - io->start;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(struct bench_stat *st, double pct)
+{
+	size_t idx = (size_t)(st->nr_ios * pct / 100);
+
+	if (idx >= st->nr_ios)
+		idx = st->nr_ios - 1;
+	return st->lat[idx] / 1000.0;
+}
+
+static void print_stat(const char *name, struct bench_stat *st, double sec)
+{
+	double sum = 0;
+
+	if (!st->nr_ios)
+		return;
+
+	qsort(st->lat, st->nr_ios, sizeof(*st->lat), lat_cmp);
+	for (uint64_t i = 0; i < st->nr_ios; i++)
+		sum += st->lat[i];
+
+	printf("%s: IOPS=%.0f, BW=%.2fMiB/s (%"PRIu64" ios in %.2fs)\n",
+	       name, st->nr_ios / sec, st->nr_ios * opt.bs / sec / 1048576,
+	       st->nr_ios, sec);
+	printf("  lat (usec): min=%.1f, avg=%.1f, max=%.1f\n",
+	       st->lat[0] / 1000.0, sum / st->nr_ios / 1000,
+	       st->lat[st->nr_ios - 1] / 1000.0);
+	printf("  lat percentiles (usec): 50th=%.1f, 90th=%.1f, 99th=%.1f, "
+	       "99.9th=%.1f\n", percentile(st, 50), percentile(st, 90),
+	       percentile(st, 99), percentile(st, 99.9));
+}
+
+static int run_bench(struct sd_cluster *c, struct sd_vdi *vdi)
+{
+	struct bench_io *ios = calloc(opt.iodepth, sizeof(*ios));
+	struct sd_aio_event events[64];
+	struct pollfd pfd = { .fd = sd_aio_fd(c), .events = POLLIN };
+	uint64_t start, end;
+	int inflight = 0, ret = 0;
+
+	if (!ios)
+		return -1;
+
+	for (int i = 0; i < opt.iodepth; i++) {
+		ios[i].buf = malloc(opt.bs);
+		if (!ios[i].buf)
+			return -1;
+		for (size_t j = 0; j < opt.bs; j += sizeof(uint64_t))
+			*(uint64_t *)(ios[i].buf + j) = bench_rand();
+	}
+
+	start = now_ns();
+	end = start + (uint64_t)opt.runtime * 1000000000;
+	for (int i = 0; i < opt.iodepth; i++, inflight++) {
+		ret = submit_io(c, vdi, ios + i);
+		if (ret == SD_RES_NO_SPACE)
+			break;
+		if (ret != SD_RES_SUCCESS)
+			return -1;
+	}
+	ret = 0;
+
+	while (inflight > 0) {
+		int nr;
+		uint64_t now;
+
+		if (poll(&pfd, 1, 1000) < 0)
+			continue;
+
+		nr = sd_aio_reap(c, events, sizeof(events) / sizeof(events[0]));
+		now = now_ns();
+		for (int i = 0; i < nr; i++) {
+			struct bench_io *io = events[i].opaque;
+
+			inflight--;
+			if (events[i].ret != SD_RES_SUCCESS) {
+				fprintf(stderr, "%s failed, %s\n",
+					io->rw == BENCH_READ ? "read" : "write",
+					sd_strerror(events[i].ret));
+				ret = -1;
+				end = 0;
+				continue;
+			}
+			account_io(io, now);
+			if (now < end && submit_io(c, vdi, io) == SD_RES_SUCCESS)
+				inflight++;
+		}
+	}
+
+	if (!ret) {
+		double sec = (now_ns() - start) / 1e9;
+
+		print_stat("read", stats + BENCH_READ, sec);
+		print_stat("write", stats + BENCH_WRITE, sec);
+	}
+
+	for (int i = 0; i < opt.iodepth; i++)
+		free(ios[i].buf);
+	free(ios);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct sd_cluster *c;
+	struct sd_vdi *vdi;
+	const char *rw = "read";
+	int ch, ret;
+
+	while ((ch = getopt_long(argc, argv, "c:d:b:s:t:w:m:Dh", long_options,
+				 NULL)) >= 0) {
+		switch (ch) {
+		case 'c':
+			opt.nr_conns = atoi(optarg);
+			break;
+		case 'd':
+			opt.iodepth = atoi(optarg);
+			break;
+		case 'b':
+			opt.bs = parse_size(optarg);
+			break;
+		case 's':
+			opt.size = parse_size(optarg);
+			break;
+		case 't':
+			opt.runtime = atoi(optarg);
+			break;
+		case 'w':
+			rw = optarg;
+			break;
+		case 'm':
+			opt.rwmixread = atoi(optarg);
+			break;
+		case 'D':
+			opt.direct = true;
+			break;
+		default:
+			usage(argv[0]);
+			exit(ch == 'h' ? 0 : 1);
+		}
+	}
+
+	if (argc - optind != 2 || !parse_rw(rw) || opt.nr_conns < 1 ||
+	    opt.iodepth < 1 || opt.bs == 0 || opt.bs % 512 ||
+	    opt.runtime < 1 || opt.rwmixread > 100) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	c = sd_connect_multi(argv[optind], opt.nr_conns);
+	if (!c) {
+		fprintf(stderr, "failed to connect to %s, %s\n", argv[optind],
+			sd_strerror(errno));
+		exit(1);
+	}
+
+	if (opt.direct) {
+		ret = sd_enable_direct_io(c);
+		if (ret != SD_RES_SUCCESS) {
+			fprintf(stderr, "failed to enable direct I/O, %s\n",
+				sd_strerror(ret));
+			sd_disconnect(c);
+			exit(1);
+		}
+	}
+
+	vdi = sd_vdi_open(c, argv[optind + 1]);
+	if (!vdi) {
+		fprintf(stderr, "failed to open %s, %s\n", argv[optind + 1],
+			sd_strerror(errno));
+		sd_disconnect(c);
+		exit(1);
+	}
+
+	if (!opt.size || opt.size > vdi->inode->vdi_size)
+		opt.size = vdi->inode->vdi_size;
+	object_size = (uint64_t)1 << (vdi->inode->block_size_shift ?
+				      vdi->inode->block_size_shift :
+				      SD_DEFAULT_BLOCK_SIZE_SHIFT);
+	if (opt.size < opt.bs) {
+		fprintf(stderr, "%s is smaller than the block size\n",
+			argv[optind + 1]);
+		exit(1);
+	}
+
+	ret = run_bench(c, vdi);
+
+	sd_vdi_close(c, vdi);
+	sd_disconnect(c);
+
+	return ret ? 1 : 0;
+}